@@ -0,0 +1,151 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         AsyncStream.cpp
+* Description:  Implementation file for AsyncStream.hpp
+\*********************************************************/
+#include "AsyncStream.hpp"
+
+#include <stdexcept>
+#include <utility>
+
+/**
+ * Constructor. Takes over a connection and registers it with a loop.
+ *
+ * This function throws a runtime_error exception if the socket cannot
+ * be registered.
+ *
+ *  loop    The loop running the session that uses the stream.
+ *  stream  The connection. Its contents are moved into the stream.
+ */
+AsyncStream::AsyncStream(SessionLoop& loop, SocketStream& stream)
+    : _loop(loop), _stream(std::move(stream)), _open(true), _closed(false) {
+    _loop.add(_stream.get_descriptor(), &_socket);
+}
+
+/**
+ * Destructor. Closes the connection if it is still open.
+ */
+AsyncStream::~AsyncStream() {
+    close();
+}
+
+/**
+ * Queues a message and waits until it has been sent.
+ *
+ * Messages sent by a session are never dropped, because the session
+ * cannot queue another one until this one has been written.
+ *
+ *  message     The message to send.
+ *
+ * Returns an awaitable that yields false if the connection was closed.
+ */
+AsyncStream::SendAwaiter AsyncStream::send(const MessagePtr& message) {
+    if (_open) {
+        OutboxLimit limit = { 0, DROP_NEWEST };
+        size_t dropped = 0;
+        _stream.queue(message, limit, dropped, 0);
+    }
+    return SendAwaiter(*this);
+}
+
+/**
+ * Queues a copy of some text and waits until it has been sent.
+ *
+ *  text    The text to send.
+ *
+ * Returns an awaitable that yields false if the connection was closed.
+ */
+AsyncStream::SendAwaiter AsyncStream::send(const std::string& text) {
+    return send(MessagePtr(Message::create(text)));
+}
+
+/**
+ * Closes the connection. A session waiting on it is never resumed,
+ * so this must only be called by the session that owns the stream.
+ */
+void AsyncStream::close() {
+    if (_closed)
+        return;
+    _loop.remove(_stream.get_descriptor());
+    _stream.close();
+    _open = false;
+    _closed = true;
+}
+
+/**
+ * Suspends the session until the socket has more input.
+ *
+ *  h   The session.
+ */
+void AsyncStream::RecvAwaiter::await_suspend(std::coroutine_handle<> h) {
+    handle = h;
+    _stream._socket.reader = this;
+}
+
+/**
+ * Tries to take the next complete message from the connection,
+ * reading from the socket until one is buffered or the socket has
+ * nothing more to give.
+ *
+ * Returns whether the operation completed, either with a message
+ * or because the connection was closed.
+ */
+bool AsyncStream::RecvAwaiter::on_ready() {
+    SocketStream& stream = _stream._stream;
+    RingView view;
+    try {
+        while (true) {
+            // Messages that arrived just before the client hung up still count
+            if (stream.next_message(view)) {
+                _message = view.to_string();
+                _result = true;
+                return true;
+            }
+            if (!_stream._open || !_stream._socket.readable)
+                break;
+            _stream._open = stream.receive();
+            _stream._socket.readable = !stream.is_drained();
+        }
+    }
+    catch (std::runtime_error&) {
+        _stream._open = false;
+    }
+    _result = false;
+    return !_stream._open;
+}
+
+/**
+ * Suspends the session until the socket has room for more output.
+ *
+ *  h   The session.
+ */
+void AsyncStream::SendAwaiter::await_suspend(std::coroutine_handle<> h) {
+    handle = h;
+    _stream._socket.writer = this;
+}
+
+/**
+ * Tries to write everything that is queued, unless the socket was full
+ * the last time and has not become writable since.
+ *
+ * Returns whether the operation completed, either because the queue
+ * is empty or because the connection was closed.
+ */
+bool AsyncStream::SendAwaiter::on_ready() {
+    if (!_stream._open)
+        return true;
+    if (!_stream._socket.writable)
+        return false;
+
+    try {
+        _stream._open = _stream._stream.flush();
+    }
+    catch (std::runtime_error&) {
+        _stream._open = false;
+    }
+    // Anything left over means the socket buffer is full
+    _stream._socket.writable = !_stream._stream.has_pending();
+    return !_stream._open || _stream._socket.writable;
+}
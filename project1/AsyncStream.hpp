@@ -0,0 +1,86 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         AsyncStream.hpp
+* Description:  Defines the awaitable operations that a session
+*               coroutine uses to talk to its client. The stream wraps
+*               a nonblocking SocketStream, so messages are split and
+*               framed exactly as in the shards, and registers the
+*               socket with a SessionLoop. Each operation first tries
+*               to complete without waiting; only when the socket
+*               would block is the session suspended until the loop
+*               sees the socket become ready.
+*
+*               Example:
+*                   Session echo(SessionLoop& loop, SocketStream client) {
+*                       AsyncStream stream(loop, client);
+*                       std::string text;
+*                       while (co_await stream.recv_message(text))
+*                           co_await stream.send(text);
+*                   }
+\*********************************************************/
+#pragma once
+
+#include <coroutine>
+#include <string>
+
+#include "Message.hpp"
+#include "SessionLoop.hpp"
+#include "SocketStream.hpp"
+
+class AsyncStream {
+    public:
+        // Waits for the next complete message
+        class RecvAwaiter : public SessionWaiter {
+            public:
+                RecvAwaiter(AsyncStream& stream, std::string& message)
+                    : _stream(stream), _message(message), _result(false) {}
+
+                bool await_ready() { return on_ready(); }
+                void await_suspend(std::coroutine_handle<> h);
+                bool await_resume() const { return _result; }
+                bool on_ready();
+
+            private:
+                AsyncStream& _stream;
+                std::string& _message;  // Where the message is stored
+                bool _result;           // Whether a message was received
+        };
+
+        // Waits until a message has been handed to the kernel
+        class SendAwaiter : public SessionWaiter {
+            public:
+                explicit SendAwaiter(AsyncStream& stream) : _stream(stream) {}
+
+                bool await_ready() { return on_ready(); }
+                void await_suspend(std::coroutine_handle<> h);
+                bool await_resume() const { return _stream._open; }
+                bool on_ready();
+
+            private:
+                AsyncStream& _stream;
+        };
+
+        AsyncStream(SessionLoop& loop, SocketStream& stream);
+        ~AsyncStream();
+
+        RecvAwaiter recv_message(std::string& message) { return RecvAwaiter(*this, message); }
+        SendAwaiter send(const MessagePtr& message);
+        SendAwaiter send(const std::string& text);
+        void close();
+
+        bool is_open() const { return _open; }
+        SocketStream& get_stream() { return _stream; }
+
+    private:
+        SessionLoop& _loop;     // The loop that resumes the session
+        SocketStream _stream;   // The connection, in nonblocking mode
+        SessionSocket _socket;  // Readiness of the connection
+        bool _open;             // Whether the connection is still open
+        bool _closed;           // Whether the socket has been closed
+
+        // Not copyable because the loop holds pointers to its awaiters
+        AsyncStream(const AsyncStream&);
+        AsyncStream& operator=(const AsyncStream&);
+};
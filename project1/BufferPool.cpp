@@ -0,0 +1,323 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         BufferPool.cpp
+* Description:  Implementation file for BufferPool.hpp
+\*********************************************************/
+#include "BufferPool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "ShardStats.hpp"   // Counter
+
+// Number of size classes
+#define BUFFERPOOL_CLASSES (BUFFERPOOL_MAX_SHIFT - BUFFERPOOL_MIN_SHIFT + 1)
+
+// A free buffer, linked to the next one through its first bytes
+struct FreeBuffer {
+    FreeBuffer* next;
+};
+
+// A list of free buffers of one size class
+struct FreeList {
+    FreeBuffer* head;       // First buffer, or null
+    size_t count;           // Number of buffers in the list
+};
+
+// The free buffers of one thread and what it counted
+struct ThreadCache {
+    FreeList lists[BUFFERPOOL_CLASSES];     // Free buffers of each class
+    std::atomic<uint64_t> cached_bytes;     // Bytes in all lists
+    Counter allocations;
+    Counter hits;
+    Counter refills;
+    Counter releases;
+    Counter frees;
+
+    ThreadCache() : cached_bytes(0) {
+        for (size_t i = 0; i < BUFFERPOOL_CLASSES; ++i) {
+            lists[i].head = nullptr;
+            lists[i].count = 0;
+        }
+    }
+};
+
+// Batches of free buffers of one size class, shared by all threads
+struct Depot {
+    std::mutex mutex;
+    std::vector<FreeList> batches;
+    uint64_t bytes;         // Bytes in all batches
+};
+
+// Frees a thread's cache when the thread exits
+struct CacheReaper {
+    ~CacheReaper();
+};
+
+// The caches of the running threads, and the counts of those that exited
+static std::mutex registry_mutex;
+static std::vector<ThreadCache*> registry;
+static BufferPoolStats retired;
+
+static Depot depots[BUFFERPOOL_CLASSES];
+
+// The cache of this thread, created on first use. Both are constant
+// initialized, so reading them costs no more than any other variable.
+static thread_local ThreadCache* local_cache = nullptr;
+static thread_local bool local_exited = false;
+static thread_local CacheReaper reaper;
+
+/**
+ * Returns the size class of a buffer size, which must be at most
+ * the largest class.
+ */
+static inline size_t get_class(size_t size) {
+    if (size <= (size_t(1) << BUFFERPOOL_MIN_SHIFT))
+        return 0;
+    return (64 - __builtin_clzll(size - 1)) - BUFFERPOOL_MIN_SHIFT;
+}
+
+/**
+ * Returns the number of bytes in each buffer of a size class.
+ */
+static inline size_t get_class_size(size_t index) {
+    return size_t(1) << (index + BUFFERPOOL_MIN_SHIFT);
+}
+
+/**
+ * Returns the cache of this thread, or null once the thread is exiting.
+ */
+static ThreadCache* get_cache() {
+    if (local_cache == nullptr && !local_exited) {
+        local_cache = new ThreadCache();
+        (void)&reaper;      // Makes sure the cache is freed at exit
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.push_back(local_cache);
+    }
+    return local_cache;
+}
+
+/**
+ * Frees every buffer in a list.
+ */
+static void free_list(FreeList& list) {
+    while (list.head != nullptr) {
+        FreeBuffer* buffer = list.head;
+        list.head = buffer->next;
+        ::operator delete(buffer);
+    }
+    list.count = 0;
+}
+
+/**
+ * Adds a thread's counts to a total.
+ */
+static void add_counts(BufferPoolStats& total, const ThreadCache& cache) {
+    total.allocations += cache.allocations.get();
+    total.hits += cache.hits.get();
+    total.refills += cache.refills.get();
+    total.releases += cache.releases.get();
+    total.frees += cache.frees.get();
+}
+
+/**
+ * Moves half of a full list of this thread to the depot as one batch,
+ * or frees it if the depot already holds BUFFERPOOL_DEPOT_BYTES of
+ * its size class.
+ *
+ *  cache   The cache of this thread.
+ *  index   The size class of the list.
+ */
+static void spill(ThreadCache& cache, size_t index) {
+    FreeList& list = cache.lists[index];
+    FreeList batch;
+    batch.head = list.head;
+    batch.count = list.count / 2;
+
+    // Cut the batch off the front of the list
+    FreeBuffer* last = batch.head;
+    for (size_t i = 1; i < batch.count; ++i)
+        last = last->next;
+    list.head = last->next;
+    list.count -= batch.count;
+    last->next = nullptr;
+
+    size_t bytes = batch.count * get_class_size(index);
+    cache.cached_bytes.store(cache.cached_bytes.load(std::memory_order_relaxed) - bytes,
+        std::memory_order_relaxed);
+
+    Depot& depot = depots[index];
+    {
+        std::lock_guard<std::mutex> lock(depot.mutex);
+        if (depot.bytes + bytes <= BUFFERPOOL_DEPOT_BYTES) {
+            depot.batches.push_back(batch);
+            depot.bytes += bytes;
+            return;
+        }
+    }
+    cache.frees.add(batch.count);
+    free_list(batch);
+}
+
+/**
+ * Refills an empty list of this thread with a batch from the depot.
+ *
+ *  cache   The cache of this thread.
+ *  index   The size class of the list.
+ *
+ * Returns whether the depot had a batch.
+ */
+static bool refill(ThreadCache& cache, size_t index) {
+    Depot& depot = depots[index];
+    FreeList batch;
+    {
+        std::lock_guard<std::mutex> lock(depot.mutex);
+        if (depot.batches.empty())
+            return false;
+        batch = depot.batches.back();
+        depot.batches.pop_back();
+        depot.bytes -= batch.count * get_class_size(index);
+    }
+
+    cache.lists[index] = batch;
+    cache.cached_bytes.store(cache.cached_bytes.load(std::memory_order_relaxed)
+        + batch.count * get_class_size(index), std::memory_order_relaxed);
+    cache.refills.add();
+    return true;
+}
+
+/**
+ * Destructor. Frees every buffer in the exiting thread's cache and
+ * keeps its counts. Buffers released later by this thread are freed
+ * directly.
+ */
+CacheReaper::~CacheReaper() {
+    ThreadCache* cache = local_cache;
+    local_cache = nullptr;
+    local_exited = true;
+    if (cache == nullptr)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.erase(std::find(registry.begin(), registry.end(), cache));
+        add_counts(retired, *cache);
+    }
+    for (size_t i = 0; i < BUFFERPOOL_CLASSES; ++i)
+        free_list(cache->lists[i]);
+    delete cache;
+}
+
+/**
+ * Allocates a buffer, from this thread's cache if it has a free one
+ * of the right size class, or else from a batch in the depot.
+ *
+ * This function throws a bad_alloc exception if the system is out of memory.
+ *
+ *  size    The number of bytes needed.
+ *
+ * Returns the buffer, which holds get_block_size(size) bytes and
+ * must be given back with release and the same size.
+ */
+void* BufferPool::allocate(size_t size) {
+    if (size > get_class_size(BUFFERPOOL_CLASSES - 1))
+        return ::operator new(size);
+
+    size_t index = get_class(size);
+    ThreadCache* cache = get_cache();
+    if (cache == nullptr)
+        return ::operator new(get_class_size(index));
+
+    cache->allocations.add();
+    FreeList& list = cache->lists[index];
+    if (list.head == nullptr && !refill(*cache, index))
+        return ::operator new(get_class_size(index));
+
+    FreeBuffer* buffer = list.head;
+    list.head = buffer->next;
+    --list.count;
+    cache->cached_bytes.store(cache->cached_bytes.load(std::memory_order_relaxed)
+        - get_class_size(index), std::memory_order_relaxed);
+    cache->hits.add();
+    return buffer;
+}
+
+/**
+ * Gives a buffer back to this thread's cache. Once the cache holds
+ * BUFFERPOOL_CACHE_BYTES of the buffer's size class, half of them
+ * are moved to the depot.
+ *
+ * A buffer can be released on any thread, not only the one that
+ * allocated it.
+ *
+ *  buffer  The buffer from allocate, or null.
+ *  size    The size that was passed to allocate.
+ */
+void BufferPool::release(void* buffer, size_t size) {
+    if (buffer == nullptr)
+        return;
+    if (size > get_class_size(BUFFERPOOL_CLASSES - 1)) {
+        ::operator delete(buffer);
+        return;
+    }
+
+    size_t index = get_class(size);
+    ThreadCache* cache = get_cache();
+    if (cache == nullptr) {
+        ::operator delete(buffer);
+        return;
+    }
+
+    cache->releases.add();
+    FreeList& list = cache->lists[index];
+    FreeBuffer* free = static_cast<FreeBuffer*>(buffer);
+    free->next = list.head;
+    list.head = free;
+    ++list.count;
+    cache->cached_bytes.store(cache->cached_bytes.load(std::memory_order_relaxed)
+        + get_class_size(index), std::memory_order_relaxed);
+
+    // Every class keeps at least two buffers, however large
+    if (list.count >= std::max<size_t>(2, BUFFERPOOL_CACHE_BYTES / get_class_size(index)))
+        spill(*cache, index);
+}
+
+/**
+ * Returns the number of bytes in a buffer allocated for a size,
+ * which is the size rounded up to its size class.
+ */
+size_t BufferPool::get_block_size(size_t size) {
+    if (size > get_class_size(BUFFERPOOL_CLASSES - 1))
+        return size;
+    return get_class_size(get_class(size));
+}
+
+/**
+ * Adds up the counts of every thread that has used the pool.
+ *
+ * This function is safe to call from any thread.
+ *
+ * Returns the totals.
+ */
+BufferPoolStats BufferPool::get_stats() {
+    BufferPoolStats total;
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        total = retired;
+        total.cached_bytes = 0;
+        for (auto it = registry.begin(); it != registry.end(); ++it) {
+            add_counts(total, **it);
+            total.cached_bytes += (*it)->cached_bytes.load(std::memory_order_relaxed);
+        }
+    }
+    for (size_t i = 0; i < BUFFERPOOL_CLASSES; ++i) {
+        std::lock_guard<std::mutex> lock(depots[i].mutex);
+        total.cached_bytes += depots[i].bytes;
+    }
+    return total;
+}
@@ -0,0 +1,94 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         BufferPool.hpp
+* Description:  Defines the pool that the socket layer gets its
+*               buffers from: the receive buffer of each connection,
+*               each message, and each outgoing queue.
+*               Buffers are grouped in size classes of powers of two,
+*               and every thread keeps a cache of free buffers of each
+*               class. A buffer that is released goes into the cache
+*               of the thread that released it and is handed out again
+*               by the next allocation of the same class on that thread,
+*               so routing a message normally does not touch malloc at
+*               all, and threads never contend for a lock.
+*               Each cache holds a limited number of bytes per class.
+*               A thread that releases more buffers than it allocates,
+*               as the history thread does with the messages it drops,
+*               moves half of a full cache to a shared depot in one
+*               batch, and a thread whose cache is empty takes a whole
+*               batch back, so the lock on the depot is only taken once
+*               per batch. Once the depot is full too, the surplus is
+*               given back to the system.
+*               Every thread counts how often it was served from its
+*               cache, so the hit rate of the pool can be reported.
+\*********************************************************/
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Define a smallest size class of 64 bytes unless defined elsewhere
+#ifndef BUFFERPOOL_MIN_SHIFT
+#define BUFFERPOOL_MIN_SHIFT 6
+#endif
+
+// Define a largest size class of 1 MiB unless defined elsewhere.
+// Larger buffers are allocated and freed directly.
+#ifndef BUFFERPOOL_MAX_SHIFT
+#define BUFFERPOOL_MAX_SHIFT 20
+#endif
+
+// Define 256 KiB cached per size class per thread unless defined elsewhere
+#ifndef BUFFERPOOL_CACHE_BYTES
+#define BUFFERPOOL_CACHE_BYTES 262144
+#endif
+
+// Define 16 MiB of batches kept in the depot per size class
+// unless defined elsewhere
+#ifndef BUFFERPOOL_DEPOT_BYTES
+#define BUFFERPOOL_DEPOT_BYTES 16777216
+#endif
+
+// The counts of every thread that used the pool, added together
+struct BufferPoolStats {
+    uint64_t allocations;   // Buffers handed out
+    uint64_t hits;          // Of those, buffers that were reused
+    uint64_t refills;       // Batches taken from the depot
+    uint64_t releases;      // Buffers given back
+    uint64_t frees;         // Of those, buffers freed because the depot was full
+    uint64_t cached_bytes;  // Bytes in free buffers held by caches and the depot
+};
+
+class BufferPool {
+    public:
+        static void* allocate(size_t size);
+        static void release(void* buffer, size_t size);
+        static size_t get_block_size(size_t size);
+        static BufferPoolStats get_stats();
+};
+
+// An allocator for standard containers that takes their storage from
+// the pool, e.g. std::vector<T, PoolAllocator<T> >
+template <typename T>
+class PoolAllocator {
+    public:
+        typedef T value_type;
+
+        PoolAllocator() {}
+        template <typename U>
+        PoolAllocator(const PoolAllocator<U>&) {}
+
+        T* allocate(size_t count) {
+            return static_cast<T*>(BufferPool::allocate(count * sizeof(T)));
+        }
+        void deallocate(T* buffer, size_t count) {
+            BufferPool::release(buffer, count * sizeof(T));
+        }
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) { return false; }
@@ -0,0 +1,169 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         ChannelIndex.cpp
+* Description:  Implementation file for ChannelIndex.hpp
+\*********************************************************/
+#include "ChannelIndex.hpp"
+
+/**
+ * Checks whether a string can be used as a channel name.
+ * Names are 1 to CHANNEL_MAX_NAME letters, digits, '-' or '_'.
+ *
+ *  name    The name to check.
+ *
+ * Returns whether the name is valid.
+ */
+bool ChannelIndex::is_valid_name(const std::string& name) {
+    if (name.empty() || name.size() > CHANNEL_MAX_NAME)
+        return false;
+
+    for (size_t i = 0; i < name.size(); ++i) {
+        char c = name[i];
+        bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+            || (c >= '0' && c <= '9') || c == '-' || c == '_';
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Adds a member to a channel, creating the channel if needed.
+ *
+ *  channel The name of the channel to join.
+ *  member  The member to add.
+ *
+ * Returns false if the member had already joined, or true otherwise.
+ */
+bool ChannelIndex::join(const std::string& channel, int member) {
+    Channel& ch = _channels[channel];
+    if (static_cast<size_t>(member) >= _memberships.size())
+        _memberships.resize(member + 1);
+    if (find_membership(member, &ch) != _memberships[member].end())
+        return false;
+
+    if (ch.members.empty())
+        ch.name = channel;
+    Membership joined = { &ch, ch.members.size() };
+    _memberships[member].push_back(joined);
+    ch.members.push_back(member);
+    return true;
+}
+
+/**
+ * Removes a member from a channel. The channel is deleted
+ * when its last member leaves.
+ *
+ *  channel The name of the channel to leave.
+ *  member  The member to remove.
+ *
+ * Returns false if the member had not joined the channel, or true otherwise.
+ */
+bool ChannelIndex::leave(const std::string& channel, int member) {
+    auto ch = _channels.find(channel);
+    if (ch == _channels.end() || static_cast<size_t>(member) >= _memberships.size())
+        return false;
+
+    std::vector<Membership>& joined = _memberships[member];
+    auto pos = find_membership(member, &ch->second);
+    if (pos == joined.end())
+        return false;
+
+    size_t index = pos->index;
+    *pos = joined.back();
+    joined.pop_back();
+    remove_member(&ch->second, index);
+    return true;
+}
+
+/**
+ * Removes a member from every channel it joined.
+ *
+ *  member  The member to remove.
+ */
+void ChannelIndex::leave_all(int member) {
+    if (static_cast<size_t>(member) >= _memberships.size())
+        return;
+
+    // Take the member's list first so remove_member does not see it.
+    // Swapping with an empty list also frees the member's storage.
+    std::vector<Membership> channels;
+    channels.swap(_memberships[member]);
+
+    for (auto it = channels.begin(); it != channels.end(); ++it)
+        remove_member(it->channel, it->index);
+}
+
+/**
+ * Gets the names of every channel a member joined.
+ *
+ *  member  The member.
+ *  names   The vector to append the names to.
+ */
+void ChannelIndex::get_channels(int member, std::vector<std::string>& names) const {
+    if (static_cast<size_t>(member) >= _memberships.size())
+        return;
+    const std::vector<Membership>& joined = _memberships[member];
+    for (auto it = joined.begin(); it != joined.end(); ++it)
+        names.push_back(it->channel->name);
+}
+
+/**
+ * Gets the members of a channel.
+ *
+ *  channel The name of the channel.
+ *
+ * Returns the list of members, or nullptr if the channel has no members.
+ * The list is invalidated by any change to the index.
+ */
+const std::vector<int>* ChannelIndex::get_members(const std::string& channel) const {
+    auto ch = _channels.find(channel);
+    if (ch == _channels.end())
+        return nullptr;
+    return &ch->second.members;
+}
+
+/**
+ * Removes the member at a position in a channel's list of members.
+ *
+ * The last member is moved into the position, so the removal takes
+ * constant time, and the moved member's recorded position is updated.
+ * The channel is deleted if it becomes empty.
+ *
+ *  channel The channel to remove the member from.
+ *  index   The position of the member in the channel's list.
+ */
+void ChannelIndex::remove_member(Channel* channel, size_t index) {
+    int last = channel->members.back();
+    channel->members[index] = last;
+    channel->members.pop_back();
+
+    // The member that was moved now lives at the removed position
+    if (index < channel->members.size())
+        find_membership(last, channel)->index = index;
+
+    if (channel->members.empty())
+        _channels.erase(channel->name);
+}
+
+/**
+ * Finds the record of a member having joined a channel.
+ * Members join few channels, so the list is searched in order.
+ *
+ *  member  The member, which must have a list of memberships.
+ *  channel The channel to look for.
+ *
+ * Returns the position of the record, or the end of the member's list
+ * if the member has not joined the channel.
+ */
+std::vector<ChannelIndex::Membership>::iterator ChannelIndex::find_membership(
+    int member, Channel* channel) {
+    std::vector<Membership>& joined = _memberships[member];
+    for (auto it = joined.begin(); it != joined.end(); ++it) {
+        if (it->channel == channel)
+            return it;
+    }
+    return joined.end();
+}
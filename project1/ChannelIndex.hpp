@@ -0,0 +1,67 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         ChannelIndex.hpp
+* Description:  Defines the class that keeps track of which clients
+*               have joined which named channels.
+*               Each channel keeps a list of its members, so that
+*               a message only has to visit the clients that joined
+*               its channel. Each member also remembers its position
+*               in every channel it joined, so joining and leaving
+*               take constant time no matter how large the channel is.
+*               Members are small non-negative numbers (socket
+*               descriptors), so the memberships are stored in an
+*               array indexed by member, and each member's short list
+*               of channels is searched in order.
+\*********************************************************/
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Define a maximum channel name length of 32 unless defined elsewhere
+#ifndef CHANNEL_MAX_NAME
+#define CHANNEL_MAX_NAME 32
+#endif
+
+// The channel that every client joins when it connects
+#define CHANNEL_LOBBY "lobby"
+
+class ChannelIndex {
+    public:
+        static bool is_valid_name(const std::string& name);
+
+        bool join(const std::string& channel, int member);
+        bool leave(const std::string& channel, int member);
+        void leave_all(int member);
+        void get_channels(int member, std::vector<std::string>& names) const;
+
+        const std::vector<int>* get_members(const std::string& channel) const;
+        size_t get_channel_count() const { return _channels.size(); }
+
+    private:
+        // A channel with at least one member
+        struct Channel {
+            std::string name;           // Key of this channel in _channels
+            std::vector<int> members;   // Members, in no particular order
+        };
+
+        // Channels by name. Elements of an unordered_map never move,
+        // so pointers to them stay valid until they are erased.
+        std::unordered_map<std::string, Channel> _channels;
+
+        // A channel that a member joined and the member's position in it
+        struct Membership {
+            Channel* channel;
+            size_t index;
+        };
+
+        // The channels joined by each member, indexed by member
+        std::vector<std::vector<Membership> > _memberships;
+
+        std::vector<Membership>::iterator find_membership(int member, Channel* channel);
+
+        void remove_member(Channel* channel, size_t index);
+};
@@ -0,0 +1,73 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         ClientTable.cpp
+* Description:  Implementation file for ClientTable.hpp
+\*********************************************************/
+#include "ClientTable.hpp"
+
+#include <utility>
+
+/**
+ * Adds a client to the table, keyed by its socket descriptor.
+ *
+ * Adding a client can move the others, so references to clients
+ * must not be held across a call to this function.
+ *
+ *  client  The client to add. Its contents are moved into the table.
+ *
+ * Returns the client in the table.
+ */
+SocketStream& ClientTable::insert(SocketStream& client) {
+    int fd = client.get_descriptor();
+    if (static_cast<size_t>(fd) >= _positions.size())
+        _positions.resize(fd + 1, -1);
+
+    _positions[fd] = static_cast<int>(_clients.size());
+    _clients.push_back(std::move(client));
+    return _clients.back();
+}
+
+/**
+ * Finds the client with a socket descriptor.
+ *
+ *  fd  The socket descriptor of the client.
+ *
+ * Returns the client, or nullptr if it is not in the table.
+ */
+SocketStream* ClientTable::find(int fd) {
+    if (fd < 0 || static_cast<size_t>(fd) >= _positions.size() || _positions[fd] == -1)
+        return nullptr;
+    return &_clients[_positions[fd]];
+}
+
+/**
+ * Removes the client with a socket descriptor, if it is in the table.
+ *
+ * The last client is moved into the removed client's position, so
+ * a reference to the last client is no longer valid afterwards.
+ *
+ *  fd  The socket descriptor of the client.
+ */
+void ClientTable::erase(int fd) {
+    if (find(fd) == nullptr)
+        return;
+
+    int pos = _positions[fd];
+    if (static_cast<size_t>(pos) != _clients.size() - 1) {
+        _clients[pos] = std::move(_clients.back());
+        _positions[_clients[pos].get_descriptor()] = pos;
+    }
+    _clients.pop_back();
+    _positions[fd] = -1;
+}
+
+/**
+ * Returns the number of bytes allocated by the table itself, not
+ * counting the buffers that each client allocates.
+ */
+size_t ClientTable::get_memory() const {
+    return _clients.capacity() * sizeof(SocketStream)
+        + _positions.capacity() * sizeof(int);
+}
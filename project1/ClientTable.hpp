@@ -0,0 +1,39 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         ClientTable.hpp
+* Description:  Defines the table of connected clients of a shard.
+*               The clients are stored next to each other in one
+*               array, so sending to all of them walks memory in order,
+*               and a second array maps each socket descriptor to its
+*               client's position. Adding, finding and removing a client
+*               all take constant time: a removed client is replaced by
+*               the last one, whose position is updated.
+\*********************************************************/
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "SocketStream.hpp"
+
+class ClientTable {
+    public:
+        typedef std::vector<SocketStream>::iterator iterator;
+
+        SocketStream& insert(SocketStream& client);
+        SocketStream* find(int fd);
+        void erase(int fd);
+
+        iterator begin() { return _clients.begin(); }
+        iterator end() { return _clients.end(); }
+        size_t size() const { return _clients.size(); }
+        bool empty() const { return _clients.empty(); }
+
+        size_t get_memory() const;
+
+    private:
+        std::vector<SocketStream> _clients;  // Connected clients, in no particular order
+        std::vector<int> _positions;         // Position of each descriptor's client, or -1
+};
@@ -0,0 +1,157 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         EventLoop.cpp
+* Description:  Implementation file for EventLoop.hpp
+\*********************************************************/
+#include "EventLoop.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/**
+ * Throws a runtime_error exception with the specified prefix
+ * and the message for the current value of errno.
+ *
+ *  prefix  The name of the function that failed.
+ */
+static void throw_errno(const char* prefix) {
+    std::string errmsg(prefix);
+    errmsg += ": ";
+    errmsg += ::strerror(errno);
+    throw std::runtime_error(errmsg);
+}
+
+/**
+ * Constructor. Creates the epoll instance and the notification eventfd.
+ *
+ * This function throws a runtime_error exception if either descriptor
+ * cannot be created.
+ *
+ *  maxevents   The maximum number of events returned by one call to wait.
+ */
+EventLoop::EventLoop(int maxevents) : _wakeups(0), _events(maxevents) {
+    _epfd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (_epfd == -1)
+        throw_errno("epoll_create1");
+
+    _notify_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_notify_fd == -1) {
+        ::close(_epfd);
+        throw_errno("eventfd");
+    }
+
+    add(_notify_fd, EPOLLIN);
+}
+
+/**
+ * Destructor. Closes the epoll and eventfd descriptors.
+ */
+EventLoop::~EventLoop() {
+    ::close(_notify_fd);
+    ::close(_epfd);
+}
+
+/**
+ * Starts watching a descriptor for the specified events.
+ *
+ * This function throws a runtime_error exception if epoll_ctl fails.
+ *
+ *  fd      The descriptor to watch.
+ *  events  The epoll event mask (EPOLLIN, EPOLLOUT, etc.).
+ */
+void EventLoop::add(int fd, uint32_t events) {
+    struct epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if (::epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        throw_errno("epoll_ctl");
+}
+
+/**
+ * Changes the events that a descriptor is being watched for.
+ *
+ * This function throws a runtime_error exception if epoll_ctl fails.
+ *
+ *  fd      The descriptor to modify.
+ *  events  The new epoll event mask.
+ */
+void EventLoop::modify(int fd, uint32_t events) {
+    struct epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if (::epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+        throw_errno("epoll_ctl");
+}
+
+/**
+ * Stops watching a descriptor.
+ *
+ * Errors are ignored because the descriptor may already have been closed,
+ * in which case the kernel has already removed it from the epoll set.
+ *
+ *  fd      The descriptor to stop watching.
+ */
+void EventLoop::remove(int fd) {
+    struct epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ::epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+/**
+ * Blocks until at least one watched descriptor is ready
+ * or the timeout expires.
+ *
+ * This function throws a runtime_error exception if epoll_wait fails
+ * for any reason other than being interrupted by a signal.
+ *
+ *  timeout     The maximum time to wait in milliseconds, or -1 for no limit.
+ *
+ * Returns the number of ready events, which can be read with event().
+ */
+int EventLoop::wait(int timeout) {
+    int count;
+    do {
+        count = ::epoll_wait(_epfd, _events.data(), _events.size(), timeout);
+    } while (count == -1 && errno == EINTR);
+
+    if (count == -1)
+        throw_errno("epoll_wait");
+
+    // Counted atomically so other threads can report it
+    if (count > 0)
+        _wakeups.fetch_add(1, std::memory_order_relaxed);
+    return count;
+}
+
+/**
+ * Wakes up the loop from another thread.
+ *
+ * The notification descriptor becomes readable until clear_notify is called.
+ * Multiple notifications before the loop wakes up are merged into one.
+ */
+void EventLoop::notify() {
+    uint64_t one = 1;
+    ssize_t bytes;
+    do {
+        bytes = ::write(_notify_fd, &one, sizeof(one));
+    } while (bytes == -1 && errno == EINTR);
+}
+
+/**
+ * Resets the notification descriptor after the loop has woken up.
+ */
+void EventLoop::clear_notify() {
+    uint64_t count;
+    ssize_t bytes;
+    do {
+        bytes = ::read(_notify_fd, &count, sizeof(count));
+    } while (bytes == -1 && errno == EINTR);
+}
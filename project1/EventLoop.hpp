@@ -0,0 +1,51 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         EventLoop.hpp
+* Description:  Defines a thin wrapper around epoll that is used
+*               to wait until one or more sockets are ready for
+*               reading or writing.
+*               The loop also owns an eventfd descriptor so that
+*               other threads can wake it up without polling.
+\*********************************************************/
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <sys/epoll.h>
+
+// Define a maximum of 256 events per wakeup unless defined elsewhere
+#ifndef EVENTLOOP_MAX_EVENTS
+#define EVENTLOOP_MAX_EVENTS 256
+#endif
+
+class EventLoop {
+    public:
+        EventLoop(int maxevents = EVENTLOOP_MAX_EVENTS);
+        ~EventLoop();
+
+        void add(int fd, uint32_t events);
+        void modify(int fd, uint32_t events);
+        void remove(int fd);
+
+        int wait(int timeout = -1);
+        const struct epoll_event& event(int index) const { return _events[index]; }
+
+        void notify();
+        void clear_notify();
+        int get_notify_descriptor() const { return _notify_fd; }
+
+        unsigned long get_wakeups() const { return _wakeups.load(std::memory_order_relaxed); }
+
+    private:
+        int _epfd;                  // Underlying epoll descriptor
+        int _notify_fd;             // eventfd used to wake the loop
+        std::atomic<unsigned long> _wakeups; // Times wait returned events
+        std::vector<struct epoll_event> _events; // Ready events from last wait
+
+        // Not copyable because the descriptors are owned
+        EventLoop(const EventLoop&);
+        EventLoop& operator=(const EventLoop&);
+};
@@ -0,0 +1,80 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         HandleIndex.cpp
+* Description:  Implementation file for HandleIndex.hpp
+\*********************************************************/
+#include "HandleIndex.hpp"
+
+#include <functional>
+
+/**
+ * Makes a client the owner of a handle, unless another client
+ * already owns it.
+ *
+ * This function is safe to call from any thread.
+ *
+ *  handle  The handle.
+ *  shard   The index of the client's shard.
+ *  fd      The socket descriptor of the client.
+ *
+ * Returns whether the client owns the handle now.
+ */
+bool HandleIndex::claim(const std::string& handle, int shard, int fd) {
+    Stripe& stripe = get_stripe(handle);
+    HandleOwner owner = { shard, fd };
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+    if (!stripe.owners.emplace(handle, owner).second)
+        return false;
+    _count.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+/**
+ * Removes a handle from the index if a client owns it.
+ *
+ * This function is safe to call from any thread.
+ *
+ *  handle  The handle.
+ *  shard   The index of the client's shard.
+ *  fd      The socket descriptor of the client.
+ */
+void HandleIndex::release(const std::string& handle, int shard, int fd) {
+    Stripe& stripe = get_stripe(handle);
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+    auto it = stripe.owners.find(handle);
+    if (it == stripe.owners.end() || it->second.shard != shard || it->second.fd != fd)
+        return;
+    stripe.owners.erase(it);
+    _count.fetch_sub(1, std::memory_order_relaxed);
+}
+
+/**
+ * Finds the client that owns a handle.
+ *
+ * This function is safe to call from any thread. The client may
+ * disconnect right after it was found, so whoever delivers to it
+ * checks that it still has the handle.
+ *
+ *  handle  The handle.
+ *  owner   Where the client's location is stored, if it was found.
+ *
+ * Returns whether a client owns the handle.
+ */
+bool HandleIndex::find(const std::string& handle, HandleOwner& owner) {
+    Stripe& stripe = get_stripe(handle);
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+    auto it = stripe.owners.find(handle);
+    if (it == stripe.owners.end())
+        return false;
+    owner = it->second;
+    return true;
+}
+
+/**
+ * Returns the part of the index that a handle belongs in.
+ */
+HandleIndex::Stripe& HandleIndex::get_stripe(const std::string& handle) {
+    return _stripes[std::hash<std::string>()(handle) % HANDLEINDEX_STRIPES];
+}
@@ -0,0 +1,61 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         HandleIndex.hpp
+* Description:  Defines the index from each client's handle to its
+*               connection, which direct messages are routed through.
+*               A client's handle is taken from the prefix of the first
+*               message it sends, and the client keeps it until it
+*               disconnects. The first client to use a handle owns it.
+*               The index is shared by every shard, so it is split into
+*               parts that are each a hash table with a lock of its own,
+*               and the part of a handle is picked by its hash. Finding
+*               a handle takes one lock and one lookup, and two shards
+*               only wait for each other when they happen to use the
+*               same part at the same time.
+\*********************************************************/
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Define 64 separately locked parts of the index unless defined elsewhere
+#ifndef HANDLEINDEX_STRIPES
+#define HANDLEINDEX_STRIPES 64
+#endif
+
+// Where the client with a handle is connected
+struct HandleOwner {
+    int shard;      // Index of the shard that the client belongs to
+    int fd;         // Socket descriptor of the client
+};
+
+class HandleIndex {
+    public:
+        HandleIndex() : _count(0) {}
+
+        bool claim(const std::string& handle, int shard, int fd);
+        void release(const std::string& handle, int shard, int fd);
+        bool find(const std::string& handle, HandleOwner& owner);
+
+        unsigned long size() const { return _count.load(std::memory_order_relaxed); }
+
+    private:
+        // One part of the index
+        struct Stripe {
+            std::mutex mutex;
+            std::unordered_map<std::string, HandleOwner> owners;
+        };
+
+        Stripe _stripes[HANDLEINDEX_STRIPES];
+        std::atomic<unsigned long> _count;  // Handles in all parts
+
+        Stripe& get_stripe(const std::string& handle);
+
+        // Not copyable because of the locks
+        HandleIndex(const HandleIndex&);
+        HandleIndex& operator=(const HandleIndex&);
+};
@@ -0,0 +1,652 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         Handoff.cpp
+* Description:  Implementation file for Handoff.hpp
+\*********************************************************/
+#include "Handoff.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/time.h>   // timeval
+#include <sys/un.h>     // sockaddr_un
+#include <unistd.h>
+
+// Starts every message between the two processes
+static const char HANDOFF_MAGIC[8] = { 'c', 'h', 'a', 't', 'h', 'o', 'f', '1' };
+
+// Sent in the header instead of the state if the new server's
+// settings do not match
+#define HANDOFF_REJECTED 1
+
+// What the new server sends when it connects
+struct HandoffHello {
+    char magic[8];
+    uint32_t framed;        // Whether its clients use framed mode
+};
+
+// What the old server sends before the descriptors and the state
+struct HandoffHeader {
+    char magic[8];
+    uint32_t status;        // 0, or HANDOFF_REJECTED
+    uint32_t fd_count;      // Descriptors sent after the header
+    uint64_t data_size;     // Bytes of state sent after the descriptors
+};
+
+/**
+ * Throws a runtime_error exception with the description of errno.
+ *
+ *  prefix  What failed, which starts the message.
+ */
+static void throw_errno(const std::string& prefix) {
+    throw std::runtime_error("handoff: " + prefix + ": " + ::strerror(errno));
+}
+
+/**
+ * Writes all of a buffer to a blocking socket.
+ *
+ * This function throws a runtime_error exception if the socket fails.
+ *
+ *  sd      The socket descriptor.
+ *  data    The data to write.
+ *  size    The number of bytes to write.
+ */
+static void write_all(int sd, const void* data, size_t size) {
+    const char* next = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t bytes = ::send(sd, next, size, MSG_NOSIGNAL);
+        if (bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            throw_errno("send");
+        }
+        next += bytes;
+        size -= bytes;
+    }
+}
+
+/**
+ * Reads exactly the requested number of bytes from a blocking socket.
+ *
+ * This function throws a runtime_error exception if the socket fails
+ * or is closed first.
+ *
+ *  sd      The socket descriptor.
+ *  data    Where to store the data.
+ *  size    The number of bytes to read.
+ */
+static void read_all(int sd, void* data, size_t size) {
+    char* next = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t bytes = ::recv(sd, next, size, 0);
+        if (bytes == -1) {
+            if (errno == EINTR)
+                continue;
+            throw_errno("recv");
+        }
+        if (bytes == 0)
+            throw std::runtime_error("handoff: the other server closed the connection");
+        next += bytes;
+        size -= bytes;
+    }
+}
+
+/**
+ * Sends a batch of descriptors, attached to a single byte.
+ *
+ * This function throws a runtime_error exception if the socket fails.
+ *
+ *  sd      The socket descriptor.
+ *  fds     The descriptors to send.
+ *  count   The number of descriptors, at most HANDOFF_MAX_FDS.
+ */
+static void send_fds(int sd, const int* fds, size_t count) {
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * count));
+    struct msghdr hdr;
+    std::memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.data();
+    hdr.msg_controllen = control.size();
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+    while (::sendmsg(sd, &hdr, MSG_NOSIGNAL) == -1) {
+        if (errno != EINTR)
+            throw_errno("sendmsg");
+    }
+}
+
+/**
+ * Receives a batch of descriptors sent by send_fds.
+ *
+ * The kernel never returns the descriptors of two batches from one
+ * call, because it stops reading at the end of the data they were
+ * attached to, so reading one byte gets exactly one batch.
+ *
+ * This function throws a runtime_error exception if the socket fails
+ * or is closed first.
+ *
+ *  sd      The socket descriptor.
+ *  fds     The vector to append the descriptors to.
+ */
+static void receive_fds(int sd, std::vector<int>& fds) {
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS));
+    struct msghdr hdr;
+    std::memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.data();
+    hdr.msg_controllen = control.size();
+
+    ssize_t bytes;
+    while ((bytes = ::recvmsg(sd, &hdr, MSG_CMSG_CLOEXEC)) == -1) {
+        if (errno != EINTR)
+            throw_errno("recvmsg");
+    }
+    if (bytes == 0)
+        throw std::runtime_error("handoff: the other server closed the connection");
+    if (hdr.msg_flags & MSG_CTRUNC)
+        throw std::runtime_error("handoff: descriptors were lost; is the descriptor limit too low?");
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const unsigned char* data = CMSG_DATA(cmsg);
+        for (size_t i = 0; i < count; ++i) {
+            int fd;
+            std::memcpy(&fd, data + i * sizeof(int), sizeof(int));
+            fds.push_back(fd);
+        }
+    }
+}
+
+/**
+ * Appends a 32-bit number to the state.
+ */
+static void put_u32(std::string& out, uint32_t value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+/**
+ * Appends a 64-bit number to the state.
+ */
+static void put_u64(std::string& out, uint64_t value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+/**
+ * Appends a string to the state, preceded by its length.
+ */
+static void put_string(std::string& out, const char* data, size_t size) {
+    put_u32(out, static_cast<uint32_t>(size));
+    out.append(data, size);
+}
+
+/**
+ * Takes the next bytes out of the state.
+ *
+ * This function throws a runtime_error exception if the state ends first.
+ *
+ *  next    The read position, which is moved past the bytes.
+ *  end     The end of the state.
+ *  size    The number of bytes.
+ *
+ * Returns the start of the bytes.
+ */
+static const char* get_bytes(const char*& next, const char* end, size_t size) {
+    if (static_cast<size_t>(end - next) < size)
+        throw std::runtime_error("handoff: the state was cut short");
+    const char* start = next;
+    next += size;
+    return start;
+}
+
+/**
+ * Takes a 32-bit number out of the state.
+ */
+static uint32_t get_u32(const char*& next, const char* end) {
+    uint32_t value;
+    std::memcpy(&value, get_bytes(next, end, sizeof(value)), sizeof(value));
+    return value;
+}
+
+/**
+ * Takes a 64-bit number out of the state.
+ */
+static uint64_t get_u64(const char*& next, const char* end) {
+    uint64_t value;
+    std::memcpy(&value, get_bytes(next, end, sizeof(value)), sizeof(value));
+    return value;
+}
+
+/**
+ * Takes a string out of the state.
+ */
+static std::string get_string(const char*& next, const char* end) {
+    uint32_t size = get_u32(next, end);
+    return std::string(get_bytes(next, end, size), size);
+}
+
+/**
+ * Takes the next received descriptor.
+ *
+ * This function throws a runtime_error exception if there are no more.
+ *
+ *  fds     The received descriptors.
+ *  next    The index of the next one, which is moved past it.
+ */
+static int get_fd(const std::vector<int>& fds, size_t& next) {
+    if (next >= fds.size())
+        throw std::runtime_error("handoff: fewer descriptors than clients");
+    return fds[next++];
+}
+
+/**
+ * Constructor. Creates an object that is not connected to anything.
+ */
+Handoff::Handoff() : _stopped(0), _finished(0), _outcome(HANDOFF_PENDING), _resumed(0) {
+    _sd = -1;
+    _conn = -1;
+}
+
+/**
+ * Destructor. Closes the sockets and removes the socket file.
+ */
+Handoff::~Handoff() {
+    if (_conn != -1)
+        ::close(_conn);
+    if (_sd != -1) {
+        ::close(_sd);
+        ::unlink(_path.c_str());
+    }
+}
+
+/**
+ * Starts waiting on a Unix domain socket for a new server to take over.
+ *
+ * A socket file left behind by an earlier run is replaced.
+ *
+ * This function throws a runtime_error exception if any of the steps fail.
+ *
+ *  path    The path of the socket file.
+ */
+void Handoff::listen(const std::string& path) {
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("handoff socket: invalid path: " + path);
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+    _sd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_sd == -1)
+        throw_errno("socket");
+
+    ::unlink(path.c_str());
+    if (::bind(_sd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1
+        || ::listen(_sd, 1) == -1) {
+        std::string errmsg("handoff socket: ");
+        errmsg += path + ": " + ::strerror(errno);
+        ::close(_sd);
+        _sd = -1;
+        throw std::runtime_error(errmsg);
+    }
+    _path = path;
+}
+
+/**
+ * Waits until a new server connects to take over.
+ *
+ * A new server whose clients use a different mode is turned away,
+ * since the messages it would be given could not be sent as they are,
+ * and so is anything else that connects without saying hello in time.
+ *
+ *  framed  Whether the clients of this server use framed mode.
+ */
+void Handoff::accept(bool framed) {
+    while (true) {
+        int conn = ::accept4(_sd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn == -1) {
+            // Back off on errors such as running out of descriptors
+            if (errno != EINTR && errno != ECONNABORTED) {
+                std::cout << "handoff socket: accept: " << ::strerror(errno) << std::endl;
+                ::usleep(100000);
+            }
+            continue;
+        }
+
+        HandoffHello hello;
+        struct timeval timeout = { 1, 0 };
+        ::setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        try {
+            read_all(conn, &hello, sizeof(hello));
+            if (std::memcmp(hello.magic, HANDOFF_MAGIC, sizeof(HANDOFF_MAGIC)) != 0) {
+                ::close(conn);
+                continue;
+            }
+            if ((hello.framed != 0) != framed) {
+                HandoffHeader header;
+                std::memset(&header, 0, sizeof(header));
+                std::memcpy(header.magic, HANDOFF_MAGIC, sizeof(HANDOFF_MAGIC));
+                header.status = HANDOFF_REJECTED;
+                write_all(conn, &header, sizeof(header));
+                ::close(conn);
+                continue;
+            }
+        }
+        catch (const std::runtime_error& ex) {
+            ::close(conn);
+            continue;
+        }
+
+        // Taking everything may take the new server a while, but one
+        // that hangs must not keep the shards from serving for good
+        timeout.tv_sec = HANDOFF_TIMEOUT_S;
+        ::setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        ::setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        _conn = conn;
+        return;
+    }
+}
+
+/**
+ * Gets ready for the shards to hand over their state.
+ *
+ *  shards  The number of shards.
+ */
+void Handoff::begin(size_t shards) {
+    ShardHandoff empty = { -1, -1, std::vector<HandoffClient>() };
+    _shards.assign(shards, empty);
+    _stopped.store(0);
+    _finished.store(0);
+    _resumed.store(0);
+    _outcome.store(HANDOFF_PENDING);
+}
+
+/**
+ * Called by each shard once it has stopped reading from its clients.
+ * Waits until every shard has, so that nothing more is routed between
+ * them, and each can take what the others sent it before it hands over.
+ *
+ * This function is safe to call from any thread.
+ */
+void Handoff::stop() {
+    _stopped.fetch_add(1, std::memory_order_acq_rel);
+    while (_stopped.load(std::memory_order_acquire) < _shards.size())
+        std::this_thread::yield();
+}
+
+/**
+ * Called by each shard once its state is in place.
+ *
+ * This function is safe to call from any thread.
+ */
+void Handoff::finish() {
+    _finished.fetch_add(1, std::memory_order_release);
+}
+
+/**
+ * Called by each shard once it has finished. Waits until the state
+ * was either taken by the new server or could not be sent.
+ *
+ * This function is safe to call from any thread.
+ *
+ * Returns true if the new server has the sockets now, or false if
+ * the shard should go on serving them.
+ */
+bool Handoff::wait() {
+    int outcome;
+    while ((outcome = _outcome.load(std::memory_order_acquire)) == HANDOFF_PENDING)
+        std::this_thread::yield();
+    if (outcome == HANDOFF_DONE)
+        return true;
+    _resumed.fetch_add(1, std::memory_order_release);
+    return false;
+}
+
+/**
+ * Waits for every shard to finish and sends their sockets and state
+ * to the new server, then waits for it to say it has everything.
+ *
+ * Once the new server has said so, it is told that it owns the sockets.
+ *
+ * This function throws a runtime_error exception if the new server
+ * goes away or does not answer within HANDOFF_TIMEOUT_S seconds.
+ * Nothing has been given up then, so end can let the shards go on.
+ */
+void Handoff::send() {
+    while (_finished.load(std::memory_order_acquire) < _shards.size())
+        std::this_thread::yield();
+
+    // The descriptors are sent in the same order as the state refers to them
+    std::string data;
+    std::vector<int> fds;
+    put_u32(data, _shards.size());
+    for (auto shard = _shards.begin(); shard != _shards.end(); ++shard) {
+        put_u32(data, shard->listener != -1);
+        if (shard->listener != -1)
+            fds.push_back(shard->listener);
+        put_u32(data, shard->unix_listener != -1);
+        if (shard->unix_listener != -1)
+            fds.push_back(shard->unix_listener);
+
+        put_u32(data, shard->clients.size());
+        for (auto client = shard->clients.begin(); client != shard->clients.end(); ++client) {
+            fds.push_back(client->fd);
+            put_u32(data, client->named);
+            put_string(data, client->handle.data(), client->handle.size());
+            put_u32(data, client->channels.size());
+            for (auto it = client->channels.begin(); it != client->channels.end(); ++it)
+                put_string(data, it->data(), it->size());
+            put_string(data, client->input.data(), client->input.size());
+            put_u64(data, client->sent);
+            put_u32(data, client->outbox.size());
+            for (auto it = client->outbox.begin(); it != client->outbox.end(); ++it)
+                put_string(data, (*it)->data(), (*it)->size());
+        }
+    }
+
+    HandoffHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, HANDOFF_MAGIC, sizeof(HANDOFF_MAGIC));
+    header.fd_count = fds.size();
+    header.data_size = data.size();
+    write_all(_conn, &header, sizeof(header));
+    for (size_t i = 0; i < fds.size(); i += HANDOFF_MAX_FDS)
+        send_fds(_conn, fds.data() + i, std::min<size_t>(HANDOFF_MAX_FDS, fds.size() - i));
+    write_all(_conn, data.data(), data.size());
+
+    char ack;
+    read_all(_conn, &ack, 1);
+
+    // The new server only starts serving once it gets this byte, so
+    // there is never a moment in which both servers do. If it cannot
+    // be sent, the new server is gone and the shards can go on.
+    char commit = 0;
+    write_all(_conn, &commit, 1);
+}
+
+/**
+ * Tells the shards what became of the handoff, once send has returned
+ * or failed. If it failed, the connection to the new server is closed,
+ * and this waits until every shard is serving again, so that the next
+ * attempt does not begin before the last one is over.
+ *
+ *  done    Whether the new server has everything.
+ */
+void Handoff::end(bool done) {
+    if (done) {
+        _outcome.store(HANDOFF_DONE, std::memory_order_release);
+        return;
+    }
+
+    ::close(_conn);
+    _conn = -1;
+    _outcome.store(HANDOFF_FAILED, std::memory_order_release);
+    while (_resumed.load(std::memory_order_acquire) < _shards.size())
+        std::this_thread::yield();
+}
+
+/**
+ * Connects to a running server to take over from it.
+ *
+ * This function throws a runtime_error exception if the running server
+ * turns this one away or the connection fails.
+ *
+ *  path    The path of the running server's handoff socket.
+ *  framed  Whether the clients of this server use framed mode.
+ *
+ * Returns false if no server is waiting at the path, or true if
+ * one is and the state can be received.
+ */
+bool Handoff::connect(const std::string& path, bool framed) {
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("handoff socket: invalid path: " + path);
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+    _conn = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_conn == -1)
+        throw_errno("socket");
+
+    // A file left behind by a server that is no longer running
+    // refuses the connection
+    if (::connect(_conn, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1) {
+        int error = errno;
+        ::close(_conn);
+        _conn = -1;
+        if (error == ENOENT || error == ECONNREFUSED)
+            return false;
+        errno = error;
+        throw_errno("connect");
+    }
+
+    HandoffHello hello;
+    std::memcpy(hello.magic, HANDOFF_MAGIC, sizeof(HANDOFF_MAGIC));
+    hello.framed = framed;
+    write_all(_conn, &hello, sizeof(hello));
+
+    // A running server that stops answering must not keep this one
+    // waiting forever
+    struct timeval timeout = { HANDOFF_TIMEOUT_S, 0 };
+    ::setsockopt(_conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ::setsockopt(_conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return true;
+}
+
+/**
+ * Receives the sockets and state of every shard of the running server.
+ * The running server keeps its sockets open until release is called.
+ *
+ * This function throws a runtime_error exception if the running server
+ * turns this one away, goes away first, or does not send anything
+ * for HANDOFF_TIMEOUT_S seconds.
+ */
+void Handoff::receive() {
+    HandoffHeader header;
+    read_all(_conn, &header, sizeof(header));
+    if (std::memcmp(header.magic, HANDOFF_MAGIC, sizeof(HANDOFF_MAGIC)) != 0)
+        throw std::runtime_error("handoff: the running server is not compatible");
+    if (header.status == HANDOFF_REJECTED)
+        throw std::runtime_error("handoff: the running server uses a different -m mode");
+
+    std::vector<int> fds;
+    fds.reserve(header.fd_count);
+    while (fds.size() < header.fd_count)
+        receive_fds(_conn, fds);
+    std::string data(header.data_size, '\0');
+    read_all(_conn, &data[0], data.size());
+
+    const char* next = data.data();
+    const char* end = next + data.size();
+    size_t fd_index = 0;
+    _shards.resize(get_u32(next, end));
+    for (auto shard = _shards.begin(); shard != _shards.end(); ++shard) {
+        shard->listener = get_u32(next, end) ? get_fd(fds, fd_index) : -1;
+        shard->unix_listener = get_u32(next, end) ? get_fd(fds, fd_index) : -1;
+
+        shard->clients.resize(get_u32(next, end));
+        for (auto client = shard->clients.begin(); client != shard->clients.end(); ++client) {
+            client->fd = get_fd(fds, fd_index);
+            client->named = get_u32(next, end) != 0;
+            client->handle = get_string(next, end);
+            client->channels.resize(get_u32(next, end));
+            for (auto it = client->channels.begin(); it != client->channels.end(); ++it)
+                *it = get_string(next, end);
+            client->input = get_string(next, end);
+            client->sent = get_u64(next, end);
+            client->outbox.resize(get_u32(next, end));
+            for (auto it = client->outbox.begin(); it != client->outbox.end(); ++it) {
+                uint32_t size = get_u32(next, end);
+                *it = MessagePtr(Message::create(get_bytes(next, end, size), size));
+            }
+        }
+    }
+}
+
+/**
+ * Tells the old server that everything was received, waits for it to
+ * confirm that it gives up the sockets, and then waits for it to exit,
+ * so that the ports and files it was using are free.
+ *
+ * The old server may give up waiting for the answer just as it is sent,
+ * and go on serving. It then closes the connection without confirming,
+ * and the sockets must not be used.
+ *
+ * This function throws a runtime_error exception if the old server
+ * did not confirm or the connection fails.
+ */
+void Handoff::release() {
+    char ack = 0;
+    write_all(_conn, &ack, 1);
+
+    // The old server either confirms or closes the connection soon,
+    // because its own wait for the answer has a timeout
+    struct timeval timeout = { 0, 0 };
+    ::setsockopt(_conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char commit;
+    ssize_t bytes;
+    while ((bytes = ::recv(_conn, &commit, 1, 0)) == -1) {
+        if (errno != EINTR)
+            throw_errno("recv");
+    }
+    if (bytes == 0)
+        throw std::runtime_error("handoff: the running server gave up and is still serving");
+
+    // The old server's end is closed when it exits
+    char byte;
+    while ((bytes = ::recv(_conn, &byte, 1, 0)) != 0) {
+        if (bytes == -1 && errno != EINTR)
+            throw_errno("recv");
+    }
+    ::close(_conn);
+    _conn = -1;
+}
+
+/**
+ * Returns the number of clients in the state of every shard.
+ */
+size_t Handoff::get_client_count() const {
+    size_t count = 0;
+    for (auto it = _shards.begin(); it != _shards.end(); ++it)
+        count += it->clients.size();
+    return count;
+}
@@ -0,0 +1,116 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         Handoff.hpp
+* Description:  Defines the hot restart, which passes the listening
+*               sockets and every client connection of a running server
+*               to a new server process, so a new build can be deployed
+*               without disconnecting anyone.
+*               The running server waits on a Unix domain socket. A new
+*               server started with the same path connects to it, and
+*               the running server asks each shard to stop reading,
+*               waits for all of them, and collects each client's
+*               handle, channels, unrouted input and unsent messages.
+*               The descriptors are sent with SCM_RIGHTS in batches of
+*               up to 253, the most the kernel takes in one message,
+*               followed by the state of the clients. Once the new
+*               server says it has everything, the old one confirms
+*               that it gives the sockets up and exits, and the new one
+*               starts serving and takes over the Unix domain socket
+*               for the next restart. Without that confirmation, the
+*               new server exits instead, so the two never serve the
+*               same sockets.
+*               The sockets themselves never close, so the clients do
+*               not notice anything except a short pause; data they
+*               send in the meantime waits in the kernel.
+*               Nothing leaves the running server until the new one
+*               says it has everything, so if the new server fails or
+*               goes away before that, the shards just go on serving
+*               and the running server waits for the next attempt.
+\*********************************************************/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Message.hpp"
+
+// Define at most 253 descriptors per message, which is the kernel's
+// limit, unless defined elsewhere
+#ifndef HANDOFF_MAX_FDS
+#define HANDOFF_MAX_FDS 253
+#endif
+
+// Define how many seconds the new server may take to receive
+// everything unless defined elsewhere
+#ifndef HANDOFF_TIMEOUT_S
+#define HANDOFF_TIMEOUT_S 10
+#endif
+
+// What became of a hot restart
+enum HandoffOutcome {
+    HANDOFF_PENDING,                    // The state is still being sent
+    HANDOFF_DONE,                       // The new server has everything
+    HANDOFF_FAILED                      // The shards go on serving
+};
+
+// The state of one client that is passed to the new process
+struct HandoffClient {
+    int fd;                             // Socket descriptor of the client
+    bool named;                         // Whether its handle was settled
+    std::string handle;                 // Handle it owns, or empty if none
+    std::vector<std::string> channels;  // Channels it joined
+    std::string input;                  // Received data not routed yet
+    std::vector<MessagePtr> outbox;     // Messages not completely sent yet
+    uint64_t sent;                      // Bytes of the first one already sent
+};
+
+// The sockets of one shard that are passed to the new process
+struct ShardHandoff {
+    int listener;                       // TCP listening socket, or -1
+    int unix_listener;                  // Unix domain listening socket, or -1
+    std::vector<HandoffClient> clients; // Connected clients
+};
+
+class Handoff {
+    public:
+        Handoff();
+        ~Handoff();
+
+        // Used by the running server
+        void listen(const std::string& path);
+        void accept(bool framed);
+        void begin(size_t shards);
+        void stop();
+        void finish();
+        bool wait();
+        void send();
+        void end(bool done);
+
+        // Used by the new server
+        bool connect(const std::string& path, bool framed);
+        void receive();
+        void release();
+
+        ShardHandoff& get_shard(size_t index) { return _shards[index]; }
+        size_t get_shard_count() const { return _shards.size(); }
+        size_t get_client_count() const;
+
+    private:
+        int _sd;                        // Listening socket, or -1
+        int _conn;                      // Connection to the other process, or -1
+        std::string _path;              // Path of the listening socket
+        std::vector<ShardHandoff> _shards;  // State of each shard of the old server
+        std::atomic<size_t> _stopped;   // Shards that stopped reading
+        std::atomic<size_t> _finished;  // Shards whose state is in _shards
+        std::atomic<int> _outcome;      // HandoffOutcome of the current attempt
+        std::atomic<size_t> _resumed;   // Shards that went on serving after a failure
+
+        // Not copyable because the sockets are owned
+        Handoff(const Handoff&);
+        Handoff& operator=(const Handoff&);
+};
@@ -0,0 +1,563 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         History.cpp
+* Description:  Implementation file for History.hpp
+\*********************************************************/
+#include "History.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Header of a record in a log segment. It is followed by the channel
+// name and the message frame, and the record is padded to 8 bytes.
+// A header whose size is 0 marks the end of the records in a segment,
+// because new segments are filled with zeros.
+struct LogRecord {
+    uint64_t seq;           // Sequence number of the message
+    uint32_t size;          // Size of the whole record, including padding
+    uint32_t channel_size;  // Size of the channel name
+};
+
+/**
+ * Throws a runtime_error exception with the specified prefix
+ * and the message for the current value of errno.
+ *
+ *  prefix  The name of the function that failed.
+ */
+static void throw_errno(const std::string& prefix) {
+    std::string errmsg(prefix);
+    errmsg += ": ";
+    errmsg += ::strerror(errno);
+    throw std::runtime_error(errmsg);
+}
+
+/**
+ * Gets the path of a log segment file.
+ *
+ *  dir     The log directory.
+ *  index   The position of the segment in the log.
+ */
+static std::string segment_path(const std::string& dir, unsigned index) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "segment-%08u.log", index);
+    return dir + "/" + name;
+}
+
+/**
+ * Constructor. Creates an empty history that is only kept in memory
+ * until open_log is called.
+ *
+ * This function throws a runtime_error exception if the notification
+ * eventfd cannot be created.
+ */
+History::History()
+    : _appended(0), _queue(HISTORY_QUEUE_SIZE), _signaled(false),
+    _recorded(0), _dropped(0), _log_bytes(0) {
+    _last_seq = 0;
+    _log_failed = false;
+
+    // Blocking, because the history thread has nothing else to wait for
+    _notify_fd = ::eventfd(0, EFD_CLOEXEC);
+    if (_notify_fd == -1)
+        throw_errno("eventfd");
+}
+
+/**
+ * Destructor. Unmaps and closes the log segments.
+ */
+History::~History() {
+    _segments.clear();
+    ::close(_notify_fd);
+}
+
+/**
+ * Tells whether a page of replayed messages is full.
+ *
+ *  count       The number of messages in the page.
+ *  bytes       The bytes of the messages in the page.
+ *  size        The bytes of the next message.
+ *  max_bytes   The most bytes the page may have.
+ */
+static bool page_full(size_t count, size_t bytes, size_t size, size_t max_bytes) {
+    // The first message is always taken, so that none is too large to replay
+    return count > 0 && (count >= HISTORY_REPLAY_MESSAGES || bytes + size > max_bytes);
+}
+
+/**
+ * Starts writing every message to a log in the specified directory.
+ *
+ * Segments already in the directory are mapped so that their messages
+ * can be replayed, and new sequence numbers continue after the highest
+ * one found. The directory is created if it does not exist. Once there
+ * are more than HISTORY_MAX_SEGMENTS segments, the oldest are deleted.
+ *
+ * This function must be called before the history thread is started.
+ * It throws a runtime_error exception if the log cannot be opened.
+ *
+ *  dir     The directory that holds the segment files.
+ */
+void History::open_log(const std::string& dir) {
+    if (::mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST)
+        throw_errno("mkdir " + dir);
+    _log_dir = dir;
+
+    // Find the existing segments
+    DIR* d = ::opendir(dir.c_str());
+    if (d == nullptr)
+        throw_errno("opendir " + dir);
+    std::vector<unsigned> indexes;
+    struct dirent* ent;
+    while ((ent = ::readdir(d)) != nullptr) {
+        unsigned index;
+        char tail;
+        if (std::sscanf(ent->d_name, "segment-%8u.lo%c", &index, &tail) == 2 && tail == 'g')
+            indexes.push_back(index);
+    }
+    ::closedir(d);
+    std::sort(indexes.begin(), indexes.end());
+
+    // Segments are numbered without gaps; the oldest may have been deleted
+    for (unsigned i = 0; i < indexes.size() && indexes[i] == indexes[0] + i; ++i)
+        open_segment(indexes[i], false);
+    if (_segments.empty())
+        open_segment(0, true);
+    retire_segments();
+
+    for (auto it = _segments.begin(); it != _segments.end(); ++it) {
+        if (it->used > 0)
+            _last_seq = std::max(_last_seq, it->last_seq);
+    }
+}
+
+/**
+ * Maps a segment file and adds it to the end of the log.
+ *
+ * This function throws a runtime_error exception if the file
+ * cannot be opened or mapped.
+ *
+ *  index   The position of the segment in the log.
+ *  create  Whether to create a new, empty file.
+ */
+void History::open_segment(unsigned index, bool create) {
+    std::string path = segment_path(_log_dir, index);
+    int flags = O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0);
+    int fd = ::open(path.c_str(), flags, 0644);
+    if (fd == -1)
+        throw_errno("open " + path);
+
+    // A new file is full of zeros, which marks the end of the records
+    if (create && ::ftruncate(fd, HISTORY_SEGMENT_SIZE) == -1) {
+        ::close(fd);
+        throw_errno("ftruncate " + path);
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) == -1 || st.st_size < static_cast<off_t>(sizeof(LogRecord))) {
+        ::close(fd);
+        throw std::runtime_error("open " + path + ": not a log segment");
+    }
+
+    void* data = ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        ::close(fd);
+        throw_errno("mmap " + path);
+    }
+
+    // Replays read a segment without the lock, so it stays mapped
+    // until the last of them is done with it
+    size_t size = st.st_size;
+    Segment segment;
+    segment.index = index;
+    segment.map = std::shared_ptr<char>(static_cast<char*>(data), [fd, size](char* p) {
+        ::munmap(p, size);
+        ::close(fd);
+    });
+    segment.data = static_cast<char*>(data);
+    segment.size = size;
+    segment.used = 0;
+    segment.first_seq = 0;
+    segment.last_seq = 0;
+    segment.seq_index = std::shared_ptr<IndexEntry>(new IndexEntry[size / HISTORY_INDEX_BYTES + 1],
+        std::default_delete<IndexEntry[]>());
+    segment.indexed = 0;
+    if (!create)
+        scan_segment(segment);
+
+    std::lock_guard<std::mutex> guard(_mutex);
+    _segments.push_back(segment);
+}
+
+/**
+ * Finds the end of the records in a segment that was written earlier,
+ * along with the range of sequence numbers it holds, and indexes them.
+ *
+ *  segment     The segment to scan.
+ */
+void History::scan_segment(Segment& segment) {
+    size_t offset = 0;
+    while (offset + sizeof(LogRecord) <= segment.size) {
+        const LogRecord* rec = reinterpret_cast<const LogRecord*>(segment.data + offset);
+        // Stop at the end marker or at a record that was cut short
+        if (rec->size < sizeof(LogRecord) || rec->size > segment.size - offset)
+            break;
+
+        segment.indexed = index_record(segment, offset);
+        if (segment.used == 0 || rec->seq < segment.first_seq)
+            segment.first_seq = rec->seq;
+        segment.last_seq = std::max(segment.last_seq, rec->seq);
+        offset += rec->size;
+        segment.used = offset;
+    }
+}
+
+/**
+ * Adds the index entries for a record that is about to be added at the
+ * end of a segment: one for each HISTORY_INDEX_BYTES of the file up to
+ * the record, unless an earlier record already starts past it.
+ *
+ * The entries are written past the ones in use, where replays do not
+ * read them, so the caller can make them visible later under the lock.
+ *
+ *  segment     The segment the record is added to.
+ *  offset      The offset of the record.
+ *
+ * Returns the number of index entries in use after the record is added.
+ */
+size_t History::index_record(const Segment& segment, size_t offset) {
+    size_t indexed = segment.indexed;
+    while (indexed * HISTORY_INDEX_BYTES <= offset) {
+        IndexEntry& entry = segment.seq_index.get()[indexed++];
+        entry.seq = segment.used == 0 ? 0 : segment.last_seq;
+        entry.offset = offset;
+    }
+    return indexed;
+}
+
+/**
+ * Deletes the oldest log segments until at most HISTORY_MAX_SEGMENTS
+ * are left. Their messages can no longer be replayed.
+ */
+void History::retire_segments() {
+    while (_segments.size() > HISTORY_MAX_SEGMENTS) {
+        ::unlink(segment_path(_log_dir, _segments.front().index).c_str());
+        std::lock_guard<std::mutex> guard(_mutex);
+        _segments.erase(_segments.begin());
+    }
+}
+
+/**
+ * Records messages until the program terminates.
+ *
+ * This function is intended to be run in a separate thread.
+ * It sleeps until append wakes it up, then records every message
+ * that is waiting.
+ */
+void History::run() {
+    while (true) {
+        uint64_t count;
+        ssize_t bytes;
+        do {
+            bytes = ::read(_notify_fd, &count, sizeof(count));
+        } while (bytes == -1 && errno == EINTR);
+
+        // Allow the next append to notify again before draining,
+        // so that no message is left waiting without a notification
+        _signaled.exchange(false);
+
+        Entry entry;
+        while (_queue.pop(entry))
+            record(entry);
+    }
+}
+
+/**
+ * Waits until every message appended so far has been recorded or
+ * dropped, so that the log is complete before the process exits.
+ *
+ * This function is safe to call from any thread but the history thread.
+ */
+void History::flush() {
+    unsigned long appended = _appended.load();
+    while (_recorded.load() + _dropped.load() < appended)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+/**
+ * Queues a message to be recorded.
+ *
+ * This function is safe to call from any thread, and it never blocks.
+ * If the history thread has fallen too far behind, the message is
+ * not recorded and is counted as dropped.
+ *
+ *  message     The message to record. Only a reference is stored.
+ *  channel     The channel the message was sent to.
+ *
+ * Returns false if the message was dropped, or true otherwise.
+ */
+bool History::append(const MessagePtr& message, const std::string& channel) {
+    _appended.fetch_add(1);
+    Entry entry;
+    entry.seq = 0;
+    entry.message = message;
+    entry.channel = channel;
+    if (!_queue.push(entry)) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    if (!_signaled.exchange(true)) {
+        uint64_t one = 1;
+        ssize_t bytes;
+        do {
+            bytes = ::write(_notify_fd, &one, sizeof(one));
+        } while (bytes == -1 && errno == EINTR);
+    }
+    return true;
+}
+
+/**
+ * Records one message in its channel's ring and in the log, and gives
+ * it the next sequence number. Messages are recorded in the order they
+ * were queued, so every message with a lower sequence number is already
+ * recorded, and a replay never misses one that is recorded later.
+ * A message too large for a log segment is not recorded at all and is
+ * counted as dropped, so that the ring never has messages the log lacks.
+ *
+ *  entry   The message to record.
+ */
+void History::record(Entry& entry) {
+    entry.seq = _last_seq + 1;
+    if (!_log_dir.empty() && !_log_failed && !write_log(entry)) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(_mutex);
+    auto it = _rings.find(entry.channel);
+    if (it == _rings.end()) {
+        Ring ring;
+        ring.head = 0;
+        it = _rings.emplace(entry.channel, ring).first;
+    }
+
+    // Overwrite the oldest entry once the ring is full
+    Ring& ring = it->second;
+    RingEntry re;
+    re.seq = entry.seq;
+    re.message = entry.message;
+    if (ring.entries.size() < HISTORY_RING_SIZE) {
+        ring.entries.push_back(re);
+    }
+    else {
+        ring.entries[ring.head] = re;
+        ring.head = (ring.head + 1) % HISTORY_RING_SIZE;
+    }
+
+    _last_seq = entry.seq;
+    _recorded.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Appends a message to the current log segment, starting a new
+ * segment when it is full.
+ *
+ * The record is written straight into the mapped file. Readers only
+ * see it once the segment's used size is updated under the lock.
+ * If the log cannot be written, an error is displayed and the history
+ * is only kept in memory from then on.
+ *
+ *  entry   The message to write.
+ *
+ * Returns false if the message is too large for any segment, or true
+ * otherwise.
+ */
+bool History::write_log(const Entry& entry) {
+    size_t size = sizeof(LogRecord) + entry.channel.size() + entry.message->frame_size();
+    size = (size + 7) & ~static_cast<size_t>(7);
+
+    // Only this thread changes the segment list, so it can be read unlocked
+    Segment* segment = &_segments.back();
+    if (size > HISTORY_SEGMENT_SIZE)
+        return false;
+    if (segment->used + size > segment->size) {
+        try {
+            open_segment(segment->index + 1, true);
+            retire_segments();
+        }
+        catch (const std::runtime_error& ex) {
+            std::cout << std::endl << ex.what() << std::endl;
+            _log_failed = true;
+            return true;
+        }
+        segment = &_segments.back();
+    }
+
+    size_t indexed = index_record(*segment, segment->used);
+    char* p = segment->data + segment->used;
+    LogRecord rec;
+    rec.seq = entry.seq;
+    rec.size = size;
+    rec.channel_size = entry.channel.size();
+    std::memcpy(p, &rec, sizeof(rec));
+    std::memcpy(p + sizeof(rec), entry.channel.data(), entry.channel.size());
+    std::memcpy(p + sizeof(rec) + entry.channel.size(),
+        entry.message->frame(), entry.message->frame_size());
+    _log_bytes.fetch_add(size, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> guard(_mutex);
+    if (segment->used == 0 || entry.seq < segment->first_seq)
+        segment->first_seq = entry.seq;
+    segment->last_seq = std::max(segment->last_seq, entry.seq);
+    segment->used += size;
+    segment->indexed = indexed;
+    return true;
+}
+
+/**
+ * Gets one page of the recorded messages of a channel that have
+ * a sequence number greater than the specified one, oldest first.
+ * A page has at most HISTORY_REPLAY_MESSAGES messages and max_bytes
+ * bytes of frames, except that the first message is always included.
+ *
+ * The messages are taken from the channel's ring if it goes back far
+ * enough, which only copies references. Otherwise, they are copied out
+ * of the mapped log segments, which are read without holding the lock.
+ * Without a log, only the messages in the ring are available.
+ *
+ * This function is safe to call from any thread.
+ *
+ *  channel     The channel to get messages from.
+ *  since       The sequence number the caller has already seen,
+ *              or 0 for every recorded message.
+ *  max_bytes   The most bytes of frames to get.
+ *  messages    The vector to append the messages to.
+ *  more        Set to whether there are more messages after the page.
+ *
+ * Returns the sequence number to pass as since next time: the last one
+ * in the page if there are more, or else the last one recorded for
+ * any channel, since no message recorded later has a lower one.
+ */
+uint64_t History::replay(const std::string& channel, uint64_t since, size_t max_bytes,
+    std::vector<MessagePtr>& messages, bool& more) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    uint64_t last = _last_seq;
+    more = false;
+
+    auto it = _rings.find(channel);
+    bool in_ring = false;
+    if (it != _rings.end()) {
+        const Ring& ring = it->second;
+        uint64_t oldest = ring.entries[ring.head].seq;
+        in_ring = _log_dir.empty() || oldest <= since + 1;
+    }
+
+    if (in_ring) {
+        const Ring& ring = it->second;
+        size_t count = 0;
+        size_t bytes = 0;
+        for (size_t i = 0; i < ring.entries.size(); ++i) {
+            const RingEntry& re = ring.entries[(ring.head + i) % ring.entries.size()];
+            if (re.seq <= since)
+                continue;
+            if (page_full(count, bytes, re.message->frame_size(), max_bytes)) {
+                more = true;
+                return since;
+            }
+            messages.push_back(re.message);
+            bytes += re.message->frame_size();
+            ++count;
+            since = re.seq;
+        }
+        return last;
+    }
+
+    if (!_log_dir.empty()) {
+        lock.unlock();
+        uint64_t end = replay_log(channel, since, max_bytes, messages, more);
+        if (more)
+            return end;
+    }
+    return last;
+}
+
+/**
+ * Copies one page of the messages of a channel out of the log segments.
+ *
+ * Each segment's index is searched for the last point before which
+ * every record is older than since, and the segment is read from there,
+ * so a replay does not read the whole log to find where to start.
+ *
+ *  channel     The channel to get messages from.
+ *  since       Only messages with a greater sequence number are copied.
+ *  max_bytes   The most bytes of frames to copy, unless the first
+ *              message alone is larger.
+ *  messages    The vector to append the messages to.
+ *  more        Set to whether the page ended before the log did.
+ *
+ * Returns the sequence number of the last message copied, or since
+ * if there were none.
+ */
+uint64_t History::replay_log(const std::string& channel, uint64_t since, size_t max_bytes,
+    std::vector<MessagePtr>& messages, bool& more) {
+    // Take a snapshot of the segments. The records they hold are never
+    // changed, and the snapshot keeps them mapped even if they are
+    // retired, so they can be read without the lock.
+    std::vector<Segment> segments;
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        segments = _segments;
+    }
+
+    size_t count = 0;
+    size_t bytes = 0;
+    for (auto seg = segments.begin(); seg != segments.end(); ++seg) {
+        if (seg->used == 0 || seg->last_seq <= since)
+            continue;
+
+        // No index entry has a lower sequence number than the one before it
+        const IndexEntry* first = seg->seq_index.get();
+        const IndexEntry* last = first + seg->indexed;
+        const IndexEntry* start = std::upper_bound(first, last, since,
+            [](uint64_t seq, const IndexEntry& entry) { return seq < entry.seq; });
+        size_t offset = start == first ? 0 : (start - 1)->offset;
+        while (offset < seg->used) {
+            const char* p = seg->data + offset;
+            const LogRecord* rec = reinterpret_cast<const LogRecord*>(p);
+            offset += rec->size;
+
+            if (rec->seq <= since || rec->channel_size != channel.size()
+                || std::memcmp(p + sizeof(LogRecord), channel.data(), channel.size()) != 0)
+                continue;
+
+            // Skip the channel name and the length prefix of the frame
+            const char* frame = p + sizeof(LogRecord) + rec->channel_size;
+            uint32_t len = (static_cast<uint32_t>(static_cast<unsigned char>(frame[0])) << 24)
+                | (static_cast<uint32_t>(static_cast<unsigned char>(frame[1])) << 16)
+                | (static_cast<uint32_t>(static_cast<unsigned char>(frame[2])) << 8)
+                | static_cast<uint32_t>(static_cast<unsigned char>(frame[3]));
+            if (page_full(count, bytes, MESSAGE_HEADER_SIZE + len, max_bytes)) {
+                more = true;
+                return since;
+            }
+            messages.push_back(MessagePtr(Message::create(frame + MESSAGE_HEADER_SIZE, len)));
+            bytes += MESSAGE_HEADER_SIZE + len;
+            ++count;
+            since = rec->seq;
+        }
+    }
+    return since;
+}
@@ -0,0 +1,154 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         History.hpp
+* Description:  Defines the class that remembers the messages sent
+*               to each channel so that clients can catch up on what
+*               they missed.
+*               Every message gets a sequence number that is unique
+*               across the server, in the order they are recorded. The most recent messages of each
+*               channel are kept in memory, and every message can also
+*               be appended to a log of memory-mapped segment files,
+*               of which only the newest are kept. A replay returns one
+*               page of messages at a time, so a client that asks for
+*               everything cannot stall the thread that serves it.
+*               Messages are recorded by a thread of their own, so
+*               recording a message never blocks the thread that
+*               routes it.
+\*********************************************************/
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Message.hpp"
+#include "MpscQueue.hpp"
+
+// Define 1024 messages kept in memory per channel unless defined elsewhere
+#ifndef HISTORY_RING_SIZE
+#define HISTORY_RING_SIZE 1024
+#endif
+
+// Define 65536 messages waiting to be recorded unless defined elsewhere
+#ifndef HISTORY_QUEUE_SIZE
+#define HISTORY_QUEUE_SIZE 65536
+#endif
+
+// Define 64 MiB log segment files unless defined elsewhere
+#ifndef HISTORY_SEGMENT_SIZE
+#define HISTORY_SEGMENT_SIZE 67108864
+#endif
+
+// Define 16 log segments kept, 1 GiB in all, unless defined elsewhere
+#ifndef HISTORY_MAX_SEGMENTS
+#define HISTORY_MAX_SEGMENTS 16
+#endif
+
+// Define an index entry for every 64 KiB of log unless defined elsewhere
+#ifndef HISTORY_INDEX_BYTES
+#define HISTORY_INDEX_BYTES 65536
+#endif
+
+// Define at most 256 messages per replay unless defined elsewhere
+#ifndef HISTORY_REPLAY_MESSAGES
+#define HISTORY_REPLAY_MESSAGES 256
+#endif
+
+// Define at most 256 KiB of messages per replay unless defined elsewhere
+#ifndef HISTORY_REPLAY_BYTES
+#define HISTORY_REPLAY_BYTES 262144
+#endif
+
+class History {
+    public:
+        History();
+        ~History();
+
+        void open_log(const std::string& dir);
+        void run();
+        void flush();
+
+        bool append(const MessagePtr& message, const std::string& channel);
+        uint64_t replay(const std::string& channel, uint64_t since, size_t max_bytes,
+            std::vector<MessagePtr>& messages, bool& more);
+
+        unsigned long get_recorded() const { return _recorded.load(std::memory_order_relaxed); }
+        unsigned long get_dropped() const { return _dropped.load(std::memory_order_relaxed); }
+        unsigned long get_log_bytes() const { return _log_bytes.load(std::memory_order_relaxed); }
+
+    private:
+        // A message waiting to be recorded
+        struct Entry {
+            uint64_t seq;           // Sequence number, assigned when recorded
+            MessagePtr message;     // The message
+            std::string channel;    // The channel it was sent to
+        };
+
+        // A message in a channel's in-memory ring
+        struct RingEntry {
+            uint64_t seq;
+            MessagePtr message;
+        };
+
+        // The most recent messages of one channel, oldest first
+        struct Ring {
+            std::vector<RingEntry> entries; // Grows up to HISTORY_RING_SIZE
+            size_t head;                    // Position of the oldest entry
+        };
+
+        // A point in a log segment that a replay can start from
+        struct IndexEntry {
+            uint64_t seq;           // Highest sequence number before the point
+            size_t offset;          // Offset of the first record after it
+        };
+
+        // One memory-mapped log file
+        struct Segment {
+            unsigned index;         // Position in the log, which names the file
+            std::shared_ptr<char> map;  // Unmaps the file once no replay uses it
+            char* data;             // Mapping of the whole file
+            size_t size;            // Size of the file
+            size_t used;            // Bytes of complete records
+            uint64_t first_seq;     // Lowest sequence number in the file
+            uint64_t last_seq;      // Highest sequence number in the file
+            std::shared_ptr<IndexEntry> seq_index; // One entry per HISTORY_INDEX_BYTES
+            size_t indexed;         // Entries of the index in use
+        };
+
+        std::atomic<unsigned long> _appended;   // Messages appended
+        MpscQueue<Entry> _queue;            // Messages waiting to be recorded
+        std::atomic<bool> _signaled;        // Whether the thread was notified
+        int _notify_fd;                     // eventfd that wakes the thread
+
+        // Guards the rings and segment list, which are read by replay.
+        // Only the history thread changes them.
+        std::mutex _mutex;
+        std::unordered_map<std::string, Ring> _rings;
+        std::vector<Segment> _segments;
+        std::string _log_dir;               // Empty if there is no log
+        uint64_t _last_seq;                 // Last sequence number recorded
+        bool _log_failed;                   // Whether writing to the log failed
+
+        std::atomic<unsigned long> _recorded;   // Messages recorded
+        std::atomic<unsigned long> _dropped;    // Messages not recorded
+        std::atomic<unsigned long> _log_bytes;  // Bytes written to the log
+
+        void record(Entry& entry);
+        bool write_log(const Entry& entry);
+        void open_segment(unsigned index, bool create);
+        void scan_segment(Segment& segment);
+        size_t index_record(const Segment& segment, size_t offset);
+        void retire_segments();
+        uint64_t replay_log(const std::string& channel, uint64_t since, size_t max_bytes,
+            std::vector<MessagePtr>& messages, bool& more);
+
+        // Not copyable because the files are owned
+        History(const History&);
+        History& operator=(const History&);
+};
@@ -0,0 +1,162 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         LatencyHistogram.cpp
+* Description:  Implementation file for LatencyHistogram.hpp
+\*********************************************************/
+#include "LatencyHistogram.hpp"
+
+#include <limits>
+
+// Number of sub-buckets per power of two
+#define SUB_BUCKETS (1u << LATENCY_SUB_BUCKET_BITS)
+
+// Number of buckets needed to cover every 64-bit value
+#define BUCKET_COUNT ((65 - LATENCY_SUB_BUCKET_BITS) * SUB_BUCKETS)
+
+/**
+ * Constructor. Creates an empty histogram.
+ */
+LatencyHistogram::LatencyHistogram() : _buckets(new std::atomic<uint64_t>[BUCKET_COUNT]) {
+    reset();
+}
+
+/**
+ * Counts one value.
+ *
+ * This function must only be called by the histogram's writer.
+ *
+ *  value   The value to count, usually a latency in nanoseconds.
+ */
+void LatencyHistogram::record(uint64_t value) {
+    add(_buckets[bucket_index(value)], 1);
+    add(_count, 1);
+    add(_sum, value);
+    if (value < _min.load(std::memory_order_relaxed))
+        _min.store(value, std::memory_order_relaxed);
+    if (value > _max.load(std::memory_order_relaxed))
+        _max.store(value, std::memory_order_relaxed);
+}
+
+/**
+ * Adds the values counted by another histogram to this one.
+ *
+ * The other histogram can be written to at the same time. The count
+ * is taken from its buckets, so percentiles stay consistent even if
+ * a value is being recorded while they are copied.
+ *
+ *  other   The histogram to add.
+ */
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+        uint64_t bucket = other._buckets[i].load(std::memory_order_relaxed);
+        if (bucket > 0) {
+            add(_buckets[i], bucket);
+            count += bucket;
+        }
+    }
+    if (count == 0)
+        return;
+
+    add(_count, count);
+    add(_sum, other._sum.load(std::memory_order_relaxed));
+    if (other._min.load(std::memory_order_relaxed) < _min.load(std::memory_order_relaxed))
+        _min.store(other._min.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    if (other._max.load(std::memory_order_relaxed) > _max.load(std::memory_order_relaxed))
+        _max.store(other._max.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+/**
+ * Forgets every value counted so far.
+ *
+ * This function must only be called by the histogram's writer.
+ */
+void LatencyHistogram::reset() {
+    for (size_t i = 0; i < BUCKET_COUNT; ++i)
+        _buckets[i].store(0, std::memory_order_relaxed);
+    _count.store(0, std::memory_order_relaxed);
+    _min.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+    _max.store(0, std::memory_order_relaxed);
+    _sum.store(0, std::memory_order_relaxed);
+}
+
+/**
+ * Returns the average of the values counted, or 0 if there are none.
+ */
+double LatencyHistogram::get_mean() const {
+    uint64_t count = get_count();
+    return count == 0 ? 0 : static_cast<double>(_sum.load(std::memory_order_relaxed)) / count;
+}
+
+/**
+ * Finds the value that the given percentage of values are at or below.
+ *
+ * Percentiles of a histogram that is being written to are only
+ * approximate; merge it into a new histogram first for exact ones.
+ *
+ *  percentile  The percentage, from 0 to 100.
+ *
+ * Returns the highest value that falls in the same bucket as the
+ * requested value, capped at the largest value counted,
+ * or 0 if there are no values.
+ */
+uint64_t LatencyHistogram::get_percentile(double percentile) const {
+    uint64_t total = get_count();
+    uint64_t max = get_max();
+    if (total == 0)
+        return 0;
+
+    // Number of values at or below the requested one, at least one
+    uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > total)
+        rank = total;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+        seen += _buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+/**
+ * Finds the bucket that a value is counted in.
+ *
+ * Values below twice the number of sub-buckets each have a bucket
+ * of their own. Above that, a value is shifted right until it fits
+ * in the sub-buckets, and the number of shifts selects the range.
+ *
+ *  value   The value to look up.
+ *
+ * Returns the index of the bucket.
+ */
+size_t LatencyHistogram::bucket_index(uint64_t value) {
+    if (value < 2 * SUB_BUCKETS)
+        return static_cast<size_t>(value);
+
+    unsigned shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BUCKET_BITS;
+    return shift * SUB_BUCKETS + static_cast<size_t>(value >> shift);
+}
+
+/**
+ * Finds the highest value that is counted in a bucket.
+ *
+ *  index   The index of the bucket.
+ *
+ * Returns the highest value of the bucket.
+ */
+uint64_t LatencyHistogram::bucket_value(size_t index) {
+    if (index < 2 * SUB_BUCKETS)
+        return index;
+
+    unsigned shift = static_cast<unsigned>(index / SUB_BUCKETS) - 1;
+    uint64_t sub = index - static_cast<uint64_t>(shift) * SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
@@ -0,0 +1,61 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         LatencyHistogram.hpp
+* Description:  Defines a histogram of latencies in nanoseconds
+*               that percentiles can be read from.
+*               Values are counted in log-linear buckets: every
+*               power of two is split into the same number of
+*               equal sub-buckets, so each value is kept to within
+*               about 1.6% no matter how large it is, and recording
+*               a value is a few shifts and an increment.
+*               A histogram has a single writer, but any thread can
+*               read it at any time. The writer updates each field
+*               with a relaxed load and store instead of an atomic
+*               increment, which costs no more than a plain one.
+\*********************************************************/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Number of sub-buckets per power of two, as a power of two
+#define LATENCY_SUB_BUCKET_BITS 6
+
+class LatencyHistogram {
+    public:
+        LatencyHistogram();
+
+        void record(uint64_t value);
+        void merge(const LatencyHistogram& other);
+        void reset();
+
+        uint64_t get_count() const { return _count.load(std::memory_order_relaxed); }
+        uint64_t get_min() const { return get_count() == 0 ? 0 : _min.load(std::memory_order_relaxed); }
+        uint64_t get_max() const { return _max.load(std::memory_order_relaxed); }
+        double get_mean() const;
+        uint64_t get_percentile(double percentile) const;
+
+    private:
+        // Number of values in each bucket
+        std::unique_ptr<std::atomic<uint64_t>[]> _buckets;
+        std::atomic<uint64_t> _count;   // Number of values recorded
+        std::atomic<uint64_t> _min;     // Smallest value recorded
+        std::atomic<uint64_t> _max;     // Largest value recorded
+        std::atomic<uint64_t> _sum;     // Sum of all values recorded
+
+        static size_t bucket_index(uint64_t value);
+        static uint64_t bucket_value(size_t index);
+
+        // Adds to a field that only this histogram's writer changes
+        static void add(std::atomic<uint64_t>& field, uint64_t value) {
+            field.store(field.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        }
+
+        // Not copyable because readers may hold a reference
+        LatencyHistogram(const LatencyHistogram&);
+        LatencyHistogram& operator=(const LatencyHistogram&);
+};
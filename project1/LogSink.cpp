@@ -0,0 +1,240 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         LogSink.cpp
+* Description:  Implementation file for LogSink.hpp
+\*********************************************************/
+#include "LogSink.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * Constructor. Allocates an empty buffer.
+ *
+ *  capacity    The number of bytes the buffer holds.
+ *              It is rounded up to the next power of two.
+ */
+LogBuffer::LogBuffer(size_t capacity) : _tail(0), _head(0), _dropped(0) {
+    size_t size = 2;
+    while (size < capacity)
+        size *= 2;
+
+    _data.reset(new char[size]);
+    _mask = size - 1;
+}
+
+/**
+ * Adds a record to the buffer.
+ *
+ *  text    The text of the record.
+ *
+ * Returns false if the buffer is full, or true otherwise.
+ */
+bool LogBuffer::write(const std::string& text) {
+    struct iovec part;
+    part.iov_base = const_cast<char*>(text.data());
+    part.iov_len = text.size();
+    return write(&part, 1);
+}
+
+/**
+ * Adds a record made of several pieces to the buffer.
+ *
+ * The pieces are copied straight into the buffer, so a record can be
+ * put together from existing data without building a string first.
+ *
+ * This function must only be called by the thread that owns the buffer.
+ * It never blocks: if the whole record does not fit, none of it is
+ * added and it is counted as dropped.
+ *
+ *  parts   The pieces of the record, in order.
+ *  count   The number of pieces.
+ *
+ * Returns false if the buffer is full, or true otherwise.
+ */
+bool LogBuffer::write(const struct iovec* parts, size_t count) {
+    size_t size = 0;
+    for (size_t i = 0; i < count; ++i)
+        size += parts[i].iov_len;
+
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    size_t head = _head.load(std::memory_order_acquire);
+    if (tail - head + size > _mask + 1) {
+        _dropped.store(_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Copy each piece, wrapping around the end of the buffer
+    size_t pos = tail;
+    for (size_t i = 0; i < count; ++i) {
+        const char* data = static_cast<const char*>(parts[i].iov_base);
+        size_t left = parts[i].iov_len;
+        while (left > 0) {
+            size_t offset = pos & _mask;
+            size_t chunk = std::min(left, _mask + 1 - offset);
+            std::memcpy(_data.get() + offset, data, chunk);
+            data += chunk;
+            left -= chunk;
+            pos += chunk;
+        }
+    }
+
+    // Publish the whole record at once
+    _tail.store(pos, std::memory_order_release);
+    return true;
+}
+
+/**
+ * Constructor. Writes to stdout until another file is opened.
+ */
+LogSink::LogSink() : _written(0) {
+    _fd = STDOUT_FILENO;
+    _interval_ms = LOGSINK_FLUSH_MS;
+}
+
+/**
+ * Destructor. Closes the file, if one was opened.
+ */
+LogSink::~LogSink() {
+    if (_fd != STDOUT_FILENO)
+        ::close(_fd);
+}
+
+/**
+ * Writes records to the end of a file instead of stdout.
+ *
+ * This function throws a runtime_error exception if the file
+ * cannot be opened.
+ *
+ *  path    The path of the file. It is created if it does not exist.
+ */
+void LogSink::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        std::string errmsg("open: ");
+        errmsg += path + ": " + ::strerror(errno);
+        throw std::runtime_error(errmsg);
+    }
+    if (_fd != STDOUT_FILENO)
+        ::close(_fd);
+    _fd = fd;
+}
+
+/**
+ * Creates a buffer for a thread that produces records.
+ *
+ * This function is safe to call from any thread, even while the
+ * writer is running.
+ *
+ * Returns the new buffer, which lives as long as the sink.
+ */
+LogBuffer* LogSink::create_buffer() {
+    std::lock_guard<std::mutex> guard(_mutex);
+    _buffers.emplace_back(new LogBuffer(LOGSINK_BUFFER_SIZE));
+    return _buffers.back().get();
+}
+
+/**
+ * Writes the records of every buffer until the program terminates.
+ *
+ * This function is intended to be run in a separate thread.
+ * Each pass writes everything that is buffered and then sleeps for
+ * the flush interval, so records that arrive close together are
+ * written together. Only this thread ever waits for the output.
+ */
+void LogSink::run() {
+    std::vector<LogBuffer*> buffers;
+    while (true) {
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            buffers.clear();
+            for (auto it = _buffers.begin(); it != _buffers.end(); ++it)
+                buffers.push_back(it->get());
+        }
+
+        for (auto it = buffers.begin(); it != buffers.end(); ++it) {
+            while (drain(**it) > 0)
+                ;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(_interval_ms));
+    }
+}
+
+/**
+ * Waits until the writer has written every record buffered so far.
+ *
+ * This function is safe to call from any thread but the writer's.
+ */
+void LogSink::flush() {
+    // The writer takes the lock too, so it is not held while waiting
+    std::vector<LogBuffer*> buffers;
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        for (auto it = _buffers.begin(); it != _buffers.end(); ++it)
+            buffers.push_back(it->get());
+    }
+
+    for (auto it = buffers.begin(); it != buffers.end(); ++it) {
+        size_t tail = (*it)->_tail.load(std::memory_order_acquire);
+        while ((*it)->_head.load(std::memory_order_acquire) < tail)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+/**
+ * Returns the number of records dropped by every buffer.
+ */
+unsigned long LogSink::get_dropped() {
+    std::lock_guard<std::mutex> guard(_mutex);
+    unsigned long dropped = 0;
+    for (auto it = _buffers.begin(); it != _buffers.end(); ++it)
+        dropped += (*it)->get_dropped();
+    return dropped;
+}
+
+/**
+ * Writes the records that are in a buffer with a single writev call.
+ *
+ * If the output cannot be written to, the records are discarded so
+ * that the producer does not fill up and drop all later records.
+ *
+ *  buffer  The buffer to write.
+ *
+ * Returns the number of bytes taken out of the buffer.
+ */
+size_t LogSink::drain(LogBuffer& buffer) {
+    size_t head = buffer._head.load(std::memory_order_relaxed);
+    size_t tail = buffer._tail.load(std::memory_order_acquire);
+    if (head == tail)
+        return 0;
+
+    // The data wraps around the end of the buffer at most once
+    size_t offset = head & buffer._mask;
+    size_t size = tail - head;
+    struct iovec iov[2];
+    iov[0].iov_base = buffer._data.get() + offset;
+    iov[0].iov_len = std::min(size, buffer._mask + 1 - offset);
+    iov[1].iov_base = buffer._data.get();
+    iov[1].iov_len = size - iov[0].iov_len;
+
+    ssize_t bytes = ::writev(_fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+    if (bytes == -1) {
+        if (errno == EINTR || errno == EAGAIN)
+            return 0;
+        bytes = size;
+    }
+    else {
+        _written.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    buffer._head.store(head + bytes, std::memory_order_release);
+    return bytes;
+}
@@ -0,0 +1,96 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         LogSink.hpp
+* Description:  Defines the classes that write console output
+*               on a thread of its own, so that a slow terminal,
+*               a full pipe or a slow disk never holds up routing.
+*               Each thread that produces output gets its own buffer
+*               and copies finished records into it without locking
+*               or making a system call. A writer thread collects the
+*               records from every buffer every few milliseconds and
+*               writes them to stdout or a file in as few calls as
+*               possible. Records that do not fit in a full buffer
+*               are dropped and counted instead of waiting.
+\*********************************************************/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/uio.h>    // iovec
+
+// Define a 1 MiB buffer per producing thread unless defined elsewhere
+#ifndef LOGSINK_BUFFER_SIZE
+#define LOGSINK_BUFFER_SIZE 1048576
+#endif
+
+// Define 10 ms between writes unless defined elsewhere
+#ifndef LOGSINK_FLUSH_MS
+#define LOGSINK_FLUSH_MS 10
+#endif
+
+// A buffer of records that one thread writes and the writer thread reads
+class LogBuffer {
+    public:
+        LogBuffer(size_t capacity);
+
+        bool write(const std::string& text);
+        bool write(const struct iovec* parts, size_t count);
+
+        unsigned long get_dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+    private:
+        friend class LogSink;
+
+        std::unique_ptr<char[]> _data;  // Bytes, a power of two in number
+        size_t _mask;                   // Number of bytes minus one
+
+        // The positions only ever grow; the producer and the writer each
+        // update one of them, so they are kept on separate cache lines.
+        char _pad1[64];
+        std::atomic<size_t> _tail;      // End of the last complete record
+        char _pad2[64];
+        std::atomic<size_t> _head;      // Start of the first unwritten byte
+        char _pad3[64];
+
+        std::atomic<unsigned long> _dropped;    // Records that did not fit
+
+        // Not copyable because the writer holds a pointer to it
+        LogBuffer(const LogBuffer&);
+        LogBuffer& operator=(const LogBuffer&);
+};
+
+class LogSink {
+    public:
+        LogSink();
+        ~LogSink();
+
+        void open(const std::string& path);
+        void set_interval(int interval_ms) { _interval_ms = interval_ms; }
+        LogBuffer* create_buffer();
+        void run();
+        void flush();
+
+        unsigned long get_written() const { return _written.load(std::memory_order_relaxed); }
+        unsigned long get_dropped();
+
+    private:
+        int _fd;                    // Where records are written
+        int _interval_ms;           // Time to sleep when there is nothing to write
+
+        std::mutex _mutex;          // Guards the list of buffers
+        std::vector<std::unique_ptr<LogBuffer> > _buffers;
+
+        std::atomic<unsigned long> _written;    // Bytes written
+
+        size_t drain(LogBuffer& buffer);
+
+        // Not copyable because the file is owned
+        LogSink(const LogSink&);
+        LogSink& operator=(const LogSink&);
+};
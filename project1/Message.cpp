@@ -0,0 +1,105 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         Message.cpp
+* Description:  Implementation file for Message.hpp
+\*********************************************************/
+#include "Message.hpp"
+
+#include <arpa/inet.h> // htonl
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+#include "BufferPool.hpp"
+#include "TextFilter.hpp"
+
+/**
+ * Allocates a message and copies the payload into it.
+ *
+ * The header, length prefix and payload share a single buffer
+ * from the pool. The message starts with no references; wrap it in a MessagePtr.
+ *
+ *  data    The payload to copy.
+ *  size    The number of bytes in the payload.
+ *
+ * Returns the new message.
+ */
+Message* Message::create(const char* data, size_t size) {
+    Message* msg = allocate(size);
+    std::memcpy(msg->payload(), data, size);
+    return msg;
+}
+
+/**
+ * Allocates a message and copies the payload straight out of
+ * a receive buffer, without an intermediate copy.
+ *
+ *  data    A view of the payload to copy.
+ *
+ * Returns the new message.
+ */
+Message* Message::create(const RingView& data) {
+    Message* msg = allocate(data.size());
+    data.copy_to(msg->payload());
+    return msg;
+}
+
+/**
+ * Allocates a message with room for the payload and
+ * stores the length prefix. The payload is left uninitialized.
+ *
+ *  size    The number of bytes in the payload.
+ *
+ * Returns the new message.
+ */
+Message* Message::allocate(size_t size) {
+    void* mem = BufferPool::allocate(sizeof(Message) + MESSAGE_HEADER_SIZE + size);
+    Message* msg = new (mem) Message(size);
+
+    // Store the length prefix in network byte order
+    uint32_t len = htonl(static_cast<uint32_t>(size));
+    std::memcpy(reinterpret_cast<char*>(msg + 1), &len, MESSAGE_HEADER_SIZE);
+    return msg;
+}
+
+/**
+ * Allocates a message and copies the contents of a string into it.
+ *
+ *  data    The payload to copy.
+ *
+ * Returns the new message.
+ */
+Message* Message::create(const std::string& data) {
+    return create(data.data(), data.size());
+}
+
+/**
+ * Checks that the payload is valid UTF-8 and replaces any control
+ * characters in it. The size of the payload does not change.
+ *
+ * This function may only be called before the message is shared,
+ * because it changes the payload in place.
+ *
+ * Returns what the check found, as a combination of TEXT_CONTROL and
+ * TEXT_INVALID. Nothing is replaced in a payload that is not valid.
+ */
+int Message::sanitize() {
+    int found = TextFilter::check(data(), _size);
+    if (found == TEXT_CONTROL)
+        TextFilter::replace_controls(payload(), _size);
+    return found;
+}
+
+/**
+ * Drops one reference to the message and gives it back to the pool
+ * when the last reference is gone.
+ */
+void Message::release() {
+    if (_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        size_t size = sizeof(Message) + MESSAGE_HEADER_SIZE + _size;
+        this->~Message();
+        BufferPool::release(this, size);
+    }
+}
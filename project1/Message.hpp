@@ -0,0 +1,78 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         Message.hpp
+* Description:  Defines an immutable, reference-counted message
+*               buffer and a smart pointer for sharing it.
+*               The only change allowed is cleaning up the text of a
+*               message that was just received, before it is shared.
+*               A broadcast message is allocated once and every
+*               recipient's outgoing queue holds a reference to the
+*               same buffer instead of its own copy.
+*               The payload is preceded by its length as a 4-byte
+*               big-endian integer, so the same buffer can be sent
+*               to both framed and text mode clients.
+\*********************************************************/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+#include "RingBuffer.hpp"
+
+// Size of the length prefix stored in front of each payload
+#define MESSAGE_HEADER_SIZE 4
+
+class Message {
+    public:
+        static Message* create(const char* data, size_t size);
+        static Message* create(const std::string& data);
+        static Message* create(const RingView& data);
+
+        const char* data() const { return frame() + MESSAGE_HEADER_SIZE; }
+        size_t size() const { return _size; }
+        const char* frame() const { return reinterpret_cast<const char*>(this + 1); }
+        size_t frame_size() const { return _size + MESSAGE_HEADER_SIZE; }
+
+        int sanitize();
+
+        void retain() { _refs.fetch_add(1, std::memory_order_relaxed); }
+        void release();
+
+    private:
+        std::atomic<unsigned long> _refs;   // Number of MessagePtr references
+        size_t _size;                       // Number of bytes in the payload
+        // The length prefix and payload are stored immediately
+        // after this object in the same allocation.
+
+        Message(size_t size) : _refs(0), _size(size) {}
+        ~Message() {}
+
+        static Message* allocate(size_t size);
+        char* payload() { return reinterpret_cast<char*>(this + 1) + MESSAGE_HEADER_SIZE; }
+};
+
+class MessagePtr {
+    public:
+        MessagePtr() : _msg(nullptr) {}
+        explicit MessagePtr(Message* msg) : _msg(msg) { if (_msg) _msg->retain(); }
+        MessagePtr(const MessagePtr& other) : _msg(other._msg) { if (_msg) _msg->retain(); }
+        MessagePtr(MessagePtr&& other) : _msg(other._msg) { other._msg = nullptr; }
+        ~MessagePtr() { if (_msg) _msg->release(); }
+
+        MessagePtr& operator=(MessagePtr other) {
+            Message* tmp = _msg;
+            _msg = other._msg;
+            other._msg = tmp;
+            return *this;
+        }
+
+        const Message* operator->() const { return _msg; }
+        const Message& operator*() const { return *_msg; }
+        explicit operator bool() const { return _msg != nullptr; }
+
+    private:
+        Message* _msg;  // The shared message, or null
+};
@@ -0,0 +1,141 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         MpscQueue.hpp
+* Description:  Defines a bounded lock-free queue that any number
+*               of threads can push to and one thread pops from.
+*               Each slot carries a sequence number that tells
+*               producers and the consumer whether it is free or
+*               full, so neither side ever waits on the other.
+*               A push to a full queue fails instead of blocking.
+\*********************************************************/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+template <typename T>
+class MpscQueue {
+    public:
+        MpscQueue(size_t capacity);
+
+        bool push(T& value);
+        bool pop(T& value);
+
+        size_t get_capacity() const { return _mask + 1; }
+
+    private:
+        // One slot in the queue. The sequence number equals the position
+        // that can be pushed into the slot when it is free, and that
+        // position plus one when it holds a value to pop.
+        struct Cell {
+            std::atomic<size_t> sequence;
+            T value;
+        };
+
+        std::unique_ptr<Cell[]> _cells; // Slots, a power of two in number
+        size_t _mask;                   // Number of slots minus one
+
+        // Producers and the consumer update different positions, so they
+        // are kept on separate cache lines to avoid false sharing.
+        char _pad1[64];
+        std::atomic<size_t> _tail;      // Next position to push; shared
+        char _pad2[64];
+        size_t _head;                   // Next position to pop; consumer only
+        char _pad3[64];
+
+        // Not copyable because the slots are owned
+        MpscQueue(const MpscQueue&);
+        MpscQueue& operator=(const MpscQueue&);
+};
+
+/**
+ * Constructor. Allocates an empty queue.
+ *
+ *  capacity    The maximum number of values queued.
+ *              It is rounded up to the next power of two.
+ */
+template <typename T>
+MpscQueue<T>::MpscQueue(size_t capacity) : _tail(0) {
+    size_t size = 2;
+    while (size < capacity)
+        size *= 2;
+
+    _cells.reset(new Cell[size]);
+    _mask = size - 1;
+    _head = 0;
+    for (size_t i = 0; i < size; ++i)
+        _cells[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+/**
+ * Adds a value to the end of the queue.
+ *
+ * This function is safe to call from any number of threads at once.
+ * It never blocks: producers only compete for the next position,
+ * and a producer that loses simply tries the position after it.
+ *
+ *  value   The value to add. It is moved into the queue on success
+ *          and left unchanged if the queue is full.
+ *
+ * Returns false if the queue is full, or true otherwise.
+ */
+template <typename T>
+bool MpscQueue<T>::push(T& value) {
+    Cell* cell;
+    size_t pos = _tail.load(std::memory_order_relaxed);
+
+    while (true) {
+        cell = &_cells[pos & _mask];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+        if (diff == 0) {
+            // The slot is free; claim the position
+            if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) {
+            // The slot still holds a value from the previous lap
+            return false;
+        }
+        else {
+            // Another producer claimed the position first
+            pos = _tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->value = std::move(value);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+/**
+ * Removes the value at the front of the queue.
+ *
+ * This function must only be called by the consumer thread.
+ *
+ *  value   Set to the removed value.
+ *
+ * Returns false if the queue is empty, or true otherwise.
+ * A value whose producer has claimed its position but not finished
+ * writing it is treated as not yet queued.
+ */
+template <typename T>
+bool MpscQueue<T>::pop(T& value) {
+    Cell* cell = &_cells[_head & _mask];
+    size_t seq = cell->sequence.load(std::memory_order_acquire);
+    if (seq != _head + 1)
+        return false;
+
+    value = std::move(cell->value);
+    cell->value = T();      // Release anything the moved-from value holds
+
+    // Free the slot for the producer one lap later
+    cell->sequence.store(_head + _mask + 1, std::memory_order_release);
+    ++_head;
+    return true;
+}
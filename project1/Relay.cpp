@@ -0,0 +1,687 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         Relay.cpp
+* Description:  Implementation file for Relay.hpp
+\*********************************************************/
+#include "Relay.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include "ChannelIndex.hpp"
+#include "History.hpp"
+#include "Shard.hpp"
+#include "TextFilter.hpp"
+
+// A retry time for a peer that turned out to be this server
+static const uint64_t NEVER = std::numeric_limits<uint64_t>::max();
+
+/**
+ * Writes a 64-bit number in network byte order.
+ */
+static void put_u64(std::string& dest, uint64_t value) {
+    for (int shift = 56; shift >= 0; shift -= 8)
+        dest.push_back(static_cast<char>((value >> shift) & 0xff));
+}
+
+/**
+ * Reads a 64-bit number in network byte order.
+ */
+static uint64_t get_u64(const char* src) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i)
+        value = (value << 8) | static_cast<unsigned char>(src[i]);
+    return value;
+}
+
+/**
+ * Constructor. Creates a relay with no peers and picks a random origin id.
+ *
+ *  shards  The shards of this server. Received messages are posted to each.
+ *  history Records every message received from a peer.
+ *  log     Where the relay's console output is written.
+ *  prompt  The prompt string to redisplay after a message is displayed.
+ *  check_text  Whether to check received messages like the shards check
+ *              those of their clients.
+ */
+Relay::Relay(const std::vector<Shard*>& shards, History* history, LogSink* log,
+    std::string prompt, bool check_text)
+    : _shards(shards), _history(history), _prompt(prompt), _check_text(check_text), _next_seq(0),
+      _inbox(RELAY_INBOX_SIZE), _inbox_signaled(false), _pausing(false),
+      _paused(false), _linked(0),
+      _peer_count(0), _inbox_drops(0) {
+    _log = log->create_buffer();
+
+    // Zero is never used, so a hello that was never received does
+    // not match any server
+    std::random_device random;
+    do {
+        _origin = (static_cast<uint64_t>(random()) << 32) | random();
+    } while (_origin == 0);
+}
+
+/**
+ * Starts accepting links from other servers.
+ *
+ * This function throws a runtime_error exception if the port
+ * cannot be bound.
+ *
+ *  port    The TCP port on which other servers connect.
+ */
+void Relay::listen(const char* port) {
+    _listener.listen(port);
+    _loop.add(_listener.get_descriptor(), EPOLLIN);
+}
+
+/**
+ * Adds a server to connect to. The link is opened when the relay runs,
+ * and opened again whenever it is lost.
+ *
+ * This function throws a runtime_error exception if the address
+ * is not in host:port form.
+ *
+ *  address The host and relay port of the other server, as host:port.
+ */
+void Relay::add_peer(const std::string& address) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == address.size())
+        throw std::runtime_error("relay: expected host:port, got " + address);
+
+    std::unique_ptr<Peer> peer(new Peer());
+    peer->host = address.substr(0, colon);
+    peer->port = address.substr(colon + 1);
+    peer->connecting = false;
+    peer->events = 0;
+    peer->origin = 0;
+    peer->retry_at = 0;
+    _peers.push_back(std::move(peer));
+    update_peer_count();
+}
+
+/**
+ * Links to the peers and passes messages between them and the shards
+ * until the process exits.
+ */
+void Relay::run() {
+    uint64_t now = ShardStats::now();
+    for (auto it = _peers.begin(); it != _peers.end(); ++it)
+        connect_peer(**it, now);
+
+    while (true) {
+        if (_pausing.load(std::memory_order_acquire))
+            wait_paused();
+
+        // Wake up in time for the next reconnect
+        int timeout = -1;
+        for (auto it = _peers.begin(); it != _peers.end(); ++it) {
+            if ((*it)->stream || (*it)->retry_at == NEVER)
+                continue;
+            uint64_t wait = (*it)->retry_at > now ? (*it)->retry_at - now : 0;
+            int ms = static_cast<int>(wait / 1000000) + 1;
+            if (timeout < 0 || ms < timeout)
+                timeout = ms;
+        }
+
+        int count = _loop.wait(timeout);
+        for (int i = 0; i < count; ++i) {
+            const struct epoll_event& ev = _loop.event(i);
+            int fd = ev.data.fd;
+            if (fd == _loop.get_notify_descriptor()) {
+                handle_inbox();
+            }
+            else if (fd == _listener.get_descriptor()) {
+                accept_peers();
+            }
+            else {
+                int index = find_peer(fd);
+                if (index >= 0)
+                    handle_peer(index, ev.events);
+            }
+        }
+
+        now = ShardStats::now();
+        for (auto it = _peers.begin(); it != _peers.end(); ++it) {
+            if (!(*it)->stream && (*it)->retry_at <= now)
+                connect_peer(**it, now);
+        }
+
+        // Everything queued during this wakeup goes out together
+        flush_peers();
+    }
+}
+
+/**
+ * Posts a message that a local client sent, to be passed to every peer.
+ *
+ * This function is safe to call from any thread.
+ * If the inbox is full, the message is dropped and counted.
+ *
+ *  message     The message to pass on.
+ *  channel     The name of the channel it was sent to, or empty for all.
+ *
+ * Returns whether the message was posted.
+ */
+bool Relay::post(const MessagePtr& message, const std::string& channel) {
+    InboxEntry entry;
+    entry.message = message;
+    entry.channel = channel;
+    if (!_inbox.push(entry)) {
+        _inbox_drops.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Same as Shard::push: only the first post after a drain notifies
+    if (!_inbox_signaled.exchange(true))
+        _loop.notify();
+    return true;
+}
+
+/**
+ * Stops the relay before a hot restart, so that it no longer reads
+ * from its links and posts to the shards. Waits until the relay's
+ * thread is waiting for resume. Anything posted to the relay in the
+ * meantime stays in its inbox.
+ *
+ * This function is safe to call from any thread but the relay's.
+ */
+void Relay::pause() {
+    _pausing.store(true, std::memory_order_release);
+    _loop.notify();
+    while (!_paused.load(std::memory_order_acquire))
+        std::this_thread::yield();
+}
+
+/**
+ * Sends what the shards passed to the relay to the peers, once a hot
+ * restart succeeded and the shards have stopped. A peer that does not
+ * take it all within RELAY_FLUSH_MS misses the rest.
+ *
+ * This function must only be called while the relay is paused;
+ * it does the work of the relay's thread, which is waiting.
+ */
+void Relay::flush() {
+    handle_inbox();
+    uint64_t deadline = ShardStats::now() + RELAY_FLUSH_MS * 1000000ull;
+    while (true) {
+        flush_peers();
+        bool pending = false;
+        for (auto it = _peers.begin(); it != _peers.end() && !pending; ++it)
+            pending = (*it)->stream && !(*it)->connecting && (*it)->stream->has_pending();
+        if (!pending || ShardStats::now() >= deadline)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+/**
+ * Lets the relay go on after a hot restart failed, and waits until
+ * its thread does. What was posted to the relay and what its peers
+ * sent in the meantime is handled as usual.
+ *
+ * This function is safe to call from any thread but the relay's.
+ */
+void Relay::resume() {
+    _pausing.store(false, std::memory_order_release);
+    while (_paused.load(std::memory_order_acquire))
+        std::this_thread::yield();
+}
+
+/**
+ * Waits on the relay's thread while the relay is paused.
+ */
+void Relay::wait_paused() {
+    _paused.store(true, std::memory_order_release);
+    while (_pausing.load(std::memory_order_acquire))
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    _paused.store(false, std::memory_order_release);
+}
+
+/**
+ * Writes text to the relay's console output.
+ *
+ *  text    The text to display.
+ */
+void Relay::print(const std::string& text) {
+    _log->write(text);
+}
+
+/**
+ * Tags every message posted by the shards with this server's origin
+ * and the next sequence number, and queues it for every peer.
+ *
+ * Like Shard::handle_inbox, at most one inbox's worth of entries is
+ * handled per wakeup.
+ */
+void Relay::handle_inbox() {
+    _loop.clear_notify();
+    _inbox_signaled.exchange(false);
+
+    InboxEntry entry;
+    size_t count = 0;
+    while (count < _inbox.get_capacity() && _inbox.pop(entry)) {
+        MessagePtr record(make_record('M', ++_next_seq, entry.channel,
+            entry.message->data(), entry.message->size()));
+        send_to_peers(record, nullptr);
+        originated.add();
+        ++count;
+    }
+    entry.message = MessagePtr();
+    entry.channel.clear();
+
+    if (count == _inbox.get_capacity() && !_inbox_signaled.exchange(true))
+        _loop.notify();
+}
+
+/**
+ * Accepts every pending link from another server.
+ */
+void Relay::accept_peers() {
+    try {
+        _listener.accept_all(_accepted);
+    }
+    catch (const std::runtime_error& ex) {
+        print("\nrelay: " + std::string(ex.what()) + "\n");
+    }
+
+    for (auto it = _accepted.begin(); it != _accepted.end(); ++it) {
+        std::unique_ptr<Peer> peer(new Peer());
+        peer->retry_at = 0;
+        _peers.push_back(std::move(peer));
+        try {
+            open_peer(*_peers.back(), *it, false);
+        }
+        catch (const std::runtime_error& ex) {
+            print("\nrelay: " + std::string(ex.what()) + "\n");
+            close_peer(_peers.size() - 1);
+            continue;
+        }
+        print("\nrelay: accepted link from " + describe(*_peers.back()) + "\n");
+    }
+    _accepted.clear();
+    update_peer_count();
+}
+
+/**
+ * Starts connecting to a peer without waiting for the connection.
+ *
+ * If no connection can be started, another attempt is made after
+ * RELAY_RETRY_MS.
+ *
+ *  peer    The peer to connect to.
+ *  now     The current time on the ShardStats::now clock.
+ */
+void Relay::connect_peer(Peer& peer, uint64_t now) {
+    peer.retry_at = now + RELAY_RETRY_MS * 1000000ull;
+
+    struct addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* result;
+    if (::getaddrinfo(peer.host.c_str(), peer.port.c_str(), &hints, &result) != 0)
+        return;
+
+    for (struct addrinfo* ai = result; ai != nullptr; ai = ai->ai_next) {
+        int sd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            ai->ai_protocol);
+        if (sd < 0)
+            continue;
+        int rc = ::connect(sd, ai->ai_addr, ai->ai_addrlen);
+        if (rc != 0 && errno != EINPROGRESS) {
+            ::close(sd);
+            continue;
+        }
+
+        SocketStream stream(sd, ai->ai_addr, true);
+        try {
+            open_peer(peer, stream, rc != 0);
+        }
+        catch (const std::runtime_error& ex) {
+            print("\nrelay: " + std::string(ex.what()) + "\n");
+            stream.close();
+            peer.stream.reset();
+            continue;
+        }
+        if (rc == 0) {
+            print("\nrelay: linked to " + describe(peer) + "\n");
+            update_peer_count();
+        }
+        break;
+    }
+    ::freeaddrinfo(result);
+}
+
+/**
+ * Starts using a connected or connecting socket as the link to a peer,
+ * and queues a hello that tells the peer this server's origin id.
+ *
+ * This function throws a runtime_error exception if epoll_ctl fails.
+ *
+ *  peer        The peer the socket is linked to.
+ *  stream      The socket. It is moved into the peer.
+ *  connecting  Whether the connection has not been established yet.
+ */
+void Relay::open_peer(Peer& peer, SocketStream& stream, bool connecting) {
+    peer.stream.reset(new SocketStream(std::move(stream)));
+    peer.stream->set_framed(true);
+    peer.stream->set_stats(&_stats);
+    peer.connecting = connecting;
+    peer.origin = 0;
+    peer.events = 0;
+
+    size_t dropped = 0;
+    MessagePtr hello(make_record('H', 0, std::string(), nullptr, 0));
+    peer.stream->queue(hello, OutboxLimit{ RELAY_QUEUE_BYTES, DROP_OLDEST }, dropped,
+        ShardStats::now());
+
+    _loop.add(peer.stream->get_descriptor(), 0);
+    watch_peer(peer);
+}
+
+/**
+ * Closes the link to a peer.
+ *
+ * A peer that this server connects to is connected again after
+ * RELAY_RETRY_MS, unless it turned out to be this server.
+ * A peer that connected to this server is forgotten.
+ *
+ *  index   The index of the peer.
+ */
+void Relay::close_peer(size_t index) {
+    Peer& peer = *_peers[index];
+    if (peer.stream) {
+        if (!peer.connecting)
+            print("\nrelay: lost link to " + describe(peer) + "\n");
+        _loop.remove(peer.stream->get_descriptor());
+        peer.stream->close();
+        peer.stream.reset();
+    }
+
+    if (peer.host.empty())
+        _peers.erase(_peers.begin() + index);
+    else
+        peer.retry_at = peer.origin == _origin ? NEVER : ShardStats::now() + RELAY_RETRY_MS * 1000000ull;
+    update_peer_count();
+}
+
+/**
+ * Handles a link that is ready.
+ *
+ * A connecting link is checked for whether the connection succeeded.
+ * Every record received is handled, and anything left in the link's
+ * queue is sent. The link is closed if it failed.
+ *
+ *  index   The index of the peer.
+ *  events  The epoll events reported for the socket.
+ */
+void Relay::handle_peer(size_t index, uint32_t events) {
+    Peer& peer = *_peers[index];
+    SocketStream& stream = *peer.stream;
+
+    if (peer.connecting) {
+        int error = 0;
+        socklen_t size = sizeof(error);
+        ::getsockopt(stream.get_descriptor(), SOL_SOCKET, SO_ERROR, &error, &size);
+        if (error != 0) {
+            close_peer(index);
+            return;
+        }
+        if (!(events & EPOLLOUT))
+            return;
+        peer.connecting = false;
+        print("\nrelay: linked to " + describe(peer) + "\n");
+        update_peer_count();
+    }
+
+    bool open = true;
+    try {
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            open = stream.receive();
+            RingView record;
+            while (stream.next_message(record)) {
+                if (!handle_record(peer, record)) {
+                    open = false;
+                    break;
+                }
+            }
+        }
+        if (open && stream.has_pending())
+            open = stream.flush();
+    }
+    catch (const std::runtime_error& ex) {
+        print("\nrelay: " + std::string(ex.what()) + "\n");
+        open = false;
+    }
+
+    if (!open) {
+        close_peer(index);
+        return;
+    }
+    watch_peer(peer);
+}
+
+/**
+ * Handles one record received from a peer.
+ *
+ * A hello records the peer's origin id. A message that is new is
+ * displayed, delivered to the local clients, recorded in the history
+ * and passed on unchanged to every other peer; a message that was
+ * seen before is dropped. A peer is not trusted any more than a client:
+ * a message that is not valid UTF-8 or is sent to a channel with an
+ * invalid name is dropped as well, and control characters are replaced
+ * before the message reaches anyone here.
+ *
+ *  peer    The peer the record came from.
+ *  view    The record.
+ *
+ * Returns whether the link should stay open.
+ */
+bool Relay::handle_record(Peer& peer, const RingView& view) {
+    _record.resize(view.size());
+    view.copy_to(&_record[0]);
+
+    const char* data = _record.data();
+    size_t name_size = _record.size() >= RELAY_HEADER_SIZE
+        ? static_cast<unsigned char>(data[17]) : 0;
+    if (_record.size() < RELAY_HEADER_SIZE + name_size
+        || (data[0] != 'H' && data[0] != 'M')) {
+        print("\nrelay: invalid record from " + describe(peer) + "\n");
+        return false;
+    }
+
+    uint64_t origin = get_u64(data + 1);
+    if (data[0] == 'H') {
+        peer.origin = origin;
+        if (origin == _origin) {
+            print("\nrelay: " + describe(peer) + " is this server\n");
+            return false;
+        }
+        return true;
+    }
+
+    // Anything at or below the highest sequence number from its origin
+    // has already been delivered, or was sent by this server
+    uint64_t seq = get_u64(data + 9);
+    if (origin == _origin) {
+        duplicates.add();
+        return true;
+    }
+    auto seen = _seen.find(origin);
+    if (seen != _seen.end() && seq <= seen->second) {
+        duplicates.add();
+        return true;
+    }
+    _seen[origin] = seq;
+    received.add();
+
+    // An empty channel name stands for the lobby
+    std::string channel(data + RELAY_HEADER_SIZE, name_size);
+    if (!channel.empty() && !ChannelIndex::is_valid_name(channel)) {
+        rejected.add();
+        return true;
+    }
+
+    const char* text = data + RELAY_HEADER_SIZE + name_size;
+    size_t text_size = _record.size() - RELAY_HEADER_SIZE - name_size;
+    Message* copy = Message::create(text, text_size);
+    MessagePtr message(copy);
+    if (_check_text && (copy->sanitize() & TEXT_INVALID)) {
+        rejected.add();
+        return true;
+    }
+
+    struct iovec parts[4] = {
+        { const_cast<char*>("\n"), 1 },
+        { const_cast<char*>(message->data()), message->size() },
+        { const_cast<char*>("\n"), 1 },
+        { const_cast<char*>(_prompt.data()), _prompt.size() }
+    };
+    _log->write(parts, 4);
+
+    for (auto it = _shards.begin(); it != _shards.end(); ++it)
+        (*it)->post(message, channel);
+    _history->append(message, channel.empty() ? CHANNEL_LOBBY : channel);
+
+    // Pass it on to the servers that the sender may not be linked to
+    if (_linked.load(std::memory_order_relaxed) > 1) {
+        send_to_peers(MessagePtr(Message::create(_record)), &peer);
+        relayed.add();
+    }
+    return true;
+}
+
+/**
+ * Queues a record for every linked peer except one.
+ *
+ * If a peer has fallen RELAY_QUEUE_BYTES behind, its oldest records
+ * are dropped and counted, or the new one if the records being sent
+ * leave no room for it.
+ *
+ *  record  The record to send.
+ *  except  The peer the record came from, or null.
+ */
+void Relay::send_to_peers(const MessagePtr& record, const Peer* except) {
+    OutboxLimit limit = { RELAY_QUEUE_BYTES, DROP_OLDEST };
+    uint64_t now = ShardStats::now();
+    for (auto it = _peers.begin(); it != _peers.end(); ++it) {
+        Peer& peer = **it;
+        if (&peer == except || !peer.stream || peer.connecting)
+            continue;
+        size_t count = 0;
+        QueueResult result = peer.stream->queue(record, limit, count, now);
+        if (result == QUEUE_DROPPED || result == QUEUE_REJECTED)
+            dropped.add(count);
+    }
+}
+
+/**
+ * Sends what has been queued for each peer, closing the links that failed.
+ */
+void Relay::flush_peers() {
+    // Walk backwards, because closing an accepted link removes it
+    for (size_t i = _peers.size(); i-- > 0; ) {
+        Peer& peer = *_peers[i];
+        if (!peer.stream || peer.connecting || !peer.stream->has_pending())
+            continue;
+
+        bool open;
+        try {
+            open = peer.stream->flush();
+        }
+        catch (const std::runtime_error& ex) {
+            print("\nrelay: " + std::string(ex.what()) + "\n");
+            open = false;
+        }
+        if (open)
+            watch_peer(peer);
+        else
+            close_peer(i);
+    }
+}
+
+/**
+ * Watches a link for output only while it is connecting or has data
+ * that did not fit in the socket buffer.
+ *
+ * This function throws a runtime_error exception if epoll_ctl fails.
+ *
+ *  peer    The peer with an open link.
+ */
+void Relay::watch_peer(Peer& peer) {
+    uint32_t events = EPOLLIN | EPOLLRDHUP;
+    if (peer.connecting || peer.stream->has_pending())
+        events |= EPOLLOUT;
+    if (events != peer.events) {
+        _loop.modify(peer.stream->get_descriptor(), events);
+        peer.events = events;
+    }
+}
+
+/**
+ * Updates the counts of peers and of linked peers read by the statistics.
+ */
+void Relay::update_peer_count() {
+    unsigned long linked = 0;
+    for (auto it = _peers.begin(); it != _peers.end(); ++it) {
+        if ((*it)->stream && !(*it)->connecting)
+            ++linked;
+    }
+    _linked.store(linked, std::memory_order_relaxed);
+    _peer_count.store(_peers.size(), std::memory_order_relaxed);
+}
+
+/**
+ * Finds the peer whose link uses a socket descriptor.
+ *
+ * Returns the index of the peer, or -1 if none does.
+ */
+int Relay::find_peer(int fd) const {
+    for (size_t i = 0; i < _peers.size(); ++i) {
+        if (_peers[i]->stream && _peers[i]->stream->get_descriptor() == fd)
+            return static_cast<int>(i);
+    }
+    return -1;
+}
+
+/**
+ * Returns the address of a peer as host:port, for display.
+ */
+std::string Relay::describe(const Peer& peer) {
+    if (!peer.host.empty())
+        return peer.host + ":" + peer.port;
+    return peer.stream->get_hostname() + ":" + peer.stream->get_port();
+}
+
+/**
+ * Builds a record from this server.
+ *
+ *  type    'H' for a hello or 'M' for a message.
+ *  seq     The sequence number of the message, or 0 for a hello.
+ *  channel The channel the message was sent to, or empty for all.
+ *  data    The text of the message.
+ *  size    The number of bytes of text.
+ *
+ * Returns the record as a message that can be queued for any peer.
+ */
+MessagePtr Relay::make_record(char type, uint64_t seq, const std::string& channel,
+    const char* data, size_t size) {
+    _record.clear();
+    _record.push_back(type);
+    put_u64(_record, _origin);
+    put_u64(_record, seq);
+    _record.push_back(static_cast<char>(channel.size()));
+    _record += channel;
+    _record.append(data, size);
+    return MessagePtr(Message::create(_record));
+}
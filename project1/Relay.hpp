@@ -0,0 +1,176 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         Relay.hpp
+* Description:  Defines the class that links chatserve instances
+*               together, so that clients connected to any of them
+*               share the same channels.
+*               Each server connects to the peers it is given and
+*               accepts links from others on a relay port. Every
+*               message that a local client sends is passed to the
+*               relay, which tags it with this server's origin id and
+*               the next sequence number and queues it for every peer.
+*               A message received from a peer is checked like one
+*               from a local client, then delivered to the local
+*               clients and passed on to the other peers, so
+*               servers that are not linked directly still see each
+*               other's messages. Each server remembers the highest
+*               sequence number it has seen from each origin and drops
+*               anything older, which stops messages from looping and
+*               removes the copies that arrive over redundant links.
+*               The relay runs its own event loop on its own thread.
+*               Messages queued for a peer during one wakeup are sent
+*               with one sendmsg call, so links carry batches instead
+*               of one message per system call.
+*               Messages sent while a link is down are not replayed
+*               when it comes back.
+*               For a hot restart, the relay is paused before the shards
+*               stop, so it posts nothing they would never take, and
+*               what the shards passed to it is flushed before the
+*               process exits. Messages that peers send while it is
+*               paused wait in the links and are lost when the old
+*               process exits, since the new one links again.
+\*********************************************************/
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "EventLoop.hpp"
+#include "LogSink.hpp"
+#include "Message.hpp"
+#include "MpscQueue.hpp"
+#include "ShardStats.hpp"
+#include "Socket.hpp"
+#include "SocketStream.hpp"
+
+class History;
+class Shard;
+
+// Define an inbox of 16384 entries unless defined elsewhere
+#ifndef RELAY_INBOX_SIZE
+#define RELAY_INBOX_SIZE 16384
+#endif
+
+// Define 1 second between attempts to reconnect to a peer
+// unless defined elsewhere
+#ifndef RELAY_RETRY_MS
+#define RELAY_RETRY_MS 1000
+#endif
+
+// Define a maximum of 16 MiB queued for a peer unless defined elsewhere
+#ifndef RELAY_QUEUE_BYTES
+#define RELAY_QUEUE_BYTES 16777216
+#endif
+
+// Define at most 100 ms to send what is queued for the peers
+// before a hot restart exits, unless defined elsewhere
+#ifndef RELAY_FLUSH_MS
+#define RELAY_FLUSH_MS 100
+#endif
+
+// Each record starts with its type, origin, sequence number and the
+// length of its channel name, followed by the name and the message
+#define RELAY_HEADER_SIZE 18
+
+class Relay {
+    public:
+        Relay(const std::vector<Shard*>& shards, History* history,
+            LogSink* log, std::string prompt, bool check_text);
+
+        void listen(const char* port);
+        void add_peer(const std::string& address);
+        void run();
+
+        bool post(const MessagePtr& message, const std::string& channel);
+        void pause();
+        void flush();
+        void resume();
+
+        uint64_t get_origin() const { return _origin; }
+        unsigned long get_linked() const { return _linked.load(std::memory_order_relaxed); }
+        unsigned long get_peer_count() const { return _peer_count.load(std::memory_order_relaxed); }
+        unsigned long get_inbox_drops() const { return _inbox_drops.load(std::memory_order_relaxed); }
+        const ShardStats& get_stats() const { return _stats; }
+
+        Counter originated;     // Local messages sent to the peers
+        Counter received;       // New messages received from peers
+        Counter relayed;        // Messages from one peer passed on to others
+        Counter duplicates;     // Messages that were seen before
+        Counter rejected;       // Messages with invalid text or channel names
+        Counter dropped;        // Messages dropped because a peer fell behind
+
+    private:
+        // An entry in the inbox posted by a shard
+        struct InboxEntry {
+            MessagePtr message;     // The message a local client sent
+            std::string channel;    // The channel it was sent to
+        };
+
+        // A link to another server
+        struct Peer {
+            std::string host;       // Where to connect, or empty if the
+            std::string port;       // peer connected to this server
+            std::unique_ptr<SocketStream> stream; // The link, or null while down
+            bool connecting;        // Waiting for a connect to finish
+            uint32_t events;        // Events the link is watched for
+            uint64_t origin;        // The peer's origin id, once it is known
+            uint64_t retry_at;      // When to connect again, if down
+        };
+
+        const std::vector<Shard*>& _shards; // Where received messages are delivered
+        History* _history;          // Records received messages
+        LogBuffer* _log;            // The relay's console output
+        std::string _prompt;        // Prompt to redisplay after output
+        bool _check_text;           // Whether to check that messages are clean text
+        uint64_t _origin;           // Random id of this server
+        uint64_t _next_seq;         // Sequence number of the last local message
+
+        EventLoop _loop;            // Waits for links and the inbox
+        Socket _listener;           // Accepts links from other servers
+        std::vector<std::unique_ptr<Peer> > _peers;
+        std::vector<SocketStream> _accepted;    // Links accepted in a batch
+        MpscQueue<InboxEntry> _inbox;           // Messages posted by shards
+        std::atomic<bool> _inbox_signaled;      // Notified since the inbox was drained
+        std::atomic<bool> _pausing;             // Whether the relay was asked to pause
+        std::atomic<bool> _paused;              // Whether the relay's thread is waiting
+
+        // Highest sequence number seen from each origin
+        std::unordered_map<uint64_t, uint64_t> _seen;
+
+        std::string _record;        // Where records are built and parsed
+
+        std::atomic<unsigned long> _linked;     // Peers that are connected
+        std::atomic<unsigned long> _peer_count; // Peers, connected or not
+        std::atomic<unsigned long> _inbox_drops; // Posts to a full inbox
+
+        // Traffic on the links, written only by the relay's thread
+        ShardStats _stats;
+
+        void print(const std::string& text);
+        void wait_paused();
+        void handle_inbox();
+        void accept_peers();
+        void connect_peer(Peer& peer, uint64_t now);
+        void open_peer(Peer& peer, SocketStream& stream, bool connecting);
+        void close_peer(size_t index);
+        void handle_peer(size_t index, uint32_t events);
+        bool handle_record(Peer& peer, const RingView& view);
+        void send_to_peers(const MessagePtr& record, const Peer* except);
+        void flush_peers();
+        void watch_peer(Peer& peer);
+        void update_peer_count();
+        int find_peer(int fd) const;
+        static std::string describe(const Peer& peer);
+        MessagePtr make_record(char type, uint64_t seq, const std::string& channel,
+            const char* data, size_t size);
+
+        // Not copyable because the sockets are owned
+        Relay(const Relay&);
+        Relay& operator=(const Relay&);
+};
@@ -0,0 +1,226 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         RingBuffer.cpp
+* Description:  Implementation file for RingBuffer.hpp
+\*********************************************************/
+#include "RingBuffer.hpp"
+
+#include <cstring>
+#include <utility>
+
+#include "BufferPool.hpp"
+
+/**
+ * Copies the viewed bytes into a contiguous destination.
+ *
+ *  dest    The destination, which must have room for size() bytes.
+ */
+void RingView::copy_to(char* dest) const {
+    std::memcpy(dest, first, first_size);
+    if (second_size > 0)
+        std::memcpy(dest + first_size, second, second_size);
+}
+
+/**
+ * Copies the viewed bytes into a new string.
+ *
+ * Returns the string.
+ */
+std::string RingView::to_string() const {
+    std::string result(first, first_size);
+    result.append(second, second_size);
+    return result;
+}
+
+/**
+ * Constructor. Creates an empty buffer.
+ *
+ * No memory is allocated until reserve is called, so a connection
+ * that never receives anything costs nothing.
+ */
+RingBuffer::RingBuffer() {
+    _data = nullptr;
+    _capacity = 0;
+    _head = 0;
+    _size = 0;
+}
+
+/**
+ * Copy constructor. Copies the buffered data into storage of its own.
+ */
+RingBuffer::RingBuffer(const RingBuffer& other) {
+    _data = nullptr;
+    _capacity = 0;
+    _head = 0;
+    _size = 0;
+    if (other._capacity > 0) {
+        _data = static_cast<char*>(BufferPool::allocate(other._capacity));
+        _capacity = other._capacity;
+        other.peek(0, other._size).copy_to(_data);
+        _size = other._size;
+    }
+}
+
+/**
+ * Move constructor. Takes the storage of the other buffer,
+ * which is left empty.
+ */
+RingBuffer::RingBuffer(RingBuffer&& other) noexcept {
+    _data = other._data;
+    _capacity = other._capacity;
+    _head = other._head;
+    _size = other._size;
+    other._data = nullptr;
+    other._capacity = 0;
+    other._head = 0;
+    other._size = 0;
+}
+
+/**
+ * Destructor. Gives the storage back to the pool.
+ */
+RingBuffer::~RingBuffer() {
+    BufferPool::release(_data, _capacity);
+}
+
+/**
+ * Assignment operator. The argument is a copy, or the moved buffer,
+ * whose storage is swapped with this one's.
+ */
+RingBuffer& RingBuffer::operator=(RingBuffer other) {
+    std::swap(_data, other._data);
+    std::swap(_capacity, other._capacity);
+    std::swap(_head, other._head);
+    std::swap(_size, other._size);
+    return *this;
+}
+
+/**
+ * Grows the buffer to hold at least the specified number of bytes.
+ *
+ * The capacity is rounded up to a power of two. Buffered data is moved
+ * to the start of the new storage. The buffer never shrinks here.
+ *
+ *  capacity    The minimum capacity in bytes.
+ */
+void RingBuffer::reserve(size_t capacity) {
+    if (capacity <= _capacity)
+        return;
+
+    size_t new_capacity = _capacity == 0 ? 1 : _capacity;
+    while (new_capacity < capacity)
+        new_capacity *= 2;
+
+    // The storage is not cleared, since only received bytes are read
+    char* bigger = static_cast<char*>(BufferPool::allocate(new_capacity));
+    peek(0, _size).copy_to(bigger);
+    BufferPool::release(_data, _capacity);
+    _data = bigger;
+    _capacity = new_capacity;
+    _head = 0;
+}
+
+/**
+ * Describes the free space in the buffer as up to two iovec entries,
+ * in the order the space should be filled.
+ *
+ *  iov     An array of two entries to fill in.
+ *
+ * Returns the number of entries used (0 if the buffer is full).
+ */
+int RingBuffer::prepare(struct iovec iov[2]) {
+    size_t capacity = _capacity;
+    size_t free = capacity - _size;
+    if (free == 0)
+        return 0;
+
+    size_t tail = (_head + _size) & (capacity - 1);
+    size_t first = capacity - tail;     // Space from tail to end of storage
+    if (first >= free) {
+        iov[0].iov_base = &_data[tail];
+        iov[0].iov_len = free;
+        return 1;
+    }
+
+    iov[0].iov_base = &_data[tail];
+    iov[0].iov_len = first;
+    iov[1].iov_base = &_data[0];
+    iov[1].iov_len = free - first;
+    return 2;
+}
+
+/**
+ * Marks bytes written into the space from prepare as buffered.
+ *
+ *  bytes   The number of bytes that were written.
+ */
+void RingBuffer::commit(size_t bytes) {
+    _size += bytes;
+}
+
+/**
+ * Gets a view of buffered bytes without copying them.
+ *
+ * The view is valid until the buffer is modified.
+ *
+ *  offset  The offset from the first buffered byte.
+ *  length  The number of bytes to view. offset + length must not
+ *          exceed size().
+ *
+ * Returns the view.
+ */
+RingView RingBuffer::peek(size_t offset, size_t length) const {
+    RingView view;
+    view.second = nullptr;
+    view.second_size = 0;
+
+    if (length == 0) {
+        view.first = nullptr;
+        view.first_size = 0;
+        return view;
+    }
+
+    size_t capacity = _capacity;
+    size_t start = (_head + offset) & (capacity - 1);
+    size_t first = capacity - start;
+    view.first = &_data[start];
+    if (first >= length) {
+        view.first_size = length;
+    }
+    else {
+        view.first_size = first;
+        view.second = &_data[0];
+        view.second_size = length - first;
+    }
+    return view;
+}
+
+/**
+ * Discards bytes from the front of the buffer.
+ *
+ * When the buffer becomes empty, the next read starts at the beginning
+ * of the storage so that it can be filled with one contiguous read.
+ *
+ *  bytes   The number of bytes to discard.
+ */
+void RingBuffer::consume(size_t bytes) {
+    _size -= bytes;
+    if (_size == 0)
+        _head = 0;
+    else
+        _head = (_head + bytes) & (_capacity - 1);
+}
+
+/**
+ * Gives the storage back to the pool if the buffer is empty.
+ */
+void RingBuffer::release() {
+    if (_size == 0) {
+        BufferPool::release(_data, _capacity);
+        _data = nullptr;
+        _capacity = 0;
+        _head = 0;
+    }
+}
@@ -0,0 +1,61 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         RingBuffer.hpp
+* Description:  Defines a growable ring buffer of bytes that is
+*               reused for every read on a connection.
+*               The free space is exposed as (up to) two iovec
+*               entries so it can be filled with a single readv,
+*               and the buffered data is handed out as views
+*               that point into the buffer instead of copies.
+*               The storage comes from the buffer pool, so a buffer that
+*               is released when its connection goes idle is reused by
+*               the next connection that receives something.
+\*********************************************************/
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <sys/uio.h>    // iovec
+
+// A read-only view of bytes in a RingBuffer.
+// Data that wraps around the end of the buffer is split into two pieces;
+// otherwise the second piece is empty.
+struct RingView {
+    const char* first;      // Start of the first piece
+    size_t first_size;      // Bytes in the first piece
+    const char* second;     // Start of the second piece (wrapped data)
+    size_t second_size;     // Bytes in the second piece
+
+    size_t size() const { return first_size + second_size; }
+    void copy_to(char* dest) const;
+    std::string to_string() const;
+};
+
+class RingBuffer {
+    public:
+        RingBuffer();
+        RingBuffer(const RingBuffer& other);
+        RingBuffer(RingBuffer&& other) noexcept;
+        ~RingBuffer();
+        RingBuffer& operator=(RingBuffer other);
+
+        size_t size() const { return _size; }
+        size_t capacity() const { return _capacity; }
+        bool empty() const { return _size == 0; }
+
+        void reserve(size_t capacity);
+        int prepare(struct iovec iov[2]);
+        void commit(size_t bytes);
+
+        RingView peek(size_t offset, size_t length) const;
+        void consume(size_t bytes);
+        void release();
+
+    private:
+        char* _data;                // Storage from the pool, or null
+        size_t _capacity;           // Bytes of storage; zero or a power of two
+        size_t _head;               // Index of the first buffered byte
+        size_t _size;               // Number of buffered bytes
+};
@@ -0,0 +1,160 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         SessionLoop.cpp
+* Description:  Implementation file for SessionLoop.hpp
+\*********************************************************/
+#include "SessionLoop.hpp"
+
+#include <exception>
+#include <iostream>
+
+/**
+ * Destructor. Tells the loop that the session has returned.
+ */
+Session::promise_type::~promise_type() {
+    if (loop != nullptr)
+        --loop->_sessions;
+}
+
+/**
+ * Ends a session that let an exception escape.
+ *
+ * The exception cannot be passed to anyone because nothing waits for
+ * a session to finish, so it is printed and the session ends as if it
+ * had returned. Its AsyncStream closes the connection on the way out.
+ */
+void Session::promise_type::unhandled_exception() {
+    try {
+        throw;
+    }
+    catch (std::exception& e) {
+        std::cout << "session: " << e.what() << std::endl;
+    }
+}
+
+/**
+ * Constructor. Creates a loop with no sessions.
+ */
+SessionLoop::SessionLoop() : _sessions(0), _resumes(0), _stopping(false) {}
+
+/**
+ * Starts running a session.
+ *
+ * The session runs the next time the loop runs, up to its first
+ * operation that has to wait.
+ *
+ *  session     The session to run. The loop takes ownership of it.
+ */
+void SessionLoop::spawn(Session session) {
+    session._handle.promise().loop = this;
+    ++_sessions;
+    _ready.push_back(session._handle);
+}
+
+/**
+ * Runs sessions until they have all returned or stop is called.
+ */
+void SessionLoop::run() {
+    _stopping = false;
+    while (!_stopping && (_sessions > 0 || !_ready.empty()))
+        run_once();
+}
+
+/**
+ * Starts the sessions that were spawned, then waits for descriptors to
+ * become ready once and resumes the sessions whose operations completed.
+ *
+ * This function throws a runtime_error exception if epoll_wait fails.
+ *
+ *  timeout     The maximum time to wait in milliseconds, or -1 for no limit.
+ *
+ * Returns whether any descriptor became ready.
+ */
+bool SessionLoop::run_once(int timeout) {
+    // A session spawned by another session is started on the next pass
+    while (!_ready.empty()) {
+        std::vector<std::coroutine_handle<> > ready;
+        ready.swap(_ready);
+        for (auto it = ready.begin(); it != ready.end(); ++it) {
+            ++_resumes;
+            it->resume();
+        }
+    }
+    if (_sessions == 0)
+        return false;
+
+    int count = _loop.wait(timeout);
+    for (int i = 0; i < count; ++i) {
+        const struct epoll_event& ev = _loop.event(i);
+        int fd = ev.data.fd;
+        if (static_cast<size_t>(fd) >= _sockets.size())
+            continue;
+
+        // Errors and hangups wake both sides so that they see the failure.
+        // A resumed session can close its own descriptor or any other,
+        // so the socket is looked up again before each side.
+        if ((ev.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && _sockets[fd] != nullptr) {
+            _sockets[fd]->readable = true;
+            resume(_sockets[fd]->reader);
+        }
+        if ((ev.events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && _sockets[fd] != nullptr) {
+            _sockets[fd]->writable = true;
+            resume(_sockets[fd]->writer);
+        }
+    }
+    return count > 0;
+}
+
+/**
+ * Starts watching a session's descriptor.
+ *
+ * The descriptor is watched for input and output at once and in
+ * edge-triggered mode, so it is added once and never modified.
+ *
+ * This function throws a runtime_error exception if epoll_ctl fails.
+ *
+ *  fd      The descriptor of the session's socket.
+ *  socket  Where the descriptor's readiness is kept. It must stay
+ *          valid until the descriptor is removed.
+ */
+void SessionLoop::add(int fd, SessionSocket* socket) {
+    if (static_cast<size_t>(fd) >= _sockets.size())
+        _sockets.resize(fd + 1, nullptr);
+    socket->readable = true;
+    socket->writable = true;
+    socket->reader = nullptr;
+    socket->writer = nullptr;
+    _loop.add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    _sockets[fd] = socket;
+}
+
+/**
+ * Stops watching a session's descriptor. A session waiting on it
+ * is never resumed.
+ *
+ *  fd      The descriptor of the session's socket.
+ */
+void SessionLoop::remove(int fd) {
+    _loop.remove(fd);
+    if (static_cast<size_t>(fd) < _sockets.size())
+        _sockets[fd] = nullptr;
+}
+
+/**
+ * Retries the operation that a session is waiting on and resumes the
+ * session if the operation completed.
+ *
+ *  waiter  The operation, or null if no session is waiting.
+ *          It is cleared before the session is resumed.
+ */
+void SessionLoop::resume(SessionWaiter*& waiter) {
+    if (waiter == nullptr || !waiter->on_ready())
+        return;
+
+    std::coroutine_handle<> handle = waiter->handle;
+    waiter = nullptr;
+    ++_resumes;
+    handle.resume();
+}
@@ -0,0 +1,112 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         SessionLoop.hpp
+* Description:  Defines a single-threaded event loop that runs
+*               connection sessions written as C++20 coroutines.
+*               A session is a function that returns Session and
+*               uses co_await on an AsyncStream instead of handling
+*               readiness callbacks, so a multi-step exchange with a
+*               client reads as straight-line code. A session that
+*               would block is suspended and registered as a waiter
+*               on its descriptor; when epoll reports the descriptor
+*               ready, the waiter retries the operation and the
+*               session is only resumed once the operation completes,
+*               so a session is resumed about once per operation.
+*               Thousands of sessions share one thread, and each
+*               costs one coroutine frame instead of a stack.
+\*********************************************************/
+#pragma once
+
+#include <coroutine>
+#include <cstddef>
+#include <vector>
+
+#include "EventLoop.hpp"
+
+class SessionLoop;
+
+// The return type of a session coroutine. The session does not start
+// until it is passed to SessionLoop::spawn, and its frame is freed
+// when it returns.
+class Session {
+    public:
+        struct promise_type {
+            SessionLoop* loop;  // The loop running the session
+
+            promise_type() : loop(nullptr) {}
+            ~promise_type();
+
+            Session get_return_object() {
+                return Session(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception();
+        };
+
+        explicit Session(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+
+    private:
+        friend class SessionLoop;
+
+        std::coroutine_handle<promise_type> _handle;    // Not started until spawned
+};
+
+// An operation that a suspended session is waiting on
+class SessionWaiter {
+    public:
+        // Retries the operation after its descriptor became ready.
+        // Returns whether it completed, so the session can be resumed.
+        virtual bool on_ready() = 0;
+
+        std::coroutine_handle<> handle;     // The suspended session
+
+    protected:
+        ~SessionWaiter() {}
+};
+
+// The readiness of a descriptor that a session uses. The descriptor is
+// watched in edge-triggered mode, so each flag records that an edge
+// arrived and stays set until the session has run into EAGAIN; until
+// then an operation can go ahead without waiting for another event.
+struct SessionSocket {
+    bool readable;              // Input may be waiting
+    bool writable;              // Output may fit
+    SessionWaiter* reader;      // Operation waiting for input, or null
+    SessionWaiter* writer;      // Operation waiting for output, or null
+};
+
+class SessionLoop {
+    public:
+        SessionLoop();
+
+        void spawn(Session session);
+        void run();
+        bool run_once(int timeout = -1);
+        void stop() { _stopping = true; }
+
+        void add(int fd, SessionSocket* socket);
+        void remove(int fd);
+
+        size_t get_sessions() const { return _sessions; }
+        unsigned long get_resumes() const { return _resumes; }
+
+    private:
+        friend struct Session::promise_type;
+
+        EventLoop _loop;            // Readiness of every session's descriptor
+        std::vector<SessionSocket*> _sockets;   // Socket of each descriptor, or null
+        std::vector<std::coroutine_handle<> > _ready;  // Sessions to start
+        size_t _sessions;           // Sessions that have not returned
+        unsigned long _resumes;     // Times a session was started or resumed
+        bool _stopping;             // Whether run should return
+
+        void resume(SessionWaiter*& waiter);
+
+        // Not copyable because sessions hold a pointer to it
+        SessionLoop(const SessionLoop&);
+        SessionLoop& operator=(const SessionLoop&);
+};
@@ -0,0 +1,2093 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         Shard.cpp
+* Description:  Implementation file for Shard.hpp
+\*********************************************************/
+#include "Shard.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <poll.h>       // POLLIN
+#include <sys/timerfd.h>
+#include <unistd.h>     // close
+
+#include "Relay.hpp"
+#include "TextFilter.hpp"
+
+// Kinds of io_uring requests, stored in the upper half of the user data
+enum UringOp { OP_ACCEPT = 1, OP_NOTIFY, OP_RECEIVE, OP_SEND, OP_CANCEL, OP_TIMER, OP_THROTTLE,
+    OP_WHEEL, OP_BACKOFF };
+
+/**
+ * Packs the kind of request and its socket descriptor, or the slot of
+ * an accept, into the user data that is returned with each completion.
+ */
+static uint64_t make_user_data(UringOp op, int fd) {
+    return (static_cast<uint64_t>(op) << 32) | static_cast<uint32_t>(fd);
+}
+
+/**
+ * Makes the console line about something that happened to a client,
+ * such as "\nhost:port disconnected\n".
+ *
+ * The line is built with append rather than operator+, which GCC
+ * inlines into copies that -Wrestrict cannot prove do not overlap.
+ *
+ *  client  The client.
+ *  event   What happened, followed by a newline.
+ */
+static std::string client_event(const SocketStream& client, const char* event) {
+    std::string host = client.get_hostname();
+    std::string port = client.get_port();
+    std::string line;
+    line.reserve(host.size() + port.size() + std::strlen(event) + 2);
+    line.append("\n").append(host).append(":").append(port).append(event);
+    return line;
+}
+
+/**
+ * Submits a request that cancels another io_uring request.
+ * The request is looked up by its user data, which the kernel keeps in
+ * a hash table, so this takes the same time however many are pending.
+ *
+ *  ring    The ring the request was submitted to.
+ *  op      The kind of request.
+ *  fd      The descriptor of the request, or the slot of an accept.
+ */
+static void cancel_request(Uring* ring, UringOp op, int fd) {
+    struct io_uring_sqe* sqe = ring->get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = make_user_data(op, fd);
+    sqe->user_data = make_user_data(OP_CANCEL, fd);
+}
+
+/**
+ * Creates a timer on the monotonic clock that can be read without
+ * blocking.
+ *
+ * This function throws a runtime_error exception if it fails.
+ *
+ * Returns the timer's descriptor.
+ */
+static int create_timer() {
+    int fd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) {
+        std::string errmsg("timerfd_create: ");
+        errmsg += ::strerror(errno);
+        throw std::runtime_error(errmsg);
+    }
+    return fd;
+}
+
+/**
+ * Sets a timer to go off at a point in time.
+ *
+ *  fd          The timer's descriptor.
+ *  deadline    The time in nanoseconds on the ShardStats::now clock.
+ */
+static void set_timer(int fd, uint64_t deadline) {
+    struct itimerspec spec;
+    std::memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = deadline / 1000000000;
+    spec.it_value.tv_nsec = deadline % 1000000000;
+    ::timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+/**
+ * Sets a timer to go off over and over at a fixed interval.
+ *
+ *  fd          The timer's descriptor.
+ *  interval    The time between expirations in nanoseconds.
+ */
+static void set_periodic_timer(int fd, uint64_t interval) {
+    struct itimerspec spec;
+    spec.it_value.tv_sec = interval / 1000000000;
+    spec.it_value.tv_nsec = interval % 1000000000;
+    spec.it_interval = spec.it_value;
+    ::timerfd_settime(fd, 0, &spec, nullptr);
+}
+
+/**
+ * Returns the tick of the idle timer wheel that a time falls in.
+ *
+ *  now     The time in nanoseconds on the ShardStats::now clock.
+ */
+static inline uint64_t get_tick(uint64_t now) {
+    return now / (SHARD_TICK_MS * 1000000ull);
+}
+
+/**
+ * Returns the number of wheel ticks in a timeout, rounded up.
+ *
+ *  ms      The timeout in milliseconds.
+ */
+static inline uint64_t get_ticks(unsigned ms) {
+    return (ms + SHARD_TICK_MS - 1) / SHARD_TICK_MS;
+}
+
+/**
+ * Constructor. Sets up an empty shard.
+ *
+ *  id      The index of this shard in the group.
+ *  group   All of the shards in the server, used for forwarding messages.
+ *  prompt  The prompt string to redisplay after a message is displayed.
+ *  options The settings shared by every shard.
+ */
+Shard::Shard(int id, const std::vector<Shard*>& group, std::string prompt,
+    const ShardOptions& options)
+    : _group(group), _listener(options.backlog), _unix_listener(options.backlog), _inbox(SHARD_INBOX_SIZE), _inbox_signaled(false),
+    _messages(0), _client_count(0), _table_memory(0), _dropped_oldest(0), _dropped_newest(0),
+    _overflow_disconnects(0), _inbox_drops(0), _timer_count(0), _wheel(get_tick(ShardStats::now())) {
+    _id = id;
+    _prompt = prompt;
+    _options = options;
+    _ring = nullptr;
+    _now = 0;
+    _log = options.log->create_buffer();
+    _timer_fd = -1;
+    _timer_armed = false;
+    _held_since = 0;
+    _held_bytes = 0;
+    _last_arrival = 0;
+    _arrival_gap = 0;
+    _throttle_fd = -1;
+    _throttle_deadline = 0;
+    _wheel_fd = -1;
+    _handoff = nullptr;
+    _uring_accepts = 0;
+    _accept_backoff.tv_sec = 0;
+    _accept_backoff.tv_nsec = SHARD_ACCEPT_BACKOFF_MS * 1000000LL;
+
+    // Fall back to epoll if io_uring cannot be set up
+    if (options.uring) {
+        try {
+            _ring = new Uring();
+        }
+        catch (const std::runtime_error& ex) {
+            print(std::string(ex.what()) + "; using epoll\n");
+        }
+    }
+
+    // The timer ends each coalescing window
+    if (options.coalesce_us > 0) {
+        _timer_fd = create_timer();
+        if (_ring == nullptr)
+            _loop.add(_timer_fd, EPOLLIN);
+    }
+
+    // Another timer ends the delay of clients that sent too fast
+    if (options.rate_limit.is_limited() && options.rate_limit.action == LIMIT_DELAY) {
+        _throttle_fd = create_timer();
+        if (_ring == nullptr)
+            _loop.add(_throttle_fd, EPOLLIN);
+    }
+
+    // The timer wheel moves forward one tick at a time
+    if (options.idle_ms > 0 || options.heartbeat_ms > 0) {
+        _wheel_fd = create_timer();
+        set_periodic_timer(_wheel_fd, SHARD_TICK_MS * 1000000ull);
+        if (_ring == nullptr)
+            _loop.add(_wheel_fd, EPOLLIN);
+    }
+}
+
+/**
+ * Destructor. Releases the io_uring instance, if any.
+ */
+Shard::~Shard() {
+    delete _ring;
+    if (_timer_fd != -1)
+        ::close(_timer_fd);
+    if (_throttle_fd != -1)
+        ::close(_throttle_fd);
+    if (_wheel_fd != -1)
+        ::close(_wheel_fd);
+}
+
+/**
+ * Displays text in the server console without waiting for it.
+ *
+ * The text is copied into this shard's log buffer and written later
+ * by the log sink's thread, or dropped if the buffer is full.
+ *
+ *  text    The text to display.
+ */
+void Shard::print(const std::string& text) {
+    _log->write(text);
+}
+
+/**
+ * Reads the clock for a message that is about to be routed, and
+ * updates the average time between messages that decides whether
+ * sends are coalesced.
+ *
+ * Gaps are capped at twice the coalescing window, so that one quiet
+ * spell does not keep coalescing off for long once a burst starts.
+ */
+void Shard::start_message() {
+    _now = ShardStats::now();
+    if (_timer_fd == -1)
+        return;
+
+    uint64_t gap = std::min<uint64_t>(_now - _last_arrival, _options.coalesce_us * 2000ull);
+    _arrival_gap = (_arrival_gap * 7 + gap) / 8;
+    _last_arrival = _now;
+}
+
+/**
+ * Starts listening for connections on this shard's socket.
+ *
+ * This function throws a runtime_error exception if the socket
+ * cannot be bound or set to listen.
+ *
+ *  port        The port to listen for connections on.
+ *  reuse_port  Whether other shards are listening on the same port.
+ */
+void Shard::listen(const char* port, bool reuse_port) {
+    _listener.listen(port, reuse_port);
+    if (_ring == nullptr)
+        _loop.add(_listener.get_descriptor(), EPOLLIN);
+}
+
+/**
+ * Also listens for connections from the same host on a Unix domain socket.
+ * Its clients are handled exactly like TCP clients.
+ *
+ * This function throws a runtime_error exception if the socket
+ * cannot be bound or set to listen.
+ *
+ *  path    The path of the socket file, or '@' followed by an abstract name.
+ */
+void Shard::listen_unix(const std::string& path) {
+    _unix_listener.listen_unix(path);
+    if (_ring == nullptr)
+        _loop.add(_unix_listener.get_descriptor(), EPOLLIN);
+}
+
+/**
+ * Listens for connections on a TCP socket that the server this one
+ * replaced was listening on. Connections waiting to be accepted
+ * stay queued.
+ *
+ *  sd      The listening socket descriptor.
+ */
+void Shard::inherit_listener(int sd) {
+    _listener.inherit(sd);
+    if (_ring == nullptr)
+        _loop.add(sd, EPOLLIN);
+}
+
+/**
+ * Listens for connections on a Unix domain socket that the server
+ * this one replaced was listening on.
+ *
+ *  sd      The listening socket descriptor.
+ */
+void Shard::inherit_unix_listener(int sd) {
+    _unix_listener.inherit(sd);
+    if (_ring == nullptr)
+        _loop.add(sd, EPOLLIN);
+}
+
+/**
+ * Adds the clients of the server that this one replaced. Each one
+ * keeps its handle, its channels and the messages that were waiting
+ * to be sent to it, and anything it sent that was not routed yet is
+ * routed once all of them are in place.
+ *
+ * This function must be called before the shard is run.
+ *
+ *  clients     The state of each client. The messages are moved out.
+ */
+void Shard::adopt_clients(std::vector<HandoffClient>& clients) {
+    OutboxLimit unlimited = { 0, DROP_NEWEST };
+    uint64_t now = ShardStats::now();
+    std::vector<int> unrouted;
+
+    for (auto it = clients.begin(); it != clients.end(); ++it) {
+        int fd = it->fd;
+        try {
+            SocketStream client = Socket::adopt(fd, true);
+            client.set_framed(_options.framed);
+
+            // The part of the first message that was already sent
+            // is skipped, so the client gets every byte exactly once
+            size_t dropped;
+            for (auto msg = it->outbox.begin(); msg != it->outbox.end(); ++msg)
+                client.queue(*msg, unlimited, dropped, now);
+            client.complete_send(it->sent);
+            if (!it->input.empty()) {
+                client.feed(it->input.data(), it->input.size());
+                unrouted.push_back(fd);
+            }
+
+            for (auto name = it->channels.begin(); name != it->channels.end(); ++name)
+                _channels.join(*name, fd);
+            if (it->named) {
+                bool owned = !it->handle.empty() && _options.handles->claim(it->handle, _id, fd);
+                client.set_handle(owned ? it->handle : std::string());
+            }
+            if (client.has_pending())
+                _dirty.push_back(fd);
+            start_client(client);
+        }
+        catch (const std::runtime_error& ex) {
+            print(std::string(ex.what()) + "\n");
+        }
+        it->outbox.clear();
+    }
+
+    for (auto it = unrouted.begin(); it != unrouted.end(); ++it) {
+        SocketStream* client = _clients.find(*it);
+        if (client != nullptr && !route_messages(*client))
+            remove_client(*it);
+    }
+}
+
+/**
+ * Accepts connections and routes messages until the program terminates
+ * or the connections are handed over to a new server.
+ *
+ * Any message received from a client is displayed in the server console,
+ * sent to all other clients of this shard, and posted to the inbox
+ * of every other shard.
+ * Any message posted to the inbox is sent to all clients of this shard.
+ */
+void Shard::run() {
+    // Clients adopted from the server this one replaced may have
+    // messages waiting
+    flush_dirty();
+    if (_ring != nullptr)
+        start_uring();
+
+    // The loop only ends for a hot restart, and starts again
+    // if the new server failed to take over
+    do {
+        if (_ring != nullptr)
+            run_uring();
+        else
+            run_epoll();
+    } while (!hand_over());
+}
+
+/**
+ * Runs the shard with epoll, which reports when sockets are ready
+ * so that they can be read and written with system calls.
+ */
+void Shard::run_epoll() {
+    while (_handoff == nullptr) {
+        int count = _loop.wait();
+
+        for (int i = 0; i < count; ++i) {
+            const struct epoll_event& ev = _loop.event(i);
+            int fd = ev.data.fd;
+
+            if (fd == _listener.get_descriptor())
+                accept_client(_listener);
+            else if (fd == _unix_listener.get_descriptor())
+                accept_client(_unix_listener);
+            else if (fd == _loop.get_notify_descriptor())
+                handle_inbox();
+            else if (fd == _timer_fd)
+                handle_timer();
+            else if (fd == _throttle_fd)
+                handle_throttle();
+            else if (fd == _wheel_fd)
+                handle_wheel();
+            else
+                handle_client(fd, ev.events);
+        }
+
+        // Send everything queued during this wakeup, unless it is held
+        // back to be coalesced with what comes next
+        finish_wakeup();
+    }
+}
+
+/**
+ * Posts a message to be sent to the clients of this shard.
+ *
+ * This function is safe to call from any thread, and it never blocks.
+ * If the inbox is full, the message is dropped and counted.
+ *
+ *  message     The message to send. Only a reference is stored.
+ *  channel     The name of the channel to send to, or empty to send
+ *              to all clients.
+ *
+ * Returns false if the message was dropped, or true otherwise.
+ */
+bool Shard::post(const MessagePtr& message, const std::string& channel) {
+    InboxEntry entry;
+    entry.quit = false;
+    entry.message = message;
+    entry.channel = channel;
+    entry.target = -1;
+    entry.handoff = nullptr;
+    if (push(entry))
+        return true;
+
+    _inbox_drops.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+/**
+ * Posts a direct message to be sent to one client of this shard.
+ *
+ * This function is safe to call from any thread, and it never blocks.
+ * If the inbox is full, the message is dropped and counted.
+ *
+ *  message The message to send.
+ *  fd      The socket descriptor of the client, from the handle index.
+ *  handle  The handle the message is addressed to. The message is only
+ *          sent if the client still owns it when the entry is handled.
+ *
+ * Returns false if the message was dropped, or true otherwise.
+ */
+bool Shard::post_direct(const MessagePtr& message, int fd, const std::string& handle) {
+    InboxEntry entry;
+    entry.quit = false;
+    entry.message = message;
+    entry.channel = handle;
+    entry.target = fd;
+    entry.handoff = nullptr;
+    if (push(entry))
+        return true;
+
+    _inbox_drops.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+/**
+ * Posts a request to disconnect all clients of this shard.
+ *
+ * This function is safe to call from any thread.
+ * Any entries posted earlier are still processed first.
+ * The request is never dropped; if the inbox is full, this function
+ * yields until the shard has made room.
+ */
+void Shard::post_quit() {
+    InboxEntry entry;
+    entry.quit = true;
+    entry.handoff = nullptr;
+    while (!push(entry))
+        std::this_thread::yield();
+}
+
+/**
+ * Posts a request to stop and hand the listening sockets and clients
+ * of this shard over to a new server. The shard's run function
+ * returns once it has.
+ *
+ * This function is safe to call from any thread.
+ * Any entries posted earlier are still processed first.
+ * The request is never dropped; if the inbox is full, this function
+ * yields until the shard has made room.
+ *
+ *  handoff     The hot restart, which receives the state.
+ */
+void Shard::post_handoff(Handoff* handoff) {
+    InboxEntry entry;
+    entry.quit = false;
+    entry.handoff = handoff;
+    while (!push(entry))
+        std::this_thread::yield();
+}
+
+/**
+ * Adds an entry to the inbox and wakes up the event loop.
+ *
+ * The loop is only notified by the first entry posted since the inbox
+ * was last drained, because any later entry is drained with it.
+ *
+ *  entry   The entry to add. Its contents are moved into the inbox.
+ *
+ * Returns false if the inbox is full, or true otherwise.
+ */
+bool Shard::push(InboxEntry& entry) {
+    if (!_inbox.push(entry))
+        return false;
+
+    // The exchange orders the push before the check, and handle_inbox
+    // resets the flag before it drains, so every entry is either seen
+    // by a drain that is already running or causes a new notification.
+    if (!_inbox_signaled.exchange(true))
+        _loop.notify();
+    return true;
+}
+
+/**
+ * Processes every entry that has been posted to the inbox.
+ *
+ * At most one inbox's worth of entries is processed per wakeup, so that
+ * producers that keep posting cannot starve the clients of this shard.
+ */
+void Shard::handle_inbox() {
+    _loop.clear_notify();
+    _inbox_signaled.exchange(false);
+
+    InboxEntry entry;
+    size_t count = 0;
+    while (count < _inbox.get_capacity() && _inbox.pop(entry)) {
+        if (entry.handoff != nullptr) {
+            // Stops the event loop once the current events are handled
+            _handoff = entry.handoff;
+        }
+        else if (entry.quit) {
+            disconnect_all();
+        }
+        else if (entry.target != -1) {
+            start_message();
+            deliver_direct(entry.target, entry.channel, entry.message);
+        }
+        else {
+            start_message();
+            publish(entry.message, entry.channel, -1);
+        }
+        ++count;
+    }
+    entry.message = MessagePtr();
+    entry.channel.clear();
+    entry.handoff = nullptr;
+
+    // Come back for the rest after handling the other events
+    if (count == _inbox.get_capacity() && !_inbox_signaled.exchange(true))
+        _loop.notify();
+}
+
+/**
+ * Handles a client socket that is ready.
+ *
+ * If the socket is writable, the rest of the client's outgoing queue is sent.
+ * If the socket is readable, each complete message received is routed
+ * to everyone else.
+ *
+ *  fd      The socket descriptor of the client.
+ *  events  The epoll events reported for the socket.
+ */
+void Shard::handle_client(int fd, uint32_t events) {
+    if (events & EPOLLOUT)
+        flush_client(fd, true);
+    if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        return;
+
+    SocketStream* client = _clients.find(fd);
+    if (client == nullptr)
+        return;     // Already disconnected earlier in this batch
+
+    bool open;
+    uint64_t start = ShardStats::now();
+    try {
+        open = client->receive();
+        _stats.recv_time.record(ShardStats::now() - start);
+        touch_client(*client, start);
+    }
+    catch (const std::runtime_error& ex) {
+        print("\n" + std::string(ex.what()) + "\n");
+        open = false;
+    }
+
+    // Route whatever was received, even if the socket was closed after it
+    if (!route_messages(*client))
+        open = false;
+
+    if (!open) {
+        // Socket closed -- remove client
+        remove_client(fd);
+
+        // Redisplay prompt if there are still clients connected
+        if (!_clients.empty())
+            print(_prompt);
+    }
+}
+
+/**
+ * Accepts every pending connection and starts watching them for
+ * incoming data.
+ *
+ * The listen queue is drained in one go, so a burst of reconnecting
+ * clients takes one wakeup per batch instead of one per connection.
+ *
+ *  listener    The TCP or Unix domain socket that is ready.
+ */
+void Shard::accept_client(Socket& listener) {
+    uint64_t start = ShardStats::now();
+    try {
+        // The SocketStream class abstracts away the details of sending
+        // and receiving data over a socket.
+        listener.accept_all(_accepted);
+    }
+    catch (const std::runtime_error& ex) {
+        print(std::string(ex.what()) + "\n");
+    }
+    if (_accepted.empty())
+        return;
+
+    for (auto it = _accepted.begin(); it != _accepted.end(); ++it)
+        add_client(*it);
+
+    // Each connection is charged its share of the batch
+    uint64_t each = (ShardStats::now() - start) / _accepted.size();
+    for (size_t i = 0; i < _accepted.size(); ++i)
+        _stats.accept_time.record(each);
+    _accepted.clear();
+}
+
+/**
+ * Adds a newly accepted client to the client list
+ * and starts waiting for incoming data.
+ *
+ *  client  The stream of the new client.
+ */
+void Shard::add_client(SocketStream& client) {
+    _stats.accepted.add();
+    print("\nAccepted connection from: " + client.get_hostname() + ":"
+        + client.get_port() + "\n");
+
+    // Add new socket to list of currently connected clients
+    _channels.join(CHANNEL_LOBBY, client.get_descriptor());
+    start_client(client);
+}
+
+/**
+ * Puts a client in the client list and starts waiting for
+ * incoming data.
+ *
+ *  client  The stream of the client.
+ */
+void Shard::start_client(SocketStream& client) {
+    int fd = client.get_descriptor();
+    client.set_framed(_options.framed);
+    client.set_stats(&_stats);
+    client.set_pinged(false);
+    touch_client(client, ShardStats::now());
+    if (_ring != nullptr) {
+        _clients.insert(client);
+        if (static_cast<size_t>(fd) >= _uring_clients.size())
+            _uring_clients.resize(fd + 1);
+        UringClient& state = _uring_clients[fd];
+        state.recv_armed = false;
+        state.closing = false;
+        arm_receive(fd);
+    }
+    else {
+        _loop.add(fd, EPOLLIN | EPOLLRDHUP);
+        _clients.insert(client);
+    }
+    update_client_count();
+}
+
+/**
+ * Finds where the text typed by the user starts in a message,
+ * skipping the "handle> " prefix that chatclient adds.
+ *
+ *  data    The message data.
+ *  size    The size of the message.
+ *
+ * Returns the offset of the text, or 0 if there is no prefix.
+ */
+static size_t find_body(const char* data, size_t size) {
+    for (size_t i = 1; i <= 10 && i + 1 < size; ++i) {
+        if (data[i] == '>' && data[i + 1] == ' ')
+            return i + 2;
+    }
+    return 0;
+}
+
+/**
+ * Gets the word at the start of some text, such as a channel name
+ * after a command. The word ends at whitespace or the end of the text.
+ *
+ *  text    The text to read from.
+ *  size    The size of the text.
+ *
+ * Returns the word.
+ */
+static std::string first_word(const char* text, size_t size) {
+    size_t len = 0;
+    while (len < size && text[len] != ' ' && text[len] != '\t'
+        && text[len] != '\r' && text[len] != '\n')
+        ++len;
+    return std::string(text, len);
+}
+
+/**
+ * Routes each complete message in a client's input buffer.
+ *
+ * The text after the sender's handle can be one of these commands:
+ * - "/join name" adds the sender to a channel.
+ * - "/leave name" removes the sender from a channel.
+ * - "#name text" sends the message to the members of a channel.
+ * - "/since seq [name]" sends the sender one page of the recorded
+ *   messages of a channel (the lobby by default) with a sequence number
+ *   after seq.
+ * - "/pong" answers a heartbeat and is not routed.
+ * - "@handle text" sends the message to the client that owns the handle
+ *   and no one else. It is not displayed, recorded or relayed.
+ * Any other message is sent to the members of the lobby channel,
+ * which every client joins when it connects.
+ *
+ * The handle in front of the first message that has one becomes
+ * the client's own handle.
+ *
+ *  client  The client that sent the messages.
+ *
+ * Returns false if the client sent something invalid and must be
+ * disconnected, or true otherwise.
+ */
+bool Shard::route_messages(SocketStream& client) {
+    RingView in_message;
+    int fd = client.get_descriptor();
+    try {
+        // Route each complete message on its own. In text mode this is
+        // everything received; in framed mode it is one frame at a time.
+        const RateLimit& limit = _options.rate_limit;
+        bool limited = limit.is_limited();
+        while (!client.is_throttled()) {
+            // A delayed client's messages stay where they are, so the
+            // check comes before a message is taken out of the buffer
+            uint64_t now = limited ? ShardStats::now() : 0;
+            if (limited && limit.action == LIMIT_DELAY && !client.within_rate(limit, now)) {
+                throttle_client(client, now);
+                break;
+            }
+            if (!client.next_message(in_message))
+                break;
+            if (in_message.size() == 0)
+                continue;
+            if (limited) {
+                if (!client.within_rate(limit, now)) {
+                    if (limit.action == LIMIT_DISCONNECT) {
+                        _stats.rate_disconnects.add();
+                        print(client_event(client, " exceeded the rate limit\n"));
+                        return false;
+                    }
+                    _stats.rate_dropped.add();
+                    continue;
+                }
+                client.charge_rate(limit, now, in_message.size());
+            }
+            start_message();
+            _stats.messages_in.add();
+
+            // The message is copied once, straight out of the receive
+            // buffer, and shared by every queue. Its text is checked
+            // while the copy is still in the cache, before it is shared.
+            Message* copy = Message::create(in_message);
+            MessagePtr message(copy);
+            if (_options.check_text) {
+                int found = copy->sanitize();
+                if (found & TEXT_INVALID) {
+                    _stats.text_invalid.add();
+                    notify_client(client, "* message dropped: not valid UTF-8");
+                    continue;
+                }
+                if (found & TEXT_CONTROL)
+                    _stats.text_cleaned.add();
+            }
+            size_t offset = find_body(message->data(), message->size());
+            const char* body = message->data() + offset;
+            size_t body_size = message->size() - offset;
+            if (offset > 0 && !client.is_named())
+                name_client(client, message->data(), offset);
+
+            // The answer to a heartbeat was already counted as activity
+            if (body_size == 5 && std::strncmp(body, "/pong", 5) == 0)
+                continue;
+
+            if (body_size > 1 && body[0] == '@') {
+                std::string handle = first_word(body + 1, body_size - 1);
+                if (!send_direct(message, handle))
+                    notify_client(client, "* no such handle: " + handle);
+                continue;
+            }
+
+            if (body_size > 6 && std::strncmp(body, "/join ", 6) == 0) {
+                std::string name = first_word(body + 6, body_size - 6);
+                if (!ChannelIndex::is_valid_name(name))
+                    notify_client(client, "* invalid channel name: " + name);
+                else if (_channels.join(name, fd))
+                    notify_client(client, "* joined #" + name);
+                continue;
+            }
+            if (body_size > 7 && std::strncmp(body, "/leave ", 7) == 0) {
+                std::string name = first_word(body + 7, body_size - 7);
+                if (_channels.leave(name, fd))
+                    notify_client(client, "* left #" + name);
+                continue;
+            }
+
+            if (body_size > 7 && std::strncmp(body, "/since ", 7) == 0) {
+                std::string seq = first_word(body + 7, body_size - 7);
+                size_t next = 7 + seq.size();
+                while (next < body_size && body[next] == ' ')
+                    ++next;
+                std::string name = first_word(body + next, body_size - next);
+                if (name.empty())
+                    name = CHANNEL_LOBBY;
+                replay_history(client, name, std::strtoull(seq.c_str(), nullptr, 10));
+                continue;
+            }
+
+            std::string channel(CHANNEL_LOBBY);
+            if (body_size > 1 && body[0] == '#') {
+                channel = first_word(body + 1, body_size - 1);
+                if (!ChannelIndex::is_valid_name(channel)) {
+                    notify_client(client, "* invalid channel name: " + channel);
+                    continue;
+                }
+            }
+
+            // Display message on next line and redisplay prompt.
+            // The message is copied straight into the log buffer.
+            struct iovec parts[4] = {
+                { const_cast<char*>("\n"), 1 },
+                { const_cast<char*>(message->data()), message->size() },
+                { const_cast<char*>("\n"), 1 },
+                { const_cast<char*>(_prompt.data()), _prompt.size() }
+            };
+            _log->write(parts, 4);
+
+            // Send to each member of the channel except the sender
+            publish(message, channel, fd);
+            forward(message, channel);
+            if (_options.relay != nullptr)
+                _options.relay->post(message, channel);
+            _options.history->append(message, channel);
+            _stats.route_time.record(ShardStats::now() - _now);
+        }
+    }
+    catch (const std::runtime_error& ex) {
+        print("\n" + std::string(ex.what()) + "\n");
+        return false;
+    }
+
+    // Most clients are idle most of the time, so they do not keep
+    // an input buffer between messages
+    client.release_idle();
+    return true;
+}
+
+/**
+ * Queues a message for every client of this shard except the sender.
+ *
+ * Each client's queue holds a reference to the same message.
+ * The data is sent when the dirty clients are flushed at the end
+ * of the current wakeup.
+ *
+ *  message     The message to send.
+ *  sender      The socket descriptor of the sender, or -1 to send to all.
+ */
+void Shard::broadcast(const MessagePtr& message, int sender) {
+    _messages.fetch_add(1, std::memory_order_relaxed);
+
+    // Clients are only removed at the end of the wakeup, so the table
+    // does not change while it is walked
+    for (auto it = _clients.begin(); it != _clients.end(); ++it) {
+        int fd = it->get_descriptor();
+        if (fd != sender)
+            deliver(fd, *it, message);
+    }
+}
+
+/**
+ * Queues a message for the members of a channel on this shard,
+ * except the sender. Only the channel's members are visited.
+ *
+ *  message     The message to send.
+ *  channel     The name of the channel, or empty to send to all clients.
+ *  sender      The socket descriptor of the sender, or -1 to send to all.
+ */
+void Shard::publish(const MessagePtr& message, const std::string& channel, int sender) {
+    if (channel.empty()) {
+        broadcast(message, sender);
+        return;
+    }
+
+    _messages.fetch_add(1, std::memory_order_relaxed);
+
+    const std::vector<int>* members = _channels.get_members(channel);
+    if (members == nullptr)
+        return;
+
+    // Overflowing clients are removed later, so the list stays valid
+    for (auto it = members->begin(); it != members->end(); ++it) {
+        if (*it == sender)
+            continue;
+        SocketStream* client = _clients.find(*it);
+        if (client != nullptr)
+            deliver(*it, *client, message);
+    }
+}
+
+/**
+ * Queues a message for one client.
+ *
+ * A client whose queue is full is handled by the overflow policy,
+ * so a slow client never holds up delivery to the others.
+ * A client that must be disconnected is added to the overflow list
+ * and removed at the end of the current wakeup.
+ *
+ *  fd          The socket descriptor of the client.
+ *  client      The client to send to.
+ *  message     The message to send.
+ */
+void Shard::deliver(int fd, SocketStream& client, const MessagePtr& message) {
+    size_t dropped;
+    switch (client.queue(message, _options.outbox_limit, dropped, _now)) {
+    case QUEUE_FIRST:
+        // A client that already had queued data is either on the dirty
+        // list or waiting for EPOLLOUT, so it only needs to be added once.
+        _dirty.push_back(fd);
+        hold(client);
+        break;
+    case QUEUE_APPENDED:
+        hold(client);
+        break;
+    case QUEUE_DROPPED:
+        _dropped_oldest.fetch_add(dropped, std::memory_order_relaxed);
+        hold(client);
+        break;
+    case QUEUE_REJECTED:
+        _dropped_newest.fetch_add(dropped, std::memory_order_relaxed);
+        break;
+    case QUEUE_OVERFLOW:
+        _overflowed.push_back(fd);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Gives a client the handle in front of a message it sent, unless
+ * another client already owns it. Either way, the client's handle
+ * is settled and does not change until it disconnects.
+ *
+ *  client  The client.
+ *  data    The message data.
+ *  offset  Where the text after the handle starts, as found by find_body.
+ */
+void Shard::name_client(SocketStream& client, const char* data, size_t offset) {
+    std::string handle(data, offset - 2);
+    if (_options.handles->claim(handle, _id, client.get_descriptor())) {
+        client.set_handle(handle);
+    }
+    else {
+        client.set_handle(std::string());
+        notify_client(client, "* handle " + handle + " is in use;"
+            " direct messages to it go to another client");
+    }
+}
+
+/**
+ * Sends a direct message to the client that owns a handle. The client
+ * is found in the handle index, and only that client's queue is visited,
+ * however many clients are connected. A client of another shard gets
+ * the message through that shard's inbox.
+ *
+ *  message The message to send.
+ *  handle  The handle it is addressed to.
+ *
+ * Returns false if no client owns the handle, or true otherwise.
+ */
+bool Shard::send_direct(const MessagePtr& message, const std::string& handle) {
+    HandleOwner owner;
+    if (!_options.handles->find(handle, owner)) {
+        _stats.direct_unknown.add();
+        return false;
+    }
+
+    _messages.fetch_add(1, std::memory_order_relaxed);
+    if (owner.shard == _id)
+        deliver_direct(owner.fd, handle, message);
+    else
+        _group[owner.shard]->post_direct(message, owner.fd, handle);
+    _stats.route_time.record(ShardStats::now() - _now);
+    return true;
+}
+
+/**
+ * Queues a direct message for a client of this shard, if it still owns
+ * the handle the message is addressed to. It may have disconnected since
+ * it was looked up, and its descriptor may belong to another client now.
+ *
+ *  fd      The socket descriptor of the client.
+ *  handle  The handle the message is addressed to.
+ *  message The message to send.
+ */
+void Shard::deliver_direct(int fd, const std::string& handle, const MessagePtr& message) {
+    SocketStream* client = _clients.find(fd);
+    if (client == nullptr || client->get_handle() != handle)
+        return;
+    deliver(fd, *client, message);
+    _stats.direct.add();
+}
+
+/**
+ * Sends a notice from the server to one client, such as
+ * the confirmation of a command.
+ *
+ *  client  The client to send to.
+ *  text    The text of the notice.
+ */
+void Shard::notify_client(SocketStream& client, const std::string& text) {
+    MessagePtr message(Message::create(text));
+    reply(client, message);
+}
+
+/**
+ * Queues a message that a client asked for, such as the confirmation
+ * of a command.
+ *
+ * The message is queued without a limit, so it never causes
+ * the client's other messages to be dropped.
+ *
+ *  client  The client to send to.
+ *  message The message to send.
+ */
+void Shard::reply(SocketStream& client, const MessagePtr& message) {
+    OutboxLimit unlimited;
+    unlimited.max_bytes = 0;
+    unlimited.policy = DROP_NEWEST;
+
+    size_t dropped;
+    if (client.queue(message, unlimited, dropped, _now) == QUEUE_FIRST)
+        _dirty.push_back(client.get_descriptor());
+    hold(client);
+}
+
+/**
+ * Records that a message was queued for a client during the current
+ * coalescing window. The window ends early once any one client has
+ * coalesce_bytes waiting, because a larger send would not be cheaper;
+ * the bytes are not summed over clients, since a message queued for
+ * many clients is held only once for each of them.
+ *
+ *  client  The client the message was queued for.
+ */
+void Shard::hold(const SocketStream& client) {
+    _held_bytes = std::max(_held_bytes, client.get_pending_bytes());
+}
+
+/**
+ * Sends a client one page of the recorded messages of a channel that
+ * it missed, followed by a notice with the sequence number to ask for
+ * next time. The page is no larger than the room left in the client's
+ * queue, so the messages are queued under the usual limit without
+ * dropping any; a client whose queue is full gets an empty page and
+ * asks again once it has caught up.
+ *
+ *  client  The client to send to.
+ *  channel The channel to replay.
+ *  since   The highest sequence number the client has already seen.
+ */
+void Shard::replay_history(SocketStream& client, const std::string& channel, uint64_t since) {
+    size_t budget = HISTORY_REPLAY_BYTES;
+    size_t pending = client.get_pending_bytes();
+    size_t max_bytes = _options.outbox_limit.max_bytes;
+    if (max_bytes > 0)
+        budget = pending < max_bytes ? std::min(budget, max_bytes - pending) : 0;
+
+    std::vector<MessagePtr> messages;
+    bool more;
+    uint64_t last = _options.history->replay(channel, since, budget, messages, more);
+
+    // The first message comes even if it is larger than the budget,
+    // which only an empty queue can take
+    if (pending > 0 && !messages.empty() && messages[0]->frame_size() > budget) {
+        messages.clear();
+        last = since;
+        more = true;
+    }
+
+    int fd = client.get_descriptor();
+    for (auto it = messages.begin(); it != messages.end(); ++it)
+        deliver(fd, client, *it);
+
+    notify_client(client, "* history #" + channel + " since "
+        + std::to_string(since) + ": " + std::to_string(messages.size())
+        + " messages, last seq " + std::to_string(last) + (more ? ", more" : ""));
+}
+
+/**
+ * Disconnects every client that could not keep up with its messages.
+ */
+void Shard::remove_overflowed() {
+    for (auto fd = _overflowed.begin(); fd != _overflowed.end(); ++fd) {
+        // A client can overflow more than once before it is removed
+        if (_clients.find(*fd) == nullptr)
+            continue;
+        _overflow_disconnects.fetch_add(1, std::memory_order_relaxed);
+        remove_client(*fd);
+    }
+    _overflowed.clear();
+}
+
+/**
+ * Posts a message received by this shard to the inbox of every other shard.
+ *
+ *  message     The message to forward.
+ *  channel     The name of the channel the message was sent to.
+ */
+void Shard::forward(const MessagePtr& message, const std::string& channel) {
+    for (auto it = _group.begin(); it != _group.end(); ++it) {
+        if (*it != this)
+            (*it)->post(message, channel);
+    }
+}
+
+/**
+ * Sends as much of a client's outgoing queue as the socket will accept.
+ *
+ * If data is left over, the socket is watched for EPOLLOUT so that
+ * the rest is sent as soon as there is room. Once the queue is empty,
+ * the socket is only watched for incoming data again.
+ * The client is disconnected if the socket was closed.
+ *
+ *  fd          The socket descriptor of the client.
+ *  watching    Whether the socket is currently watched for EPOLLOUT.
+ */
+void Shard::flush_client(int fd, bool watching) {
+    SocketStream* client = _clients.find(fd);
+    if (client == nullptr)
+        return;     // Disconnected since it was queued
+
+    bool open;
+    uint64_t start = ShardStats::now();
+    try {
+        open = client->flush();
+        _stats.send_time.record(ShardStats::now() - start);
+    }
+    catch (const std::runtime_error& ex) {
+        print("\n" + std::string(ex.what()) + "\n");
+        open = false;
+    }
+
+    if (!open) {
+        remove_client(fd);
+        return;
+    }
+
+    if (client->has_pending() != watching)
+        watch_client(*client);
+}
+
+/**
+ * Updates the events that a client's socket is watched for with epoll:
+ * input unless the client is delayed by the rate limit, and output
+ * while messages are queued for it.
+ *
+ *  client  The client.
+ */
+void Shard::watch_client(SocketStream& client) {
+    uint32_t events = client.is_throttled() ? 0 : EPOLLIN | EPOLLRDHUP;
+    if (client.has_pending())
+        events |= EPOLLOUT;
+    _loop.modify(client.get_descriptor(), events);
+}
+
+/**
+ * Disconnects the clients that overflowed during this wakeup
+ * and flushes every client that had messages queued.
+ */
+void Shard::flush_dirty() {
+    remove_overflowed();
+    for (auto it = _dirty.begin(); it != _dirty.end(); ++it) {
+        if (_ring != nullptr)
+            submit_send(*it);
+        else
+            flush_client(*it, false);
+    }
+    _dirty.clear();
+}
+
+/**
+ * Sends what was queued during a wakeup, or holds it back so that it
+ * goes out together with the messages that follow.
+ *
+ * Without coalescing, everything is sent at once. With coalescing,
+ * the queued messages are held until the window that started with the
+ * first of them ends, or until enough bytes are held. They are sent at
+ * once if messages arrive less often than the window is long, because
+ * waiting would then only add latency.
+ */
+void Shard::finish_wakeup() {
+    if (_dirty.empty()) {
+        remove_overflowed();
+        return;
+    }
+    if (_timer_fd == -1) {
+        flush_dirty();
+        return;
+    }
+
+    uint64_t now = ShardStats::now();
+    uint64_t window = _options.coalesce_us * 1000ull;
+    if (_held_since == 0)
+        _held_since = now;
+
+    if (_arrival_gap >= window) {
+        _stats.flush_light.add();
+    }
+    else if (_held_bytes >= _options.coalesce_bytes) {
+        _stats.flush_full.add();
+    }
+    else if (now - _held_since >= window) {
+        _stats.flush_window.add();
+    }
+    else {
+        // Hold the messages until the timer ends the window
+        remove_overflowed();
+        if (!_timer_armed)
+            arm_timer(_held_since + window);
+        return;
+    }
+
+    _stats.coalesce_delay.record(now - _held_since);
+    _held_since = 0;
+    _held_bytes = 0;
+    flush_dirty();
+}
+
+/**
+ * Sets the coalescing timer to go off at a point in time.
+ *
+ *  deadline    The time in nanoseconds on the ShardStats::now clock.
+ */
+void Shard::arm_timer(uint64_t deadline) {
+    set_timer(_timer_fd, deadline);
+    _timer_armed = true;
+}
+
+/**
+ * Handles the coalescing timer going off. The held messages are sent
+ * at the end of the wakeup, because the window is over.
+ */
+void Shard::handle_timer() {
+    uint64_t expirations;
+    if (::read(_timer_fd, &expirations, sizeof(expirations)) == -1)
+        return;     // Already read after an earlier notification
+    _timer_armed = false;
+}
+
+/**
+ * Stops reading from a client that sent faster than the rate limit
+ * until it may send again. Whatever it sends meanwhile stays in its
+ * socket, so TCP slows the client down instead of the server
+ * buffering its messages.
+ *
+ *  client  The client.
+ *  now     The time on the ShardStats::now clock.
+ */
+void Shard::throttle_client(SocketStream& client, uint64_t now) {
+    int fd = client.get_descriptor();
+    client.set_throttled(true);
+    _throttled.push_back(fd);
+    _stats.rate_delayed.add();
+
+    if (_ring == nullptr) {
+        watch_client(client);
+    }
+    else if (_uring_clients[fd].recv_armed) {
+        // Data that was already received is kept in the input buffer
+        struct io_uring_sqe* sqe = _ring->get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = make_user_data(OP_RECEIVE, fd);
+        sqe->user_data = make_user_data(OP_CANCEL, fd);
+    }
+
+    // A single timer goes off when the first delay ends
+    uint64_t ready = std::max(client.get_rate_ready_time(_options.rate_limit), now + 1);
+    if (_throttle_deadline == 0 || ready < _throttle_deadline) {
+        set_timer(_throttle_fd, ready);
+        _throttle_deadline = ready;
+    }
+}
+
+/**
+ * Handles the throttle timer going off. Every delayed client that may
+ * send again has the messages it sent before the delay routed and is
+ * read from again, and the timer is set for the rest.
+ */
+void Shard::handle_throttle() {
+    uint64_t expirations;
+    if (::read(_throttle_fd, &expirations, sizeof(expirations)) == -1)
+        return;     // Already read after an earlier notification
+    _throttle_deadline = 0;
+
+    uint64_t now = ShardStats::now();
+    uint64_t next = 0;
+    size_t kept = 0;
+    for (auto it = _throttled.begin(); it != _throttled.end(); ++it) {
+        SocketStream* client = _clients.find(*it);
+        if (client == nullptr || !client->is_throttled())
+            continue;   // Disconnected while it was delayed
+        uint64_t ready = client->get_rate_ready_time(_options.rate_limit);
+        if (ready <= now) {
+            _resumed.push_back(*it);
+        }
+        else {
+            _throttled[kept++] = *it;
+            if (next == 0 || ready < next)
+                next = ready;
+        }
+    }
+    _throttled.resize(kept);
+    if (next != 0) {
+        set_timer(_throttle_fd, next);
+        _throttle_deadline = next;
+    }
+
+    // Routing can delay a client again or disconnect it, so each one
+    // is looked up again
+    for (auto it = _resumed.begin(); it != _resumed.end(); ++it) {
+        int fd = *it;
+        SocketStream* client = _clients.find(fd);
+        if (client == nullptr)
+            continue;
+        client->set_throttled(false);
+        if (!route_messages(*client)) {
+            remove_client(fd);
+            continue;
+        }
+        if (client->is_throttled())
+            continue;
+
+        if (_ring == nullptr)
+            watch_client(*client);
+        else if (!_uring_clients[fd].recv_armed)
+            arm_receive(fd);
+    }
+    _resumed.clear();
+}
+
+/**
+ * Records that a client sent something, which pushes its timer back
+ * by the heartbeat interval, or the idle timeout if there is none.
+ * Most of the time this only stores the new deadline.
+ *
+ *  client  The client.
+ *  now     The time on the ShardStats::now clock.
+ */
+void Shard::touch_client(SocketStream& client, uint64_t now) {
+    if (_wheel_fd == -1)
+        return;
+    unsigned ms = _options.heartbeat_ms > 0 ? _options.heartbeat_ms : _options.idle_ms;
+    _wheel.reset(client.get_descriptor(), get_tick(now) + get_ticks(ms));
+    client.set_pinged(false);
+}
+
+/**
+ * Handles a tick of the timer wheel. Each client whose timer went off
+ * has been silent for the heartbeat interval or the idle timeout.
+ * A client that has not been sent a heartbeat since it last sent
+ * something is sent "/ping", and one that was already sent one is
+ * disconnected once the idle timeout is up. Without an idle timeout,
+ * heartbeats are sent for as long as the client stays silent, so a
+ * dead connection is found when sending to it fails.
+ *
+ * Only the clients whose timers went off are visited.
+ */
+void Shard::handle_wheel() {
+    uint64_t expirations;
+    if (::read(_wheel_fd, &expirations, sizeof(expirations)) == -1)
+        return;     // Already read after an earlier notification
+
+    // Pings share one clock reading, like the copies of a message
+    _now = ShardStats::now();
+    uint64_t tick = get_tick(_now);
+    _wheel.advance(tick, _expired);
+    _stats.timers_expired.add(_expired.size());
+
+    bool removed = false;
+    for (auto it = _expired.begin(); it != _expired.end(); ++it) {
+        int fd = *it;
+        SocketStream* client = _clients.find(fd);
+        if (client == nullptr)
+            continue;
+
+        // A delayed client is silent because it is not being read from
+        if (client->is_throttled()) {
+            touch_client(*client, _now);
+            continue;
+        }
+
+        unsigned heartbeat = _options.heartbeat_ms;
+        unsigned idle = _options.idle_ms;
+        if (heartbeat > 0 && (idle == 0 || !client->is_pinged())) {
+            // Nothing separates messages in text mode, so the heartbeat
+            // is set off by record separators, which the text check
+            // keeps out of the messages of other clients
+            notify_client(*client, client->is_framed() ? "/ping" : "\x1e/ping\x1e");
+            client->set_pinged(true);
+            _stats.heartbeats.add();
+            _wheel.schedule(fd, tick + get_ticks(idle > 0 ? idle - heartbeat : heartbeat));
+            continue;
+        }
+
+        _stats.idle_disconnects.add();
+        print(client_event(*client, " was idle for too long\n"));
+        remove_client(fd);
+        removed = true;
+    }
+    _expired.clear();
+    _timer_count.store(_wheel.size(), std::memory_order_relaxed);
+
+    // Redisplay prompt if there are still clients connected
+    if (removed && !_clients.empty())
+        print(_prompt);
+}
+
+/**
+ * Disconnects a client and removes it from the client list.
+ *
+ * With epoll, the socket is closed immediately. With io_uring, the
+ * client's pending requests are cancelled first, and the socket is
+ * closed once they have all completed.
+ *
+ * The last client in the table is moved into the removed client's
+ * place, so no reference to a client may be held across this call.
+ *
+ *  fd      The socket descriptor of the client to remove.
+ */
+void Shard::remove_client(int fd) {
+    SocketStream& client = *_clients.find(fd);
+    _channels.leave_all(fd);
+    _wheel.cancel(fd);
+    if (!client.get_handle().empty())
+        _options.handles->release(client.get_handle(), _id, fd);
+    print(client_event(client, " disconnected\n"));
+
+    if (_ring != nullptr) {
+        // Keep the data of a pending send alive until it completes
+        UringClient& state = _uring_clients[fd];
+        if (state.send)
+            client.take_outbox(state.send->orphans);
+        close_uring_client(fd);
+    }
+    else {
+        _loop.remove(fd);
+        client.close();
+    }
+
+    _clients.erase(fd);
+    update_client_count();
+}
+
+/**
+ * Publishes the number of clients and the memory used to track them,
+ * for the statistics report.
+ */
+void Shard::update_client_count() {
+    size_t memory = _clients.get_memory()
+        + _uring_clients.capacity() * sizeof(UringClient)
+        + _spare_sends.size() * sizeof(UringSend)
+        + _wheel.get_memory();
+    _client_count.store(_clients.size(), std::memory_order_relaxed);
+    _table_memory.store(memory, std::memory_order_relaxed);
+    _timer_count.store(_wheel.size(), std::memory_order_relaxed);
+}
+
+/**
+ * Disconnects every client of this shard.
+ */
+void Shard::disconnect_all() {
+    // Removing the last client never moves another one
+    while (!_clients.empty())
+        remove_client((_clients.end() - 1)->get_descriptor());
+}
+
+/**
+ * Hands the listening sockets and clients of this shard over to a new
+ * server. The shard stops reading, waits until every other shard has
+ * too, and takes the last messages they routed to it. Then the state
+ * of each client is copied into the handoff, along with the sockets,
+ * and the shard waits until the new server has it all.
+ *
+ * The shard keeps its own state until then, so if the new server
+ * fails first, the shard picks up where it left off.
+ *
+ * Returns true if the new server took over, or false if the shard
+ * should go on serving.
+ */
+bool Shard::hand_over() {
+    if (_ring != nullptr)
+        stop_uring();
+
+    // Nothing is routed to this shard once every shard stopped reading,
+    // so whatever is in the inbox then is all there will be
+    _handoff->stop();
+    handle_inbox();
+    remove_overflowed();
+
+    ShardHandoff& state = _handoff->get_shard(_id);
+    state.listener = _listener.get_descriptor();
+    state.unix_listener = _unix_listener.get_descriptor();
+    state.clients.reserve(_clients.size());
+    for (auto it = _clients.begin(); it != _clients.end(); ++it) {
+        HandoffClient client;
+        client.fd = it->get_descriptor();
+        client.named = it->is_named();
+        client.handle = it->get_handle();
+        _channels.get_channels(client.fd, client.channels);
+        client.input = it->get_input();
+        client.sent = it->get_sent_offset();
+        it->copy_outbox(client.outbox);
+        state.clients.push_back(std::move(client));
+    }
+    _handoff->finish();
+
+    if (_handoff->wait()) {
+        // The sockets belong to the new server now, so they must
+        // not be closed or have their files removed
+        _listener.release();
+        _unix_listener.release();
+        return true;
+    }
+
+    _handoff = nullptr;
+    if (_ring != nullptr)
+        resume_uring();
+    finish_wakeup();
+    return false;
+}
+
+/**
+ * Runs the shard with io_uring, which performs the accepts, receives,
+ * and sends itself and reports when they have completed.
+ *
+ * Receives are multishot requests that keep completing until they
+ * are cancelled, and received data is placed in buffers
+ * provided by the ring, so most wakeups take a single system call
+ * that both submits new sends and waits for completions.
+ */
+void Shard::run_uring() {
+    while (_handoff == nullptr) {
+        _ring->submit_and_wait(1);
+        reap_completions();
+
+        // Handle the completions in small batches and submit the sends
+        // queued by each batch before going on. A burst of receives can
+        // fill thousands of completions, and handling them all before
+        // sending anything would overflow the queues of fast clients.
+        size_t next = 0;
+        while (next < _completions.size()) {
+            size_t end = std::min(next + SHARD_URING_BATCH, _completions.size());
+            for (; next < end; ++next)
+                handle_completion(_completions[next]);
+
+            // Send everything queued during this batch, unless it is
+            // held back to be coalesced with what comes next
+            finish_wakeup();
+            _ring->submit_and_wait(0);
+            reap_completions();
+        }
+        _completions.clear();
+    }
+}
+
+/**
+ * Copies every available completion out of the completion ring.
+ *
+ * Send completions are handled immediately, ahead of any receives
+ * that are still waiting, so that sent data is released from the
+ * client's queue and the rest of the queue is sent right away.
+ */
+void Shard::reap_completions() {
+    struct io_uring_cqe cqes[EVENTLOOP_MAX_EVENTS];
+    unsigned count;
+
+    while ((count = _ring->take_completions(cqes, EVENTLOOP_MAX_EVENTS)) > 0) {
+        for (unsigned i = 0; i < count; ++i) {
+            if ((cqes[i].user_data >> 32) == OP_SEND)
+                handle_completion(cqes[i]);
+            else
+                _completions.push_back(cqes[i]);
+        }
+    }
+}
+
+/**
+ * Handles one io_uring completion.
+ *
+ *  cqe     The completion.
+ */
+void Shard::handle_completion(const struct io_uring_cqe& cqe) {
+    UringOp op = static_cast<UringOp>(cqe.user_data >> 32);
+    int fd = static_cast<int>(cqe.user_data & 0xffffffff);
+
+    switch (op) {
+    case OP_ACCEPT:
+        handle_accept(fd, cqe);
+        break;
+    case OP_NOTIFY:
+        handle_inbox();
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+            arm_notify();
+        break;
+    case OP_RECEIVE:
+        handle_receive(fd, cqe);
+        break;
+    case OP_SEND:
+        handle_send(fd, cqe);
+        break;
+    case OP_TIMER:
+        handle_timer();
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+            arm_timer_poll(_timer_fd);
+        break;
+    case OP_THROTTLE:
+        handle_throttle();
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+            arm_timer_poll(_throttle_fd);
+        break;
+    case OP_WHEEL:
+        handle_wheel();
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+            arm_timer_poll(_wheel_fd);
+        break;
+    case OP_BACKOFF:
+        // The pause after running out of descriptors is over
+        --_uring_accepts;
+        if (_handoff == nullptr)
+            arm_accept(fd);
+        break;
+    default:
+        // Nothing to do when a cancel request completes
+        break;
+    }
+}
+
+/**
+ * Handles a connection accepted by an io_uring accept request,
+ * and submits the next accept in the same slot.
+ *
+ *  fd      The listening socket descriptor.
+ *  cqe     The completion, whose result is the new socket descriptor.
+ */
+void Shard::handle_accept(unsigned slot, const struct io_uring_cqe& cqe) {
+    --_uring_accepts;
+    if (cqe.res == -ECANCELED && _handoff != nullptr)
+        return;     // Stopped for a hot restart
+    const UringAccept& accept = _uring_accept_slots[slot];
+
+    // When out of descriptors, a pending connection is turned away as
+    // with epoll, so it does not stay queued. io_uring fails an accept
+    // whenever the descriptor table is full, even with no connection
+    // pending, so if none was turned away, accepting pauses for a while
+    // instead of failing over and over.
+    bool backoff = false;
+    if (cqe.res == -EMFILE || cqe.res == -ENFILE) {
+        Socket& listener = accept.listener == _listener.get_descriptor()
+            ? _listener : _unix_listener;
+        backoff = !listener.reject_one();
+    }
+
+    // The kernel writes the next address into the slot once it is
+    // submitted again
+    struct sockaddr_storage addr;
+    std::memcpy(&addr, &accept.addr, sizeof(addr));
+    if (_handoff == nullptr && backoff)
+        arm_accept_backoff(slot);
+    else if (_handoff == nullptr)
+        arm_accept(slot);
+
+    uint64_t start = ShardStats::now();
+    try {
+        if (cqe.res < 0) {
+            std::string errmsg("accept: ");
+            errmsg += ::strerror(-cqe.res);
+            throw std::runtime_error(errmsg);
+        }
+        SocketStream ss(cqe.res, reinterpret_cast<struct sockaddr*>(&addr), true);
+        add_client(ss);
+        _stats.accept_time.record(ShardStats::now() - start);
+    }
+    catch (const std::runtime_error& ex) {
+        print(std::string(ex.what()) + "\n");
+    }
+}
+
+/**
+ * Handles data received by a client's multishot receive request.
+ *
+ * The data is copied out of the provided buffer into the client's
+ * input buffer, and the provided buffer is returned to the ring.
+ *
+ *  fd      The socket descriptor of the client.
+ *  cqe     The completion, whose result is the number of bytes received.
+ */
+void Shard::handle_receive(int fd, const struct io_uring_cqe& cqe) {
+    UringClient& state = _uring_clients[fd];
+    SocketStream* client = _clients.find(fd);
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+        state.recv_armed = false;
+
+    bool open = true;
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe.res > 0 && !state.closing) {
+            uint64_t start = ShardStats::now();
+            client->feed(_ring->get_buffer(bid), cqe.res);
+            _stats.recv_time.record(ShardStats::now() - start);
+            touch_client(*client, start);
+        }
+        _ring->recycle_buffer(bid);
+    }
+
+    if (state.closing) {
+        finish_uring_client(fd);
+        return;
+    }
+
+    // ENOBUFS means every provided buffer was in use; just receive again.
+    // ECANCELED means the client was delayed by the rate limit.
+    // Anything else that is not data means the socket was closed.
+    if (cqe.res > 0)
+        open = route_messages(*client);
+    else if (cqe.res != -ENOBUFS && cqe.res != -ECANCELED)
+        open = false;
+
+    if (!open) {
+        // Socket closed -- remove client
+        remove_client(fd);
+
+        // Redisplay prompt if there are still clients connected
+        if (!_clients.empty())
+            print(_prompt);
+        return;
+    }
+
+    if (!state.recv_armed && !client->is_throttled())
+        arm_receive(fd);
+}
+
+/**
+ * Handles the completion of a send to a client.
+ *
+ * The sent data is removed from the client's queue, and anything
+ * still queued is sent by a new request.
+ *
+ *  fd      The socket descriptor of the client.
+ *  cqe     The completion, whose result is the number of bytes sent.
+ */
+void Shard::handle_send(int fd, const struct io_uring_cqe& cqe) {
+    UringClient& state = _uring_clients[fd];
+    std::unique_ptr<UringSend> send(std::move(state.send));
+
+    if (state.closing) {
+        release_send(send);
+        finish_uring_client(fd);
+        return;
+    }
+
+    SocketStream* client = _clients.find(fd);
+    _stats.send_time.record(ShardStats::now() - send->started);
+    if (cqe.res < 0) {
+        client->complete_send(0);
+        if (cqe.res == -EAGAIN)
+            _stats.send_eagain.add();
+    }
+    else {
+        // A short send means the socket buffer is full
+        size_t total = 0;
+        for (size_t i = 0; i < send->iov.size(); ++i)
+            total += send->iov[i].iov_len;
+        if (static_cast<size_t>(cqe.res) < total)
+            _stats.send_eagain.add();
+        client->complete_send(cqe.res);
+    }
+    release_send(send);
+
+    // ECANCELED means the send was stopped for a hot restart
+    if (cqe.res < 0 && cqe.res != -EINTR && cqe.res != -EAGAIN && cqe.res != -ECANCELED) {
+        // Socket was closed
+        remove_client(fd);
+        return;
+    }
+
+    submit_send(fd);
+}
+
+/**
+ * Submits an accept request for a listening socket.
+ *
+ * The kernel writes the address of the connection into the request's
+ * slot, which saves a getpeername call per connection. A multishot
+ * accept would write every address to the same place before any is
+ * read, so each slot accepts one connection at a time instead, and
+ * SHARD_URING_ACCEPTS of them are pending for each listening socket.
+ *
+ *  slot    The slot of the request, which names the listening socket.
+ */
+void Shard::arm_accept(unsigned slot) {
+    UringAccept& accept = _uring_accept_slots[slot];
+    accept.addr_size = sizeof(accept.addr);
+
+    struct io_uring_sqe* sqe = _ring->get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = accept.listener;
+    sqe->addr = reinterpret_cast<unsigned long>(&accept.addr);
+    sqe->addr2 = reinterpret_cast<unsigned long>(&accept.addr_size);
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = make_user_data(OP_ACCEPT, slot);
+    ++_uring_accepts;
+}
+
+/**
+ * Submits a timeout after which an accept request is submitted again,
+ * for when the process ran out of descriptors.
+ *
+ *  slot    The slot of the accept request.
+ */
+void Shard::arm_accept_backoff(unsigned slot) {
+    struct io_uring_sqe* sqe = _ring->get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = reinterpret_cast<unsigned long>(&_accept_backoff);
+    sqe->len = 1;
+    sqe->user_data = make_user_data(OP_BACKOFF, slot);
+    ++_uring_accepts;
+}
+
+/**
+ * Submits a multishot poll request for the inbox notification descriptor.
+ */
+void Shard::arm_notify() {
+    struct io_uring_sqe* sqe = _ring->get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = _loop.get_notify_descriptor();
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = make_user_data(OP_NOTIFY, sqe->fd);
+}
+
+/**
+ * Submits a multishot poll request for the coalescing, throttle
+ * or wheel timer.
+ *
+ *  fd      The timer's descriptor.
+ */
+void Shard::arm_timer_poll(int fd) {
+    struct io_uring_sqe* sqe = _ring->get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    UringOp op = OP_WHEEL;
+    if (fd == _timer_fd)
+        op = OP_TIMER;
+    else if (fd == _throttle_fd)
+        op = OP_THROTTLE;
+    sqe->user_data = make_user_data(op, fd);
+}
+
+/**
+ * Submits a multishot receive request for a client socket.
+ * Each completion uses a buffer picked by the kernel from the ring.
+ * Nothing more is received once the shard is stopping for a hot restart.
+ *
+ *  fd      The socket descriptor of the client.
+ */
+void Shard::arm_receive(int fd) {
+    if (_handoff != nullptr)
+        return;
+    struct io_uring_sqe* sqe = _ring->get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = make_user_data(OP_RECEIVE, fd);
+    _uring_clients[fd].recv_armed = true;
+}
+
+/**
+ * Submits a send request for the front of a client's outgoing queue,
+ * unless one is already pending or the queue is empty. Nothing more
+ * is sent once the shard is stopping for a hot restart.
+ *
+ *  fd      The socket descriptor of the client.
+ */
+void Shard::submit_send(int fd) {
+    if (_handoff != nullptr)
+        return;
+    SocketStream* client = _clients.find(fd);
+    if (client == nullptr)
+        return;     // Disconnected since it was queued
+
+    UringClient& state = _uring_clients[fd];
+    if (state.send)
+        return;     // Sent when the pending send completes
+    if (!client->has_pending())
+        return;
+
+    // Reuse the state of a completed send if there is one
+    if (_spare_sends.empty()) {
+        state.send.reset(new UringSend());
+    }
+    else {
+        state.send = std::move(_spare_sends.back());
+        _spare_sends.pop_back();
+    }
+    UringSend& send = *state.send;
+
+    size_t count = client->prepare_send(_send_iov, SOCKETSTREAM_MAX_IOV);
+    send.iov.assign(_send_iov, _send_iov + count);
+    std::memset(&send.hdr, 0, sizeof(send.hdr));
+    send.hdr.msg_iov = send.iov.data();
+    send.hdr.msg_iovlen = count;
+    _stats.sends.add();
+    _stats.send_batch.record(count);
+
+    // MSG_NOSIGNAL returns EPIPE instead of raising SIGPIPE.
+    // MSG_MORE corks the socket if this send does not take everything.
+    struct io_uring_sqe* sqe = _ring->get_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<unsigned long>(&send.hdr);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL
+        | (count < client->get_pending_messages() ? MSG_MORE : 0);
+    sqe->user_data = make_user_data(OP_SEND, fd);
+    send.started = ShardStats::now();
+}
+
+/**
+ * Keeps the state of a completed send for the next send, unless
+ * enough are kept already. A broadcast can have a send pending for
+ * every client at once, and the states are not kept after that.
+ *
+ *  send    The state of the completed send. It is empty afterwards.
+ */
+void Shard::release_send(std::unique_ptr<UringSend>& send) {
+    send->orphans.clear();
+    if (_spare_sends.size() < SHARD_SPARE_SENDS)
+        _spare_sends.push_back(std::move(send));
+    else
+        send.reset();
+}
+
+/**
+ * Starts closing a client socket that uses io_uring.
+ *
+ * The socket cannot be closed while requests still refer to it, because
+ * its descriptor could be reused by a new connection, so the requests
+ * are cancelled and the socket is closed when the last one completes.
+ *
+ *  fd      The socket descriptor of the client.
+ */
+void Shard::close_uring_client(int fd) {
+    UringClient& state = _uring_clients[fd];
+    state.closing = true;
+    if (!state.recv_armed && !state.send) {
+        finish_uring_client(fd);
+        return;
+    }
+
+    // Each request is cancelled by its user data. Cancelling by
+    // descriptor checks every pending request, which adds up when
+    // thousands of idle clients are disconnected at once.
+    if (state.recv_armed)
+        cancel_request(_ring, OP_RECEIVE, fd);
+    if (state.send)
+        cancel_request(_ring, OP_SEND, fd);
+}
+
+/**
+ * Closes a client socket that uses io_uring once no requests
+ * refer to it anymore.
+ *
+ *  fd      The socket descriptor of the client.
+ */
+void Shard::finish_uring_client(int fd) {
+    UringClient& state = _uring_clients[fd];
+    if (state.recv_armed || state.send)
+        return;
+    state.closing = false;
+    ::close(fd);
+}
+
+/**
+ * Submits the requests that the io_uring loop starts with: accepts on
+ * the listening sockets, and polls of the notification descriptor and
+ * the timers, which are re-armed as they complete.
+ */
+void Shard::start_uring() {
+    UringAccept accept;
+    accept.listener = _listener.get_descriptor();
+    _uring_accept_slots.assign(SHARD_URING_ACCEPTS, accept);
+    if (_unix_listener.get_descriptor() != -1) {
+        accept.listener = _unix_listener.get_descriptor();
+        _uring_accept_slots.insert(_uring_accept_slots.end(), SHARD_URING_ACCEPTS, accept);
+    }
+    for (unsigned slot = 0; slot < _uring_accept_slots.size(); ++slot)
+        arm_accept(slot);
+    arm_notify();
+    if (_timer_fd != -1)
+        arm_timer_poll(_timer_fd);
+    if (_throttle_fd != -1)
+        arm_timer_poll(_throttle_fd);
+    if (_wheel_fd != -1)
+        arm_timer_poll(_wheel_fd);
+}
+
+/**
+ * Stops accepting, receiving and sending with io_uring for a hot
+ * restart. Every such request is cancelled, and the shard waits until
+ * they have all ended. Requests that finish in the meantime are handled
+ * as usual: received data is routed, the bytes a send got out are
+ * removed from its client's queue, and an accepted connection is
+ * handed over with the rest.
+ */
+void Shard::stop_uring() {
+    for (unsigned slot = 0; slot < _uring_accept_slots.size(); ++slot) {
+        cancel_request(_ring, OP_ACCEPT, slot);
+        cancel_request(_ring, OP_BACKOFF, slot);
+    }
+    for (auto it = _clients.begin(); it != _clients.end(); ++it) {
+        int fd = it->get_descriptor();
+        if (_uring_clients[fd].recv_armed)
+            cancel_request(_ring, OP_RECEIVE, fd);
+        if (_uring_clients[fd].send)
+            cancel_request(_ring, OP_SEND, fd);
+    }
+
+    while (true) {
+        bool pending = _uring_accepts > 0;
+        for (auto it = _clients.begin(); it != _clients.end() && !pending; ++it) {
+            const UringClient& state = _uring_clients[it->get_descriptor()];
+            pending = state.recv_armed || state.send;
+        }
+        if (!pending)
+            break;
+
+        _ring->submit_and_wait(1);
+        reap_completions();
+        for (auto it = _completions.begin(); it != _completions.end(); ++it)
+            handle_completion(*it);
+        _completions.clear();
+    }
+}
+
+/**
+ * Starts accepting, receiving and sending with io_uring again after
+ * a hot restart failed. Messages that were queued in the meantime
+ * are sent, and clients delayed by the rate limit stay delayed.
+ * The polls were never cancelled, so they are still armed.
+ */
+void Shard::resume_uring() {
+    for (unsigned slot = 0; slot < _uring_accept_slots.size(); ++slot)
+        arm_accept(slot);
+    for (auto it = _clients.begin(); it != _clients.end(); ++it) {
+        int fd = it->get_descriptor();
+        if (!_uring_clients[fd].recv_armed && !it->is_throttled())
+            arm_receive(fd);
+        submit_send(fd);
+    }
+}
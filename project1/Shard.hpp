@@ -0,0 +1,342 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         Shard.hpp
+* Description:  Defines the class that accepts and routes messages
+*               for one subset of the connected clients.
+*               Each shard runs its own event loop on its own thread
+*               and has its own listening socket and client list.
+*               Messages are passed between shards through a
+*               per-shard lock-free inbox, so no thread ever waits
+*               for another.
+*               A shard waits for events with either epoll or io_uring.
+*               Each shard keeps its own statistics about the messages
+*               it routes and how long each step takes.
+*               Console output is handed to a log sink, so a shard never
+*               waits for the terminal.
+*               Each client can be limited in how fast it sends, before
+*               its messages are routed to anyone.
+*               Messages from local clients are also passed to the
+*               relay, if any, which sends them to other servers.
+*               A client that sends nothing for a while can be sent a
+*               heartbeat and disconnected if it stays silent, using a
+*               timer wheel, so a dead connection is found without
+*               walking the client list.
+*               A message to "@handle" is looked up in the handle
+*               index shared by all shards and only queued for the
+*               client that owns the handle, on whichever shard it is.
+*               On a hot restart, a shard stops reading from its clients
+*               and hands its sockets and the state of its clients over
+*               to the new server, and the new server's shards adopt
+*               them without the clients being disconnected.
+\*********************************************************/
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ChannelIndex.hpp"
+#include "ClientTable.hpp"
+#include "EventLoop.hpp"
+#include "Handoff.hpp"
+#include "HandleIndex.hpp"
+#include "History.hpp"
+#include "LogSink.hpp"
+#include "Message.hpp"
+#include "MpscQueue.hpp"
+#include "ShardStats.hpp"
+#include "Socket.hpp"
+#include "SocketStream.hpp"
+#include "TimerWheel.hpp"
+#include "Uring.hpp"
+
+class Relay;
+
+// Define 32 io_uring completions per batch unless defined elsewhere
+#ifndef SHARD_URING_BATCH
+#define SHARD_URING_BATCH 32
+#endif
+
+// Define at most 256 spare io_uring send states unless defined elsewhere
+#ifndef SHARD_SPARE_SENDS
+#define SHARD_SPARE_SENDS 256
+#endif
+
+// Define 16 io_uring accepts pending per listening socket
+// unless defined elsewhere
+#ifndef SHARD_URING_ACCEPTS
+#define SHARD_URING_ACCEPTS 16
+#endif
+
+// Define 64 KiB held back before coalesced messages are sent
+// unless defined elsewhere
+#ifndef SHARD_COALESCE_BYTES
+#define SHARD_COALESCE_BYTES 65536
+#endif
+
+// Define an inbox of 16384 entries unless defined elsewhere
+#ifndef SHARD_INBOX_SIZE
+#define SHARD_INBOX_SIZE 16384
+#endif
+
+// Define 100 ms per tick of the idle timer wheel unless defined elsewhere
+#ifndef SHARD_TICK_MS
+#define SHARD_TICK_MS 100
+#endif
+
+// Define 100 ms before accepting again when out of descriptors
+// unless defined elsewhere
+#ifndef SHARD_ACCEPT_BACKOFF_MS
+#define SHARD_ACCEPT_BACKOFF_MS 100
+#endif
+
+// Settings shared by every shard in the server
+struct ShardOptions {
+    OutboxLimit outbox_limit;   // Bound on each client's outgoing queue
+    bool framed;                // Whether clients use length-prefixed messages
+    bool uring;                 // Whether to use io_uring instead of epoll
+    int backlog;                // Connections the kernel queues for accept
+    unsigned coalesce_us;       // Longest time to hold messages back, or 0
+    size_t coalesce_bytes;      // Bytes held back that end the window early
+    RateLimit rate_limit;       // How fast each client may send
+    unsigned idle_ms;           // Silence after which a client is disconnected, or 0
+    unsigned heartbeat_ms;      // Silence after which a client is pinged, or 0
+    History* history;           // Records every message sent to a channel
+    LogSink* log;               // Writes console output on its own thread
+    Relay* relay;               // Passes messages to other servers, or null
+    HandleIndex* handles;       // Finds clients by handle for direct messages
+    bool check_text;            // Whether to check that messages are clean text
+};
+
+class Shard {
+    public:
+        Shard(int id, const std::vector<Shard*>& group, std::string prompt,
+            const ShardOptions& options);
+        ~Shard();
+
+        void listen(const char* port, bool reuse_port);
+        void listen_unix(const std::string& path);
+        void inherit_listener(int sd);
+        void inherit_unix_listener(int sd);
+        void adopt_clients(std::vector<HandoffClient>& clients);
+        void run();
+
+        bool post(const MessagePtr& message, const std::string& channel = std::string());
+        bool post_direct(const MessagePtr& message, int fd, const std::string& handle);
+        void post_quit();
+        void post_handoff(Handoff* handoff);
+
+        int get_id() const { return _id; }
+        bool is_uring() const { return _ring != nullptr; }
+        unsigned long get_wakeups() const { return _ring ? _ring->get_enter_calls() : _loop.get_wakeups(); }
+        unsigned long get_messages() const { return _messages.load(std::memory_order_relaxed); }
+        unsigned long get_client_count() const { return _client_count.load(std::memory_order_relaxed); }
+        unsigned long get_table_memory() const { return _table_memory.load(std::memory_order_relaxed); }
+        unsigned long get_dropped_oldest() const { return _dropped_oldest.load(std::memory_order_relaxed); }
+        unsigned long get_dropped_newest() const { return _dropped_newest.load(std::memory_order_relaxed); }
+        unsigned long get_overflow_disconnects() const { return _overflow_disconnects.load(std::memory_order_relaxed); }
+        unsigned long get_inbox_drops() const { return _inbox_drops.load(std::memory_order_relaxed); }
+        unsigned long get_timer_count() const { return _timer_count.load(std::memory_order_relaxed); }
+        const ShardStats& get_stats() const { return _stats; }
+
+    private:
+        // An entry in the inbox posted by another thread
+        struct InboxEntry {
+            bool quit;              // Disconnect all clients instead of sending
+            MessagePtr message;     // The message to send
+            std::string channel;    // The channel to send to, or empty for all,
+                                    // or the handle of the target
+            int target;             // The one client to send to, or -1
+            Handoff* handoff;       // Hand the connections over instead, or null
+        };
+
+        // The state of a pending io_uring send. Only clients with a send
+        // in progress have one; it is reused for the next send afterwards.
+        struct UringSend {
+            uint64_t started;       // When the send was submitted
+            struct msghdr hdr;      // Describes the send
+            std::vector<struct iovec> iov;   // Data of the send
+            std::vector<MessagePtr> orphans; // Keeps sent data alive after close
+        };
+
+        // A pending io_uring accept, with room for the kernel to write the
+        // address of the connection, so it does not have to be looked up
+        struct UringAccept {
+            int listener;                   // The listening socket descriptor
+            struct sockaddr_storage addr;   // Address of the accepted connection
+            socklen_t addr_size;            // Size of the address
+        };
+
+        // The state of the io_uring requests for one client socket.
+        // It outlives the client's SocketStream until every request
+        // that refers to the socket has completed.
+        struct UringClient {
+            bool recv_armed;        // A multishot receive is pending
+            bool closing;           // Disconnected; waiting for requests to end
+            std::unique_ptr<UringSend> send; // The pending send, or null
+        };
+
+        int _id;                            // Index of this shard in the group
+        const std::vector<Shard*>& _group;  // All shards, including this one
+        std::string _prompt;                // Prompt to redisplay after output
+        ShardOptions _options;              // Settings shared by all shards
+        EventLoop _loop;                    // Waits for socket and inbox events
+        Socket _listener;                   // This shard's listening socket
+        Socket _unix_listener;              // Local listening socket, if any
+        Uring* _ring;                       // Used instead of _loop if not null
+        LogBuffer* _log;                    // This shard's console output
+
+        // Connected clients, keyed by socket descriptor.
+        // Only this shard's thread accesses this.
+        ClientTable _clients;
+
+        // Connections accepted in the current batch, reused for each batch
+        std::vector<SocketStream> _accepted;
+
+        // The channels joined by this shard's clients
+        ChannelIndex _channels;
+
+        // io_uring request state, indexed by socket descriptor.
+        // Only used when _ring is not null.
+        std::vector<UringClient> _uring_clients;
+
+        // The accepts, SHARD_URING_ACCEPTS for each listening socket.
+        // Its size is fixed before the first accept is submitted, because
+        // the kernel writes to the addresses while the accepts are pending.
+        std::vector<UringAccept> _uring_accept_slots;
+
+        // Send state that is not in use, kept for the next send
+        std::vector<std::unique_ptr<UringSend> > _spare_sends;
+
+        // Where the data of a send is gathered before it is copied
+        // into a send state of the right size
+        struct iovec _send_iov[SOCKETSTREAM_MAX_IOV];
+
+        // io_uring completions that have been reaped but not yet handled
+        std::vector<struct io_uring_cqe> _completions;
+
+        MpscQueue<InboxEntry> _inbox;       // Entries posted by other threads
+
+        // Set by the first producer to post after the inbox was drained,
+        // so that the event loop is notified once per batch of entries.
+        std::atomic<bool> _inbox_signaled;
+
+        // Clients whose outgoing queue went from empty to non-empty during
+        // the current wakeup. They are flushed once at the end of the wakeup
+        // so that all of their new messages go out in one system call.
+        std::vector<int> _dirty;
+
+        // Clients whose queue overflowed under the DISCONNECT policy during
+        // the current wakeup. They are removed before the dirty clients are
+        // flushed, so that no list of clients changes while it is walked.
+        std::vector<int> _overflowed;
+
+        std::atomic<unsigned long> _messages;       // Messages routed
+        std::atomic<unsigned long> _client_count;   // Size of _clients
+        std::atomic<unsigned long> _table_memory;   // Bytes used by the client tables
+
+        // Slow consumer counters, one for each overflow policy
+        std::atomic<unsigned long> _dropped_oldest;     // Old messages dropped
+        std::atomic<unsigned long> _dropped_newest;     // New messages dropped
+        std::atomic<unsigned long> _overflow_disconnects; // Clients disconnected
+        std::atomic<unsigned long> _inbox_drops;    // Posts to a full inbox
+        std::atomic<unsigned long> _timer_count;    // Timers in the wheel
+
+        // Traffic and latency statistics, written only by this shard's thread
+        ShardStats _stats;
+
+        // When the message being routed was received or taken from the
+        // inbox, so every queue it is added to shares one clock reading
+        uint64_t _now;
+
+        // Write coalescing. Queued messages are held back for up to
+        // coalesce_us so that each client gets them in fewer, larger
+        // sends, but only while messages arrive more often than that.
+        int _timer_fd;              // Ends the window, or -1 if not coalescing
+        bool _timer_armed;          // The timer is set for the current window
+        uint64_t _held_since;       // When the window started, or 0
+        size_t _held_bytes;         // Most bytes queued for one client in the window
+        uint64_t _last_arrival;     // When the last message was routed
+        uint64_t _arrival_gap;      // Moving average of the time between messages
+
+        // Clients that sent faster than the rate limit and are not read
+        // from until they may send again. Only used with LIMIT_DELAY.
+        int _throttle_fd;           // Ends the earliest delay, or -1
+        uint64_t _throttle_deadline; // When the timer goes off, or 0 if not set
+        std::vector<int> _throttled; // Delayed clients, possibly disconnected since
+        std::vector<int> _resumed;  // Delayed clients whose delay just ended
+
+        // Idle timeouts and heartbeats. Each client has a timer in the
+        // wheel that is pushed back whenever it sends anything.
+        int _wheel_fd;              // Goes off every tick, or -1 if not used
+        TimerWheel _wheel;          // Timers of the clients, by descriptor
+        std::vector<int> _expired;  // Clients whose timers just went off
+
+        // The hot restart this shard is stopping for, or null
+        Handoff* _handoff;
+        int _uring_accepts;         // Accept requests and pauses pending
+        struct __kernel_timespec _accept_backoff; // Pause before accepting again
+
+        void print(const std::string& text);
+        void start_message();
+        bool push(InboxEntry& entry);
+        void handle_inbox();
+        void handle_client(int fd, uint32_t events);
+        void accept_client(Socket& listener);
+        void add_client(SocketStream& client);
+        void start_client(SocketStream& client);
+        bool route_messages(SocketStream& client);
+        void broadcast(const MessagePtr& message, int sender);
+        void publish(const MessagePtr& message, const std::string& channel, int sender);
+        void deliver(int fd, SocketStream& client, const MessagePtr& message);
+        void name_client(SocketStream& client, const char* data, size_t offset);
+        bool send_direct(const MessagePtr& message, const std::string& handle);
+        void deliver_direct(int fd, const std::string& handle, const MessagePtr& message);
+        void notify_client(SocketStream& client, const std::string& text);
+        void reply(SocketStream& client, const MessagePtr& message);
+        void hold(const SocketStream& client);
+        void replay_history(SocketStream& client, const std::string& channel, uint64_t since);
+        void remove_overflowed();
+        void forward(const MessagePtr& message, const std::string& channel);
+        void flush_client(int fd, bool watching);
+        void flush_dirty();
+        void finish_wakeup();
+        void arm_timer(uint64_t deadline);
+        void handle_timer();
+        void throttle_client(SocketStream& client, uint64_t now);
+        void handle_throttle();
+        void touch_client(SocketStream& client, uint64_t now);
+        void handle_wheel();
+        void watch_client(SocketStream& client);
+        void remove_client(int fd);
+        void update_client_count();
+        void disconnect_all();
+        bool hand_over();
+
+        void run_epoll();
+        void run_uring();
+        void reap_completions();
+        void handle_completion(const struct io_uring_cqe& cqe);
+        void handle_accept(unsigned slot, const struct io_uring_cqe& cqe);
+        void handle_receive(int fd, const struct io_uring_cqe& cqe);
+        void handle_send(int fd, const struct io_uring_cqe& cqe);
+        void arm_accept(unsigned slot);
+        void arm_accept_backoff(unsigned slot);
+        void arm_notify();
+        void arm_timer_poll(int fd);
+        void arm_receive(int fd);
+        void submit_send(int fd);
+        void release_send(std::unique_ptr<UringSend>& send);
+        void close_uring_client(int fd);
+        void finish_uring_client(int fd);
+        void start_uring();
+        void stop_uring();
+        void resume_uring();
+
+        // Not copyable because the sockets are owned
+        Shard(const Shard&);
+        Shard& operator=(const Shard&);
+};
@@ -0,0 +1,21 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         ShardStats.cpp
+* Description:  Implementation file for ShardStats.hpp
+\*********************************************************/
+#include "ShardStats.hpp"
+
+#include <ctime>
+
+/**
+ * Returns the time of the monotonic clock in nanoseconds.
+ *
+ * The clock is read through the vDSO, without a system call.
+ */
+uint64_t ShardStats::now() {
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
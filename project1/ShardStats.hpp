@@ -0,0 +1,87 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         ShardStats.hpp
+* Description:  Defines the counters and latency histograms that
+*               each shard keeps about the work it does.
+*               Every shard has its own set and is the only thread
+*               that writes to it, so recording is a plain load and
+*               store with no locks or atomic read-modify-write
+*               instructions. Any thread can read the values at any
+*               time to report them.
+\*********************************************************/
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "LatencyHistogram.hpp"
+
+// A count that only one thread changes
+class Counter {
+    public:
+        Counter() : _value(0) {}
+
+        void add(uint64_t value = 1) {
+            _value.store(_value.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        }
+        uint64_t get() const { return _value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> _value;
+};
+
+struct ShardStats {
+    Counter accepted;           // Connections accepted
+    Counter messages_in;        // Messages received from clients
+    Counter bytes_in;           // Bytes received from clients
+    Counter messages_out;       // Messages completely sent to a client
+    Counter bytes_out;          // Bytes sent to clients
+    Counter send_eagain;        // Sends cut short by a full socket buffer
+    Counter sends;              // sendmsg calls or io_uring send requests
+
+    // Why the queued messages were sent when they were, if coalescing
+    Counter flush_light;        // At once, because traffic was light
+    Counter flush_window;       // When the coalescing window ended
+    Counter flush_full;         // When enough bytes were held back
+
+    // Clients that sent faster than the rate limit, by what was done
+    Counter rate_delayed;       // Times a client stopped being read from
+    Counter rate_dropped;       // Messages dropped
+    Counter rate_disconnects;   // Clients disconnected
+
+    // Clients that went silent
+    Counter timers_expired;     // Idle timers that went off
+    Counter heartbeats;         // Heartbeats sent
+    Counter idle_disconnects;   // Clients disconnected for being idle
+
+    // Direct messages, counted by the shard of the sender or recipient
+    Counter direct;             // Delivered to a client of this shard
+    Counter direct_unknown;     // Sent to a handle that nobody owns
+
+    // Messages whose text was checked, by what was found
+    Counter text_cleaned;       // Control characters replaced
+    Counter text_invalid;       // Dropped for not being valid UTF-8
+
+    // Latencies in nanoseconds. With io_uring, recv_time only covers
+    // copying the received data in, and send_time runs from submitting
+    // a send until it completes.
+    LatencyHistogram accept_time;   // Accepting and adding one connection,
+                                    // averaged over its batch
+    LatencyHistogram recv_time;     // Reading everything a socket has
+    LatencyHistogram route_time;    // Routing one message to its recipients
+    LatencyHistogram send_time;     // Writing a client's queue to its socket
+    LatencyHistogram queue_wait;    // From queueing a message until it is sent
+
+    // Messages already in a client's queue when another one is added
+    LatencyHistogram queue_depth;
+
+    // Messages written by each send
+    LatencyHistogram send_batch;
+
+    // How long queued messages were held back to be sent together
+    LatencyHistogram coalesce_delay;
+
+    static uint64_t now();
+};
@@ -9,10 +9,13 @@
 
 #include <unistd.h>
 #include <cerrno>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <cstddef>      // offsetof
 #include <cstring>
+#include <sys/un.h>     // sockaddr_un
 #include <exception>
 #include <stdexcept>
 
@@ -24,15 +27,23 @@
  *  queuelen   The queue size for incoming connections.
  */
 Socket::Socket(int queuelen) {
+    _sd = -1;
     _queue_len = queuelen;
     _info = nullptr;
+
+    // Keep a descriptor in reserve for rejecting connections
+    // when the process runs out of descriptors
+    _spare_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
 }
 
 /**
- * Destructor. Closes the socket and frees memory allocated for address info.
+ * Destructor. Closes the socket, removes its file if it has one,
+ * and frees memory allocated for address info.
  */
 Socket::~Socket() {
-    ::close(_sd);
+    if (_sd != -1) ::close(_sd);
+    if (!_path.empty()) ::unlink(_path.c_str());
+    if (_spare_fd != -1) ::close(_spare_fd);
     if (_info != nullptr) ::freeaddrinfo(_info);
 }
 
@@ -41,9 +52,12 @@ Socket::~Socket() {
  *
  * This function throws a runtime_error exception if any of the steps fail.
  *
- *  port   The port to listen for connections on.
+ *  port       The port to listen for connections on.
+ *  reuse_port Whether to set SO_REUSEPORT so that several sockets
+ *             (one per thread) can listen on the same port and have
+ *             the kernel distribute incoming connections between them.
  */
-void Socket::listen(const char* port) {
+void Socket::listen(const char* port, bool reuse_port) {
     struct addrinfo hints;
     struct addrinfo *current = nullptr;
     int yes = 1;
@@ -79,6 +93,13 @@ void Socket::listen(const char* port) {
             throw std::runtime_error(errmsg);
         }
 
+        // Share the port with other listening sockets if requested
+        if (reuse_port && ::setsockopt(_sd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+            errmsg = "setsockopt: ";
+            errmsg += ::strerror(errno);
+            throw std::runtime_error(errmsg);
+        }
+
         // Attempt to bind the socket to the port
         if (::bind(_sd, current->ai_addr, current->ai_addrlen) == 0) {
             break;  // Break from loop if bind was successful
@@ -104,60 +125,169 @@ void Socket::listen(const char* port) {
         errmsg += ::strerror(errno);
         throw std::runtime_error(errmsg);
     }
+
+    // Never block in accept, so every pending connection can be
+    // accepted until there are none left
+    ::fcntl(_sd, F_SETFL, ::fcntl(_sd, F_GETFL) | O_NONBLOCK);
 }
 
 /**
- * Accepts an incoming connection.
+ * Configures the socket to listen for connections on a Unix domain socket.
+ *
+ * A path that starts with '@' is an abstract name, which has no file and
+ * goes away with the socket. Otherwise a socket file left behind by an
+ * earlier run is replaced, and the file is removed when the socket closes.
  *
  * This function throws a runtime_error exception if any of the steps fail.
  *
- * Returns a SocketStream for the new connection.
+ *  path    The path of the socket file, or '@' followed by an abstract name.
  */
-SocketStream Socket::accept() {
-    int new_sd;
-    struct sockaddr_storage remote_addr;
-    socklen_t sin_size = sizeof(remote_addr);
+void Socket::listen_unix(const std::string& path) {
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() < 2 || path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("unix socket: invalid path: " + path);
 
-    new_sd = ::accept(_sd, reinterpret_cast<struct sockaddr*>(&remote_addr), &sin_size);
-    if (new_sd < 0) {
-        std::string errmsg("accept: ");
-        errmsg += ::strerror(errno);
+    // An abstract name starts with a null byte and is not null-terminated
+    bool abstract = path[0] == '@';
+    std::memcpy(addr.sun_path, path.data(), path.size());
+    socklen_t len = sizeof(addr);
+    if (abstract) {
+        addr.sun_path[0] = '\0';
+        len = offsetof(struct sockaddr_un, sun_path) + path.size();
+    }
+
+    _sd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (_sd == -1)
+        throw std::runtime_error(std::string("socket: ") + ::strerror(errno));
+
+    if (!abstract)
+        ::unlink(path.c_str());
+    if (::bind(_sd, reinterpret_cast<struct sockaddr*>(&addr), len) == -1
+        || ::listen(_sd, _queue_len) == -1) {
+        std::string errmsg("unix socket: ");
+        errmsg += path + ": " + ::strerror(errno);
+        ::close(_sd);
+        _sd = -1;
         throw std::runtime_error(errmsg);
     }
+    if (!abstract)
+        _path = path;
+}
 
-    // Get the remote IP and port information
-    std::string host, port;
-    get_remote_addr(reinterpret_cast<struct sockaddr*>(&remote_addr), host, port);
+/**
+ * Takes over a socket that is already listening, such as one passed
+ * from the server that this one replaced. The socket is made
+ * non-blocking, and its file, if any, is left in place when it closes.
+ *
+ *  sd      The listening socket descriptor. It is owned by this object.
+ */
+void Socket::inherit(int sd) {
+    _sd = sd;
+    ::fcntl(_sd, F_SETFL, ::fcntl(_sd, F_GETFL) | O_NONBLOCK);
+}
 
-    return SocketStream(new_sd, host, port);
+/**
+ * Gives up the socket without closing it or removing its file, so that
+ * it keeps listening after it was passed to another process.
+ *
+ * Returns the listening socket descriptor, or -1 if there is none.
+ */
+int Socket::release() {
+    int sd = _sd;
+    _sd = -1;
+    _path.clear();
+    return sd;
 }
 
 /**
- * Gets the remote host IP address and port.
+ * Accepts every pending connection.
+ *
+ * Each connection is accepted with accept4, which makes it non-blocking
+ * and close-on-exec in the same call, until the listen queue is empty.
+ *
+ * If the process is out of descriptors, one pending connection is
+ * rejected so that it does not stay in the queue and wake up the
+ * event loop again and again, and an exception is thrown.
  *
- * This function extracts the information for both IPv4 and IPv6 connections.
+ * This function throws a runtime_error exception if any of the steps fail.
+ * Connections accepted before the failure are still added to streams.
+ *
+ *  streams The vector to append a SocketStream to for each connection.
  *
- *  sa      The sockaddr struct to parse for the information.
- *  host    The string to store the IP address.
- *  port    The string to store the port number.
+ * Returns the number of connections accepted.
  */
-void Socket::get_remote_addr(struct sockaddr* sa, std::string& host, std::string& port) {
-    char s[INET6_ADDRSTRLEN]; // temp storage buffer for IP address
-    void* in_addr = nullptr;
-
-    // IPv4 connection
-    if (sa->sa_family == AF_INET) {
-        struct sockaddr_in* addr = reinterpret_cast<struct sockaddr_in*>(sa);
-        in_addr = reinterpret_cast<void*>(&addr->sin_addr);
-        port.assign(std::to_string(ntohs(addr->sin_port)));
+size_t Socket::accept_all(std::vector<SocketStream>& streams) {
+    size_t count = 0;
+    while (true) {
+        struct sockaddr_storage remote_addr;
+        socklen_t addr_size = sizeof(remote_addr);
+        int new_sd = ::accept4(_sd, reinterpret_cast<struct sockaddr*>(&remote_addr),
+            &addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_sd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;      // No more pending connections
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;   // Try the next one
+
+            std::string errmsg("accept: ");
+            errmsg += ::strerror(errno);
+            if (errno == EMFILE || errno == ENFILE)
+                reject_one();
+            throw std::runtime_error(errmsg);
+        }
+
+        streams.push_back(SocketStream(new_sd, reinterpret_cast<struct sockaddr*>(&remote_addr), true));
+        ++count;
     }
-    // IPv6 connection
-    else {
-        struct sockaddr_in6* addr = reinterpret_cast<struct sockaddr_in6*>(sa);
-        in_addr = reinterpret_cast<void*>(&addr->sin6_addr);
-        port.assign(std::to_string(ntohs(addr->sin6_port)));
+    return count;
+}
+
+/**
+ * Accepts one pending connection and closes it right away, using
+ * the spare descriptor to make room for it. This is how a connection
+ * is turned away when the process is out of descriptors, instead of
+ * leaving it queued to fail again.
+ *
+ * Returns true if a connection was turned away, or false if none was
+ * pending or there was no spare descriptor to use.
+ */
+bool Socket::reject_one() {
+    if (_spare_fd == -1) {
+        _spare_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+        return false;
+    }
+    ::close(_spare_fd);
+    int sd = ::accept(_sd, nullptr, nullptr);
+    if (sd != -1)
+        ::close(sd);
+    _spare_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return sd != -1;
+}
+
+/**
+ * Wraps a connection that was accepted some other way, such as one
+ * handed over by the server this one replaced, and looks up the
+ * remote address.
+ *
+ * This function throws a runtime_error exception if the address
+ * cannot be determined.
+ *
+ *  sd          The connected socket descriptor. It is owned by the new stream.
+ *  nonblocking Whether the socket is already non-blocking.
+ *
+ * Returns a SocketStream object for the connection.
+ */
+SocketStream Socket::adopt(int sd, bool nonblocking) {
+    struct sockaddr_storage remote_addr;
+    socklen_t addr_size = sizeof(remote_addr);
+    if (::getpeername(sd, reinterpret_cast<struct sockaddr*>(&remote_addr), &addr_size) == -1) {
+        std::string errmsg("getpeername: ");
+        errmsg += ::strerror(errno);
+        ::close(sd);
+        throw std::runtime_error(errmsg);
     }
 
-    ::inet_ntop(sa->sa_family, in_addr, s, sizeof(s));
-    host.assign(s);
+    return SocketStream(sd, reinterpret_cast<struct sockaddr*>(&remote_addr), nonblocking);
 }
@@ -7,16 +7,22 @@
 *               a socket before a connection is established.
 *               This class is intended for use by a server and
 *               only accepts incoming connections.
+*               The listening socket is non-blocking, so every pending
+*               connection can be accepted in one batch.
+*               A socket listens either on a TCP port or on a Unix
+*               domain socket, which can be a file or, if its name
+*               starts with '@', an abstract name that has no file.
 \*********************************************************/
 #pragma once
 
 #include <string>
+#include <vector>
 #include <sys/types.h>
 #include <sys/socket.h> /* SOCK_STREAM */
 
-// Define a maximum connection queue of 10 unless defined elsewhere
+// Define the system's maximum connection queue unless defined elsewhere
 #ifndef SOCKET_CONNECTION_QUEUE
-#define SOCKET_CONNECTION_QUEUE 10
+#define SOCKET_CONNECTION_QUEUE SOMAXCONN
 #endif
 
 // Forward declaration
@@ -27,13 +33,20 @@ class Socket {
         Socket(int queuelen = SOCKET_CONNECTION_QUEUE);
         ~Socket();
 
-        void listen(const char* port);
-        SocketStream accept();
+        void listen(const char* port, bool reuse_port = false);
+        void listen_unix(const std::string& path);
+        size_t accept_all(std::vector<SocketStream>& streams);
+        static SocketStream adopt(int sd, bool nonblocking = false);
+        void inherit(int sd);
+        int release();
+        bool reject_one();
+
+        int get_descriptor() { return _sd; }
 
     private:
         int _sd;                // Underlying socket descriptor
         int _queue_len;         // Max incoming connections to queue
         struct addrinfo* _info; // Used for address info lookup
-
-        void get_remote_addr(struct sockaddr*, std::string&, std::string&);
+        int _spare_fd;          // Closed to make room when out of descriptors
+        std::string _path;      // Socket file to remove when closed, if any
 };
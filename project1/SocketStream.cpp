@@ -7,69 +7,426 @@
 \*********************************************************/
 #include "SocketStream.hpp"
 
+#include <algorithm>
 #include <iostream>
+#include <arpa/inet.h> // inet_ntop, ntohl
 #include <cerrno>
+#include <cstdint>
 #include <cstring>
 #include <fcntl.h>
+#include <netinet/tcp.h>  // TCP_NODELAY
 #include <sys/types.h>
-#include <sys/socket.h> // recv, send
+#include <sys/socket.h> // sendmsg
+#include <sys/uio.h>    // iovec, readv
 #include <unistd.h>     // close
 #include <exception>
 #include <stdexcept>
 
-// Define buffer size of 500 + 1 for null terminator
-#define BUFFER_SIZE 501
+/**
+ * Finds a UTF-8 character at the end of some text that was cut short,
+ * such as one whose bytes arrived in two reads.
+ *
+ *  tail    The last bytes of the text.
+ *  size    The number of bytes in tail, at most 3.
+ *
+ * Returns the number of bytes of the incomplete character, or 0 if the
+ * text ends with a complete character or with bytes that cannot start
+ * a valid one.
+ */
+static size_t incomplete_utf8(const unsigned char* tail, size_t size) {
+    for (size_t i = size; i > 0; --i) {
+        unsigned char c = tail[i - 1];
+        if ((c & 0xC0) == 0x80)
+            continue;   // Continuation byte; keep looking for the lead byte
+
+        size_t need = 0;
+        if (c >= 0xC2 && c <= 0xDF)
+            need = 2;
+        else if (c >= 0xE0 && c <= 0xEF)
+            need = 3;
+        else if (c >= 0xF0 && c <= 0xF4)
+            need = 4;
+        size_t have = size - i + 1;
+        return have < need ? have : 0;
+    }
+    return 0;
+}
 
 /**
- * Constructor. Sets the underlying socket descriptor and it to non-blocking.
+ * Constructor. Sets the underlying socket descriptor and it to non-blocking,
+ * and turns off Nagle's algorithm.
  *
- *  sock_desc   The socket descriptor to use.
- *  hostname    The hostname of the connected client.
- *  port        The port number of the connected client.
+ *  sd          The socket descriptor to use.
+ *  addr        The address of the connected client (IPv4, IPv6 or Unix).
+ *  nonblocking Whether the socket was already made non-blocking,
+ *              such as by accept4, which saves a system call.
  */
-SocketStream::SocketStream(int sock_desc, std::string hostname, std::string port) {
-    _sd = sock_desc;
-    _hostname = hostname;
-    _port = port;
+SocketStream::SocketStream(int sd, const struct sockaddr* addr, bool nonblocking) {
+    _sd = sd;
+    std::memset(&_peer, 0, sizeof(_peer));
+    _peer.family = addr->sa_family;
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in* in = reinterpret_cast<const struct sockaddr_in*>(addr);
+        _peer.port = in->sin_port;
+        std::memcpy(_peer.addr, &in->sin_addr, sizeof(in->sin_addr));
+    }
+    else if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6* in6 = reinterpret_cast<const struct sockaddr_in6*>(addr);
+        _peer.port = in6->sin6_port;
+        std::memcpy(_peer.addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+    }
+    _outbox_head = 0;
+    _outbox_count = 0;
+    _outbox_offset = 0;
+    _outbox_bytes = 0;
+    _outbox_inflight = 0;
+    _framed = false;
+    _drained = false;
+    _throttled = false;
+    _pinged = false;
+    _named = false;
+    _stats = nullptr;
 
     // Set socket to be non-blocking for receives
-    fcntl(_sd, F_SETFL, O_NONBLOCK);
+    if (!nonblocking)
+        fcntl(_sd, F_SETFL, O_NONBLOCK);
+
+    // Queued messages are already gathered into as few sends as possible,
+    // so Nagle's algorithm would only delay them waiting for an ACK
+    if (addr->sa_family == AF_INET || addr->sa_family == AF_INET6) {
+        int on = 1;
+        ::setsockopt(_sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+}
+
+/**
+ * Adds a message to the end of the outgoing queue, subject to a limit.
+ *
+ * The message is not copied; the queue holds a reference to it.
+ * Nothing is sent until flush is called.
+ *
+ * If the message would push the queued bytes over the limit,
+ * the limit's policy decides what happens:
+ * - DROP_OLDEST drops queued messages that have not started sending,
+ *   oldest first, until the new message fits, and returns QUEUE_DROPPED.
+ *   If the messages that are being sent leave no room for it, the new
+ *   message is dropped instead and QUEUE_REJECTED is returned.
+ *   Either way the queue stays within the limit.
+ * - DROP_NEWEST drops the new message and returns QUEUE_REJECTED.
+ * - DISCONNECT leaves the queue alone and returns QUEUE_OVERFLOW
+ *   so the caller can disconnect the client.
+ * An empty queue always accepts a message, so a message larger than
+ * the limit can still be delivered on its own.
+ *
+ *  msg         The message to send.
+ *  limit       The maximum queued bytes and overflow policy.
+ *  dropped     Set to the number of messages dropped by this call.
+ *  queued_at   The current time from ShardStats::now, used to measure
+ *              how long the message waits in the queue.
+ *
+ * Returns the result of queueing the message. If it is QUEUE_FIRST,
+ * the caller is responsible for making sure flush is called.
+ */
+QueueResult SocketStream::queue(const MessagePtr& msg, const OutboxLimit& limit, size_t& dropped,
+    uint64_t queued_at) {
+    dropped = 0;
+    if (_stats != nullptr)
+        _stats->queue_depth.record(_outbox_count);
+
+    if (_outbox_count == 0) {
+        push_back(msg, queued_at);
+        return QUEUE_FIRST;
+    }
+
+    if (limit.max_bytes == 0 || _outbox_bytes + wire_size(msg) <= limit.max_bytes) {
+        push_back(msg, queued_at);
+        return QUEUE_APPENDED;
+    }
+
+    switch (limit.policy) {
+    case DROP_OLDEST:
+        if (get_kept_bytes() + wire_size(msg) > limit.max_bytes) {
+            // Dropping every message that may be dropped would not help
+            dropped = 1;
+            return QUEUE_REJECTED;
+        }
+        while (_outbox_bytes + wire_size(msg) > limit.max_bytes) {
+            drop_oldest();
+            ++dropped;
+        }
+        push_back(msg, queued_at);
+        return QUEUE_DROPPED;
+    case DROP_NEWEST:
+        dropped = 1;
+        return QUEUE_REJECTED;
+    default:
+        return QUEUE_OVERFLOW;
+    }
+}
+
+/**
+ * Appends a message to the ring buffer, growing it if it is full.
+ *
+ *  msg         The message to append.
+ *  queued_at   When the message was queued.
+ */
+void SocketStream::push_back(const MessagePtr& msg, uint64_t queued_at) {
+    // Double the ring buffer when it is full, keeping messages in order
+    if (_outbox_count == _outbox.size()) {
+        size_t size = _outbox.empty() ? SOCKETSTREAM_OUTBOX_SIZE : _outbox.size() * 2;
+        std::vector<MessagePtr, PoolAllocator<MessagePtr> > bigger(size);
+        std::vector<uint64_t, PoolAllocator<uint64_t> > bigger_times(size);
+        for (size_t i = 0; i < _outbox_count; ++i) {
+            size_t index = (_outbox_head + i) & (_outbox.size() - 1);
+            bigger[i] = std::move(_outbox[index]);
+            bigger_times[i] = _outbox_times[index];
+        }
+        _outbox.swap(bigger);
+        _outbox_times.swap(bigger_times);
+        _outbox_head = 0;
+    }
+
+    size_t tail = (_outbox_head + _outbox_count) & (_outbox.size() - 1);
+    _outbox[tail] = msg;
+    _outbox_times[tail] = queued_at;
+    _outbox_bytes += wire_size(msg);
+    ++_outbox_count;
+}
+
+/**
+ * Removes the oldest queued message that has not started sending.
+ *
+ * Messages that are partly sent or are part of a send that is still
+ * in progress must be finished to keep the stream intact, so the first
+ * message after them is removed instead.
+ *
+ * Returns the number of messages removed (0 or 1).
+ */
+size_t SocketStream::drop_oldest() {
+    size_t mask = _outbox.size() - 1;
+    size_t keep = get_kept_count();
+    if (keep >= _outbox_count)
+        return 0;
+
+    size_t victim = (_outbox_head + keep) & mask;
+    _outbox_bytes -= wire_size(_outbox[victim]);
+
+    // Shift the protected messages back into the dropped message's slot
+    for (size_t i = keep; i > 0; --i) {
+        _outbox[(_outbox_head + i) & mask] =
+            std::move(_outbox[(_outbox_head + i - 1) & mask]);
+        _outbox_times[(_outbox_head + i) & mask] = _outbox_times[(_outbox_head + i - 1) & mask];
+    }
+    _outbox[_outbox_head] = MessagePtr();
+
+    _outbox_head = (_outbox_head + 1) & mask;
+    --_outbox_count;
+    return 1;
+}
+
+/**
+ * Returns the number of messages at the front of the outgoing queue
+ * that must not be dropped, because they are partly sent or are part
+ * of a send that is still in progress.
+ */
+size_t SocketStream::get_kept_count() const {
+    size_t keep = _outbox_inflight;
+    if (keep == 0 && _outbox_offset > 0)
+        keep = 1;
+    return std::min(keep, _outbox_count);
+}
+
+/**
+ * Returns the bytes of the messages that must not be dropped that
+ * are not sent yet.
+ */
+size_t SocketStream::get_kept_bytes() const {
+    size_t mask = _outbox.size() - 1;
+    size_t keep = get_kept_count();
+    size_t bytes = 0;
+    for (size_t i = 0; i < keep; ++i)
+        bytes += wire_size(_outbox[(_outbox_head + i) & mask]);
+    return keep > 0 ? bytes - _outbox_offset : 0;
+}
+
+/**
+ * Describes the front of the outgoing queue as iovec entries for a send.
+ *
+ * The described messages are marked as in progress, so they are not
+ * dropped until complete_send is called, even if the queue overflows.
+ * This allows the send to be performed asynchronously.
+ *
+ *  iov     An array to fill in.
+ *  max     The number of entries in the array.
+ *
+ * Returns the number of entries filled in (0 if the queue is empty).
+ */
+size_t SocketStream::prepare_send(struct iovec* iov, size_t max) {
+    size_t mask = _outbox.size() - 1;
+    size_t count = 0;
+
+    // Gather the queued messages, skipping what was already sent
+    while (count < _outbox_count && count < max) {
+        const MessagePtr& msg = _outbox[(_outbox_head + count) & mask];
+        size_t skip = (count == 0) ? _outbox_offset : 0;
+        iov[count].iov_base = const_cast<char*>(wire_data(msg) + skip);
+        iov[count].iov_len = wire_size(msg) - skip;
+        ++count;
+    }
+
+    _outbox_inflight = count;
+    return count;
+}
+
+/**
+ * Removes the data that was sent from the front of the outgoing queue.
+ *
+ * Every message that was completely sent is released; if the last one
+ * was only partly sent, the rest of it stays at the front of the queue.
+ * If the stream has statistics, the time each released message spent
+ * in the queue is recorded.
+ *
+ *  bytes   The number of bytes that were sent.
+ */
+void SocketStream::complete_send(size_t bytes) {
+    size_t mask = _outbox.size() - 1;
+    uint64_t now = 0;
+    _outbox_inflight = 0;
+    if (_stats != nullptr && bytes > 0) {
+        _stats->bytes_out.add(bytes);
+        now = ShardStats::now();
+    }
+
+    // Release every message that was completely sent
+    while (_outbox_count > 0) {
+        MessagePtr& msg = _outbox[_outbox_head];
+        size_t remaining = wire_size(msg) - _outbox_offset;
+        if (bytes < remaining) {
+            _outbox_offset += bytes;
+            _outbox_bytes -= bytes;
+            break;
+        }
+        bytes -= remaining;
+        _outbox_bytes -= remaining;
+        if (now != 0) {
+            _stats->messages_out.add();
+            _stats->queue_wait.record(now - _outbox_times[_outbox_head]);
+        }
+        msg = MessagePtr();
+        _outbox_head = (_outbox_head + 1) & mask;
+        _outbox_offset = 0;
+        --_outbox_count;
+    }
+
+    // Give back the memory of a queue that grew during a burst, so that
+    // a client that goes idle afterwards only costs its initial queue
+    if (_outbox_count == 0 && _outbox.size() > SOCKETSTREAM_OUTBOX_SIZE) {
+        std::vector<MessagePtr, PoolAllocator<MessagePtr> >().swap(_outbox);
+        std::vector<uint64_t, PoolAllocator<uint64_t> >().swap(_outbox_times);
+        _outbox_head = 0;
+    }
+}
+
+/**
+ * Moves every queued message out of the outgoing queue.
+ *
+ * This is used when a connection is closed while an asynchronous send
+ * is still in progress, so that the data being sent stays allocated
+ * until the send completes.
+ *
+ *  messages    The vector to append the messages to.
+ */
+void SocketStream::take_outbox(std::vector<MessagePtr>& messages) {
+    size_t mask = _outbox.size() - 1;
+    while (_outbox_count > 0) {
+        messages.push_back(std::move(_outbox[_outbox_head]));
+        _outbox_head = (_outbox_head + 1) & mask;
+        --_outbox_count;
+    }
+    _outbox_offset = 0;
+    _outbox_bytes = 0;
+    _outbox_inflight = 0;
 }
 
 /**
- * Sends the specified data to the connected host.
+ * Copies every queued message, leaving the outgoing queue as it is.
  *
- * This function continues to send until all data has been sent
- * or the socket is closed.
+ *  messages    The vector to append the messages to.
+ */
+void SocketStream::copy_outbox(std::vector<MessagePtr>& messages) const {
+    size_t mask = _outbox.size() - 1;
+    for (size_t i = 0; i < _outbox_count; ++i)
+        messages.push_back(_outbox[(_outbox_head + i) & mask]);
+}
+
+/**
+ * Sends as much of the outgoing queue as the socket will accept.
+ *
+ * Up to SOCKETSTREAM_MAX_IOV queued messages are gathered into
+ * a single sendmsg call. This function keeps sending until the queue
+ * is empty or the socket buffer is full, so it never blocks.
+ * Any unsent data stays queued for the next call.
+ * Every call but the last passes MSG_MORE, which corks the socket
+ * like TCP_CORK for that call only, so a queue that takes several
+ * calls still goes out in full-sized segments.
  *
- *  data    The data to send over the socket.
+ * This function throws a runtime_error exception if an unexpected
+ * error occurs.
  *
  * Returns whether the socket is still open.
  */
-bool SocketStream::send(std::string data) {
-    ssize_t bytes;
+bool SocketStream::flush() {
+    struct iovec iov[SOCKETSTREAM_MAX_IOV];
+    struct msghdr hdr;
+    std::memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = iov;
 
-    // Send until there is nothing left to send
-    while (!data.empty()) {
-        bytes = ::send(_sd, data.c_str(), data.size(), 0);
-        if (bytes == 0) {
-            // Socket was closed, return false
-            return false;
-        } else if (bytes == -1) {
+    while (_outbox_count > 0) {
+        size_t count = prepare_send(iov, SOCKETSTREAM_MAX_IOV);
+        size_t total = 0;
+        for (size_t i = 0; i < count; ++i)
+            total += iov[i].iov_len;
+        hdr.msg_iovlen = count;
+        if (_stats != nullptr) {
+            _stats->sends.add();
+            _stats->send_batch.record(count);
+        }
+
+        // MSG_NOSIGNAL returns EPIPE instead of raising SIGPIPE
+        int flags = MSG_NOSIGNAL | (count < _outbox_count ? MSG_MORE : 0);
+        ssize_t bytes = ::sendmsg(_sd, &hdr, flags);
+        if (bytes == -1) {
+            complete_send(0);
             if (errno == EINTR) {
                 // Keep sending if interrupted by signal
                 continue;
             }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Socket buffer is full; send the rest later
+                if (_stats != nullptr)
+                    _stats->send_eagain.add();
+                break;
+            }
+            else if (errno == EPIPE || errno == ECONNRESET) {
+                // Socket was closed, return false
+                return false;
+            }
             else {
-                // Some non-interrupt error occurred. Throw exception.
-                std::string errmsg("send: ");
+                // Some other error occurred. Throw exception.
+                std::string errmsg("sendmsg: ");
                 errmsg += ::strerror(errno);
                 throw std::runtime_error(errmsg);
             }
         }
 
-        // Remove the sent characters
-        data = data.substr(bytes);
+        complete_send(bytes);
+
+        // A short write means the socket buffer is full
+        if (static_cast<size_t>(bytes) < total) {
+            if (_stats != nullptr)
+                _stats->send_eagain.add();
+            break;
+        }
     }
 
     // Return true if socket is still open
@@ -79,24 +436,42 @@ bool SocketStream::send(std::string data) {
 /**
  * Receives any data available from the connected host.
  *
- * This function receives whatever data is available without blocking.
- * If no data is available, buffer is set to an empty string
- * and the function returns true.
+ * This function reads into the connection's ring buffer with readv,
+ * filling all of its free space (both halves if it wraps) in one call.
+ * It stops when a read comes back short, which means the socket has
+ * been drained, or when the buffer is full. In the latter case the
+ * rest is read on the next call, after the buffered messages have been
+ * returned by next_message.
+ *
+ * Afterwards, is_drained tells whether the socket was emptied, so a
+ * caller that waits for edge-triggered events knows whether to read
+ * again before waiting.
  *
- *  buffer  A string buffer to store the received data.
+ * This function throws a runtime_error exception if an unexpected
+ * error occurs.
  *
  * Returns whether the socket is still open.
  */
-bool SocketStream::recv(std::string& buffer) {
+bool SocketStream::receive() {
+    struct iovec iov[2];
     ssize_t bytes;
-    char buf[BUFFER_SIZE];
-    buffer.clear();
 
-    /* Keep trying until all data is received */
+    _drained = false;
+
+    // The buffer is allocated on first use and reused afterwards
+    _inbuf.reserve(SOCKETSTREAM_RING_SIZE);
+
+    /* Keep trying until all data is received or the buffer is full */
     while (true) {
-        bytes = ::recv(_sd, buf, BUFFER_SIZE - 1, 0);
+        int count = _inbuf.prepare(iov);
+        if (count == 0)
+            break;
+        size_t requested = iov[0].iov_len + (count == 2 ? iov[1].iov_len : 0);
+
+        bytes = ::readv(_sd, iov, count);
         // Socket was closed, return false
         if (bytes == 0) {
+            _drained = true;
             return false;
         } else if (bytes == -1) {
             if (errno == EINTR) {
@@ -105,6 +480,7 @@ bool SocketStream::recv(std::string& buffer) {
             }
             else if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // No more data to receive
+                _drained = true;
                 break;
             }
             /* otherwise, throw exception */
@@ -114,14 +490,187 @@ bool SocketStream::recv(std::string& buffer) {
                 throw std::runtime_error(errmsg);
             }
         }
-        buf[bytes] = '\0';
-        buffer += buf;
+        _inbuf.commit(bytes);
+        if (_stats != nullptr)
+            _stats->bytes_in.add(bytes);
+
+        // A short read means there is nothing more to read right now
+        if (static_cast<size_t>(bytes) < requested) {
+            _drained = true;
+            break;
+        }
     }
 
     // Return true if socket is still open
     return true;
 }
 
+/**
+ * Appends data that was received on this connection by someone else,
+ * such as an io_uring completion, to the input buffer.
+ *
+ *  data    The received data.
+ *  size    The number of bytes received.
+ */
+void SocketStream::feed(const char* data, size_t size) {
+    struct iovec iov[2];
+
+    _inbuf.reserve(std::max<size_t>(SOCKETSTREAM_RING_SIZE, _inbuf.size() + size));
+    int count = _inbuf.prepare(iov);
+    size_t first = std::min(size, iov[0].iov_len);
+    std::memcpy(iov[0].iov_base, data, first);
+    if (first < size && count == 2)
+        std::memcpy(iov[1].iov_base, data + first, size - first);
+    _inbuf.commit(size);
+    if (_stats != nullptr)
+        _stats->bytes_in.add(size);
+}
+
+/**
+ * Gets the next complete message from the input buffer.
+ *
+ * In framed mode, this returns the payload of the next frame once all
+ * of it has been received; partial frames stay buffered, and the buffer
+ * is grown so that the rest of the frame fits in it.
+ * In text mode, there are no message boundaries, so this returns
+ * everything that has been received, except for a UTF-8 character
+ * whose last bytes have not arrived yet. That one stays buffered, so
+ * that each message only has whole characters.
+ *
+ * The message is a view into the input buffer, not a copy.
+ * It is valid until the next call to receive.
+ *
+ * This function throws a runtime_error exception if a frame is longer
+ * than SOCKETSTREAM_MAX_FRAME bytes.
+ *
+ *  message     Set to a view of the message.
+ *
+ * Returns whether a message was available.
+ */
+bool SocketStream::next_message(RingView& message) {
+    size_t available = _inbuf.size();
+
+    if (!_framed) {
+        if (available == 0)
+            return false;
+        unsigned char tail[3];
+        size_t tail_size = std::min<size_t>(sizeof(tail), available);
+        _inbuf.peek(available - tail_size, tail_size).copy_to(reinterpret_cast<char*>(tail));
+        size_t complete = available - incomplete_utf8(tail, tail_size);
+        if (complete == 0)
+            return false;
+        message = _inbuf.peek(0, complete);
+        _inbuf.consume(complete);
+        return true;
+    }
+
+    // Wait for the length prefix
+    if (available < MESSAGE_HEADER_SIZE)
+        return false;
+
+    uint32_t len;
+    _inbuf.peek(0, MESSAGE_HEADER_SIZE).copy_to(reinterpret_cast<char*>(&len));
+    len = ntohl(len);
+    if (len > SOCKETSTREAM_MAX_FRAME)
+        throw std::runtime_error("recv: frame too large");
+
+    // Wait for the rest of the frame, making sure there is room for it
+    if (available < MESSAGE_HEADER_SIZE + len) {
+        _inbuf.reserve(MESSAGE_HEADER_SIZE + len);
+        return false;
+    }
+
+    // Consuming only moves the read position, so the view stays valid
+    message = _inbuf.peek(MESSAGE_HEADER_SIZE, len);
+    _inbuf.consume(MESSAGE_HEADER_SIZE + len);
+    return true;
+}
+
+/**
+ * Gets everything in the input buffer that was not returned by
+ * next_message yet, such as the start of a frame. The data stays
+ * in the buffer.
+ *
+ * Returns a copy of the data.
+ */
+std::string SocketStream::get_input() const {
+    return _inbuf.peek(0, _inbuf.size()).to_string();
+}
+
+/**
+ * Frees the input buffer if it holds no partial message.
+ *
+ * This is called once everything received has been routed, so a
+ * connection that is not sending anything does not keep a buffer.
+ * The next call to receive allocates it again.
+ */
+void SocketStream::release_idle() {
+    _inbuf.release();
+}
+
+/**
+ * Formats the IP address of the connected client.
+ * Clients on a Unix domain socket have no address and are shown as "unix".
+ *
+ * Returns the address as text, or an empty string if it is unknown.
+ */
+std::string SocketStream::get_hostname() const {
+    if (_peer.family == AF_UNIX)
+        return "unix";
+    char text[INET6_ADDRSTRLEN];
+    if (::inet_ntop(_peer.family, _peer.addr, text, sizeof(text)) == nullptr)
+        return std::string();
+    return text;
+}
+
+/**
+ * Formats the port number of the connected client.
+ * Clients on a Unix domain socket have no port, so the socket
+ * descriptor is shown instead to tell them apart.
+ *
+ * Returns the port number as text.
+ */
+std::string SocketStream::get_port() const {
+    if (_peer.family == AF_UNIX)
+        return std::to_string(_sd);
+    return std::to_string(ntohs(_peer.port));
+}
+
+/**
+ * Returns whether the client may send another message, which is
+ * when both of its buckets have at least one token left.
+ *
+ *  limit   The limits on the client.
+ *  now     The time on the ShardStats::now clock.
+ */
+bool SocketStream::within_rate(const RateLimit& limit, uint64_t now) const {
+    return _message_tokens.has_tokens(limit.messages, now)
+        && _byte_tokens.has_tokens(limit.bytes, now);
+}
+
+/**
+ * Takes the tokens for a received message out of the client's buckets.
+ *
+ *  limit   The limits on the client.
+ *  now     The time on the ShardStats::now clock.
+ *  bytes   The size of the message.
+ */
+void SocketStream::charge_rate(const RateLimit& limit, uint64_t now, size_t bytes) {
+    _message_tokens.take(limit.messages, now, 1);
+    _byte_tokens.take(limit.bytes, now, bytes);
+}
+
+/**
+ * Returns the time on the ShardStats::now clock at which the client
+ * may send again, which is in the past if it may send already.
+ *
+ *  limit   The limits on the client.
+ */
+uint64_t SocketStream::get_rate_ready_time(const RateLimit& limit) const {
+    return std::max(_message_tokens.get_ready_time(limit.messages),
+        _byte_tokens.get_ready_time(limit.bytes));
+}
+
 /**
  * Closes the socket.
  *
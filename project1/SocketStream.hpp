@@ -5,24 +5,169 @@
 * File:         SocketStream.hpp
 * Description:  Defines the class used for interacting with
 *               a socket after a connection is established.
+*               Outgoing messages are queued by reference and
+*               written with a single sendmsg call per flush.
+*               The queue can be bounded, with a policy that decides
+*               what happens when a slow client falls too far behind.
+*               In framed mode every message is preceded by its length
+*               as a 4-byte big-endian integer; in text mode the data
+*               is sent and received as is.
+*               Received data is read into a reusable ring buffer and
+*               messages are returned as views into it.
+*               The ring buffer and the outgoing queue both take their
+*               storage from the buffer pool.
+*               If the stream is given a shard's statistics, it counts
+*               the bytes and messages it moves and how long each
+*               message waited in the outgoing queue.
+*               The remote address is kept in binary form and only
+*               formatted when it is displayed, so that an idle
+*               connection takes as little memory as possible.
+*               Each stream also holds the token buckets that limit
+*               how fast its client may send, and the handle that
+*               direct messages to its client are addressed to.
 \*********************************************************/
 #pragma once
 
+#include <cstdint>
 #include <string>
+#include <vector>
+#include <sys/socket.h> // sockaddr
+#include <sys/uio.h>    // iovec
+
+#include "BufferPool.hpp"
+#include "Message.hpp"
+#include "RingBuffer.hpp"
+#include "ShardStats.hpp"
+#include "TokenBucket.hpp"
+
+// Define a maximum of 64 messages per sendmsg call unless defined elsewhere
+#ifndef SOCKETSTREAM_MAX_IOV
+#define SOCKETSTREAM_MAX_IOV 64
+#endif
+
+// Define a maximum incoming frame of 1 MiB unless defined elsewhere
+#ifndef SOCKETSTREAM_MAX_FRAME
+#define SOCKETSTREAM_MAX_FRAME 1048576
+#endif
+
+// Define an initial outgoing queue of 8 messages unless defined elsewhere.
+// A queue that grew past this during a burst is freed once it empties.
+#ifndef SOCKETSTREAM_OUTBOX_SIZE
+#define SOCKETSTREAM_OUTBOX_SIZE 8
+#endif
+
+// Define an initial receive buffer of 16 KiB unless defined elsewhere
+#ifndef SOCKETSTREAM_RING_SIZE
+#define SOCKETSTREAM_RING_SIZE 16384
+#endif
+
+// What to do when a message would push a client's queue over its limit
+enum OverflowPolicy {
+    DROP_OLDEST,    // Drop the oldest messages that have not started sending
+    DROP_NEWEST,    // Drop the message being queued
+    DISCONNECT      // Disconnect the client
+};
+
+// The limit on the number of bytes waiting in a client's outgoing queue
+struct OutboxLimit {
+    size_t max_bytes;           // Maximum queued bytes, or 0 for no limit
+    OverflowPolicy policy;      // Action to take when the limit is reached
+};
+
+// The result of adding a message to an outgoing queue
+enum QueueResult {
+    QUEUE_APPENDED,     // Queued behind other messages
+    QUEUE_FIRST,        // Queued and the queue was empty, so it needs a flush
+    QUEUE_DROPPED,      // Queued after dropping older messages (DROP_OLDEST)
+    QUEUE_REJECTED,     // Queue was full, so the new message was dropped
+    QUEUE_OVERFLOW      // Queue was full and the policy is DISCONNECT
+};
+
+// The address of the remote end of a connection, in binary form
+struct PeerAddress {
+    uint16_t family;            // AF_INET, AF_INET6 or AF_UNIX
+    uint16_t port;              // Port number in network byte order
+    unsigned char addr[16];     // Address; IPv4 only uses the first 4 bytes
+};
 
 class SocketStream {
     public:
-        SocketStream(int, std::string, std::string);
+        SocketStream(int sd, const struct sockaddr* addr, bool nonblocking = false);
 
-        bool send(std::string data);
-        bool recv(std::string& buffer);
+        QueueResult queue(const MessagePtr& msg, const OutboxLimit& limit, size_t& dropped,
+            uint64_t queued_at);
+        bool flush();
+        size_t prepare_send(struct iovec* iov, size_t max);
+        void complete_send(size_t bytes);
+        void take_outbox(std::vector<MessagePtr>& messages);
+        void copy_outbox(std::vector<MessagePtr>& messages) const;
+        bool has_pending() const { return _outbox_count > 0; }
+        size_t get_pending_bytes() const { return _outbox_bytes; }
+        size_t get_pending_messages() const { return _outbox_count; }
+        size_t get_sent_offset() const { return _outbox_offset; }
+        bool receive();
+        bool is_drained() const { return _drained; }
+        void feed(const char* data, size_t size);
+        std::string get_input() const;
+        bool next_message(RingView& message);
+        void release_idle();
         void close();
 
-        std::string get_hostname() { return _hostname; }
-        std::string get_port() { return _port; }
+        void set_framed(bool framed) { _framed = framed; }
+        bool is_framed() const { return _framed; }
+        void set_stats(ShardStats* stats) { _stats = stats; }
+
+        bool within_rate(const RateLimit& limit, uint64_t now) const;
+        void charge_rate(const RateLimit& limit, uint64_t now, size_t bytes);
+        uint64_t get_rate_ready_time(const RateLimit& limit) const;
+        void set_throttled(bool throttled) { _throttled = throttled; }
+        bool is_throttled() const { return _throttled; }
+        void set_pinged(bool pinged) { _pinged = pinged; }
+        bool is_pinged() const { return _pinged; }
+        void set_handle(const std::string& handle) { _handle = handle; _named = true; }
+        const std::string& get_handle() const { return _handle; }
+        bool is_named() const { return _named; }
+
+        std::string get_hostname() const;
+        std::string get_port() const;
+        int get_descriptor() const { return _sd; }
 
-        private:
+    private:
         int _sd;                // Underlying socket descriptor
-        std::string _hostname;  // Name of connected client
-        std::string _port;      // Port number of connected client
+        bool _framed;           // Whether messages are length-prefixed
+        bool _drained;          // Whether the last receive read everything
+        bool _throttled;        // Not read from until it is within its rate
+        bool _pinged;           // Sent a heartbeat since it last sent anything
+        bool _named;            // Whether its handle was settled
+        std::string _handle;    // Handle it owns, or empty if none
+        PeerAddress _peer;      // Address of connected client
+        ShardStats* _stats;     // Where to count traffic, or null
+        TokenBucket _message_tokens;    // Limits messages received per second
+        TokenBucket _byte_tokens;       // Limits bytes received per second
+
+        // Received data that has not been returned by next_message yet
+        RingBuffer _inbuf;
+
+        // Outgoing messages waiting to be sent, stored as a ring buffer
+        // whose size is always zero or a power of two
+        std::vector<MessagePtr, PoolAllocator<MessagePtr> > _outbox;
+        std::vector<uint64_t, PoolAllocator<uint64_t> > _outbox_times; // When each message was queued
+        size_t _outbox_head;    // Index of the oldest queued message
+        size_t _outbox_count;   // Number of queued messages
+        size_t _outbox_offset;  // Bytes of the oldest message already sent
+        size_t _outbox_bytes;   // Bytes queued and not yet sent
+        size_t _outbox_inflight; // Messages in a send that has not completed
+
+        void push_back(const MessagePtr& msg, uint64_t queued_at);
+        size_t drop_oldest();
+        size_t get_kept_count() const;
+        size_t get_kept_bytes() const;
+
+        // The bytes of a message as they are sent over this socket
+        const char* wire_data(const MessagePtr& msg) const {
+            return _framed ? msg->frame() : msg->data();
+        }
+        size_t wire_size(const MessagePtr& msg) const {
+            return _framed ? msg->frame_size() : msg->size();
+        }
 };
@@ -0,0 +1,106 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         StatsSocket.cpp
+* Description:  Implementation file for StatsSocket.hpp
+\*********************************************************/
+#include "StatsSocket.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/time.h>   // timeval
+#include <sys/un.h>     // sockaddr_un
+#include <unistd.h>
+
+/**
+ * Constructor. Creates an object that is not listening yet.
+ */
+StatsSocket::StatsSocket() {
+    _sd = -1;
+}
+
+/**
+ * Destructor. Closes the socket and removes its file.
+ */
+StatsSocket::~StatsSocket() {
+    if (_sd != -1) {
+        ::close(_sd);
+        ::unlink(_path.c_str());
+    }
+}
+
+/**
+ * Starts listening for connections on a Unix domain socket.
+ *
+ * A socket file left behind by an earlier run is replaced.
+ *
+ * This function throws a runtime_error exception if any of the steps fail.
+ *
+ *  path    The path of the socket file.
+ */
+void StatsSocket::listen(const std::string& path) {
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("stats socket: invalid path: " + path);
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+    _sd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_sd == -1)
+        throw std::runtime_error(std::string("socket: ") + ::strerror(errno));
+
+    ::unlink(path.c_str());
+    if (::bind(_sd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1
+        || ::listen(_sd, 8) == -1) {
+        std::string errmsg("stats socket: ");
+        errmsg += ::strerror(errno);
+        ::close(_sd);
+        _sd = -1;
+        throw std::runtime_error(errmsg);
+    }
+    _path = path;
+}
+
+/**
+ * Sends the report to every client that connects until the program
+ * terminates.
+ *
+ * This function is intended to be run in a separate thread, so that
+ * building the report never delays routing. A client that does not
+ * read the report within a second is disconnected.
+ *
+ *  report  The function that builds the current report.
+ */
+void StatsSocket::run(std::string (*report)()) {
+    while (true) {
+        int client = ::accept4(_sd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client == -1) {
+            // Back off on errors such as running out of descriptors
+            if (errno != EINTR && errno != ECONNABORTED) {
+                std::cout << "stats socket: accept: " << ::strerror(errno) << std::endl;
+                ::usleep(100000);
+            }
+            continue;
+        }
+
+        struct timeval timeout = { 1, 0 };
+        ::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        std::string text = report();
+        size_t sent = 0;
+        while (sent < text.size()) {
+            ssize_t bytes = ::send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+            if (bytes == -1 && errno == EINTR)
+                continue;
+            if (bytes <= 0)
+                break;
+            sent += bytes;
+        }
+        ::close(client);
+    }
+}
@@ -0,0 +1,32 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         StatsSocket.hpp
+* Description:  Defines the class that serves the server's statistics
+*               on a local Unix domain socket.
+*               Every connection receives the current report and is
+*               then closed, so the statistics can be read at any time
+*               by a monitoring script without using the console,
+*               for example with "nc -U <path>".
+\*********************************************************/
+#pragma once
+
+#include <string>
+
+class StatsSocket {
+    public:
+        StatsSocket();
+        ~StatsSocket();
+
+        void listen(const std::string& path);
+        void run(std::string (*report)());
+
+    private:
+        int _sd;                // Listening socket descriptor
+        std::string _path;      // Path of the socket file
+
+        // Not copyable because the socket is owned
+        StatsSocket(const StatsSocket&);
+        StatsSocket& operator=(const StatsSocket&);
+};
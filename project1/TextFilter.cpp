@@ -0,0 +1,415 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         TextFilter.cpp
+* Description:  Implementation file for TextFilter.hpp
+\*********************************************************/
+#include "TextFilter.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TEXTFILTER_X86 1
+#include <immintrin.h>
+#endif
+
+// The errors that a pair of adjacent bytes can show, from Keiser and
+// Lemire. Each lookup table gives the errors that are possible for the
+// high or low nibble of the first byte or the high nibble of the second,
+// and a pair has an error if all three agree on one.
+#define TOO_SHORT       (1 << 0)    // Lead byte followed by a lead byte or ASCII
+#define TOO_LONG        (1 << 1)    // ASCII followed by a continuation byte
+#define OVERLONG_3      (1 << 2)    // 11100000 100_____
+#define TOO_LARGE       (1 << 3)    // 11110100 1001____ and above
+#define SURROGATE       (1 << 4)    // 11101101 101_____
+#define OVERLONG_2      (1 << 5)    // 1100000_ 10______
+#define TOO_LARGE_1000  (1 << 6)    // 11110101 1000____ and above
+#define OVERLONG_4      (1 << 6)    // 11110000 1000____
+#define TWO_CONTS       (1 << 7)    // Two continuation bytes, an error
+                                    // unless a lead byte asked for them
+#define CARRY           (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+// Errors by the high nibble of the first byte of a pair
+static const uint8_t byte_1_high[16] = {
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+};
+
+// Errors by the low nibble of the first byte of a pair
+static const uint8_t byte_1_low[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000
+};
+
+// Errors by the high nibble of the second byte of a pair
+static const uint8_t byte_2_high[16] = {
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+};
+
+// The largest value of each of the last bytes of a block that does not
+// start a sequence running past the end of the block
+static const uint8_t incomplete_max[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1
+};
+
+/**
+ * Returns whether an ASCII character is a control character,
+ * which is every one below space except tab and newline, and delete.
+ */
+static inline bool is_control(unsigned char c) {
+    return (c < 0x20 && c != '\t' && c != '\n') || c == 0x7F;
+}
+
+/**
+ * Checks a message one character at a time. Eight bytes of plain
+ * ASCII without control characters are skipped at once.
+ *
+ *  data    The message data.
+ *  size    The size of the message.
+ *
+ * Returns TEXT_CONTROL if the message has control characters and
+ * TEXT_INVALID if it is not valid UTF-8, or 0 if it is fine.
+ */
+int TextFilter::check_scalar(const char* data, size_t size) {
+    const unsigned char* text = reinterpret_cast<const unsigned char*>(data);
+    int result = 0;
+    size_t i = 0;
+    while (i < size) {
+        // A word with no byte at or above 0x80, none below 0x20 and no 0x7F
+        if (size - i >= 8) {
+            uint64_t word;
+            std::memcpy(&word, text + i, 8);
+            uint64_t low = (word - 0x2020202020202020ull) & ~word;
+            uint64_t del = word ^ 0x7F7F7F7F7F7F7F7Full;
+            del = (del - 0x0101010101010101ull) & ~del;
+            if (((word | low | del) & 0x8080808080808080ull) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+
+        unsigned char c = text[i];
+        if (c < 0x80) {
+            if (is_control(c))
+                result |= TEXT_CONTROL;
+            ++i;
+            continue;
+        }
+
+        size_t length;
+        uint32_t code;
+        uint32_t min;
+        if ((c & 0xE0) == 0xC0) {
+            length = 2;
+            code = c & 0x1F;
+            min = 0x80;
+        }
+        else if ((c & 0xF0) == 0xE0) {
+            length = 3;
+            code = c & 0x0F;
+            min = 0x800;
+        }
+        else if ((c & 0xF8) == 0xF0) {
+            length = 4;
+            code = c & 0x07;
+            min = 0x10000;
+        }
+        else {
+            return result | TEXT_INVALID;
+        }
+        if (size - i < length)
+            return result | TEXT_INVALID;
+        for (size_t k = 1; k < length; ++k) {
+            if ((text[i + k] & 0xC0) != 0x80)
+                return result | TEXT_INVALID;
+            code = (code << 6) | (text[i + k] & 0x3F);
+        }
+        if (code < min || code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF))
+            return result | TEXT_INVALID;
+        if (code <= 0x9F)
+            result |= TEXT_CONTROL;     // C1 control character
+        i += length;
+    }
+    return result;
+}
+
+#ifdef TEXTFILTER_X86
+
+/**
+ * Checks a message 16 bytes at a time with SSE4.1.
+ *
+ *  data    The message data.
+ *  size    The size of the message.
+ *
+ * Returns TEXT_CONTROL if the message has control characters and
+ * TEXT_INVALID if it is not valid UTF-8, or 0 if it is fine.
+ */
+__attribute__((target("sse4.1")))
+int TextFilter::check_sse(const char* data, size_t size) {
+    const __m128i table_1_high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(byte_1_high));
+    const __m128i table_1_low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(byte_1_low));
+    const __m128i table_2_high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(byte_2_high));
+    const __m128i max = _mm_loadu_si128(reinterpret_cast<const __m128i*>(incomplete_max + 16));
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+
+    __m128i error = _mm_setzero_si128();
+    __m128i prev_input = _mm_setzero_si128();
+    __m128i prev_incomplete = _mm_setzero_si128();
+    unsigned controls = 0;
+    char tail[16];
+
+    for (size_t i = 0; i < size; i += 16) {
+        // The last block is padded with spaces, which are fine
+        __m128i input;
+        if (size - i >= 16) {
+            input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        }
+        else {
+            std::memset(tail, ' ', sizeof(tail));
+            std::memcpy(tail, data + i, size - i);
+            input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tail));
+        }
+
+        // A signed compare finds the bytes below space and those at or
+        // above 0x80, and the second kind are left out
+        unsigned high = _mm_movemask_epi8(input);
+        unsigned low = _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(0x20), input));
+        low &= ~high & ~_mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi8(input, _mm_set1_epi8('\t')), _mm_cmpeq_epi8(input, _mm_set1_epi8('\n'))));
+        low |= _mm_movemask_epi8(_mm_cmpeq_epi8(input, _mm_set1_epi8(0x7F)));
+        controls |= low;
+
+        // A block of ASCII is only wrong if the block before it
+        // ended in the middle of a sequence
+        if (high == 0) {
+            error = _mm_or_si128(error, prev_incomplete);
+            prev_incomplete = _mm_setzero_si128();
+            prev_input = input;
+            continue;
+        }
+
+        __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+        __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+        __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+        __m128i special = _mm_and_si128(
+            _mm_and_si128(
+                _mm_shuffle_epi8(table_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                _mm_shuffle_epi8(table_1_low, _mm_and_si128(prev1, nibble))),
+            _mm_shuffle_epi8(table_2_high, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+        // The second and third continuation bytes after a lead byte
+        // are expected to show TWO_CONTS, and any others are errors
+        __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+        __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+        __m128i must_23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(static_cast<char>(0x80)));
+        error = _mm_or_si128(error, _mm_xor_si128(must_23, special));
+
+        // C1 control characters are 0xC2 followed by 0x80 to 0x9F
+        __m128i c1 = _mm_and_si128(
+            _mm_cmpeq_epi8(prev1, _mm_set1_epi8(static_cast<char>(0xC2))),
+            _mm_cmpeq_epi8(_mm_and_si128(input, _mm_set1_epi8(static_cast<char>(0xE0))),
+                _mm_set1_epi8(static_cast<char>(0x80))));
+        controls |= _mm_movemask_epi8(c1);
+
+        prev_incomplete = _mm_subs_epu8(input, max);
+        prev_input = input;
+    }
+    error = _mm_or_si128(error, prev_incomplete);
+
+    int result = controls != 0 ? TEXT_CONTROL : 0;
+    if (!_mm_testz_si128(error, error))
+        result |= TEXT_INVALID;
+    return result;
+}
+
+/**
+ * Checks a message 32 bytes at a time with AVX2, in the same way
+ * as check_sse.
+ *
+ *  data    The message data.
+ *  size    The size of the message.
+ *
+ * Returns TEXT_CONTROL if the message has control characters and
+ * TEXT_INVALID if it is not valid UTF-8, or 0 if it is fine.
+ */
+__attribute__((target("avx2")))
+int TextFilter::check_avx2(const char* data, size_t size) {
+    const __m256i table_1_high = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(byte_1_high)));
+    const __m256i table_1_low = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(byte_1_low)));
+    const __m256i table_2_high = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(byte_2_high)));
+    const __m256i max = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(incomplete_max));
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+    __m256i error = _mm256_setzero_si256();
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    unsigned controls = 0;
+    char tail[32];
+
+    for (size_t i = 0; i < size; i += 32) {
+        __m256i input;
+        if (size - i >= 32) {
+            input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        }
+        else {
+            std::memset(tail, ' ', sizeof(tail));
+            std::memcpy(tail, data + i, size - i);
+            input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tail));
+        }
+
+        unsigned high = _mm256_movemask_epi8(input);
+        unsigned low = _mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), input));
+        low &= ~high & ~_mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(input, _mm256_set1_epi8('\t')), _mm256_cmpeq_epi8(input, _mm256_set1_epi8('\n'))));
+        low |= _mm256_movemask_epi8(_mm256_cmpeq_epi8(input, _mm256_set1_epi8(0x7F)));
+        controls |= low;
+
+        if (high == 0) {
+            error = _mm256_or_si256(error, prev_incomplete);
+            prev_incomplete = _mm256_setzero_si256();
+            prev_input = input;
+            continue;
+        }
+
+        // The bytes before each byte, the first ones from the previous block
+        __m256i shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+        __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+        __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+        __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+        __m256i special = _mm256_and_si256(
+            _mm256_and_si256(
+                _mm256_shuffle_epi8(table_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                _mm256_shuffle_epi8(table_1_low, _mm256_and_si256(prev1, nibble))),
+            _mm256_shuffle_epi8(table_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+        __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+        __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+        __m256i must_23 = _mm256_and_si256(_mm256_or_si256(third, fourth),
+            _mm256_set1_epi8(static_cast<char>(0x80)));
+        error = _mm256_or_si256(error, _mm256_xor_si256(must_23, special));
+
+        __m256i c1 = _mm256_and_si256(
+            _mm256_cmpeq_epi8(prev1, _mm256_set1_epi8(static_cast<char>(0xC2))),
+            _mm256_cmpeq_epi8(_mm256_and_si256(input, _mm256_set1_epi8(static_cast<char>(0xE0))),
+                _mm256_set1_epi8(static_cast<char>(0x80))));
+        controls |= _mm256_movemask_epi8(c1);
+
+        prev_incomplete = _mm256_subs_epu8(input, max);
+        prev_input = input;
+    }
+    error = _mm256_or_si256(error, prev_incomplete);
+
+    int result = controls != 0 ? TEXT_CONTROL : 0;
+    if (!_mm256_testz_si256(error, error))
+        result |= TEXT_INVALID;
+    return result;
+}
+
+/**
+ * Returns whether the processor supports SSE4.1.
+ */
+bool TextFilter::has_sse() {
+    __builtin_cpu_init();   // May be called before main
+    return __builtin_cpu_supports("sse4.1");
+}
+
+/**
+ * Returns whether the processor supports AVX2.
+ */
+bool TextFilter::has_avx2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+// Without x86 vector instructions, every version is the scalar one
+int TextFilter::check_sse(const char* data, size_t size) { return check_scalar(data, size); }
+int TextFilter::check_avx2(const char* data, size_t size) { return check_scalar(data, size); }
+bool TextFilter::has_sse() { return false; }
+bool TextFilter::has_avx2() { return false; }
+
+#endif
+
+// The best version of the check for this processor, and its name
+typedef int (*CheckFunction)(const char*, size_t);
+static CheckFunction check_function = TextFilter::has_avx2() ? TextFilter::check_avx2
+    : TextFilter::has_sse() ? TextFilter::check_sse : TextFilter::check_scalar;
+static const char* check_name = TextFilter::has_avx2() ? "avx2"
+    : TextFilter::has_sse() ? "sse4.1" : "scalar";
+
+/**
+ * Checks whether a message is valid UTF-8 and has control characters,
+ * with the fastest version that the processor supports.
+ *
+ *  data    The message data.
+ *  size    The size of the message.
+ *
+ * Returns TEXT_CONTROL if the message has control characters and
+ * TEXT_INVALID if it is not valid UTF-8, or 0 if it is fine.
+ */
+int TextFilter::check(const char* data, size_t size) {
+    return check_function(data, size);
+}
+
+/**
+ * Replaces every control character in a message with '?'.
+ * A C1 control character takes two bytes, so it is replaced by "??".
+ * Only messages that check found control characters in need this,
+ * so it is done one byte at a time.
+ *
+ *  data    The message data, which must be valid UTF-8.
+ *  size    The size of the message.
+ */
+void TextFilter::replace_controls(char* data, size_t size) {
+    unsigned char* text = reinterpret_cast<unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        if (is_control(text[i])) {
+            text[i] = '?';
+        }
+        else if (text[i] == 0xC2 && i + 1 < size && text[i + 1] >= 0x80 && text[i + 1] <= 0x9F) {
+            text[i] = '?';
+            text[++i] = '?';
+        }
+    }
+}
+
+/**
+ * Returns the name of the version of the check that is used.
+ */
+const char* TextFilter::get_implementation() {
+    return check_name;
+}
@@ -0,0 +1,46 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         TextFilter.hpp
+* Description:  Defines the check that every message goes through
+*               once, right after it is received and before it is sent
+*               to anyone, so that what reaches the terminals of the
+*               other clients is valid UTF-8 without control characters.
+*               A control character, such as the escape that starts a
+*               terminal escape sequence, is replaced by '?', and a
+*               message that is not valid UTF-8 is dropped.
+*               The check runs with AVX2 or SSE4.1 if the processor has
+*               them, and with plain C++ otherwise; which one is picked
+*               once when the program starts. The vector versions test
+*               32 or 16 bytes at a time. Blocks of plain ASCII only
+*               need a few instructions, and blocks with other
+*               characters are validated without any branches using
+*               the lookup tables of Keiser and Lemire, "Validating
+*               UTF-8 In Less Than One Instruction Per Byte" (2021).
+*               Messages are checked in place, right after they are
+*               copied out of the receive buffer, while they are still
+*               in the cache.
+\*********************************************************/
+#pragma once
+
+#include <cstddef>
+
+// What a check found in a message, as a combination of these bits
+#define TEXT_CONTROL 1      // Has control characters to be replaced
+#define TEXT_INVALID 2      // Is not valid UTF-8
+
+class TextFilter {
+    public:
+        static int check(const char* data, size_t size);
+        static void replace_controls(char* data, size_t size);
+        static const char* get_implementation();
+
+        // Each version of the check, for the benchmark. The vector
+        // versions may only be called if the processor supports them.
+        static int check_scalar(const char* data, size_t size);
+        static int check_sse(const char* data, size_t size);
+        static int check_avx2(const char* data, size_t size);
+        static bool has_sse();
+        static bool has_avx2();
+};
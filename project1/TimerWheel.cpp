@@ -0,0 +1,184 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         TimerWheel.cpp
+* Description:  Implementation file for TimerWheel.hpp
+\*********************************************************/
+#include "TimerWheel.hpp"
+
+#include <algorithm>
+
+#define TIMERWHEEL_MASK (TIMERWHEEL_SLOTS - 1)
+
+// The furthest a timer can be placed ahead of the current tick.
+// A timer due later than this is placed this far ahead and moved
+// on when its slot comes up.
+#define TIMERWHEEL_SPAN ((uint64_t(1) << (TIMERWHEEL_SLOT_BITS * TIMERWHEEL_LEVELS)) - 1)
+
+/**
+ * Constructor. Sets up an empty wheel.
+ *
+ *  now     The current tick.
+ */
+TimerWheel::TimerWheel(uint64_t now) {
+    std::fill(_slots, _slots + TIMERWHEEL_LEVELS * TIMERWHEEL_SLOTS, -1);
+    _now = now;
+    _count = 0;
+}
+
+/**
+ * Schedules a timer, replacing its deadline if it is already scheduled.
+ *
+ *  id          The id of the timer, such as a socket descriptor.
+ *  deadline    The tick at which it goes off. A deadline that is not
+ *              after the current tick goes off at the next one.
+ */
+void TimerWheel::schedule(int id, uint64_t deadline) {
+    if (static_cast<size_t>(id) >= _timers.size()) {
+        Timer unused = { -1, -1, -1, 0 };
+        _timers.resize(id + 1, unused);
+    }
+    if (_timers[id].slot != -1)
+        unlink(id);
+    _timers[id].deadline = deadline;
+    link(id, _now + 1);
+}
+
+/**
+ * Pushes a timer back to a later deadline. Unless the deadline is
+ * earlier than the one it has, the timer stays where it is and only
+ * the deadline is changed, so this is a single store.
+ *
+ *  id          The id of the timer.
+ *  deadline    The tick at which it goes off.
+ */
+void TimerWheel::reset(int id, uint64_t deadline) {
+    if (!is_scheduled(id) || deadline < _timers[id].deadline)
+        schedule(id, deadline);
+    else
+        _timers[id].deadline = deadline;
+}
+
+/**
+ * Cancels a timer, if it is scheduled.
+ *
+ *  id      The id of the timer.
+ */
+void TimerWheel::cancel(int id) {
+    if (is_scheduled(id))
+        unlink(id);
+}
+
+/**
+ * Moves the wheel forward to a tick. Timers that were pushed back are
+ * moved to their new slots, and the ids of the timers that went off
+ * are added to a list. Those timers are no longer scheduled.
+ *
+ * Each tick handles one slot of the first level, and every 64 ticks
+ * one slot of each level above that wrapped around.
+ *
+ *  now     The current tick.
+ *  expired Where the ids of the timers that went off are added.
+ */
+void TimerWheel::advance(uint64_t now, std::vector<int>& expired) {
+    while (_now < now) {
+        // Nothing can go off, so skip straight to the end
+        if (_count == 0) {
+            _now = now;
+            break;
+        }
+        ++_now;
+
+        // At the start of each block, its slot in the level above is
+        // spread over the levels below, and so on up the wheel
+        for (int level = 1; level < TIMERWHEEL_LEVELS; ++level) {
+            if ((_now & ((uint64_t(1) << (TIMERWHEEL_SLOT_BITS * level)) - 1)) != 0)
+                break;
+            cascade(level * TIMERWHEEL_SLOTS
+                + ((_now >> (TIMERWHEEL_SLOT_BITS * level)) & TIMERWHEEL_MASK));
+        }
+
+        // Every timer in the slot of this tick goes off,
+        // unless it was pushed back since it was placed there
+        int slot = _now & TIMERWHEEL_MASK;
+        int id = _slots[slot];
+        _slots[slot] = -1;
+        while (id != -1) {
+            Timer& timer = _timers[id];
+            int next = timer.next;
+            timer.slot = -1;
+            --_count;
+            if (timer.deadline > _now)
+                link(id, _now + 1);
+            else
+                expired.push_back(id);
+            id = next;
+        }
+    }
+}
+
+/**
+ * Adds a timer to the slot that comes up at its deadline.
+ * The level is picked by how far ahead the deadline is.
+ *
+ *  id          The id of the timer, which must not be scheduled.
+ *  earliest    The first tick whose slot may still be handled. Timers
+ *              that are due before then go off at that tick.
+ */
+void TimerWheel::link(int id, uint64_t earliest) {
+    Timer& timer = _timers[id];
+    uint64_t deadline = std::max(timer.deadline, earliest);
+    deadline = std::min(deadline, _now + TIMERWHEEL_SPAN);
+    uint64_t delta = deadline - _now;
+
+    int level = 0;
+    while (level < TIMERWHEEL_LEVELS - 1
+        && delta >= (uint64_t(1) << (TIMERWHEEL_SLOT_BITS * (level + 1))))
+        ++level;
+    int slot = level * TIMERWHEEL_SLOTS
+        + ((deadline >> (TIMERWHEEL_SLOT_BITS * level)) & TIMERWHEEL_MASK);
+
+    timer.slot = slot;
+    timer.prev = -1;
+    timer.next = _slots[slot];
+    if (timer.next != -1)
+        _timers[timer.next].prev = id;
+    _slots[slot] = id;
+    ++_count;
+}
+
+/**
+ * Removes a timer from its slot.
+ *
+ *  id      The id of the timer, which must be scheduled.
+ */
+void TimerWheel::unlink(int id) {
+    Timer& timer = _timers[id];
+    if (timer.prev != -1)
+        _timers[timer.prev].next = timer.next;
+    else
+        _slots[timer.slot] = timer.next;
+    if (timer.next != -1)
+        _timers[timer.next].prev = timer.prev;
+    timer.slot = -1;
+    --_count;
+}
+
+/**
+ * Moves every timer in a slot of a higher level to the slot
+ * that it belongs in now, which is on a lower level.
+ *
+ *  slot    The index of the slot.
+ */
+void TimerWheel::cascade(int slot) {
+    int id = _slots[slot];
+    _slots[slot] = -1;
+    while (id != -1) {
+        int next = _timers[id].next;
+        _timers[id].slot = -1;
+        --_count;
+        link(id, _now);     // Timers due now go off in this tick's slot
+        id = next;
+    }
+}
@@ -0,0 +1,70 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         TimerWheel.hpp
+* Description:  Defines the hierarchical timing wheel that a shard
+*               uses for the idle timeout and heartbeat of each client.
+*               Time is counted in ticks. The wheel has four levels of
+*               64 slots each; a slot of the first level holds the timers
+*               that go off in one tick, a slot of the second level those
+*               that go off in one block of 64 ticks, and so on. Each
+*               slot is a doubly linked list of timers, linked through
+*               an array indexed by socket descriptor, so scheduling and
+*               cancelling a timer take constant time and never allocate.
+*               When the first level wraps around, the next slot of the
+*               level above is emptied into the levels below, so each
+*               timer moves down at most three times before it goes off.
+*               Most timers are pushed back over and over, once for every
+*               message a client sends, so pushing one back only records
+*               the new deadline. The timer stays in its slot and is put
+*               where it belongs when that slot comes up, which costs one
+*               move per slot period instead of one per message.
+*               Advancing the wheel only visits the slots that come up,
+*               never the timers that are not due.
+\*********************************************************/
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Number of levels and the number of slots in each, as a power of two
+#define TIMERWHEEL_LEVELS 4
+#define TIMERWHEEL_SLOT_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_SLOT_BITS)
+
+class TimerWheel {
+    public:
+        TimerWheel(uint64_t now);
+
+        void schedule(int id, uint64_t deadline);
+        void reset(int id, uint64_t deadline);
+        void cancel(int id);
+        void advance(uint64_t now, std::vector<int>& expired);
+
+        bool is_scheduled(int id) const {
+            return static_cast<size_t>(id) < _timers.size() && _timers[id].slot != -1;
+        }
+        uint64_t get_now() const { return _now; }
+        size_t size() const { return _count; }
+        size_t get_memory() const { return _timers.capacity() * sizeof(Timer); }
+
+    private:
+        // A timer, linked into the list of its slot
+        struct Timer {
+            int prev;           // Previous timer in the slot, or -1
+            int next;           // Next timer in the slot, or -1
+            int slot;           // Index of the slot, or -1 if not scheduled
+            uint64_t deadline;  // Tick at which the timer goes off
+        };
+
+        std::vector<Timer> _timers;     // Timers, indexed by id
+        int _slots[TIMERWHEEL_LEVELS * TIMERWHEEL_SLOTS]; // First timer in each slot, or -1
+        uint64_t _now;                  // The last tick that was handled
+        size_t _count;                  // Scheduled timers
+
+        void link(int id, uint64_t earliest);
+        void unlink(int id);
+        void cascade(int slot);
+};
@@ -0,0 +1,91 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         TokenBucket.hpp
+* Description:  Defines the token buckets that limit how fast a
+*               client may send messages. Every message a client
+*               sends is forwarded to every other client, so one
+*               client that floods the server would otherwise use up
+*               the outgoing bandwidth of all of them.
+*               A bucket fills at a fixed rate up to a burst size, and
+*               each message takes tokens out of it. Instead of a token
+*               count and the time it was last refilled, a bucket only
+*               keeps the time at which it will be full again: taking
+*               tokens moves that time forward, and the time passing
+*               refills it without any work. So a bucket is 8 bytes,
+*               is kept inside each client's SocketStream, and is
+*               checked without allocating or dividing.
+\*********************************************************/
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+// Define buckets that hold one second of tokens unless defined elsewhere
+#ifndef TOKENBUCKET_BURST_MS
+#define TOKENBUCKET_BURST_MS 1000
+#endif
+
+// What to do with a client that sends faster than its limit
+enum LimitAction {
+    LIMIT_DELAY,        // Stop reading from it, so TCP pushes back
+    LIMIT_DROP,         // Drop its messages
+    LIMIT_DISCONNECT    // Disconnect it
+};
+
+// How fast a bucket fills and how many tokens it holds
+struct TokenRate {
+    double ns_per_token;    // Time to add one token, or 0 for no limit
+    uint64_t burst_ns;      // Time to fill an empty bucket
+
+    TokenRate(double per_second = 0) {
+        ns_per_token = per_second > 0 ? 1e9 / per_second : 0;
+        burst_ns = per_second > 0 ? TOKENBUCKET_BURST_MS * 1000000ull : 0;
+    }
+    bool is_limited() const { return ns_per_token > 0; }
+};
+
+// The limits on what each client may send
+struct RateLimit {
+    TokenRate messages;     // Messages per second
+    TokenRate bytes;        // Bytes per second
+    LimitAction action;     // What to do when either runs out
+
+    bool is_limited() const { return messages.is_limited() || bytes.is_limited(); }
+};
+
+class TokenBucket {
+    public:
+        TokenBucket() : _full_at(0) {}
+
+        /**
+         * Returns whether the bucket has any tokens left at a point in time.
+         * A message is let through as long as there is one token, even
+         * if it needs more; the bucket then goes into debt, and the
+         * next message waits until the debt is paid off.
+         */
+        bool has_tokens(const TokenRate& rate, uint64_t now) const {
+            return _full_at < now + rate.burst_ns;
+        }
+
+        /**
+         * Takes tokens out of the bucket.
+         */
+        void take(const TokenRate& rate, uint64_t now, size_t tokens) {
+            if (rate.is_limited())
+                _full_at = std::max(_full_at, now) + static_cast<uint64_t>(tokens * rate.ns_per_token);
+        }
+
+        /**
+         * Returns the time at which the bucket has a token again,
+         * which is in the past if it has one already.
+         */
+        uint64_t get_ready_time(const TokenRate& rate) const {
+            return _full_at > rate.burst_ns ? _full_at - rate.burst_ns + 1 : 0;
+        }
+
+    private:
+        uint64_t _full_at;  // When the bucket will be full, on the ShardStats::now clock
+};
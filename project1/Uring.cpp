@@ -0,0 +1,354 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         Uring.cpp
+* Description:  Implementation file for Uring.hpp
+\*********************************************************/
+#include "Uring.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+/**
+ * Throws a runtime_error exception with the specified prefix
+ * and the message for the specified error number.
+ *
+ *  prefix  The name of the function that failed.
+ *  err     The error number.
+ */
+static void throw_error(const char* prefix, int err) {
+    std::string errmsg(prefix);
+    errmsg += ": ";
+    errmsg += ::strerror(err);
+    throw std::runtime_error(errmsg);
+}
+
+/**
+ * Reads a value written by the kernel with acquire ordering.
+ */
+static unsigned load_acquire(const unsigned* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Writes a value read by the kernel with release ordering.
+ */
+static void store_release(unsigned* p, unsigned value) {
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+/**
+ * Checks whether the running kernel supports the io_uring features
+ * this class needs: multishot accept and receive, cancelling by
+ * descriptor, and skipping successful completions. These were all
+ * added by Linux 6.0.
+ *
+ * Returns whether io_uring can be used.
+ */
+bool Uring::is_supported() {
+    struct utsname name;
+    int major = 0;
+    int minor = 0;
+    if (::uname(&name) != 0 || std::sscanf(name.release, "%d.%d", &major, &minor) != 2)
+        return false;
+    if (major < 6)
+        return false;
+
+    // The system call may still be disabled (e.g. by seccomp or sysctl)
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int fd = ::syscall(__NR_io_uring_setup, 1, &params);
+    if (fd < 0)
+        return false;
+    ::close(fd);
+    return true;
+}
+
+/**
+ * Constructor. Creates the io_uring instance, maps its rings,
+ * and provides the receive buffers.
+ *
+ * This function throws a runtime_error exception if any step fails.
+ *
+ *  entries     The number of submission queue entries.
+ */
+Uring::Uring(unsigned entries) : _backlog_head(0), _enter_calls(0) {
+    _sq_ring = nullptr;
+    _cq_ring = nullptr;
+    _sqes = nullptr;
+    _buffers = nullptr;
+
+    std::memset(&_params, 0, sizeof(_params));
+    // Multishot requests can complete many times per submission,
+    // so make the completion ring larger than the submission ring.
+    _params.flags = IORING_SETUP_CQSIZE;
+    _params.cq_entries = entries * 4;
+
+    _fd = ::syscall(__NR_io_uring_setup, entries, &_params);
+    if (_fd < 0)
+        throw_error("io_uring_setup", errno);
+
+    try {
+        map_rings();
+        setup_buffers();
+    }
+    catch (...) {
+        cleanup();
+        throw;
+    }
+}
+
+/**
+ * Destructor. Closes the descriptor, which cancels any requests
+ * that are still pending, and unmaps the rings and buffers.
+ */
+Uring::~Uring() {
+    cleanup();
+}
+
+/**
+ * Maps the submission and completion rings into memory.
+ *
+ * This function throws a runtime_error exception if mmap fails.
+ */
+void Uring::map_rings() {
+    _sq_ring_size = _params.sq_off.array + _params.sq_entries * sizeof(unsigned);
+    _cq_ring_size = _params.cq_off.cqes + _params.cq_entries * sizeof(struct io_uring_cqe);
+    if (_params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (_cq_ring_size > _sq_ring_size)
+            _sq_ring_size = _cq_ring_size;
+        _cq_ring_size = _sq_ring_size;
+    }
+
+    void* sq = ::mmap(nullptr, _sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        throw_error("mmap", errno);
+    _sq_ring = sq;
+
+    if (_params.features & IORING_FEAT_SINGLE_MMAP) {
+        _cq_ring = _sq_ring;
+    }
+    else {
+        void* cq = ::mmap(nullptr, _cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            throw_error("mmap", errno);
+        _cq_ring = cq;
+    }
+
+    _sqes_size = _params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = ::mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        throw_error("mmap", errno);
+    _sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+    char* sqp = static_cast<char*>(_sq_ring);
+    _sq_head = reinterpret_cast<unsigned*>(sqp + _params.sq_off.head);
+    _sq_tail = reinterpret_cast<unsigned*>(sqp + _params.sq_off.tail);
+    _sq_mask = *reinterpret_cast<unsigned*>(sqp + _params.sq_off.ring_mask);
+    _sq_array = reinterpret_cast<unsigned*>(sqp + _params.sq_off.array);
+    _sqe_tail = *_sq_tail;
+    _submitted = _sqe_tail;
+
+    char* cqp = static_cast<char*>(_cq_ring);
+    _cq_head = reinterpret_cast<unsigned*>(cqp + _params.cq_off.head);
+    _cq_tail = reinterpret_cast<unsigned*>(cqp + _params.cq_off.tail);
+    _cq_mask = *reinterpret_cast<unsigned*>(cqp + _params.cq_off.ring_mask);
+    _cqes = reinterpret_cast<struct io_uring_cqe*>(cqp + _params.cq_off.cqes);
+}
+
+/**
+ * Closes the descriptor and unmaps everything that was mapped.
+ */
+void Uring::cleanup() {
+    if (_fd != -1)
+        ::close(_fd);
+    _fd = -1;
+
+    if (_buffers != nullptr)
+        ::munmap(_buffers, URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    if (_sqes != nullptr)
+        ::munmap(_sqes, _sqes_size);
+    if (_cq_ring != nullptr && _cq_ring != _sq_ring)
+        ::munmap(_cq_ring, _cq_ring_size);
+    if (_sq_ring != nullptr)
+        ::munmap(_sq_ring, _sq_ring_size);
+    _buffers = nullptr;
+    _sqes = nullptr;
+    _cq_ring = nullptr;
+    _sq_ring = nullptr;
+}
+
+/**
+ * Allocates the receive buffers and hands them all to the kernel,
+ * which picks one for each completed receive.
+ *
+ * This function throws a runtime_error exception if any step fails.
+ */
+void Uring::setup_buffers() {
+    void* buffers = ::mmap(nullptr, URING_BUFFER_COUNT * URING_BUFFER_SIZE,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED)
+        throw_error("mmap", errno);
+    _buffers = static_cast<char*>(buffers);
+
+    // Provide every buffer with one request and wait for it to finish
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = URING_BUFFER_COUNT;
+    sqe->addr = reinterpret_cast<unsigned long>(_buffers);
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->off = 0;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    submit_and_wait(1);
+
+    struct io_uring_cqe cqe;
+    if (take_completions(&cqe, 1) != 1)
+        throw std::runtime_error("io_uring: no completion for provided buffers");
+    if (cqe.res < 0)
+        throw_error("io_uring provide buffers", -cqe.res);
+}
+
+/**
+ * Returns a receive buffer to the kernel after its data has been used.
+ *
+ * The request is submitted with the next call to submit_and_wait,
+ * and it does not produce a completion unless it fails.
+ *
+ *  bid     The ID of the buffer from the completion flags.
+ */
+void Uring::recycle_buffer(unsigned short bid) {
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->fd = 1;
+    sqe->addr = reinterpret_cast<unsigned long>(get_buffer(bid));
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->off = bid;
+    sqe->buf_group = URING_BUFFER_GROUP;
+}
+
+/**
+ * Gets a zeroed submission queue entry to fill in.
+ *
+ * If the submission ring is full, the pending entries are submitted
+ * first, so an entry is never handed out while the kernel has not yet
+ * read the one in the same slot. The entry is submitted by the next
+ * call to submit_and_wait.
+ *
+ * Returns the entry.
+ */
+struct io_uring_sqe* Uring::get_sqe() {
+    while (_sqe_tail - load_acquire(_sq_head) >= _params.sq_entries)
+        submit_and_wait(0);
+
+    unsigned index = _sqe_tail & _sq_mask;
+    struct io_uring_sqe* sqe = &_sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    _sq_array[index] = index;
+    ++_sqe_tail;
+    return sqe;
+}
+
+/**
+ * Submits every pending entry and waits for completions,
+ * both in a single system call.
+ *
+ * The kernel refuses new entries while completions it could not fit
+ * in the completion ring are waiting. When that happens, the ready
+ * completions are moved to a backlog to make room, and the entries
+ * are submitted again. Completions in the backlog count as ready,
+ * so the call does not wait if there are any.
+ *
+ * This function throws a runtime_error exception if io_uring_enter
+ * fails for any reason other than being interrupted by a signal.
+ *
+ *  wait_nr     The number of completions to wait for (0 to not wait).
+ */
+void Uring::submit_and_wait(unsigned wait_nr) {
+    store_release(_sq_tail, _sqe_tail);
+
+    if (_backlog_head < _backlog.size())
+        wait_nr = 0;
+
+    while (true) {
+        unsigned to_submit = _sqe_tail - _submitted;
+        unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        _enter_calls.fetch_add(1, std::memory_order_relaxed);
+        int ret = ::syscall(__NR_io_uring_enter, _fd, to_submit, wait_nr, flags, nullptr, 0);
+        if (ret >= 0) {
+            _submitted += ret;
+            if (_submitted == _sqe_tail || wait_nr > 0)
+                return;
+            continue;   // Submit the rest
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EBUSY) {
+            // The completion ring is full. If it is already empty, the
+            // kernel still holds completions; waiting for one makes it
+            // move them into the ring.
+            if (drain_completions())
+                wait_nr = 0;
+            else
+                wait_nr = 1;
+            continue;
+        }
+        throw_error("io_uring_enter", errno);
+    }
+}
+
+/**
+ * Moves every completion in the completion ring to the backlog.
+ *
+ * Returns whether any completion was moved.
+ */
+bool Uring::drain_completions() {
+    unsigned head = *_cq_head;
+    unsigned tail = load_acquire(_cq_tail);
+    if (head == tail)
+        return false;
+    for (; head != tail; ++head)
+        _backlog.push_back(_cqes[head & _cq_mask]);
+    store_release(_cq_head, head);
+    return true;
+}
+
+/**
+ * Copies out the completions that are ready, without a system call,
+ * and releases their slots so the kernel can reuse them.
+ * Completions moved to the backlog come first.
+ *
+ *  cqes    An array to store the completions.
+ *  max     The size of the array.
+ *
+ * Returns the number of completions stored.
+ */
+unsigned Uring::take_completions(struct io_uring_cqe* cqes, unsigned max) {
+    unsigned count = 0;
+    while (_backlog_head < _backlog.size() && count < max)
+        cqes[count++] = _backlog[_backlog_head++];
+    if (_backlog_head == _backlog.size()) {
+        _backlog.clear();
+        _backlog_head = 0;
+    }
+
+    unsigned head = *_cq_head;
+    unsigned tail = load_acquire(_cq_tail);
+    while (head != tail && count < max) {
+        cqes[count++] = _cqes[head & _cq_mask];
+        ++head;
+    }
+    store_release(_cq_head, head);
+    return count;
+}
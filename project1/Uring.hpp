@@ -0,0 +1,94 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         Uring.hpp
+* Description:  Defines a minimal wrapper around the Linux io_uring
+*               system calls, used as an alternative to epoll.
+*               Requests are written to a shared submission ring
+*               and submitted in batches; completions are read from
+*               a shared completion ring without system calls.
+*               The wrapper also manages a pool of receive buffers
+*               that the kernel picks from for multishot receives.
+\*********************************************************/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <linux/io_uring.h>
+#include <vector>
+
+// Define 4096 submission entries unless defined elsewhere
+#ifndef URING_ENTRIES
+#define URING_ENTRIES 4096
+#endif
+
+// Define 512 provided receive buffers of 4 KiB unless defined elsewhere
+#ifndef URING_BUFFER_COUNT
+#define URING_BUFFER_COUNT 512
+#endif
+#ifndef URING_BUFFER_SIZE
+#define URING_BUFFER_SIZE 4096
+#endif
+
+// The buffer group used for provided receive buffers
+#define URING_BUFFER_GROUP 0
+
+class Uring {
+    public:
+        Uring(unsigned entries = URING_ENTRIES);
+        ~Uring();
+
+        static bool is_supported();
+
+        struct io_uring_sqe* get_sqe();
+        void submit_and_wait(unsigned wait_nr);
+
+        unsigned take_completions(struct io_uring_cqe* cqes, unsigned max);
+
+        char* get_buffer(unsigned short bid) { return _buffers + bid * URING_BUFFER_SIZE; }
+        void recycle_buffer(unsigned short bid);
+
+        unsigned long get_enter_calls() const { return _enter_calls.load(std::memory_order_relaxed); }
+
+    private:
+        int _fd;                        // io_uring descriptor
+        struct io_uring_params _params; // Parameters returned by setup
+
+        // Submission ring, shared with the kernel
+        void* _sq_ring;
+        size_t _sq_ring_size;
+        unsigned* _sq_head;
+        unsigned* _sq_tail;
+        unsigned _sq_mask;
+        unsigned* _sq_array;
+        struct io_uring_sqe* _sqes;
+        size_t _sqes_size;
+        unsigned _sqe_tail;             // Next entry to hand out
+        unsigned _submitted;            // Entries already passed to the kernel
+
+        // Completion ring, shared with the kernel
+        void* _cq_ring;
+        size_t _cq_ring_size;
+        unsigned* _cq_head;
+        unsigned* _cq_tail;
+        unsigned _cq_mask;
+        struct io_uring_cqe* _cqes;
+
+        // Completions moved out of the ring to let submissions through
+        std::vector<struct io_uring_cqe> _backlog;
+        size_t _backlog_head;           // Next backlog entry to return
+
+        char* _buffers;                 // Receive buffers provided to the kernel
+
+        std::atomic<unsigned long> _enter_calls;    // io_uring_enter calls
+
+        void map_rings();
+        bool drain_completions();
+        void setup_buffers();
+        void cleanup();
+
+        // Not copyable because the rings are owned
+        Uring(const Uring&);
+        Uring& operator=(const Uring&);
+};
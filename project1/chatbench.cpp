@@ -0,0 +1,1153 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         chatbench.cpp
+* Description:  A load generator that measures how quickly chatserve
+*               fans messages out to its clients.
+*
+*               This program opens many client connections to chatserve,
+*               all of which stay in the lobby, and sends messages from
+*               them at a fixed total rate. Each message carries the time
+*               it was due to be sent, so every client that receives it
+*               can record how long it took to arrive. Messages are sent
+*               on schedule even when the server falls behind, so a slow
+*               server shows up as higher latency instead of a lower rate.
+*               The send times are read from the monotonic clock, so the
+*               program must run on the same host as the server.
+*
+*               With -S, it measures a reconnect storm instead: every
+*               client connects at the same moment, as they would after
+*               a server restart, and it reports how long it takes until
+*               all of them are connected and receiving messages.
+*
+*               With -e, the clients are spread across several chatserve
+*               instances on the same host that are linked with their
+*               relays, and the messages that crossed from one server to
+*               another are timed separately from those that did not, to
+*               show the throughput of the links and the latency they add.
+*
+*               With -T, it measures a hot restart instead: halfway
+*               through the run, it runs a command that starts a new
+*               chatserve with -T, which takes over the connections.
+*               Only the first few clients send and receive, so that the
+*               server is not busy fanning out messages; the others leave
+*               the lobby and just stay connected. It reports the longest
+*               time that no client received anything, which is the
+*               pause, along with how many clients of either kind were
+*               disconnected and how many messages were lost.
+*
+*               With -M, it also reads the statistics socket of chatserve
+*               before and after the run, and reports how many buffers the
+*               server allocated per delivered message and how many of
+*               them had to come from malloc instead of its buffer pool.
+*
+*               When the run is over, the results are printed to stdout
+*               as one line of JSON, so runs can be appended to a file
+*               and compared against a baseline.
+*
+*               The command line syntax is as follows:
+*
+*                   chatbench [-c clients] [-t threads] [-r rate] [-s size]
+*                             [-d seconds] [-m mode] [-S] [-e port]...
+*                             [-M stats_path] [-T command] host port
+*                   chatbench [options] -u socket
+*
+*               This program takes the following arguments:
+*               - clients   -- The number of connections to open (default 100).
+*               - threads   -- The number of threads that send and receive
+*                              (default 1). Each one handles its own subset
+*                              of the connections.
+*               - rate      -- The total number of messages to send per
+*                              second, spread across all clients (default 1000).
+*               - size      -- The size of each message in bytes, including
+*                              the handle (default 64).
+*               - seconds   -- How long to send messages for (default 10).
+*               - mode      -- How messages are delimited: framed (default)
+*                              or text. It must match the -m option of
+*                              chatserve. In text mode every message ends
+*                              with a newline.
+*               - -S        -- Measure a reconnect storm of the clients
+*                              instead of sending at a fixed rate.
+*               - -e port   -- Also connect to the chatserve on this
+*                              port of the same host. May be repeated.
+*                              Client i connects to server i modulo the
+*                              number of servers, the first being the
+*                              one given by port.
+*               - stats_path -- The statistics socket that chatserve was
+*                              given with -s.
+*               - command   -- A shell command that starts the new
+*                              chatserve for a hot restart, such as
+*                              "echo srv | ./chatserve -T /tmp/ho.sock
+*                              5000 > new.log". It is run in the
+*                              background and left running, and its
+*                              output is discarded unless it is
+*                              redirected.
+*               - socket    -- Connect to the Unix domain socket that
+*                              chatserve was given with -u instead of
+*                              a host and port. A name that starts with
+*                              '@' is an abstract socket.
+*               - host      -- The host name or IP address of chatserve.
+*               - port      -- The port that chatserve is listening on.
+\*********************************************************/
+#include <cerrno>
+#include <chrono>
+#include <cstddef>          // offsetof
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>    // TCP_NODELAY
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>         // sockaddr_un
+#include <unistd.h>         // getopt
+
+#include "LatencyHistogram.hpp"
+
+// Define a 500 ms pause between connecting and sending unless defined elsewhere
+#ifndef CHATBENCH_SETTLE_MS
+#define CHATBENCH_SETTLE_MS 500
+#endif
+
+// Define 2 seconds to receive after the last send unless defined elsewhere
+#ifndef CHATBENCH_DRAIN_MS
+#define CHATBENCH_DRAIN_MS 2000
+#endif
+
+// Define a maximum of 1 MiB waiting to be sent per client unless defined elsewhere
+#ifndef CHATBENCH_MAX_PENDING
+#define CHATBENCH_MAX_PENDING 1048576
+#endif
+
+// Define 30 seconds for a reconnect storm to settle unless defined elsewhere
+#ifndef CHATBENCH_STORM_TIMEOUT_MS
+#define CHATBENCH_STORM_TIMEOUT_MS 30000
+#endif
+
+// Define 10 ms between probes during a reconnect storm unless defined elsewhere
+#ifndef CHATBENCH_PROBE_MS
+#define CHATBENCH_PROBE_MS 10
+#endif
+
+// Define 10 clients that send and receive during a hot restart
+// unless defined elsewhere
+#ifndef CHATBENCH_RESTART_CLIENTS
+#define CHATBENCH_RESTART_CLIENTS 10
+#endif
+
+// Define 64 KiB read per recv call unless defined elsewhere
+#ifndef CHATBENCH_READ_SIZE
+#define CHATBENCH_READ_SIZE 65536
+#endif
+
+/*========================================================*
+ * Types
+ *========================================================*/
+// The settings of a run, from the command line
+struct BenchOptions {
+    const char* host;       // Host name of chatserve
+    const char* port;       // Port of chatserve
+    std::vector<const char*> ports; // Port of each server, the first being port
+    const char* unix_path;  // Unix domain socket of chatserve, or null
+    const char* stats_path; // Statistics socket of chatserve, or null
+    int clients;            // Number of connections
+    int threads;            // Number of threads
+    double rate;            // Total messages sent per second
+    size_t size;            // Bytes per message
+    double duration;        // Seconds to send for
+    bool framed;            // Whether messages have a length prefix
+    bool storm;             // Whether to measure a reconnect storm
+    const char* restart;    // Command that starts a new server halfway, or null
+};
+
+// One simulated client
+struct BenchClient {
+    int fd;                 // Connected socket, or -1 once it is closed
+    int id;                 // Number used in the handle
+    int node;               // Index of the server it is connected to
+    std::string out;        // Data waiting to be sent
+    size_t out_offset;      // Bytes of out that were already sent
+    std::string in;         // Data received but not yet parsed
+};
+
+// The clients handled by one thread and what they measured
+struct BenchWorker {
+    std::vector<BenchClient> clients;
+    double rate;                    // Messages per second sent by this thread
+    LatencyHistogram latency;       // Nanoseconds from due time to arrival
+    LatencyHistogram local_latency; // The same, for messages sent to the same server
+    LatencyHistogram relay_latency; // The same, for messages sent to another server
+    unsigned long sent;             // Messages written to a socket
+    unsigned long skipped;          // Messages not sent because a client fell behind
+    unsigned long received;         // Messages received with a send time
+    unsigned long relayed;          // Of those, messages sent to another server
+    unsigned long disconnects;      // Clients closed by the server
+    uint64_t last_arrival;          // When messages last arrived, or 0
+    uint64_t longest_gap;           // Longest time between arrivals
+    uint64_t gap_end;               // When that time ended
+};
+
+// The buffer pool counters of chatserve, from its statistics socket
+struct PoolCounts {
+    unsigned long long allocations;     // Buffers handed out
+    unsigned long long misses;          // Of those, buffers from malloc
+};
+
+// The clients that only stay connected during a hot restart
+struct RestartCounts {
+    uint64_t started_at;    // When the command was run, or 0 if it failed
+    int held;               // Clients that only stay connected
+    int held_closed;        // Of those, clients the server closed
+};
+
+/*========================================================*
+ * Forward declarations
+ *========================================================*/
+uint64_t now_ns();
+int connect_client(const BenchOptions& options, int node);
+bool get_unix_address(const char* path, struct sockaddr_un& addr, socklen_t& len);
+void run_worker(BenchWorker* worker, const BenchOptions* options, uint64_t start);
+void queue_message(BenchClient& client, const BenchOptions& options, uint64_t due);
+bool flush_client(BenchClient& client);
+bool read_client(BenchClient& client, BenchWorker& worker, const BenchOptions& options);
+void close_client(BenchClient& client, BenchWorker& worker);
+bool read_pool_counts(const char* path, PoolCounts& counts);
+void print_results(const BenchOptions& options, const std::vector<BenchWorker*>& workers,
+    int connected, int failed, const PoolCounts* pool, const RestartCounts* restart);
+void run_storm(const BenchOptions& options);
+bool start_restart(const char* command);
+void send_command(int fd, int id, const char* command, const BenchOptions& options);
+
+/*========================================================*
+ * main function
+ *========================================================*/
+int main(int argc, char* argv[]) {
+    bool valid = true;
+    int opt;
+
+    BenchOptions options;
+    options.clients = 100;
+    options.threads = 1;
+    options.rate = 1000;
+    options.size = 64;
+    options.duration = 10;
+    options.framed = true;
+    options.storm = false;
+    options.unix_path = nullptr;
+    options.stats_path = nullptr;
+    options.restart = nullptr;
+
+    // Parse command line options
+    while ((opt = ::getopt(argc, argv, "c:t:r:s:d:m:Su:e:M:T:")) != -1) {
+        switch (opt) {
+        case 'c':
+            options.clients = std::atoi(optarg);
+            valid = valid && options.clients > 0;
+            break;
+        case 't':
+            options.threads = std::atoi(optarg);
+            valid = valid && options.threads > 0;
+            break;
+        case 'r':
+            options.rate = std::atof(optarg);
+            valid = valid && options.rate >= 0;
+            break;
+        case 's':
+            options.size = std::strtoul(optarg, nullptr, 10);
+            break;
+        case 'd':
+            options.duration = std::atof(optarg);
+            valid = valid && options.duration > 0;
+            break;
+        case 'm':
+            if (std::strcmp(optarg, "text") == 0)
+                options.framed = false;
+            else if (std::strcmp(optarg, "framed") == 0)
+                options.framed = true;
+            else
+                valid = false;
+            break;
+        case 'S':
+            options.storm = true;
+            break;
+        case 'u':
+            options.unix_path = optarg;
+            break;
+        case 'e':
+            options.ports.push_back(optarg);
+            break;
+        case 'M':
+            options.stats_path = optarg;
+            break;
+        case 'T':
+            options.restart = optarg;
+            break;
+        default:
+            valid = false;
+            break;
+        }
+    }
+
+    // Verify command line arguments
+    if (argc - optind != (options.unix_path != nullptr ? 0 : 2) || !valid
+        || (options.unix_path != nullptr && !options.ports.empty())) {
+        std::cerr << "usage: " << argv[0]
+            << " [-c clients] [-t threads] [-r rate] [-s size] [-d seconds]"
+            << " [-m framed|text] [-S] [-e port]... [-M stats_path] [-T command]"
+            << " {host port | -u unix_path}"
+            << std::endl;
+        exit(1);
+    }
+    options.host = options.unix_path != nullptr ? options.unix_path : argv[optind];
+    options.port = options.unix_path != nullptr ? "" : argv[optind + 1];
+    options.ports.insert(options.ports.begin(), options.port);
+    if (options.threads > options.clients)
+        options.threads = options.clients;
+    if (options.restart != nullptr && options.threads > CHATBENCH_RESTART_CLIENTS)
+        options.threads = CHATBENCH_RESTART_CLIENTS;
+
+    // Writes to a client the server closed must fail instead of killing us
+    ::signal(SIGPIPE, SIG_IGN);
+
+    // Allow as many connections as the hard limit permits
+    struct rlimit limit;
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (options.storm) {
+        run_storm(options);
+        return 0;
+    }
+
+    // Connect every client before sending anything, spreading
+    // them across the threads in turn
+    std::vector<BenchWorker*> workers;
+    for (int i = 0; i < options.threads; ++i) {
+        workers.push_back(new BenchWorker());
+        workers.back()->sent = 0;
+        workers.back()->skipped = 0;
+        workers.back()->received = 0;
+        workers.back()->relayed = 0;
+        workers.back()->disconnects = 0;
+        workers.back()->last_arrival = 0;
+        workers.back()->longest_gap = 0;
+        workers.back()->gap_end = 0;
+    }
+
+    int connected = 0;
+    int failed = 0;
+    int active = 0;
+    std::vector<int> held;
+    for (int i = 0; i < options.clients; ++i) {
+        int node = i % options.ports.size();
+        int fd = connect_client(options, node);
+        if (fd == -1) {
+            ++failed;
+            continue;
+        }
+        ++connected;
+
+        // For a hot restart, most clients only stay connected
+        if (options.restart != nullptr && active == CHATBENCH_RESTART_CLIENTS) {
+            send_command(fd, i, "/leave lobby", options);
+            held.push_back(fd);
+            continue;
+        }
+
+        BenchClient client;
+        client.fd = fd;
+        client.id = i;
+        client.node = node;
+        client.out_offset = 0;
+        workers[active % options.threads]->clients.push_back(client);
+        ++active;
+    }
+    if (active == 0) {
+        std::cerr << "chatbench: could not connect to "
+            << options.host << ":" << options.port << std::endl;
+        exit(1);
+    }
+
+    // Each thread sends its share of the total rate
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i]->rate = options.rate * workers[i]->clients.size() / active;
+
+    // Only the buffers used during the run are counted
+    PoolCounts pool_start;
+    bool pool_valid = options.stats_path != nullptr
+        && read_pool_counts(options.stats_path, pool_start);
+
+    // Give the server time to add every client to the lobby
+    // so that the first messages reach all of them
+    uint64_t start = now_ns() + CHATBENCH_SETTLE_MS * 1000000ull;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workers.size(); ++i)
+        threads.emplace_back(run_worker, workers[i], &options, start);
+
+    // Start the new server halfway through sending
+    RestartCounts restart;
+    restart.started_at = 0;
+    restart.held = held.size();
+    restart.held_closed = 0;
+    if (options.restart != nullptr) {
+        uint64_t due = start + static_cast<uint64_t>(options.duration * 1e9 / 2);
+        uint64_t now = now_ns();
+        if (due > now)
+            std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+        if (start_restart(options.restart))
+            restart.started_at = now_ns();
+    }
+
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    // A held client that is still open has nothing more to read
+    // than the notice that it left the lobby
+    for (size_t i = 0; i < held.size(); ++i) {
+        char buf[CHATBENCH_READ_SIZE];
+        ssize_t received;
+        while ((received = ::recv(held[i], buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+            continue;
+        if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            ++restart.held_closed;
+        ::close(held[i]);
+    }
+
+    PoolCounts pool_end;
+    if (pool_valid && read_pool_counts(options.stats_path, pool_end)) {
+        pool_end.allocations -= pool_start.allocations;
+        pool_end.misses -= pool_start.misses;
+    }
+    else {
+        pool_valid = false;
+    }
+
+    print_results(options, workers, connected, failed, pool_valid ? &pool_end : nullptr,
+        options.restart != nullptr ? &restart : nullptr);
+    return 0;
+}
+
+/**
+ * Returns the time of the monotonic clock in nanoseconds.
+ */
+uint64_t now_ns() {
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Opens a connection to chatserve.
+ *
+ * The socket is made non-blocking after it connects, and for TCP,
+ * Nagle's algorithm is turned off so small messages are sent right away.
+ *
+ *  options The settings of the run.
+ *  node    The index of the server in options.ports.
+ *
+ * Returns the connected socket, or -1 if it could not connect.
+ */
+int connect_client(const BenchOptions& options, int node) {
+    if (options.unix_path != nullptr) {
+        struct sockaddr_un addr;
+        socklen_t len;
+        if (!get_unix_address(options.unix_path, addr, len))
+            return -1;
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1 || ::connect(fd, reinterpret_cast<struct sockaddr*>(&addr), len) == -1) {
+            std::cerr << "connect: " << ::strerror(errno) << std::endl;
+            if (fd != -1)
+                ::close(fd);
+            return -1;
+        }
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+        return fd;
+    }
+
+    struct addrinfo hints;
+    struct addrinfo* info = nullptr;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int retval = ::getaddrinfo(options.host, options.ports[node], &hints, &info);
+    if (retval != 0) {
+        std::cerr << "getaddrinfo: " << ::gai_strerror(retval) << std::endl;
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo* current = info; current != nullptr; current = current->ai_next) {
+        fd = ::socket(current->ai_family, current->ai_socktype, current->ai_protocol);
+        if (fd == -1)
+            continue;
+        if (::connect(fd, current->ai_addr, current->ai_addrlen) == 0)
+            break;
+        ::close(fd);
+        fd = -1;
+    }
+    ::freeaddrinfo(info);
+    if (fd == -1) {
+        std::cerr << "connect: " << ::strerror(errno) << std::endl;
+        return -1;
+    }
+
+    int yes = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/**
+ * Builds the address of a Unix domain socket.
+ *
+ *  path    The path of the socket file, or '@' followed by an abstract name.
+ *  addr    The address to fill in.
+ *  len     Set to the length of the address.
+ *
+ * Returns false if the path is too long, or true otherwise.
+ */
+bool get_unix_address(const char* path, struct sockaddr_un& addr, socklen_t& len) {
+    size_t size = std::strlen(path);
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (size < 2 || size >= sizeof(addr.sun_path)) {
+        std::cerr << "chatbench: invalid unix socket path: " << path << std::endl;
+        return false;
+    }
+
+    // An abstract name starts with a null byte and is not null-terminated
+    std::memcpy(addr.sun_path, path, size);
+    len = sizeof(addr);
+    if (path[0] == '@') {
+        addr.sun_path[0] = '\0';
+        len = offsetof(struct sockaddr_un, sun_path) + size;
+    }
+    return true;
+}
+
+/**
+ * Sends and receives messages for one thread's clients until the run is over.
+ *
+ * Messages are due at even intervals from the start time, and each one
+ * is sent by the next client in turn. The thread sends every message
+ * that is due whenever it wakes up, so a late wakeup sends a burst
+ * instead of losing messages. After the last message is sent, the
+ * thread keeps receiving for CHATBENCH_DRAIN_MS.
+ *
+ *  worker  The clients of this thread and their results.
+ *  options The settings of the run.
+ *  start   When the first message is due, from now_ns.
+ */
+void run_worker(BenchWorker* worker, const BenchOptions* options, uint64_t start) {
+    std::vector<BenchClient>& clients = worker->clients;
+    int epfd = ::epoll_create1(0);
+
+    // Watch every client for both directions. The events are edge
+    // triggered, so each socket is read and written until it would block.
+    for (size_t i = 0; i < clients.size(); ++i) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u64 = i;
+        ::epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].fd, &ev);
+    }
+
+    uint64_t send_end = start + static_cast<uint64_t>(options->duration * 1e9);
+    uint64_t stop = send_end + CHATBENCH_DRAIN_MS * 1000000ull;
+    uint64_t scheduled = 0;     // Messages that were due so far
+    size_t next = 0;            // Client that sends the next message
+    std::vector<struct epoll_event> events(256);
+
+    uint64_t now = now_ns();
+    while (now < stop) {
+        // Send every message that is due by now
+        if (now >= start && now < send_end && worker->rate > 0) {
+            // Message n is due n / rate seconds after the start
+            uint64_t due = static_cast<uint64_t>((now - start) / 1e9 * worker->rate) + 1;
+            for (; scheduled < due; ++scheduled) {
+                // Skip clients that were disconnected
+                size_t tries = 0;
+                while (clients[next].fd == -1 && tries < clients.size()) {
+                    next = (next + 1) % clients.size();
+                    ++tries;
+                }
+                BenchClient& client = clients[next];
+                next = (next + 1) % clients.size();
+                if (client.fd == -1 || client.out.size() - client.out_offset > CHATBENCH_MAX_PENDING) {
+                    ++worker->skipped;
+                    continue;
+                }
+
+                // Stamp the message with the time it was due, not the
+                // time it is sent, so a stalled sender is measured too
+                bool idle = client.out.size() == client.out_offset;
+                queue_message(client, *options, start + static_cast<uint64_t>(scheduled * 1e9 / worker->rate));
+                ++worker->sent;
+                if (idle && !flush_client(client))
+                    close_client(client, *worker);
+            }
+        }
+
+        // Wake up every millisecond while sending, to stay on schedule
+        int timeout = 1;
+        if (now < start)
+            timeout = static_cast<int>((start - now) / 1000000) + 1;
+        else if (now >= send_end)
+            timeout = static_cast<int>((stop - now) / 1000000) + 1;
+
+        int count = ::epoll_wait(epfd, events.data(), events.size(), timeout);
+        for (int i = 0; i < count; ++i) {
+            BenchClient& client = clients[events[i].data.u64];
+            if (client.fd == -1)
+                continue;
+
+            bool open = true;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                open = read_client(client, *worker, *options);
+            if (open && (events[i].events & EPOLLOUT))
+                open = flush_client(client);
+            if (!open)
+                close_client(client, *worker);
+        }
+        now = now_ns();
+    }
+
+    for (size_t i = 0; i < clients.size(); ++i) {
+        if (clients[i].fd != -1)
+            ::close(clients[i].fd);
+    }
+    ::close(epfd);
+}
+
+/**
+ * Adds a message to the data a client has waiting to be sent.
+ *
+ * The message is "b<id>> <due> " followed by enough 'x' characters
+ * to make it the requested size. The "b<id>> " prefix looks like the
+ * handle that chatclient adds, so chatserve treats it as chat text.
+ *
+ *  client  The client that sends the message.
+ *  options The settings of the run.
+ *  due     When the message was due, from now_ns.
+ */
+void queue_message(BenchClient& client, const BenchOptions& options, uint64_t due) {
+    char text[64];
+    int length = std::snprintf(text, sizeof(text), "b%d> %llu ",
+        client.id, static_cast<unsigned long long>(due));
+
+    // Text mode messages end with a newline, which counts toward the size
+    size_t body = options.size;
+    if (!options.framed && body > 0)
+        --body;
+    if (body < static_cast<size_t>(length))
+        body = length;
+
+    // Drop data that was already sent before the buffer grows
+    if (client.out_offset == client.out.size()) {
+        client.out.clear();
+        client.out_offset = 0;
+    }
+
+    if (options.framed) {
+        uint32_t size = static_cast<uint32_t>(body);
+        char prefix[4] = {
+            static_cast<char>(size >> 24), static_cast<char>(size >> 16),
+            static_cast<char>(size >> 8), static_cast<char>(size)
+        };
+        client.out.append(prefix, sizeof(prefix));
+    }
+    client.out.append(text, length);
+    client.out.append(body - length, 'x');
+    if (!options.framed)
+        client.out.push_back('\n');
+}
+
+/**
+ * Sends as much of a client's waiting data as the socket accepts.
+ *
+ *  client  The client to send for.
+ *
+ * Returns false if the connection failed, or true otherwise.
+ */
+bool flush_client(BenchClient& client) {
+    while (client.out_offset < client.out.size()) {
+        ssize_t sent = ::send(client.fd, client.out.data() + client.out_offset,
+            client.out.size() - client.out_offset, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        client.out_offset += sent;
+    }
+    return true;
+}
+
+/**
+ * Reads everything a client has received and records the latency
+ * of each message that carries a send time.
+ *
+ * Messages without one, such as those typed at the server console,
+ * are ignored.
+ *
+ *  client  The client to read for.
+ *  worker  The thread that records the results.
+ *  options The settings of the run.
+ *
+ * Returns false if the server closed the connection, or true otherwise.
+ */
+bool read_client(BenchClient& client, BenchWorker& worker, const BenchOptions& options) {
+    char buf[CHATBENCH_READ_SIZE];
+    bool open = true;
+
+    while (true) {
+        ssize_t received = ::recv(client.fd, buf, sizeof(buf), 0);
+        if (received > 0) {
+            client.in.append(buf, received);
+            continue;
+        }
+        if (received < 0 && errno == EINTR)
+            continue;
+        open = received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        break;
+    }
+
+    // Every message in this batch arrived at about the same time
+    uint64_t now = now_ns();
+    unsigned long timed = worker.received;
+    size_t pos = 0;
+    while (true) {
+        const char* data;
+        size_t size;
+        if (options.framed) {
+            if (client.in.size() - pos < 4)
+                break;
+            const unsigned char* prefix = reinterpret_cast<const unsigned char*>(client.in.data() + pos);
+            size = (static_cast<size_t>(prefix[0]) << 24) | (prefix[1] << 16) | (prefix[2] << 8) | prefix[3];
+            if (client.in.size() - pos - 4 < size)
+                break;
+            data = client.in.data() + pos + 4;
+            pos += 4 + size;
+        }
+        else {
+            size_t end = client.in.find('\n', pos);
+            if (end == std::string::npos)
+                break;
+            data = client.in.data() + pos;
+            size = end - pos;
+            pos = end + 1;
+        }
+
+        // Only messages that start with a "b<id>> " handle are timed
+        if (size < 4 || data[0] != 'b')
+            continue;
+        const char* mark = static_cast<const char*>(std::memchr(data, '>', size));
+        if (mark == nullptr || mark + 2 >= data + size)
+            continue;
+        uint64_t due = std::strtoull(mark + 2, nullptr, 10);
+        if (due == 0)
+            continue;
+
+        // The sender's server follows from its id, as in main
+        uint64_t latency = now > due ? now - due : 0;
+        worker.latency.record(latency);
+        ++worker.received;
+        int sender = std::atoi(data + 1);
+        if (sender % static_cast<int>(options.ports.size()) != client.node) {
+            worker.relay_latency.record(latency);
+            ++worker.relayed;
+        }
+        else {
+            worker.local_latency.record(latency);
+        }
+    }
+    client.in.erase(0, pos);
+
+    // The longest time without any timed message shows a server pause
+    if (worker.received > timed) {
+        if (worker.last_arrival != 0 && now - worker.last_arrival > worker.longest_gap) {
+            worker.longest_gap = now - worker.last_arrival;
+            worker.gap_end = now;
+        }
+        worker.last_arrival = now;
+    }
+
+    return open;
+}
+
+/**
+ * Closes a client that the server disconnected and counts it.
+ *
+ *  client  The client to close.
+ *  worker  The thread that records the results.
+ */
+void close_client(BenchClient& client, BenchWorker& worker) {
+    ::close(client.fd);
+    client.fd = -1;
+    ++worker.disconnects;
+}
+
+/**
+ * Reads the buffer pool counters from the statistics of chatserve.
+ *
+ *  path    The statistics socket that chatserve was given with -s.
+ *  counts  Set to the counters.
+ *
+ * Returns false if the statistics could not be read, or true otherwise.
+ */
+bool read_pool_counts(const char* path, PoolCounts& counts) {
+    struct sockaddr_un addr;
+    socklen_t len;
+    if (!get_unix_address(path, addr, len))
+        return false;
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || ::connect(fd, reinterpret_cast<struct sockaddr*>(&addr), len) == -1) {
+        std::cerr << "chatbench: cannot read statistics from " << path << ": "
+            << ::strerror(errno) << std::endl;
+        if (fd != -1)
+            ::close(fd);
+        return false;
+    }
+
+    // The server sends the statistics and closes the connection
+    std::string text;
+    char buf[4096];
+    ssize_t received;
+    while ((received = ::recv(fd, buf, sizeof(buf), 0)) > 0)
+        text.append(buf, received);
+    ::close(fd);
+
+    size_t pos = text.find("buffers: ");
+    return pos != std::string::npos
+        && std::sscanf(text.c_str() + pos, "buffers: allocations: %llu, hits: %*u, misses: %llu",
+            &counts.allocations, &counts.misses) == 2;
+}
+
+/**
+ * Prints the combined results of every thread as one line of JSON.
+ *
+ * Latencies are in microseconds. The expected number of deliveries
+ * assumes every message reaches every other client that sends and
+ * receives, which is every client that connected unless there was
+ * a hot restart.
+ * With more than one server, the messages that crossed a relay link
+ * are also reported on their own, with how much later they arrived
+ * at the median than messages that stayed on one server.
+ *
+ *  options     The settings of the run.
+ *  workers     The threads and their results.
+ *  connected   The number of clients that connected.
+ *  failed      The number of clients that could not connect.
+ *  pool        The buffers the server allocated during the run,
+ *              or null if they were not read.
+ *  restart     The clients held across a hot restart, or null if there
+ *              was none.
+ */
+void print_results(const BenchOptions& options, const std::vector<BenchWorker*>& workers,
+        int connected, int failed, const PoolCounts* pool, const RestartCounts* restart) {
+    LatencyHistogram latency, local_latency, relay_latency;
+    unsigned long relayed = 0;
+    unsigned long sent = 0;
+    unsigned long skipped = 0;
+    unsigned long received = 0;
+    unsigned long disconnects = 0;
+    uint64_t longest_gap = 0;
+    uint64_t gap_end = 0;
+    size_t receivers = 0;
+    for (size_t i = 0; i < workers.size(); ++i) {
+        receivers += workers[i]->clients.size();
+        if (workers[i]->longest_gap > longest_gap) {
+            longest_gap = workers[i]->longest_gap;
+            gap_end = workers[i]->gap_end;
+        }
+        latency.merge(workers[i]->latency);
+        local_latency.merge(workers[i]->local_latency);
+        relay_latency.merge(workers[i]->relay_latency);
+        relayed += workers[i]->relayed;
+        sent += workers[i]->sent;
+        skipped += workers[i]->skipped;
+        received += workers[i]->received;
+        disconnects += workers[i]->disconnects;
+    }
+    double expected = static_cast<double>(sent) * (receivers - 1);
+
+    std::printf("{\"clients\": %d, \"threads\": %d, \"rate\": %.0f, \"size\": %zu, "
+        "\"duration_s\": %.3f, \"mode\": \"%s\", \"transport\": \"%s\", "
+        "\"connected\": %d, \"connect_failures\": %d, \"disconnects\": %lu, "
+        "\"sent\": %lu, \"skipped\": %lu, \"delivered\": %lu, \"delivery_ratio\": %.4f, "
+        "\"delivered_per_s\": %.0f, "
+        "\"latency_us\": {\"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, "
+        "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+        options.clients, options.threads, options.rate, options.size,
+        options.duration, options.framed ? "framed" : "text",
+        options.unix_path != nullptr ? "unix" : "tcp", connected, failed, disconnects,
+        sent, skipped, received, expected > 0 ? received / expected : 0.0,
+        received / options.duration,
+        latency.get_min() / 1e3, latency.get_mean() / 1e3,
+        latency.get_percentile(50) / 1e3, latency.get_percentile(99) / 1e3,
+        latency.get_percentile(99.9) / 1e3, latency.get_max() / 1e3);
+    if (options.ports.size() > 1) {
+        std::printf(", \"nodes\": %zu, \"relay\": {\"delivered\": %lu, "
+            "\"delivered_per_s\": %.0f, \"latency_us\": {\"p50\": %.1f, "
+            "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}, "
+            "\"local_p50_us\": %.1f, \"added_p50_us\": %.1f}",
+            options.ports.size(), relayed, relayed / options.duration,
+            relay_latency.get_percentile(50) / 1e3, relay_latency.get_percentile(99) / 1e3,
+            relay_latency.get_percentile(99.9) / 1e3, relay_latency.get_max() / 1e3,
+            local_latency.get_percentile(50) / 1e3,
+            (static_cast<double>(relay_latency.get_percentile(50))
+                - local_latency.get_percentile(50)) / 1e3);
+    }
+    if (restart != nullptr) {
+        // The pause is the longest gap of any thread; it should start
+        // soon after the command was run
+        std::printf(", \"restart\": {\"started\": %s, \"held\": %d, "
+            "\"held_disconnects\": %d, \"pause_ms\": %.1f, \"pause_start_ms\": %.1f}",
+            restart->started_at != 0 ? "true" : "false", restart->held,
+            restart->held_closed, longest_gap / 1e6,
+            restart->started_at != 0 && gap_end != 0
+                ? (static_cast<double>(gap_end - longest_gap) - restart->started_at) / 1e6 : 0.0);
+    }
+    if (pool != nullptr) {
+        std::printf(", \"server_buffers\": {\"allocations\": %llu, \"misses\": %llu, "
+            "\"hit_rate\": %.4f, \"per_delivery\": %.5f, \"misses_per_delivery\": %.5f}",
+            pool->allocations, pool->misses,
+            pool->allocations > 0 ? 1.0 - static_cast<double>(pool->misses) / pool->allocations : 0.0,
+            received > 0 ? static_cast<double>(pool->allocations) / received : 0.0,
+            received > 0 ? static_cast<double>(pool->misses) / received : 0.0);
+    }
+    std::printf("}\n");
+}
+
+/**
+ * Measures how long the server takes to accept a reconnect storm.
+ *
+ * Every client starts a non-blocking connect at the same moment.
+ * Once the first one is connected, it sends a probe message every
+ * CHATBENCH_PROBE_MS, and a client counts as ready when it receives
+ * one, which shows that the server has accepted it and added it to
+ * the lobby. The run ends when every client is ready or after
+ * CHATBENCH_STORM_TIMEOUT_MS.
+ *
+ * The results are printed as one line of JSON. Times are in
+ * milliseconds from the start of the storm, and a time of -1 means
+ * that it was never reached.
+ *
+ *  options The settings of the run.
+ */
+void run_storm(const BenchOptions& options) {
+    // Every client connects to the first address of the server
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    if (options.unix_path != nullptr) {
+        if (!get_unix_address(options.unix_path,
+            reinterpret_cast<struct sockaddr_un&>(addr), addrlen))
+            exit(1);
+    }
+    else {
+        struct addrinfo hints;
+        struct addrinfo* info = nullptr;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        int retval = ::getaddrinfo(options.host, options.port, &hints, &info);
+        if (retval != 0) {
+            std::cerr << "getaddrinfo: " << ::gai_strerror(retval) << std::endl;
+            exit(1);
+        }
+        std::memcpy(&addr, info->ai_addr, info->ai_addrlen);
+        addrlen = info->ai_addrlen;
+        ::freeaddrinfo(info);
+    }
+
+    // State of each client: 0 connecting, 1 connected, 2 ready, -1 failed
+    std::vector<int> fds(options.clients, -1);
+    std::vector<int> states(options.clients, 0);
+    int epfd = ::epoll_create1(0);
+    LatencyHistogram connect_time;
+    int connected = 0;
+    int ready = 0;
+    int failed = 0;
+    int prober = -1;
+    uint64_t all_connected = 0;
+    uint64_t all_ready = 0;
+    uint64_t next_probe = 0;
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < options.clients; ++i) {
+        int fd = ::socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd == -1 || (::connect(fd, reinterpret_cast<struct sockaddr*>(&addr), addrlen) == -1
+            && errno != EINPROGRESS)) {
+            if (fd != -1)
+                ::close(fd);
+            states[i] = -1;
+            ++failed;
+            continue;
+        }
+        int yes = 1;
+        if (options.unix_path == nullptr)
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+        ev.data.u32 = i;
+        ::epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        fds[i] = fd;
+    }
+
+    std::vector<struct epoll_event> events(1024);
+    char buf[CHATBENCH_READ_SIZE];
+    uint64_t deadline = start + CHATBENCH_STORM_TIMEOUT_MS * 1000000ull;
+    uint64_t now = now_ns();
+    while (now < deadline && ready + failed < options.clients) {
+        // Keep probing until every connected client has seen a probe
+        if (prober != -1 && now >= next_probe) {
+            BenchClient probe;
+            probe.id = prober;
+            probe.out_offset = 0;
+            queue_message(probe, options, now);
+            ::send(fds[prober], probe.out.data(), probe.out.size(), MSG_NOSIGNAL);
+            next_probe = now + CHATBENCH_PROBE_MS * 1000000ull;
+        }
+
+        int count = ::epoll_wait(epfd, events.data(), events.size(), CHATBENCH_PROBE_MS);
+        now = now_ns();
+        for (int i = 0; i < count; ++i) {
+            int id = events[i].data.u32;
+            int fd = fds[id];
+
+            if (states[id] == 0 && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int error = 0;
+                socklen_t size = sizeof(error);
+                ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size);
+                if (error != 0) {
+                    states[id] = -1;
+                    ++failed;
+                    ::epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+                    ::close(fd);
+                    continue;
+                }
+
+                // Only incoming data matters from now on
+                states[id] = 1;
+                ++connected;
+                connect_time.record(now - start);
+                struct epoll_event ev;
+                ev.events = EPOLLIN | EPOLLRDHUP;
+                ev.data.u32 = id;
+                ::epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+
+                // The first client to connect sends the probes and
+                // does not need to receive one itself
+                if (prober == -1) {
+                    prober = id;
+                    states[id] = 2;
+                    ++ready;
+                }
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+                ssize_t received;
+                bool any = false;
+                while ((received = ::recv(fd, buf, sizeof(buf), 0)) > 0)
+                    any = true;
+                if (any && states[id] == 1) {
+                    states[id] = 2;
+                    ++ready;
+                }
+            }
+        }
+
+        if (all_connected == 0 && connected + failed == options.clients)
+            all_connected = now;
+        if (all_ready == 0 && ready + failed == options.clients)
+            all_ready = now;
+    }
+
+    for (size_t i = 0; i < fds.size(); ++i) {
+        if (states[i] != -1)
+            ::close(fds[i]);
+    }
+    ::close(epfd);
+
+    std::printf("{\"mode\": \"storm\", \"transport\": \"%s\", "
+        "\"clients\": %d, \"connected\": %d, "
+        "\"connect_failures\": %d, \"ready\": %d, "
+        "\"connect_ms\": {\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f}, "
+        "\"all_connected_ms\": %.1f, \"all_ready_ms\": %.1f}\n",
+        options.unix_path != nullptr ? "unix" : "tcp",
+        options.clients, connected, failed, ready,
+        connect_time.get_percentile(50) / 1e6, connect_time.get_percentile(99) / 1e6,
+        connect_time.get_max() / 1e6,
+        all_connected ? (all_connected - start) / 1e6 : -1.0,
+        all_ready ? (all_ready - start) / 1e6 : -1.0);
+}
+
+/**
+ * Runs the command that starts the new server for a hot restart,
+ * without waiting for it.
+ *
+ *  command The shell command.
+ *
+ * Returns false if it could not be started, or true otherwise.
+ */
+bool start_restart(const char* command) {
+    pid_t pid = ::fork();
+    if (pid == 0) {
+        // The new server must not hold the clients' sockets open,
+        // or the results pipe, which would keep a reader waiting
+        int null = ::open("/dev/null", O_WRONLY);
+        ::dup2(null, STDOUT_FILENO);
+        long max_fd = ::sysconf(_SC_OPEN_MAX);
+        for (int fd = 3; fd < max_fd; ++fd)
+            ::close(fd);
+        ::execl("/bin/sh", "sh", "-c", command, static_cast<char*>(nullptr));
+        ::_exit(127);
+    }
+    if (pid == -1) {
+        std::cerr << "chatbench: cannot run " << command << ": " << ::strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Sends a command such as "/leave lobby" from a client, with the
+ * client's handle in front of it like chatclient adds.
+ *
+ *  fd      The socket of the client.
+ *  id      The number used in the handle.
+ *  command The command.
+ *  options The settings of the run.
+ */
+void send_command(int fd, int id, const char* command, const BenchOptions& options) {
+    char text[64];
+    int length = std::snprintf(text, sizeof(text), "b%d> %s", id, command);
+    std::string out;
+    if (options.framed) {
+        char prefix[4] = {
+            static_cast<char>(length >> 24), static_cast<char>(length >> 16),
+            static_cast<char>(length >> 8), static_cast<char>(length)
+        };
+        out.append(prefix, sizeof(prefix));
+    }
+    out.append(text, length);
+    if (!options.framed)
+        out.push_back('\n');
+
+    // A new connection always has room for a few bytes
+    ::send(fd, out.data(), out.size(), MSG_NOSIGNAL);
+}
@@ -6,59 +6,361 @@
 * Description:  A multiuser chat server written in C++.
 *
 *               This program accepts TCP connections from chatclient clients
-*               and adds them to a chat room that persists as long as
-*               the program is running.
+*               and adds them to a lobby channel that persists as long as
+*               the program is running. Clients can join other channels
+*               with "/join name", leave them with "/leave name", and send
+*               to one with "#name message". A client can also send a
+*               direct message with "@handle message", which only goes
+*               to the client whose first message had that handle.
 *               Messages received from clients are displayed in the console
-*               and forwarded to all other connected clients.
+*               and forwarded to the other members of their channel.
 *
 *               The command line syntax is as follows:
 *
-*                   chatserve port
+*                   chatserve [-t threads] [-q bytes] [-p policy] [-m mode]
+*                             [-i backend] [-l logdir] [-s path]
+*                             [-o output] [-f ms] [-b backlog]
+*                             [-w window] [-W limit] [-u socket]
+*                             [-r msg_rate] [-R byte_rate] [-a action]
+*                             [-F relay_port] [-J peer]...
+*                             [-I idle] [-H heartbeat] [-x check]
+*                             [-T handoff] port
 *
 *               This program takes the following arguments:
+*               - threads   -- The number of threads that accept and route
+*                              messages (default 1). Each thread has its
+*                              own listening socket on the same port.
+*               - bytes     -- The maximum number of bytes queued for
+*                              a client that is not reading fast enough
+*                              (default 1048576, 0 for no limit).
+*               - policy    -- What to do when a client's queue is full:
+*                              drop-oldest (default), drop-newest
+*                              or disconnect.
+*               - mode      -- How messages are delimited: text (default),
+*                              which is what chatclient uses, or framed,
+*                              where each message is preceded by its
+*                              length as a 4-byte big-endian integer.
+*               - backend   -- How sockets are read and written: epoll
+*                              (default) or uring, which uses io_uring
+*                              and falls back to epoll if the kernel
+*                              does not support it.
+*               - logdir    -- A directory in which every message is also
+*                              logged, so that clients can ask for messages
+*                              older than the ones kept in memory, even
+*                              after the server is restarted.
+*               - path      -- A Unix domain socket on which the statistics
+*                              shown by \stats are served to anyone who
+*                              connects.
+*               - output    -- A file to which connections and messages are
+*                              written instead of the console.
+*               - ms        -- How often, in milliseconds, connections and
+*                              messages are written out (default 10).
+*                              They are written by a thread of their own,
+*                              so a slow console never delays routing.
+*               - backlog   -- The number of connections the kernel queues
+*                              until they are accepted (default SOMAXCONN).
+*                              A larger queue lets many clients reconnect
+*                              at once after a restart without being refused.
+*               - window    -- The longest time, in microseconds, that
+*                              messages for a client are held back so
+*                              that they are sent together (default 0,
+*                              which sends at the end of every wakeup).
+*                              Messages are only held back while they
+*                              arrive more often than this.
+*               - limit     -- The number of bytes held back for any one
+*                              client that sends them before the window
+*                              ends (default 65536).
+*               - socket    -- A Unix domain socket on which clients on
+*                              the same host can also connect, instead of
+*                              going through TCP loopback. A name that
+*                              starts with '@' is an abstract socket,
+*                              which has no file. The first thread
+*                              accepts these clients.
+*               - msg_rate  -- The number of messages per second that each
+*                              client may send (default 0, no limit).
+*               - byte_rate -- The number of bytes per second that each
+*                              client may send (default 0, no limit).
+*                              Either limit allows bursts of one second
+*                              at the full rate.
+*               - action    -- What to do with a client that sends faster
+*                              than that: delay (default), which stops
+*                              reading from it until it may send again,
+*                              drop, which drops its messages, or
+*                              disconnect.
+*               - relay_port -- A TCP port on which other chatserve
+*                              instances link to this one, so that
+*                              clients of all of them share the same
+*                              channels.
+*               - peer      -- Another chatserve instance to link to,
+*                              as host:relay_port. May be repeated.
+*                              Messages are passed on between linked
+*                              servers, so every server only needs a
+*                              path to every other one, not a link.
+*               - idle      -- The number of seconds after which a client
+*                              that has sent nothing is disconnected
+*                              (default 0, never). This removes
+*                              connections whose other end went away
+*                              without closing them.
+*               - heartbeat -- The number of seconds after which a client
+*                              that has sent nothing is sent "/ping"
+*                              (default 0, never). chatclient answers
+*                              with "/pong", which counts as activity.
+*                              Must be less than idle, if both are set.
+*               - check     -- Whether every message must be valid UTF-8
+*                              without control characters: on (default),
+*                              which drops invalid messages and replaces
+*                              control characters with '?', or off, which
+*                              passes on any bytes, such as binary framed
+*                              messages.
+*               - handoff   -- A Unix domain socket for hot restarts.
+*                              If a server is waiting on it, this one
+*                              takes over its listening sockets and
+*                              clients, which stay connected, and the
+*                              old server exits. Then this one waits on
+*                              it for the next restart. Both servers must
+*                              use the same mode.
 *               - port      -- The TCP port on which to wait for client
 *                              connections.
 \*********************************************************/
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <mutex>
-#include <queue>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <thread>
-#include <unistd.h>
 #include <vector>
+#include <sys/resource.h>
+#include <unistd.h>     // getopt
 
-#include "Socket.hpp"
-#include "SocketStream.hpp"
+#include "BufferPool.hpp"
+#include "HandleIndex.hpp"
+#include "Handoff.hpp"
+#include "Relay.hpp"
+#include "Shard.hpp"
+#include "StatsSocket.hpp"
+#include "TextFilter.hpp"
 
 /*========================================================*
  * Global variables
  *========================================================*/
-// A queue for outgoing messages typed in the server console
-std::queue<std::string> outgoing;
-// A mutex for ensuring thread-safe access to outgoing queue
-std::mutex outgoing_mutex;
+// All shards in the server. Each one runs on its own thread
+// and owns a listening socket and a subset of the clients.
+std::vector<Shard*> shards;
 
-// A list of sockets for all connected clients
-std::vector<SocketStream> clients;
-// A mutex for ensuring thread-safe access to socket list
-std::mutex clients_mutex;
+// The recorded messages of every channel, shared by all shards
+History* history;
+
+// Serves the statistics to local monitoring tools, if requested
+StatsSocket stats_socket;
+
+// Writes the console output of all shards
+LogSink log_sink;
+
+// Links this server to other servers, or null if it has no relay
+Relay* relay;
+
+// Finds the connection of each client's handle, shared by all shards
+HandleIndex handles;
+
+// Passes the sockets to a new server for a hot restart
+Handoff handoff;
+
+// Set while the shards are handing over, when the server user's
+// messages would not reach anyone. Guarded by console_mutex.
+bool handing_off = false;
+std::mutex console_mutex;
+
+// Resident memory once the server was set up, before any clients
+unsigned long startup_rss;
 
 /*========================================================*
  * Forward declarations
  *========================================================*/
 void get_input(std::string);
-void handle_clients(std::string);
+void hand_off(bool framed);
+std::string get_stats();
+unsigned long get_rss();
+void print_histogram(std::ostream& out, const char* name,
+    const LatencyHistogram& histogram, double scale);
 
 /*========================================================*
  * main function
  *========================================================*/
 int main(int argc, char* argv[]) {
+    int threads = 1;
+    bool valid = true;
+    int opt;
+
+    ShardOptions options;
+    options.outbox_limit.max_bytes = 1048576;
+    options.outbox_limit.policy = DROP_OLDEST;
+    options.framed = false;
+    options.uring = false;
+    options.backlog = SOCKET_CONNECTION_QUEUE;
+    options.coalesce_us = 0;
+    options.coalesce_bytes = SHARD_COALESCE_BYTES;
+    options.rate_limit.action = LIMIT_DELAY;
+    options.relay = nullptr;
+    options.handles = &handles;
+    options.idle_ms = 0;
+    options.heartbeat_ms = 0;
+    options.check_text = true;
+    const char* relay_port = nullptr;
+    std::vector<std::string> relay_peers;
+    const char* log_dir = nullptr;
+    const char* stats_path = nullptr;
+    const char* output_path = nullptr;
+    const char* unix_path = nullptr;
+    const char* handoff_path = nullptr;
+
+    // Parse command line options
+    while ((opt = ::getopt(argc, argv, "t:q:p:m:i:l:s:o:f:b:w:W:u:r:R:a:F:J:I:H:x:T:")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = std::atoi(optarg);
+            valid = valid && threads > 0;
+            break;
+        case 'q':
+            options.outbox_limit.max_bytes = std::strtoul(optarg, nullptr, 10);
+            break;
+        case 'p':
+            if (std::strcmp(optarg, "drop-oldest") == 0)
+                options.outbox_limit.policy = DROP_OLDEST;
+            else if (std::strcmp(optarg, "drop-newest") == 0)
+                options.outbox_limit.policy = DROP_NEWEST;
+            else if (std::strcmp(optarg, "disconnect") == 0)
+                options.outbox_limit.policy = DISCONNECT;
+            else
+                valid = false;
+            break;
+        case 'm':
+            if (std::strcmp(optarg, "text") == 0)
+                options.framed = false;
+            else if (std::strcmp(optarg, "framed") == 0)
+                options.framed = true;
+            else
+                valid = false;
+            break;
+        case 'i':
+            if (std::strcmp(optarg, "epoll") == 0)
+                options.uring = false;
+            else if (std::strcmp(optarg, "uring") == 0)
+                options.uring = true;
+            else
+                valid = false;
+            break;
+        case 'l':
+            log_dir = optarg;
+            break;
+        case 's':
+            stats_path = optarg;
+            break;
+        case 'o':
+            output_path = optarg;
+            break;
+        case 'f':
+            log_sink.set_interval(std::atoi(optarg));
+            valid = valid && std::atoi(optarg) > 0;
+            break;
+        case 'b':
+            options.backlog = std::atoi(optarg);
+            valid = valid && options.backlog > 0;
+            break;
+        case 'w':
+            options.coalesce_us = std::strtoul(optarg, nullptr, 10);
+            break;
+        case 'W':
+            options.coalesce_bytes = std::strtoul(optarg, nullptr, 10);
+            valid = valid && options.coalesce_bytes > 0;
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'r':
+            options.rate_limit.messages = TokenRate(std::atof(optarg));
+            valid = valid && std::atof(optarg) >= 0;
+            break;
+        case 'R':
+            options.rate_limit.bytes = TokenRate(std::atof(optarg));
+            valid = valid && std::atof(optarg) >= 0;
+            break;
+        case 'a':
+            if (std::strcmp(optarg, "delay") == 0)
+                options.rate_limit.action = LIMIT_DELAY;
+            else if (std::strcmp(optarg, "drop") == 0)
+                options.rate_limit.action = LIMIT_DROP;
+            else if (std::strcmp(optarg, "disconnect") == 0)
+                options.rate_limit.action = LIMIT_DISCONNECT;
+            else
+                valid = false;
+            break;
+        case 'F':
+            relay_port = optarg;
+            break;
+        case 'J':
+            relay_peers.push_back(optarg);
+            break;
+        case 'I':
+            options.idle_ms = static_cast<unsigned>(std::atof(optarg) * 1000);
+            valid = valid && std::atof(optarg) >= 0;
+            break;
+        case 'H':
+            options.heartbeat_ms = static_cast<unsigned>(std::atof(optarg) * 1000);
+            valid = valid && std::atof(optarg) >= 0;
+            break;
+        case 'x':
+            if (std::strcmp(optarg, "on") == 0)
+                options.check_text = true;
+            else if (std::strcmp(optarg, "off") == 0)
+                options.check_text = false;
+            else
+                valid = false;
+            break;
+        case 'T':
+            handoff_path = optarg;
+            break;
+        default:
+            valid = false;
+            break;
+        }
+    }
+
+    // A heartbeat has to come before the idle timeout to be answered
+    if (options.idle_ms > 0 && options.heartbeat_ms >= options.idle_ms)
+        valid = false;
+
     // Verify command line arguments
-    if (argc != 2) {
-        std::cout << "usage: " << argv[0] << " listen_port" << std::endl;
+    if (argc - optind != 1 || !valid) {
+        std::cout << "usage: " << argv[0]
+            << " [-t threads] [-q bytes] [-p drop-oldest|drop-newest|disconnect]"
+            << " [-m text|framed] [-i epoll|uring] [-l logdir] [-s stats_path]"
+            << " [-o output] [-f flush_ms] [-b backlog] [-w window_us]"
+            << " [-W limit_bytes] [-u unix_path] [-r messages_per_s]"
+            << " [-R bytes_per_s] [-a delay|drop|disconnect]"
+            << " [-F relay_port] [-J host:relay_port]..."
+            << " [-I idle_s] [-H heartbeat_s] [-x on|off] [-T handoff_path]"
+            << " listen_port"
+            << std::endl;
         exit(1);
     }
+    const char* port = argv[optind];
+
+    if (options.uring && !Uring::is_supported()) {
+        std::cout << "io_uring is not supported by this kernel; using epoll"
+            << std::endl;
+        options.uring = false;
+    }
+
+    // Allow as many connections as the hard limit permits
+    struct rlimit limit;
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &limit);
+    }
 
     // Prompt the user for their handle
     // Keep prompting until a valid handle is entered
@@ -68,16 +370,95 @@ int main(int argc, char* argv[]) {
         std::getline(std::cin, handle);
     }
 
-    // Instantiate a Socket for listening
-    // The Socket class member functions abstract away the details
-    // of the socket library.
-    Socket s = Socket();
+    // Take over from a server that is already running, if there is one.
+    // This waits until it has exited, so its ports and files are free.
+    uint64_t handoff_start = ShardStats::now();
+    try {
+        if (handoff_path != nullptr && handoff.connect(handoff_path, options.framed)) {
+            handoff.receive();
+            handoff.release();
+        }
+    }
+    catch (const std::runtime_error& ex) {
+        std::cout << ex.what() << std::endl;
+        exit(1);
+    }
 
-    // Start listening for connections
+    // Create one shard per thread and start listening for connections.
+    // When there is more than one shard, every listening socket sets
+    // SO_REUSEPORT so the kernel spreads new connections across them.
+    // Listening sockets taken over are used as they are, so connections
+    // queued on them are not lost. With hot restarts, SO_REUSEPORT is
+    // set even for one shard, so that a new server with more shards can
+    // add sockets next to the ones it takes over.
     try {
-        s.listen(argv[1]);
-        std::cout << "Waiting for connections on port "
-            << argv[1] << "..." << std::endl;
+        history = new History();
+        if (log_dir != nullptr)
+            history->open_log(log_dir);
+        options.history = history;
+        if (output_path != nullptr)
+            log_sink.open(output_path);
+        options.log = &log_sink;
+
+        // The relay only holds a reference to the shard list,
+        // so it can be created before the shards that use it
+        if (relay_port != nullptr || !relay_peers.empty()) {
+            relay = new Relay(shards, history, &log_sink, handle + "> ", options.check_text);
+            if (relay_port != nullptr)
+                relay->listen(relay_port);
+            for (auto it = relay_peers.begin(); it != relay_peers.end(); ++it)
+                relay->add_peer(*it);
+            options.relay = relay;
+        }
+
+        size_t inherited = handoff.get_shard_count();
+        for (int i = 0; i < threads; ++i) {
+            shards.push_back(new Shard(i, shards, handle + "> ", options));
+            if (static_cast<size_t>(i) < inherited && handoff.get_shard(i).listener != -1)
+                shards.back()->inherit_listener(handoff.get_shard(i).listener);
+            else
+                shards.back()->listen(port, threads > 1 || handoff_path != nullptr);
+        }
+
+        // Listening sockets of old threads that this server does not
+        // have are closed; connections queued on them are reset
+        int unix_listener = -1;
+        for (size_t i = 0; i < inherited; ++i) {
+            ShardHandoff& old = handoff.get_shard(i);
+            if (i >= shards.size() && old.listener != -1)
+                ::close(old.listener);
+            if (old.unix_listener != -1) {
+                if (unix_listener == -1 && unix_path != nullptr)
+                    unix_listener = old.unix_listener;
+                else
+                    ::close(old.unix_listener);
+            }
+        }
+        if (unix_listener != -1)
+            shards[0]->inherit_unix_listener(unix_listener);
+        else if (unix_path != nullptr)
+            shards[0]->listen_unix(unix_path);
+
+        // The clients of old threads that this server does not have
+        // are spread over the others
+        for (size_t i = 0; i < inherited; ++i)
+            shards[i % shards.size()]->adopt_clients(handoff.get_shard(i).clients);
+        if (inherited > 0)
+            std::cout << "Took over " << handoff.get_client_count() << " clients from "
+                << inherited << " threads in "
+                << (ShardStats::now() - handoff_start) / 1e6 << " ms" << std::endl;
+        if (handoff_path != nullptr)
+            handoff.listen(handoff_path);
+        if (stats_path != nullptr)
+            stats_socket.listen(stats_path);
+        startup_rss = get_rss();
+        std::cout << "Waiting for connections on port " << port;
+        if (unix_path != nullptr)
+            std::cout << " and " << unix_path;
+        std::cout << "..." << std::endl;
+        if (relay_port != nullptr)
+            std::cout << "Accepting links from other servers on port "
+                << relay_port << std::endl;
     }
     catch (const std::runtime_error& ex) {
         // Exit with an error if any exceptions occur during listen/bind
@@ -90,150 +471,372 @@ int main(int argc, char* argv[]) {
     // to receive messages while waiting for clients to send messages.
     std::thread input_thread (get_input, handle + "> ");
 
-    // Start client handling thread
-    // Having this in a separate thread allows the server to continue
-    // to accept new connections while handling the existing clients.
-    std::thread client_thread (handle_clients, handle + "> ");
+    // Start the thread that writes the output of the shards
+    std::thread log_thread (&LogSink::run, &log_sink);
+
+    // Start the thread that records messages for replay
+    std::thread history_thread (&History::run, history);
+
+    // Start the thread that serves the statistics, if requested
+    if (stats_path != nullptr)
+        std::thread(&StatsSocket::run, &stats_socket, get_stats).detach();
 
-    // Accept incoming connections until interrupt
+    // Start the thread that links this server to the others, if requested
+    if (relay != nullptr)
+        std::thread(&Relay::run, relay).detach();
+
+    // Start the thread that waits for a new server to take over, if requested
+    std::thread handoff_thread;
+    if (handoff_path != nullptr)
+        handoff_thread = std::thread(hand_off, options.framed);
+
+    // Start one thread per additional shard and run the first shard
+    // on this thread. Each shard accepts its own connections and routes
+    // messages until interrupt or a hot restart.
+    std::vector<std::thread> shard_threads;
+    for (size_t i = 1; i < shards.size(); ++i)
+        shard_threads.emplace_back(&Shard::run, shards[i]);
+    shards[0]->run();
+
+    // The shard only returns once it has handed over its sockets;
+    // the handoff thread exits the process once the others have too
+    handoff_thread.join();
+
+    return 0;
+}
+
+/**
+ * Waits for a new server to take over, and hands the listening sockets
+ * and clients of every shard over to it. Then exits without closing them
+ * or removing any socket files, which now belong to the new server.
+ * If the new server fails before it has everything, the shards go on
+ * serving, and this waits for the next one.
+ *
+ * This function is intended to be run in a separate thread.
+ *
+ *  framed  Whether the clients use framed mode.
+ */
+void hand_off(bool framed) {
     while (true) {
+        handoff.accept(framed);
+        uint64_t start = ShardStats::now();
+
+        // Nothing may be posted to the shards once they stop, or it
+        // would be neither handled nor handed over
+        {
+            std::lock_guard<std::mutex> lock(console_mutex);
+            handing_off = true;
+        }
+        if (relay != nullptr)
+            relay->pause();
+
+        handoff.begin(shards.size());
+        for (auto it = shards.begin(); it != shards.end(); ++it)
+            (*it)->post_handoff(&handoff);
         try {
-            // The SocketStream class abstracts away the details of sending
-            // and receiving data over a socket.
-            SocketStream ss = s.accept();
-            std::cout << std::endl
-                << "Accepted connection from: " << ss.get_hostname() << ":"
-                << ss.get_port() << std::endl;
-
-            // Add new socket to list of currently connected clients
-            // A mutex is used to prevent race conditions.
-            std::lock_guard<std::mutex> guard(clients_mutex);
-            clients.push_back(ss);
+            handoff.send();
         }
         catch (const std::runtime_error& ex) {
-            std::cout << ex.what() << std::endl;
+            // No socket has been given up, so the shards can go on
+            std::cout << ex.what() << "; still serving" << std::endl;
+            handoff.end(false);
+            if (relay != nullptr)
+                relay->resume();
+            std::lock_guard<std::mutex> lock(console_mutex);
+            handing_off = false;
+            continue;
         }
-
+        handoff.end(true);
+        std::cout << "Handed over " << handoff.get_client_count() << " clients in "
+            << (ShardStats::now() - start) / 1e6 << " ms" << std::endl;
+        break;
     }
 
-    return 0;
+    // Everything that was passed on, recorded or written so far is kept
+    if (relay != nullptr)
+        relay->flush();
+    history->flush();
+    log_sink.flush();
+    std::cout << std::flush;
+    ::_exit(0);
 }
 
 /**
- * Gets input from stdin and adds it to the outgoing message queue.
+ * Gets input from stdin and posts it to the inbox of every shard.
  *
  * This function is intended to be run in a separate thread for non-blocking
  * input on stdin. It displays a prompt that includes the server user's handle.
- * This function runs until the program terminates.
+ * A line starting with "#name " is only sent to the members of that channel,
+ * and a line starting with "@handle " only to the client with that handle.
+ * Nothing is sent while a new server is taking over.
+ * This function runs until the program terminates or stdin is closed.
  *
- *  prompt  The prompt string to display.
+ *  prompt  The prompt string to display and prepend to any entered text.
  */
 void get_input(std::string prompt) {
     std::string buf;
-    while (true) {
-        std::getline(std::cin, buf);
-        if (!buf.empty()) {
-            std::lock_guard<std::mutex> guard(outgoing_mutex);
-            outgoing.emplace(buf);
-            if (buf != "\\quit")
-                std::cout << prompt << std::flush;
+    // Stop reading when stdin is closed instead of spinning on EOF
+    while (std::getline(std::cin, buf)) {
+        if (buf.empty())
+            continue;
+
+        // Holding the lock keeps a hot restart from stopping the shards
+        // while this posts to them
+        std::lock_guard<std::mutex> lock(console_mutex);
+        if (handing_off && buf != "\\stats") {
+            std::cout << "A new server is taking over; not sent" << std::endl;
+            std::cout << prompt << std::flush;
+            continue;
+        }
+
+        if (buf == "\\quit") {
+            // Disconnect all clients
+            for (auto it = shards.begin(); it != shards.end(); ++it)
+                (*it)->post_quit();
+            continue;
         }
+
+        if (buf == "\\stats") {
+            // Display the routing cost
+            std::cout << get_stats();
+        }
+        else if (buf[0] == '@') {
+            // A direct message goes to the one shard of its recipient
+            std::string target = buf.substr(1, buf.find(' ') - 1);
+            HandleOwner owner;
+            if (handles.find(target, owner))
+                shards[owner.shard]->post_direct(MessagePtr(Message::create(prompt + buf)),
+                    owner.fd, target);
+            else
+                std::cout << "No such handle: " << target << std::endl;
+        }
+        else {
+            // A message starting with "#name " goes to that channel only;
+            // anything else goes to every client.
+            std::string channel;
+            if (buf[0] == '#') {
+                channel = buf.substr(1, buf.find(' ') - 1);
+                if (!ChannelIndex::is_valid_name(channel)) {
+                    std::cout << "Invalid channel name: " << channel << std::endl;
+                    std::cout << prompt << std::flush;
+                    continue;
+                }
+            }
+
+            // Send the message to the clients of every shard.
+            // Every shard shares the same message buffer.
+            MessagePtr message(Message::create(prompt + buf));
+            for (auto it = shards.begin(); it != shards.end(); ++it)
+                (*it)->post(message, channel);
+            if (relay != nullptr)
+                relay->post(message, channel);
+
+            // A message to every client is recorded in the lobby
+            history->append(message, channel.empty() ? CHANNEL_LOBBY : channel);
+        }
+        std::cout << prompt << std::flush;
     }
 }
 
 /**
- * Sends and receives messages to and from all connected clients.
- *
- * Any message entered in the server console is prepended with
- * the server user's handle and sent to all connected clients.
- * Any message received from a client is displayed in the server console
- * and sent to all other connected clients.
+ * Builds a report of the event loop wakeups and the CPU time consumed
+ * per routed message since the server was started, the traffic of each
+ * shard, and the latency of each step of routing a message.
  *
- * This function is intended to be run in a separate thread so that new
- * clients can continue to be accepted in the main thread.
+ * A message routed by several shards is counted once per shard.
+ * The histograms of all shards are combined, so the latencies are
+ * those of the whole server.
  *
- *  prompt  The prompt string to display and prepend to any entered text.
+ * Returns the report, one line per item.
  */
-void handle_clients(std::string prompt) {
-    while (true) {
-        // Sleep for 1 millisecond to avoid consuming too much CPU time
-        ::usleep(1000);
-
-        bool received = false;
-        std::string out_message;
-        std::string in_message;
-
-        // Get one outgoing server message (if any)
-        if (!outgoing.empty()) {
-            std::lock_guard<std::mutex> guard(outgoing_mutex);
-            out_message = outgoing.front();
-            outgoing.pop();
-
-            // If \quit is entered, disconnect all clients
-            if (out_message == "\\quit") {
-                // Clear queued messages
-                while (!outgoing.empty())
-                    outgoing.pop();
-
-                // Disconnect all clients
-                std::lock_guard<std::mutex> guard(clients_mutex);
-                auto it = clients.begin();
-                while (it != clients.end()) {
-                    it->close();
-                    std::cout << std::endl
-                        << it->get_hostname() << ":" << it->get_port()
-                        << " disconnected" << std::endl;
-                    it = clients.erase(it);
-                }
+std::string get_stats() {
+    std::ostringstream out;
+    struct rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+    double cpu_ms = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+    unsigned long clients = 0;
+    unsigned long messages = 0;
+    unsigned long wakeups = 0;
+    unsigned long table_memory = 0;
+    LatencyHistogram accept_time, recv_time, route_time, send_time;
+    LatencyHistogram queue_wait, queue_depth, send_batch, coalesce_delay;
 
-                // Skip rest of loop
-                continue;
-            }
+    for (auto it = shards.begin(); it != shards.end(); ++it) {
+        const ShardStats& stats = (*it)->get_stats();
+        out << "shard " << (*it)->get_id()
+            << " (" << ((*it)->is_uring() ? "io_uring" : "epoll") << ")"
+            << ": clients: " << (*it)->get_client_count()
+            << ", messages: " << (*it)->get_messages()
+            << ", wakeups: " << (*it)->get_wakeups()
+            << ", dropped oldest: " << (*it)->get_dropped_oldest()
+            << ", dropped newest: " << (*it)->get_dropped_newest()
+            << ", overflow disconnects: " << (*it)->get_overflow_disconnects()
+            << ", inbox drops: " << (*it)->get_inbox_drops()
+            << std::endl;
+        out << "shard " << (*it)->get_id()
+            << " traffic: accepted: " << stats.accepted.get()
+            << ", in: " << stats.messages_in.get() << " messages, "
+            << stats.bytes_in.get() << " bytes"
+            << ", out: " << stats.messages_out.get() << " messages, "
+            << stats.bytes_out.get() << " bytes"
+            << ", send eagain: " << stats.send_eagain.get()
+            << std::endl;
+        out << "shard " << (*it)->get_id()
+            << " sends: " << stats.sends.get();
+        if (stats.sends.get() > 0) {
+            out << ", messages/send: "
+                << static_cast<double>(stats.messages_out.get()) / stats.sends.get();
         }
+        out << ", coalesced: sent at once: " << stats.flush_light.get()
+            << ", window ended: " << stats.flush_window.get()
+            << ", limit reached: " << stats.flush_full.get()
+            << std::endl;
+        out << "shard " << (*it)->get_id()
+            << " rate limited: delayed: " << stats.rate_delayed.get()
+            << ", dropped: " << stats.rate_dropped.get()
+            << ", disconnected: " << stats.rate_disconnects.get()
+            << std::endl;
+        out << "shard " << (*it)->get_id()
+            << " idle: timers: " << (*it)->get_timer_count()
+            << ", expired: " << stats.timers_expired.get()
+            << ", heartbeats: " << stats.heartbeats.get()
+            << ", disconnected: " << stats.idle_disconnects.get()
+            << std::endl;
+        out << "shard " << (*it)->get_id()
+            << " direct: delivered: " << stats.direct.get()
+            << ", unknown handle: " << stats.direct_unknown.get()
+            << std::endl;
+        out << "shard " << (*it)->get_id()
+            << " text: cleaned: " << stats.text_cleaned.get()
+            << ", invalid: " << stats.text_invalid.get()
+            << std::endl;
+        clients += (*it)->get_client_count();
+        table_memory += (*it)->get_table_memory();
+        messages += (*it)->get_messages();
+        wakeups += (*it)->get_wakeups();
 
-        // Handle sending and receiving of messages from clients
-        std::lock_guard<std::mutex> guard(clients_mutex);
-        auto it = clients.begin();
-        while (it != clients.end()) {
-            // Send the server message (if any)
-            if (!out_message.empty())
-                it->send(prompt + out_message);
-            // Receive any messages from client
-            if (it->recv(in_message)) {
-                if (!in_message.empty()) {
-                    // Message received -- set flag
-                    received = true;
-
-                    // Display message on next line
-                    std::cout << std::endl << in_message << std::endl;
-
-                    // Send to each connected client
-                    auto it2 = clients.begin();
-                    while (it2 != clients.end()) {
-                        if (it != it2)
-                            it2->send(in_message);
-                        ++it2;
-                    }
-                }
+        accept_time.merge(stats.accept_time);
+        recv_time.merge(stats.recv_time);
+        route_time.merge(stats.route_time);
+        send_time.merge(stats.send_time);
+        queue_wait.merge(stats.queue_wait);
+        queue_depth.merge(stats.queue_depth);
+        send_batch.merge(stats.send_batch);
+        coalesce_delay.merge(stats.coalesce_delay);
+    }
 
-                ++it;
-            }
-            else {
-                // Socket closed -- remove client
-                std::cout << std::endl
-                    << it->get_hostname() << ":" << it->get_port()
-                    << " disconnected" << std::endl;
-                it = clients.erase(it);
-
-                // Treat this as a received message if there are still clients
-                // connected so the prompt will be redisplayed.
-                received = !clients.empty();
-            }
+    if (relay != nullptr) {
+        const ShardStats& stats = relay->get_stats();
+        out << "relay " << std::hex << relay->get_origin() << std::dec
+            << ": linked: " << relay->get_linked() << "/" << relay->get_peer_count()
+            << ", originated: " << relay->originated.get()
+            << ", received: " << relay->received.get()
+            << ", relayed: " << relay->relayed.get()
+            << ", duplicates: " << relay->duplicates.get()
+            << ", rejected: " << relay->rejected.get()
+            << ", dropped: " << relay->dropped.get()
+            << ", inbox drops: " << relay->get_inbox_drops()
+            << std::endl;
+        out << "relay sends: " << stats.sends.get();
+        if (stats.sends.get() > 0) {
+            out << ", records/send: "
+                << static_cast<double>(stats.messages_out.get()) / stats.sends.get();
         }
+        out << ", out: " << stats.bytes_out.get() << " bytes"
+            << ", in: " << stats.bytes_in.get() << " bytes" << std::endl;
+    }
 
-        // Redisplay prompt if message was received
-        if (received) {
-            std::cout << prompt << std::flush;
-        }
+    out << "handles: " << handles.size() << std::endl;
+    out << "text check: " << TextFilter::get_implementation() << std::endl;
+    out << "history: recorded: " << history->get_recorded()
+        << ", dropped: " << history->get_dropped()
+        << ", log bytes: " << history->get_log_bytes() << std::endl;
+    out << "output: written: " << log_sink.get_written() << " bytes"
+        << ", dropped: " << log_sink.get_dropped() << " records" << std::endl;
+    // A miss is a buffer that had to come from malloc
+    BufferPoolStats pool = BufferPool::get_stats();
+    uint64_t misses = pool.allocations - pool.hits;
+    out << "buffers: allocations: " << pool.allocations
+        << ", hits: " << pool.hits
+        << ", misses: " << misses;
+    if (pool.allocations > 0)
+        out << ", hit rate: " << 100.0 * pool.hits / pool.allocations << "%";
+    out << ", depot refills: " << pool.refills
+        << ", freed: " << pool.frees
+        << ", cached: " << pool.cached_bytes / 1024 << " KiB";
+    if (messages > 0)
+        out << ", misses/message: " << static_cast<double>(misses) / messages;
+    out << std::endl;
+    out << "clients: " << clients
+        << ", messages: " << messages
+        << ", wakeups: " << wakeups
+        << ", cpu: " << cpu_ms << " ms" << std::endl;
+    if (messages > 0) {
+        out << "wakeups/message: "
+            << static_cast<double>(wakeups) / messages
+            << ", cpu/message: " << cpu_ms / messages << " ms" << std::endl;
+    }
+
+    // The growth since startup divided by the clients is what each
+    // connection costs in this process, including its buffers
+    unsigned long rss = get_rss();
+    out << "memory: rss: " << rss / 1024 << " KiB"
+        << ", at startup: " << startup_rss / 1024 << " KiB"
+        << ", client tables: " << table_memory << " bytes";
+    if (clients > 0 && rss > startup_rss)
+        out << ", per client: " << (rss - startup_rss) / clients << " bytes";
+    out << std::endl;
+
+    out << std::left << std::setw(12) << "latency (us)" << std::right
+        << std::setw(12) << "count" << std::setw(10) << "p50"
+        << std::setw(10) << "p99" << std::setw(10) << "p999"
+        << std::setw(10) << "max" << std::endl;
+    print_histogram(out, "accept", accept_time, 1e3);
+    print_histogram(out, "recv", recv_time, 1e3);
+    print_histogram(out, "route", route_time, 1e3);
+    print_histogram(out, "send", send_time, 1e3);
+    print_histogram(out, "queue wait", queue_wait, 1e3);
+    print_histogram(out, "coalesce", coalesce_delay, 1e3);
+    print_histogram(out, "queue depth", queue_depth, 1);
+    print_histogram(out, "send batch", send_batch, 1);
+    if (relay != nullptr) {
+        print_histogram(out, "relay wait", relay->get_stats().queue_wait, 1e3);
+        print_histogram(out, "relay batch", relay->get_stats().send_batch, 1);
     }
+    return out.str();
+}
+
+/**
+ * Writes one row of the latency table: the number of values
+ * in a histogram and its percentiles.
+ *
+ *  out         The stream to write to.
+ *  name        The label of the row.
+ *  histogram   The values to summarize.
+ *  scale       The number to divide each value by.
+ */
+void print_histogram(std::ostream& out, const char* name,
+    const LatencyHistogram& histogram, double scale) {
+    out << std::left << std::setw(12) << name << std::right
+        << std::setw(12) << histogram.get_count()
+        << std::fixed << std::setprecision(1)
+        << std::setw(10) << histogram.get_percentile(50) / scale
+        << std::setw(10) << histogram.get_percentile(99) / scale
+        << std::setw(10) << histogram.get_percentile(99.9) / scale
+        << std::setw(10) << histogram.get_max() / scale
+        << std::defaultfloat << std::endl;
+}
+
+/**
+ * Gets the resident memory of the process from /proc/self/statm.
+ *
+ * Returns the number of bytes, or 0 if it cannot be read.
+ */
+unsigned long get_rss() {
+    std::ifstream statm("/proc/self/statm");
+    unsigned long pages = 0, resident = 0;
+    if (!(statm >> pages >> resident))
+        return 0;
+    return resident * ::sysconf(_SC_PAGESIZE);
 }
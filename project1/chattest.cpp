@@ -0,0 +1,390 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         chattest.cpp
+* Description:  Checks parts of the server that are easy to get wrong
+*               and hard to notice by hand.
+*
+*               Each check prints "ok" or "FAIL" and its name, and the
+*               program exits with 1 if any check failed. Run it with
+*               'make test'.
+*               The hot restart checks start ./chatserve on a port
+*               picked from the process ID, so run it from the
+*               directory chatserve was built in.
+*
+*               The command line syntax is as follows:
+*
+*                   chattest
+\*********************************************************/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <arpa/inet.h>      // inet_pton
+#include <fcntl.h>          // open
+#include <netinet/in.h>     // sockaddr_in
+#include <poll.h>
+#include <signal.h>         // kill
+#include <sys/socket.h>     // socketpair
+#include <sys/un.h>         // sockaddr_un
+#include <sys/wait.h>       // waitpid
+#include <unistd.h>         // close, fork
+
+#include "Handoff.hpp"
+#include "Message.hpp"
+#include "SocketStream.hpp"
+#include "TextFilter.hpp"
+
+/*========================================================*
+ * Forward declarations
+ *========================================================*/
+void expect(bool passed, const char* name);
+std::string feed_and_take(SocketStream& stream, const std::string& data);
+void test_split_utf8();
+pid_t start_server(const char* backend, const std::string& port, const std::string& path);
+int connect_client(const std::string& port);
+bool send_line(int sd, const std::string& line);
+bool wait_for(int sd, const std::string& text);
+void test_failed_handoff(const char* backend);
+void test_uncommitted_handoff();
+
+// Number of checks that failed
+int failures = 0;
+
+/*========================================================*
+ * main function
+ *========================================================*/
+int main() {
+    // A server that stops answering would otherwise hang the checks
+    ::alarm(60);
+
+    test_split_utf8();
+    test_failed_handoff("epoll");
+    test_failed_handoff("uring");
+    test_uncommitted_handoff();
+    return failures == 0 ? 0 : 1;
+}
+
+/**
+ * Reports the result of one check.
+ *
+ *  passed  Whether the check passed.
+ *  name    What was checked.
+ */
+void expect(bool passed, const char* name) {
+    std::printf("%s %s\n", passed ? "ok  " : "FAIL", name);
+    std::fflush(stdout);
+    if (!passed)
+        ++failures;
+}
+
+/**
+ * Feeds data to a stream as if it was received, and takes whatever
+ * message the stream returns for it.
+ *
+ *  stream  The stream, in text mode.
+ *  data    The received data.
+ *
+ * Returns the message, or an empty string if there was none.
+ */
+std::string feed_and_take(SocketStream& stream, const std::string& data) {
+    stream.feed(data.data(), data.size());
+    RingView view;
+    if (!stream.next_message(view))
+        return std::string();
+    return view.to_string();
+}
+
+/**
+ * Checks that a UTF-8 character split across two reads in text mode
+ * is returned whole with the second read, so that neither message
+ * fails the text check.
+ */
+void test_split_utf8() {
+    int sds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sds) == -1) {
+        expect(false, "socketpair");
+        return;
+    }
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    SocketStream stream(sds[0], reinterpret_cast<struct sockaddr*>(&addr));
+
+    // "é" is C3 A9
+    std::string first = feed_and_take(stream, "alice> caf\xC3");
+    std::string second = feed_and_take(stream, "\xA9 au lait\n");
+    expect(first == "alice> caf", "2-byte character: the lead byte is held back");
+    expect(second == "\xC3\xA9 au lait\n", "2-byte character: it comes whole with the rest");
+    expect(TextFilter::check(first.data(), first.size()) == 0
+        && TextFilter::check(second.data(), second.size()) == 0,
+        "2-byte character: both messages pass the text check");
+
+    // "😀" is F0 9F 98 80, split after 3 bytes and after 1 byte
+    first = feed_and_take(stream, "bob> \xF0\x9F\x98");
+    second = feed_and_take(stream, "\x80\n");
+    expect(first == "bob> " && second == "\xF0\x9F\x98\x80\n",
+        "4-byte character split after 3 bytes");
+    first = feed_and_take(stream, "bob> \xF0");
+    second = feed_and_take(stream, "\x9F\x98\x80\n");
+    expect(first == "bob> " && second == "\xF0\x9F\x98\x80\n",
+        "4-byte character split after 1 byte");
+
+    // Nothing but the start of a character is no message at all
+    first = feed_and_take(stream, "\xE2\x82");
+    second = feed_and_take(stream, "\xAC");
+    expect(first.empty() && second == "\xE2\x82\xAC", "a message of one split character");
+
+    // Bytes that cannot start a character are not held back
+    first = feed_and_take(stream, "carol> \xFF");
+    expect(first == "carol> \xFF", "an invalid last byte is passed on to be rejected");
+
+    stream.close();
+    ::close(sds[1]);
+}
+
+/**
+ * Starts ./chatserve with a handoff socket, and gives it its handle.
+ * Its output is discarded.
+ *
+ *  backend The event loop backend, epoll or uring.
+ *  port    The port to listen on.
+ *  path    The path of the handoff socket.
+ *
+ * Returns the process ID, or -1 if it could not be started.
+ */
+pid_t start_server(const char* backend, const std::string& port, const std::string& path) {
+    int input[2];
+    if (::pipe(input) == -1)
+        return -1;
+    pid_t pid = ::fork();
+    if (pid == 0) {
+        int null = ::open("/dev/null", O_WRONLY);
+        ::dup2(input[0], STDIN_FILENO);
+        ::dup2(null, STDOUT_FILENO);
+        ::close(input[0]);
+        ::close(input[1]);
+        ::execl("./chatserve", "chatserve", "-i", backend, "-T", path.c_str(), port.c_str(),
+            static_cast<char*>(nullptr));
+        ::_exit(127);
+    }
+    ::close(input[0]);
+    if (pid != -1 && ::write(input[1], "srv\n", 4) != 4)
+        pid = -1;
+    // The write end stays open, so the server's input thread keeps waiting
+    return pid;
+}
+
+/**
+ * Connects a client to the server on the loopback address, retrying
+ * for up to 2 seconds while the server starts.
+ *
+ *  port    The port of the server.
+ *
+ * Returns the socket descriptor, or -1 if the server is not there.
+ */
+int connect_client(const std::string& port) {
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(std::atoi(port.c_str()));
+    ::inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    for (int tries = 0; tries < 200; ++tries) {
+        int sd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (::connect(sd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0)
+            return sd;
+        ::close(sd);
+        ::usleep(10000);
+    }
+    return -1;
+}
+
+/**
+ * Sends a line of text to the server.
+ *
+ *  sd      The socket descriptor of the client.
+ *  line    The line, without the newline.
+ *
+ * Returns true if the line was sent.
+ */
+bool send_line(int sd, const std::string& line) {
+    std::string data = line + "\n";
+    return ::send(sd, data.data(), data.size(), MSG_NOSIGNAL)
+        == static_cast<ssize_t>(data.size());
+}
+
+/**
+ * Reads from a client until some text arrives. Anything before it
+ * is discarded.
+ *
+ *  sd      The socket descriptor of the client.
+ *  text    The text to wait for.
+ *
+ * Returns true if the text arrived within 3 seconds, or false if it
+ * did not or the connection was closed.
+ */
+bool wait_for(int sd, const std::string& text) {
+    std::string received;
+    for (int waits = 0; waits < 300; ++waits) {
+        struct pollfd pfd = { sd, POLLIN, 0 };
+        if (::poll(&pfd, 1, 10) != 1)
+            continue;
+        char buf[4096];
+        ssize_t bytes = ::recv(sd, buf, sizeof(buf), 0);
+        if (bytes <= 0)
+            return false;
+        received.append(buf, bytes);
+        if (received.find(text) != std::string::npos)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Checks that a running server goes on serving its clients when a new
+ * server goes away in the middle of a hot restart, both before it has
+ * received anything and after it received everything but did not say
+ * so, and that a new server can still take over afterwards.
+ *
+ *  backend The event loop backend of the server, epoll or uring.
+ */
+void test_failed_handoff(const char* backend) {
+    std::string name = std::string("failed handoff (") + backend + "): ";
+    std::string port = std::to_string(20000 + (::getpid() + backend[0]) % 20000);
+    std::string path = "/tmp/chattest-" + std::to_string(::getpid()) + ".sock";
+    pid_t old_server = start_server(backend, port, path);
+    int alice = connect_client(port);
+    int bob = connect_client(port);
+    if (old_server == -1 || alice == -1 || bob == -1) {
+        expect(false, (name + "start the server").c_str());
+        if (old_server != -1)
+            ::kill(old_server, SIGKILL);
+        return;
+    }
+    expect(send_line(alice, "alice> before") && wait_for(bob, "alice> before"),
+        (name + "the server routes messages").c_str());
+
+    // A new server that goes away right after it connects
+    try {
+        Handoff early;
+        expect(early.connect(path, false), (name + "connect to the handoff socket").c_str());
+    }
+    catch (const std::runtime_error& ex) {
+        expect(false, ex.what());
+    }
+    expect(send_line(alice, "alice> after early") && wait_for(bob, "alice> after early")
+        && send_line(bob, "bob> after early") && wait_for(alice, "bob> after early"),
+        (name + "clients stay connected when the new server goes away first").c_str());
+
+    // A new server that takes everything but never says it has it.
+    // The sockets it got are copies, so closing them changes nothing.
+    try {
+        Handoff late;
+        if (late.connect(path, false)) {
+            late.receive();
+            expect(late.get_client_count() == 2, (name + "the state has both clients").c_str());
+            for (size_t i = 0; i < late.get_shard_count(); ++i) {
+                ShardHandoff& shard = late.get_shard(i);
+                ::close(shard.listener);
+                if (shard.unix_listener != -1)
+                    ::close(shard.unix_listener);
+                for (auto it = shard.clients.begin(); it != shard.clients.end(); ++it)
+                    ::close(it->fd);
+            }
+        }
+    }
+    catch (const std::runtime_error& ex) {
+        expect(false, ex.what());
+    }
+    expect(send_line(alice, "alice> after late") && wait_for(bob, "alice> after late")
+        && send_line(bob, "bob> after late") && wait_for(alice, "bob> after late"),
+        (name + "clients stay connected when the new server goes away last").c_str());
+    int carol = connect_client(port);
+    expect(carol != -1 && send_line(carol, "carol> new") && wait_for(alice, "carol> new"),
+        (name + "new clients are accepted again").c_str());
+
+    // A real new server still takes over afterwards
+    pid_t new_server = start_server(backend, port, path);
+    int status = -1;
+    expect(new_server != -1 && ::waitpid(old_server, &status, 0) == old_server
+        && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+        (name + "a later hot restart succeeds").c_str());
+    expect(send_line(alice, "alice> restarted") && wait_for(bob, "alice> restarted")
+        && wait_for(carol, "alice> restarted"),
+        (name + "the new server routes messages").c_str());
+
+    ::close(alice);
+    ::close(bob);
+    if (carol != -1)
+        ::close(carol);
+    if (new_server != -1) {
+        ::kill(new_server, SIGKILL);
+        ::waitpid(new_server, nullptr, 0);
+    }
+    ::unlink(path.c_str());
+}
+
+/**
+ * Checks that a new server does not take the sockets when the running
+ * server gives up waiting for its answer just as it is sent, and closes
+ * the connection instead of confirming.
+ *
+ * The running server is played by this process: it sends the header
+ * and the state of no shards, reads the answer, and closes.
+ */
+void test_uncommitted_handoff() {
+    std::string path = "/tmp/chattest-" + std::to_string(::getpid()) + "-commit.sock";
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+    int sd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    ::unlink(path.c_str());
+    if (::bind(sd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1
+        || ::listen(sd, 1) == -1) {
+        expect(false, "uncommitted handoff: listen");
+        ::close(sd);
+        return;
+    }
+
+    std::thread old_server([sd]() {
+        int conn = ::accept(sd, nullptr, nullptr);
+        char hello[12];
+        if (conn == -1 || ::recv(conn, hello, sizeof(hello), MSG_WAITALL) != sizeof(hello)) {
+            if (conn != -1)
+                ::close(conn);
+            return;
+        }
+
+        // The header (magic, status, descriptor count and state size),
+        // followed by the state, which is a count of no shards
+        char header[28];
+        std::memset(header, 0, sizeof(header));
+        std::memcpy(header, "chathof1", 8);
+        uint64_t size = 4;
+        std::memcpy(header + 16, &size, sizeof(size));
+        ::send(conn, header, sizeof(header), MSG_NOSIGNAL);
+        char ack;
+        ::recv(conn, &ack, 1, 0);
+        ::close(conn);
+    });
+
+    bool refused = false;
+    try {
+        Handoff handoff;
+        if (handoff.connect(path, false)) {
+            handoff.receive();
+            handoff.release();
+        }
+    }
+    catch (const std::runtime_error& ex) {
+        refused = std::strstr(ex.what(), "still serving") != nullptr;
+    }
+    old_server.join();
+    expect(refused, "uncommitted handoff: the new server does not take the sockets");
+    ::close(sd);
+    ::unlink(path.c_str());
+}
@@ -0,0 +1,423 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         corobench.cpp
+* Description:  A microbenchmark that measures what it costs to run
+*               connection sessions as coroutines on a SessionLoop
+*               instead of as readiness callbacks like the shards do.
+*
+*               This program connects many pairs of Unix domain sockets
+*               within the process. One end of every pair is served by
+*               an echo handler and the other end pings it. The same
+*               echo is run twice: once as a callback that the event
+*               loop calls for every ready socket, exactly as Shard
+*               handles a client, and once as a session coroutine that
+*               loops on recv_message and send. Both use the same
+*               SocketStream calls and the same epoll flags, so the
+*               difference in time per echo is the cost of suspending
+*               and resuming a session.
+*
+*               It also times a bare coroutine resume against a bare
+*               call through a function pointer, without any I/O.
+*
+*               The results are printed to stdout as one line of JSON.
+*
+*               The command line syntax is as follows:
+*
+*                   corobench [-c sessions] [-r rounds]
+*
+*               This program takes the following arguments:
+*               - sessions  -- The number of socket pairs (default 1000).
+*               - rounds    -- The number of times every session is pinged
+*                              (default 1000).
+\*********************************************************/
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>         // getopt
+
+#include "AsyncStream.hpp"
+#include "ClientTable.hpp"
+#include "EventLoop.hpp"
+#include "Message.hpp"
+#include "SessionLoop.hpp"
+#include "SocketStream.hpp"
+
+// Define 10 million calls for the dispatch-only timing unless defined elsewhere
+#ifndef COROBENCH_DISPATCH_CALLS
+#define COROBENCH_DISPATCH_CALLS 10000000
+#endif
+
+/*========================================================*
+ * Types
+ *========================================================*/
+// One connected pair of sockets
+struct BenchPair {
+    int client;     // The end that sends pings, in blocking mode
+    int server;     // The end served by the echo handler
+};
+
+// What one way of serving the sessions measured
+struct BenchResult {
+    uint64_t serve_ns;          // Time spent in the event loop
+    unsigned long echoes;       // Messages echoed
+    unsigned long resumes;      // Times a session was resumed
+};
+
+// A coroutine that counts every time it is resumed and suspends again
+struct Ticker {
+    struct promise_type {
+        Ticker get_return_object() {
+            return Ticker{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+/*========================================================*
+ * Forward declarations
+ *========================================================*/
+uint64_t now_ns();
+std::vector<BenchPair> open_pairs(int count);
+void ping_all(const std::vector<BenchPair>& pairs);
+void read_all(const std::vector<BenchPair>& pairs);
+void close_all(const std::vector<BenchPair>& pairs);
+BenchResult run_callbacks(int sessions, int rounds);
+void handle_echo(SocketStream& client, unsigned long& echoes);
+BenchResult run_sessions(int sessions, int rounds);
+Session echo_session(SessionLoop& loop, SocketStream client, unsigned long& echoes);
+Ticker tick(unsigned long& count);
+void tick_callback(unsigned long& count);
+double time_resume(unsigned long calls);
+double time_callback(unsigned long calls);
+
+// The message every session echoes
+static const char PING[] = "ping\n";
+
+/*========================================================*
+ * main function
+ *========================================================*/
+int main(int argc, char* argv[]) {
+    bool valid = true;
+    int opt;
+    int sessions = 1000;
+    int rounds = 1000;
+
+    // Parse command line options
+    while ((opt = ::getopt(argc, argv, "c:r:")) != -1) {
+        switch (opt) {
+        case 'c':
+            sessions = std::atoi(optarg);
+            valid = valid && sessions > 0;
+            break;
+        case 'r':
+            rounds = std::atoi(optarg);
+            valid = valid && rounds > 0;
+            break;
+        default:
+            valid = false;
+            break;
+        }
+    }
+
+    // Verify command line arguments
+    if (argc != optind || !valid) {
+        std::cerr << "usage: " << argv[0] << " [-c sessions] [-r rounds]" << std::endl;
+        exit(1);
+    }
+
+    // Each session takes two descriptors
+    struct rlimit limit;
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    BenchResult callbacks = run_callbacks(sessions, rounds);
+    BenchResult coroutines = run_sessions(sessions, rounds);
+    double callback_ns = static_cast<double>(callbacks.serve_ns) / callbacks.echoes;
+    double session_ns = static_cast<double>(coroutines.serve_ns) / coroutines.echoes;
+    double resume_ns = time_resume(COROBENCH_DISPATCH_CALLS);
+    double call_ns = time_callback(COROBENCH_DISPATCH_CALLS);
+
+    std::printf("{\"sessions\":%d,\"rounds\":%d,\"echoes\":%lu,"
+        "\"callback_ns_per_echo\":%.1f,\"session_ns_per_echo\":%.1f,"
+        "\"overhead_ns_per_echo\":%.1f,\"resumes_per_echo\":%.2f,"
+        "\"dispatch_call_ns\":%.2f,\"dispatch_resume_ns\":%.2f}\n",
+        sessions, rounds, coroutines.echoes, callback_ns, session_ns,
+        session_ns - callback_ns,
+        static_cast<double>(coroutines.resumes) / coroutines.echoes,
+        call_ns, resume_ns);
+    return 0;
+}
+
+/**
+ * Returns the time of the monotonic clock in nanoseconds.
+ */
+uint64_t now_ns() {
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Connects pairs of Unix domain sockets. Exits if any pair cannot
+ * be created.
+ *
+ *  count   The number of pairs.
+ *
+ * Returns the pairs.
+ */
+std::vector<BenchPair> open_pairs(int count) {
+    std::vector<BenchPair> pairs;
+    for (int i = 0; i < count; ++i) {
+        int fds[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+            std::perror("corobench: socketpair");
+            exit(1);
+        }
+        BenchPair pair = { fds[0], fds[1] };
+        pairs.push_back(pair);
+    }
+    return pairs;
+}
+
+/**
+ * Sends a ping to every session.
+ *
+ *  pairs   The connected pairs.
+ */
+void ping_all(const std::vector<BenchPair>& pairs) {
+    for (auto it = pairs.begin(); it != pairs.end(); ++it) {
+        if (::send(it->client, PING, sizeof(PING) - 1, MSG_NOSIGNAL) != sizeof(PING) - 1) {
+            std::perror("corobench: send");
+            exit(1);
+        }
+    }
+}
+
+/**
+ * Reads the echo of the last ping from every session.
+ *
+ *  pairs   The connected pairs.
+ */
+void read_all(const std::vector<BenchPair>& pairs) {
+    char buffer[sizeof(PING)];
+    for (auto it = pairs.begin(); it != pairs.end(); ++it) {
+        size_t got = 0;
+        while (got < sizeof(PING) - 1) {
+            ssize_t bytes = ::recv(it->client, buffer + got, sizeof(PING) - 1 - got, 0);
+            if (bytes <= 0) {
+                std::perror("corobench: recv");
+                exit(1);
+            }
+            got += bytes;
+        }
+    }
+}
+
+/**
+ * Closes the pinging end of every pair.
+ *
+ *  pairs   The connected pairs.
+ */
+void close_all(const std::vector<BenchPair>& pairs) {
+    for (auto it = pairs.begin(); it != pairs.end(); ++it)
+        ::close(it->client);
+}
+
+/**
+ * Serves the sessions with a callback per ready socket, the way a
+ * shard serves its clients.
+ *
+ *  sessions    The number of socket pairs.
+ *  rounds      The number of times every session is pinged.
+ *
+ * Returns what was measured.
+ */
+BenchResult run_callbacks(int sessions, int rounds) {
+    BenchResult result = { 0, 0, 0 };
+    std::vector<BenchPair> pairs = open_pairs(sessions);
+    struct sockaddr addr;
+    addr.sa_family = AF_UNIX;
+
+    EventLoop loop;
+    ClientTable clients;
+    for (auto it = pairs.begin(); it != pairs.end(); ++it) {
+        SocketStream client(it->server, &addr);
+        clients.insert(client);
+        loop.add(it->server, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    }
+
+    for (int i = 0; i < rounds; ++i) {
+        ping_all(pairs);
+        unsigned long target = result.echoes + pairs.size();
+        uint64_t start = now_ns();
+        while (result.echoes < target) {
+            int count = loop.wait();
+            for (int j = 0; j < count; ++j) {
+                const struct epoll_event& ev = loop.event(j);
+                SocketStream* client = clients.find(ev.data.fd);
+                if (client != nullptr && (ev.events & EPOLLIN))
+                    handle_echo(*client, result.echoes);
+            }
+        }
+        result.serve_ns += now_ns() - start;
+        read_all(pairs);
+    }
+
+    close_all(pairs);
+    for (auto it = clients.begin(); it != clients.end(); ++it)
+        it->close();
+    return result;
+}
+
+/**
+ * Echoes every message that a client has sent.
+ *
+ *  client  The client whose socket has input.
+ *  echoes  The number of messages echoed, which is updated.
+ */
+void handle_echo(SocketStream& client, unsigned long& echoes) {
+    client.receive();
+    RingView view;
+    while (client.next_message(view)) {
+        std::string text = view.to_string();
+        OutboxLimit limit = { 0, DROP_NEWEST };
+        size_t dropped = 0;
+        client.queue(MessagePtr(Message::create(text)), limit, dropped, 0);
+        ++echoes;
+    }
+    client.flush();
+}
+
+/**
+ * Serves the sessions with a coroutine each on a SessionLoop.
+ *
+ *  sessions    The number of socket pairs.
+ *  rounds      The number of times every session is pinged.
+ *
+ * Returns what was measured.
+ */
+BenchResult run_sessions(int sessions, int rounds) {
+    BenchResult result = { 0, 0, 0 };
+    std::vector<BenchPair> pairs = open_pairs(sessions);
+    struct sockaddr addr;
+    addr.sa_family = AF_UNIX;
+
+    // Start every session so that it is waiting for its first ping
+    SessionLoop loop;
+    for (auto it = pairs.begin(); it != pairs.end(); ++it)
+        loop.spawn(echo_session(loop, SocketStream(it->server, &addr), result.echoes));
+    loop.run_once(0);
+    unsigned long started = loop.get_resumes();
+
+    for (int i = 0; i < rounds; ++i) {
+        ping_all(pairs);
+        unsigned long target = result.echoes + pairs.size();
+        uint64_t start = now_ns();
+        while (result.echoes < target)
+            loop.run_once();
+        result.serve_ns += now_ns() - start;
+        read_all(pairs);
+    }
+    result.resumes = loop.get_resumes() - started;
+
+    // Every session returns once its peer hangs up
+    close_all(pairs);
+    loop.run();
+    return result;
+}
+
+/**
+ * Echoes every message that a client sends until it disconnects.
+ *
+ *  loop    The loop running the session.
+ *  client  The client.
+ *  echoes  The number of messages echoed, which is updated.
+ */
+Session echo_session(SessionLoop& loop, SocketStream client, unsigned long& echoes) {
+    AsyncStream stream(loop, client);
+    std::string text;
+    while (co_await stream.recv_message(text)) {
+        if (!co_await stream.send(text))
+            break;
+        ++echoes;
+    }
+}
+
+/**
+ * Counts every time it is resumed.
+ *
+ *  count   The counter.
+ */
+Ticker tick(unsigned long& count) {
+    while (true) {
+        ++count;
+        co_await std::suspend_always();
+    }
+}
+
+/**
+ * Counts every time it is called.
+ *
+ *  count   The counter.
+ */
+void tick_callback(unsigned long& count) {
+    ++count;
+}
+
+/**
+ * Times resuming a suspended coroutine.
+ *
+ *  calls   The number of times to resume it.
+ *
+ * Returns the nanoseconds per resume.
+ */
+double time_resume(unsigned long calls) {
+    unsigned long count = 0;
+    Ticker ticker = tick(count);
+    // The frame is read through a volatile so the loop is not optimized away
+    void* volatile frame = ticker.handle.address();
+
+    uint64_t start = now_ns();
+    for (unsigned long i = 0; i < calls; ++i)
+        std::coroutine_handle<>::from_address(frame).resume();
+    uint64_t elapsed = now_ns() - start;
+
+    ticker.handle.destroy();
+    return count == calls ? static_cast<double>(elapsed) / calls : 0;
+}
+
+/**
+ * Times calling a function through a pointer, as an event loop calls
+ * a handler.
+ *
+ *  calls   The number of times to call it.
+ *
+ * Returns the nanoseconds per call.
+ */
+double time_callback(unsigned long calls) {
+    unsigned long count = 0;
+    void (* volatile callback)(unsigned long&) = tick_callback;
+
+    uint64_t start = now_ns();
+    for (unsigned long i = 0; i < calls; ++i)
+        callback(count);
+    uint64_t elapsed = now_ns() - start;
+
+    return count == calls ? static_cast<double>(elapsed) / calls : 0;
+}
@@ -0,0 +1,208 @@
+/*********************************************************\
+* Author:       David Rigert
+* Class:        CS372 Spring 2016
+* Assignment:   Project 1
+* File:         textbench.cpp
+* Description:  A microbenchmark that measures how fast TextFilter
+*               checks messages with each of its versions: scalar,
+*               SSE4.1 and AVX2.
+*
+*               Messages of each size are filled with one kind of text
+*               at a time: plain ASCII chat, accented Latin, Cyrillic,
+*               Chinese and emoji. Each version checks a set of them
+*               about the size of a shard's cache, over and over, until
+*               it has checked the requested number of bytes. The
+*               messages are in the cache, as they are in the server,
+*               which checks each one right after copying it.
+*               A version that the processor does not support is
+*               reported as 0.
+*
+*               The results are printed to stdout as one line of JSON,
+*               in gigabytes (10^9 bytes) per second.
+*
+*               The command line syntax is as follows:
+*
+*                   textbench [-s size]... [-b bytes]
+*
+*               This program takes the following arguments:
+*               - size      -- The size of each message in bytes. May be
+*                              repeated (default 64, 1024 and 65536).
+*               - bytes     -- The number of bytes each version checks
+*                              for each kind of text and size
+*                              (default 268435456).
+\*********************************************************/
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>         // getopt
+
+#include "TextFilter.hpp"
+
+// Define 1 MiB of messages checked over and over unless defined elsewhere
+#ifndef TEXTBENCH_SET_BYTES
+#define TEXTBENCH_SET_BYTES 1048576
+#endif
+
+/*========================================================*
+ * Types
+ *========================================================*/
+// A kind of text that messages are made of
+struct BenchCorpus {
+    const char* name;
+    const char* text;   // Repeated to fill each message
+};
+
+/*========================================================*
+ * Forward declarations
+ *========================================================*/
+uint64_t now_ns();
+std::string make_message(const char* text, size_t size);
+double time_check(int (*check)(const char*, size_t), const std::vector<std::string>& messages,
+    unsigned long long bytes);
+
+static const BenchCorpus CORPORA[] = {
+    { "ascii", "alice> are we still on for lunch tomorrow at noon? " },
+    { "latin", "bob> le café près de la gare, ça vous va? très bien. " },
+    { "cyrillic", "ivan> Привет! Встречаемся завтра в полдень у вокзала? " },
+    { "chinese", "wei> 明天中午我们在火车站附近的咖啡馆见面吧。" },
+    { "emoji", "kim> sounds good 😀👍🎉 see you there 🚆☕ " }
+};
+
+/*========================================================*
+ * main function
+ *========================================================*/
+int main(int argc, char* argv[]) {
+    bool valid = true;
+    int opt;
+    std::vector<size_t> sizes;
+    unsigned long long bytes = 268435456;
+
+    // Parse command line options
+    while ((opt = ::getopt(argc, argv, "s:b:")) != -1) {
+        switch (opt) {
+        case 's':
+            sizes.push_back(std::strtoul(optarg, nullptr, 10));
+            valid = valid && sizes.back() > 0;
+            break;
+        case 'b':
+            bytes = std::strtoull(optarg, nullptr, 10);
+            valid = valid && bytes > 0;
+            break;
+        default:
+            valid = false;
+            break;
+        }
+    }
+
+    // Verify command line arguments
+    if (argc != optind || !valid) {
+        std::cerr << "usage: " << argv[0] << " [-s size]... [-b bytes]" << std::endl;
+        exit(1);
+    }
+    if (sizes.empty()) {
+        sizes.push_back(64);
+        sizes.push_back(1024);
+        sizes.push_back(65536);
+    }
+
+    std::printf("{\"implementation\":\"%s\",\"results\":[", TextFilter::get_implementation());
+    bool first = true;
+    for (auto size = sizes.begin(); size != sizes.end(); ++size) {
+        for (size_t c = 0; c < sizeof(CORPORA) / sizeof(CORPORA[0]); ++c) {
+            // Enough copies of the message to fill the set, each in
+            // its own allocation like the messages in the server
+            std::vector<std::string> messages;
+            size_t count = std::max<size_t>(1, TEXTBENCH_SET_BYTES / *size);
+            for (size_t i = 0; i < count; ++i)
+                messages.push_back(make_message(CORPORA[c].text, *size));
+            if (TextFilter::check_scalar(messages[0].data(), messages[0].size()) != 0) {
+                std::cerr << "textbench: " << CORPORA[c].name << " text is not clean" << std::endl;
+                exit(1);
+            }
+
+            double scalar = time_check(TextFilter::check_scalar, messages, bytes);
+            double sse = TextFilter::has_sse() ? time_check(TextFilter::check_sse, messages, bytes) : 0;
+            double avx2 = TextFilter::has_avx2() ? time_check(TextFilter::check_avx2, messages, bytes) : 0;
+            std::printf("%s{\"text\":\"%s\",\"size\":%zu,\"scalar_gbps\":%.2f,"
+                "\"sse_gbps\":%.2f,\"avx2_gbps\":%.2f}",
+                first ? "" : ",", CORPORA[c].name, *size, scalar, sse, avx2);
+            first = false;
+        }
+    }
+    std::printf("]}\n");
+    return 0;
+}
+
+/**
+ * Returns the time of the monotonic clock in nanoseconds.
+ */
+uint64_t now_ns() {
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Makes a message of a given size by repeating some text. Only whole
+ * characters are added, and the rest is filled with spaces.
+ *
+ *  text    The UTF-8 text to repeat.
+ *  size    The size of the message.
+ *
+ * Returns the message.
+ */
+std::string make_message(const char* text, size_t size) {
+    std::string message;
+    const char* next = text;
+    while (true) {
+        // Find the end of the next character
+        const char* end = next + 1;
+        while ((*end & 0xC0) == 0x80)
+            ++end;
+        if (message.size() + (end - next) > size)
+            break;
+        message.append(next, end);
+        next = *end == '\0' ? text : end;
+    }
+    message.append(size - message.size(), ' ');
+    return message;
+}
+
+/**
+ * Times one version of the check.
+ *
+ *  check       The version to time.
+ *  messages    The messages to check, over and over.
+ *  bytes       The number of bytes to check in all.
+ *
+ * Returns the bytes checked per nanosecond, which is gigabytes per second.
+ */
+double time_check(int (*check)(const char*, size_t), const std::vector<std::string>& messages,
+    unsigned long long bytes) {
+    // One pass first, so the messages are in the cache
+    int found = 0;
+    for (auto it = messages.begin(); it != messages.end(); ++it)
+        found |= check(it->data(), it->size());
+
+    unsigned long long checked = 0;
+    uint64_t start = now_ns();
+    while (checked < bytes) {
+        for (auto it = messages.begin(); it != messages.end(); ++it) {
+            found |= check(it->data(), it->size());
+            checked += it->size();
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    // Every message is clean, so anything found means a bug
+    if (found != 0) {
+        std::cerr << "textbench: a check failed on clean text" << std::endl;
+        exit(1);
+    }
+    return static_cast<double>(checked) / elapsed;
+}